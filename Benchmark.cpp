@@ -0,0 +1,946 @@
+/*
+ 		Copyright (C) 2010 Wouter van Kleunen
+
+		This file is part of JsonDb.
+
+    Foobar is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Foobar is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with JsonDb.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "JsonDb.h"
+#include "JsonDbValues.h"
+#include "JsonDbParser.h"
+#include "JsonDbStructuralIndex.h"
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <algorithm>
+
+#include <boost/format.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+// Measures the elapsed time since construction
+class BenchmarkTimer
+{
+public:
+	BenchmarkTimer()
+		: start(boost::posix_time::microsec_clock::universal_time())
+	{ }
+
+	// Elapsed time in microseconds
+	double Elapsed() const
+	{
+		return (double)(boost::posix_time::microsec_clock::universal_time() - start).total_microseconds();
+	}
+
+private:
+	boost::posix_time::ptime start;
+};
+
+static void Report(std::string const &name, double elapsed, size_t iterations)
+{
+	std::cout << boost::format("  %-40s %10.3f us/op  (%d ops)") % name % (elapsed / iterations) % iterations << std::endl;
+}
+
+// Path compilation cost of a lookup, string paths are compiled on every call
+static void Benchmark_PathParse(JsonDb &json_db)
+{
+	size_t const elements = 100;
+	size_t const iterations = 20000;
+
+	JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+	json_db.SetArray(transaction, "$.benchmark.this.is.a.deep.test.path.array_value", elements);
+	for(size_t i = 0; i < elements; ++i)
+		json_db.Set(transaction, (boost::format("$.benchmark.this.is.a.deep.test.path.array_value[%d]") % i).str(), (int)i);
+
+	std::cout << "Path parsing:" << std::endl;
+	{
+		BenchmarkTimer timer;
+		for(size_t i = 0; i < iterations; ++i)
+			JsonDb::Path path((boost::format("$.benchmark.this.is.a.deep.test.path.array_value[%d]") % (i % elements)).str());
+		Report("compile path expression", timer.Elapsed(), iterations);
+	}
+
+	JsonDb::Path array_path("$.benchmark.this.is.a.deep.test.path.array_value");
+	{
+		BenchmarkTimer timer;
+		for(size_t i = 0; i < iterations; ++i)
+			JsonDb::Path path(array_path[i % elements]);
+		Report("derive compiled path", timer.Elapsed(), iterations);
+	}
+
+	{
+		BenchmarkTimer timer;
+		for(size_t i = 0; i < iterations; ++i)
+			json_db.GetInt(transaction, (boost::format("$.benchmark.this.is.a.deep.test.path.array_value[%d]") % (i % elements)).str());
+		Report("GetInt, string path", timer.Elapsed(), iterations);
+	}
+
+	{
+		BenchmarkTimer timer;
+		for(size_t i = 0; i < iterations; ++i)
+			json_db.GetInt(transaction, array_path[i % elements]);
+		Report("GetInt, compiled path", timer.Elapsed(), iterations);
+	}
+
+	json_db.Delete(transaction, "$.benchmark");
+}
+
+// Store and retrieve records of a single type, retrieve reads from the database instead of the node cache
+static void Benchmark_Records(JsonDb &json_db, char const *name, ValuePointer (*create)(ValueKey key))
+{
+	size_t const records = 20000;
+
+	JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+
+	std::vector<ValueKey> keys(records);
+	for(size_t i = 0; i < records; ++i)
+		keys[i] = transaction->GenerateKey();
+
+	{
+		BenchmarkTimer timer;
+		for(size_t i = 0; i < records; ++i)
+			transaction->Store(keys[i], create(keys[i]));
+		transaction->Flush();
+		Report((boost::format("Store %s") % name).str(), timer.Elapsed(), records);
+	}
+
+	transaction->ClearCache();
+	{
+		BenchmarkTimer timer;
+		for(size_t i = 0; i < records; ++i)
+			transaction->Retrieve(keys[i]);
+		Report((boost::format("Retrieve %s") % name).str(), timer.Elapsed(), records);
+	}
+
+	for(size_t i = 0; i < records; ++i)
+		transaction->Delete(keys[i]);
+}
+
+static ValuePointer CreateInteger(ValueKey key) { return ValuePointer(new ValueNumberInteger(key, 10)); }
+static ValuePointer CreateReal(ValueKey key) { return ValuePointer(new ValueNumberReal(key, 1.5)); }
+static ValuePointer CreateBoolean(ValueKey key) { return ValuePointer(new ValueNumberBoolean(key, true)); }
+static ValuePointer CreateNull(ValueKey key) { return ValuePointer(new ValueNull(key)); }
+static ValuePointer CreateString(ValueKey key) { return ValuePointer(new ValueString(key, "this is a short string value")); }
+static ValuePointer CreateArray(ValueKey key) { return ValuePointer(new ValueArray(key, ValueArray::Type(32, key))); }
+
+static ValuePointer CreateObject(ValueKey key)
+{
+	static ValueObject::Type values;
+	for(int i = 0; values.size() < 16; ++i)
+		values[(boost::format("member_%d") % i).str()] = null_key;
+	return ValuePointer(new ValueObject(key, values));
+}
+
+// Store and retrieve throughput of the record codec, per value type
+static void Benchmark_Codec(JsonDb &json_db)
+{
+	std::cout << "Record codec:" << std::endl;
+	Benchmark_Records(json_db, "integer", CreateInteger);
+	Benchmark_Records(json_db, "real", CreateReal);
+	Benchmark_Records(json_db, "boolean", CreateBoolean);
+	Benchmark_Records(json_db, "null", CreateNull);
+	Benchmark_Records(json_db, "string", CreateString);
+	Benchmark_Records(json_db, "array (32 elements)", CreateArray);
+	Benchmark_Records(json_db, "object (16 members)", CreateObject);
+}
+
+// Append to a large array, flushing regularly as a sequence of small transactions would
+static void Benchmark_ArrayAppend(JsonDb &json_db)
+{
+	size_t const elements = 100000;
+	size_t const flush_interval = 100;
+
+	JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+	JsonDb::Path array_path("$.benchmark.array");
+	json_db.SetArray(transaction, array_path, 0);
+
+	std::cout << "Array append:" << std::endl;
+	{
+		BenchmarkTimer timer;
+		for(size_t i = 0; i < elements; ++i)
+		{
+			json_db.AppendArray(transaction, array_path, (int)i);
+			if(i % flush_interval == 0)
+				transaction->Flush();
+		}
+		transaction->Flush();
+		Report("AppendArray", timer.Elapsed(), elements);
+	}
+
+	transaction->ClearCache();
+	{
+		BenchmarkTimer timer;
+		for(size_t i = 0; i < elements; i += 10)
+			json_db.GetInt(transaction, array_path[(i * 7919) % elements]);
+		Report("GetInt, random index", timer.Elapsed(), elements / 10);
+	}
+
+	json_db.Delete(transaction, "$.benchmark");
+}
+
+// Records stored and read for typical small documents
+static void Benchmark_Documents(JsonDb &json_db)
+{
+	size_t const documents = 10000;
+	std::string const document = "{ \"id\": 1, \"name\": \"user\", \"email\": \"user@example.com\", \"admin\": false, "
+		"\"score\": 1.5, \"logins\": 10, \"manager\": null, \"groups\": [1, 2, 3, 4] }";
+
+	JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+	JsonDb::Path users_path("$.benchmark.users");
+	json_db.SetArray(transaction, users_path, 0);
+	size_t records = transaction->Walk().size();
+
+	std::cout << "Documents:" << std::endl;
+	{
+		BenchmarkTimer timer;
+		for(size_t i = 0; i < documents; ++i)
+			json_db.AppendArrayJson(transaction, users_path, document);
+		transaction->Flush();
+		Report("AppendArrayJson", timer.Elapsed(), documents);
+	}
+
+	std::cout << boost::format("  %-40s %10.1f") % "records per document" % ((double)(transaction->Walk().size() - records) / documents) << std::endl;
+
+	transaction->ClearCache();
+	unsigned long misses = transaction->GetCacheMisses();
+	{
+		BenchmarkTimer timer;
+		std::ostringstream output;
+		for(size_t i = 0; i < documents; ++i)
+			json_db.Print(transaction, users_path[i], output);
+		Report("Print document", timer.Elapsed(), documents);
+	}
+
+	std::cout << boost::format("  %-40s %10.1f") % "records read per document" % ((double)(transaction->GetCacheMisses() - misses) / documents) << std::endl;
+
+	json_db.Delete(transaction, "$.benchmark");
+}
+
+static void ReportBytes(std::string const &name, double elapsed, size_t bytes)
+{
+	std::cout << boost::format("  %-40s %10.2f MB/s  (%d bytes)") % name % (bytes / elapsed) % bytes << std::endl;
+}
+
+// Document with an array of user documents
+static std::string UsersDocument(size_t documents)
+{
+	std::ostringstream document;
+	document << "{ \"users\": [";
+	for(size_t i = 0; i < documents; ++i)
+		document << (i == 0 ? "" : ", ") << "{ \"id\": " << i << ", \"name\": \"user\", \"email\": \"user@example.com\", \"admin\": false, "
+			"\"score\": 1.5, \"logins\": 10, \"manager\": null, \"groups\": [1, 2, 3, 4] }";
+	document << "] }";
+	return document.str();
+}
+
+// Import throughput of a large document, parsed from a stream and parsed as a single expression
+static void Benchmark_Import(JsonDb &json_db)
+{
+	std::string const document_str = UsersDocument(50000);
+
+	std::cout << "Import:" << std::endl;
+	{
+		BenchmarkTimer timer;
+		std::istringstream input(document_str);
+		json_db.ImportJson("$.benchmark.import", input);
+		ReportBytes("ImportJson", timer.Elapsed(), document_str.size());
+	}
+
+	{
+		BenchmarkTimer timer;
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		json_db.SetJson(transaction, "$.benchmark.set", document_str);
+		transaction->Commit();
+		ReportBytes("SetJson", timer.Elapsed(), document_str.size());
+	}
+
+	JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+	json_db.Delete(transaction, "$.benchmark");
+}
+
+// Parse throughput of a large document with the structural index parser and the Spirit grammar
+static void Benchmark_Parse(JsonDb &json_db)
+{
+	std::string const document = UsersDocument(50000);
+
+	std::cout << "Parse:" << std::endl;
+	JsonDbIndexer const indexers[] = { indexer_scalar, indexer_sse2, indexer_avx2 };
+	for(size_t i = 0; i < sizeof(indexers) / sizeof(indexers[0]); ++i)
+	{
+		if(!JsonDb_IndexerSupported(indexers[i]))
+			continue;
+
+		JsonDbStructuralIndex index;
+		BenchmarkTimer timer;
+		for(int j = 0; j < 10; ++j)
+			JsonDb_BuildStructuralIndex(document.data(), document.size(), index, indexers[i]);
+		ReportBytes((boost::format("structural index, %s") % JsonDb_IndexerName(indexers[i])).str(), timer.Elapsed(), document.size() * 10);
+	}
+
+	// Both parsers write the same elements, the elements are not committed
+	for(int grammar = 0; grammar < 2; ++grammar)
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		ValuePointer value(new ValueNull(transaction->GenerateKey()));
+
+		BenchmarkTimer timer;
+		if(grammar)
+			JsonDb_ParseJsonGrammar(transaction, document, value);
+		else
+			JsonDb_ParseJsonExpression(transaction, document, value);
+		ReportBytes(grammar ? "parse and store, grammar" : (boost::format("parse and store, structural (%s)") % JsonDb_IndexerName(indexer_auto)).str(), timer.Elapsed(), document.size());
+
+		transaction->Retrieve(value->GetKey())->Delete(transaction);
+	}
+}
+
+// Export throughput of a large document, in compact and pretty format
+static void Benchmark_Export(JsonDb &json_db)
+{
+	std::istringstream input(UsersDocument(50000));
+	json_db.ImportJson("$.benchmark.export", input);
+
+	std::cout << "Export:" << std::endl;
+	for(int pretty = 0; pretty < 2; ++pretty)
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartReadTransaction();
+
+		BenchmarkTimer timer;
+		std::ostringstream output;
+		json_db.Export(transaction, "$.benchmark.export", output, JsonDb::ExportOptions(pretty != 0));
+		ReportBytes(pretty ? "Export pretty" : "Export compact", timer.Elapsed(), output.str().size());
+	}
+
+	JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+	json_db.Delete(transaction, "$.benchmark");
+}
+
+// Export, validation and deletion of a wide tree read from the database
+static void Benchmark_Traversal(JsonDb &json_db)
+{
+	std::istringstream input(UsersDocument(50000));
+	json_db.ImportJson("$.benchmark.traversal", input);
+
+	std::cout << "Traversal:" << std::endl;
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartReadTransaction();
+		transaction->ClearCache();
+
+		BenchmarkTimer timer;
+		std::ostringstream output;
+		json_db.Export(transaction, "$.benchmark.traversal", output);
+		ReportBytes("Export uncached", timer.Elapsed(), output.str().size());
+	}
+
+	// Readers of a closed database can validate with several threads
+	json_db.Close();
+	for(size_t threads = 1; threads <= 4; threads *= 4)
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartReadTransaction();
+		transaction->ClearCache();
+
+		BenchmarkTimer timer;
+		JsonDb::ValidationReport report = json_db.Validate(transaction, threads);
+		Report((boost::format("Validate uncached, %d threads") % report.threads).str(), timer.Elapsed(), report.records);
+	}
+
+	JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+	transaction->ClearCache();
+
+	BenchmarkTimer timer;
+	json_db.Delete(transaction, "$.benchmark");
+	Report("Delete uncached", timer.Elapsed(), 1);
+}
+
+// Compaction in time slices after half of the database is deleted and stray records are left behind
+static void Benchmark_Compaction(JsonDb &json_db)
+{
+	std::istringstream input(UsersDocument(50000));
+	json_db.ImportJson("$.benchmark.compaction", input);
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		for(size_t i = 0; i < 25000; ++i)
+			json_db.Delete(transaction, "$.benchmark.compaction.users[0]");
+
+		for(size_t i = 0; i < 25000; ++i)
+		{
+			ValueKey key = transaction->GenerateKey();
+			transaction->Store(key, ValuePointer(new ValueNumberInteger(key, (int)i)));
+		}
+	}
+
+	std::cout << "Compaction:" << std::endl;
+
+	double longest = 0;
+	BenchmarkTimer timer;
+	JsonDb::CompactionReport report;
+	do
+	{
+		BenchmarkTimer slice;
+		report = json_db.Compact(1000);
+		longest = std::max(longest, slice.Elapsed());
+	} while(!report.complete);
+
+	Report("Compact in slices of 1 ms", timer.Elapsed(), report.slices);
+	std::cout << boost::format("  %-40s %10.0f us") % "Longest slice" % longest << std::endl;
+	std::cout << boost::format("  %-40s %10d records, %d entries") % "Removed" % report.removed_records % report.removed_entries << std::endl;
+	std::cout << boost::format("  %-40s %10d bytes, %d pages rewritten") % "Reclaimed" % report.GetReclaimed() % report.pages_rewritten << std::endl;
+
+	JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+	json_db.Delete(transaction, "$.benchmark");
+}
+
+// Time to delete a large subtree in the foreground, and with deferred deletion
+static void Benchmark_DeferredDelete(JsonDb &json_db)
+{
+	std::cout << "Deferred delete:" << std::endl;
+
+	for(int deferred = 0; deferred < 2; ++deferred)
+	{
+		std::istringstream input(UsersDocument(20000));
+		json_db.ImportJson("$.benchmark.deferred", input);
+
+		json_db.EnableDeferredDelete(deferred != 0);
+		BenchmarkTimer timer;
+		{
+			JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+			json_db.Delete(transaction, "$.benchmark.deferred");
+		}
+		Report(deferred ? "Delete 20000 users, deferred" : "Delete 20000 users", timer.Elapsed(), 1);
+
+		if(deferred)
+		{
+			size_t batches = 0;
+			double longest = 0;
+			BenchmarkTimer reclaim;
+			for(;;)
+			{
+				BenchmarkTimer batch;
+				if(json_db.Reclaim() == 0)
+					break;
+				longest = std::max(longest, batch.Elapsed());
+				++batches;
+			}
+			Report("Reclaim in batches", reclaim.Elapsed(), batches);
+			std::cout << boost::format("  %-40s %10.0f us") % "Longest batch" % longest << std::endl;
+		}
+	}
+
+	json_db.EnableDeferredDelete(false);
+	JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+	json_db.Delete(transaction, "$.benchmark");
+}
+
+// Finding an element by value with an index, and by reading the elements of the array
+static void Benchmark_Index(JsonDb &json_db)
+{
+	size_t const users = 20000;
+	size_t const lookups = 1000;
+
+	std::istringstream input(UsersDocument(users));
+	json_db.ImportJson("$.benchmark.index", input);
+
+	std::cout << "Index:" << std::endl;
+	{
+		BenchmarkTimer timer;
+		JsonDb::TransactionHandle transaction = json_db.StartReadTransaction();
+		for(size_t i = 0; i < 10; ++i)
+		{
+			int id = (int)((i * 7919) % users);
+			for(size_t j = 0; j < users; ++j)
+				if(json_db.GetInt(transaction, JsonDb::Path("$.benchmark.index.users")[j]["id"]) == id)
+					break;
+		}
+		Report("Find by reading the array", timer.Elapsed(), 10);
+	}
+
+	{
+		BenchmarkTimer timer;
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		json_db.CreateIndex(transaction, "id", "$.benchmark.index.users[*].id");
+		transaction->Commit();
+		Report("Create index", timer.Elapsed(), 1);
+	}
+
+	{
+		BenchmarkTimer timer;
+		JsonDb::TransactionHandle transaction = json_db.StartReadTransaction();
+		for(size_t i = 0; i < lookups; ++i)
+			json_db.Lookup(transaction, "id", (int)((i * 7919) % users));
+		Report("Lookup", timer.Elapsed(), lookups);
+	}
+
+	// The indexed value changes, and a value which is not indexed
+	char const *members[] = { "id", "logins" };
+	for(size_t member = 0; member < 2; ++member)
+	{
+		BenchmarkTimer timer;
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		for(size_t i = 0; i < lookups; ++i)
+			json_db.Set(transaction, JsonDb::Path("$.benchmark.index.users")[(i * 7919) % users][members[member]], (int)(users + i));
+		transaction->Commit();
+		Report(member == 0 ? "Set indexed value" : "Set value not indexed", timer.Elapsed(), lookups);
+	}
+
+	JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+	json_db.DropIndex(transaction, "id");
+	json_db.Delete(transaction, "$.benchmark");
+}
+
+// Sum of a member of every element, read with Get per element and aggregated in a single pass
+static void Benchmark_Aggregate(JsonDb &json_db)
+{
+	size_t const users = 20000;
+	size_t const passes = 10;
+
+	std::istringstream input(UsersDocument(users));
+	json_db.ImportJson("$.benchmark.aggregate", input);
+
+	std::cout << "Aggregate:" << std::endl;
+	{
+		BenchmarkTimer timer;
+		for(size_t i = 0; i < passes; ++i)
+		{
+			JsonDb::TransactionHandle transaction = json_db.StartReadTransaction();
+			double sum = 0.0;
+			for(size_t j = 0; j < users; ++j)
+				sum += json_db.GetInt(transaction, JsonDb::Path("$.benchmark.aggregate.users")[j]["logins"]);
+		}
+		Report("Sum by reading the array", timer.Elapsed(), passes);
+	}
+
+	{
+		BenchmarkTimer timer;
+		for(size_t i = 0; i < passes; ++i)
+		{
+			JsonDb::TransactionHandle transaction = json_db.StartReadTransaction();
+			json_db.Aggregate(transaction, "$.benchmark.aggregate.users[*].logins");
+		}
+		Report("Aggregate", timer.Elapsed(), passes);
+	}
+
+	{
+		BenchmarkTimer timer;
+		for(size_t i = 0; i < passes; ++i)
+		{
+			JsonDb::TransactionHandle transaction = json_db.StartReadTransaction();
+			json_db.Aggregate(transaction, "$.benchmark.aggregate.users[*]", JsonDb::aggregate_count);
+		}
+		Report("Count elements", timer.Elapsed(), passes);
+	}
+
+	JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+	json_db.Delete(transaction, "$.benchmark");
+}
+
+// Latest values and values in a range, found by reading every element and by scanning an ordered index
+static void Benchmark_OrderedIndex(JsonDb &json_db)
+{
+	size_t const users = 20000;
+	size_t const scans = 100;
+
+	std::istringstream input(UsersDocument(users));
+	json_db.ImportJson("$.benchmark.range", input);
+
+	std::cout << "Ordered index:" << std::endl;
+	{
+		BenchmarkTimer timer;
+		JsonDb::TransactionHandle transaction = json_db.StartReadTransaction();
+		for(size_t i = 0; i < 10; ++i)
+		{
+			size_t in_range = 0;
+			for(size_t j = 0; j < users; ++j)
+			{
+				int id = json_db.GetInt(transaction, JsonDb::Path("$.benchmark.range.users")[j]["id"]);
+				if(id >= 5000 && id < 6000)
+					++in_range;
+			}
+		}
+		Report("Count in range by reading the array", timer.Elapsed(), 10);
+	}
+
+	{
+		BenchmarkTimer timer;
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		json_db.CreateOrderedIndex(transaction, "id", "$.benchmark.range.users[*].id");
+		transaction->Commit();
+		Report("Create ordered index", timer.Elapsed(), 1);
+	}
+
+	{
+		BenchmarkTimer timer;
+		JsonDb::TransactionHandle transaction = json_db.StartReadTransaction();
+		for(size_t i = 0; i < scans; ++i)
+			json_db.Count(transaction, "id", JsonDb::IndexRange().From(5000).To(6000, true));
+		Report("Count in range", timer.Elapsed(), scans);
+	}
+
+	{
+		BenchmarkTimer timer;
+		JsonDb::TransactionHandle transaction = json_db.StartReadTransaction();
+		for(size_t i = 0; i < scans; ++i)
+			json_db.Scan(transaction, "id", JsonDb::IndexRange().Descending().Limit(50));
+		Report("Top 50", timer.Elapsed(), scans);
+	}
+
+	JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+	json_db.DropIndex(transaction, "id");
+	json_db.Delete(transaction, "$.benchmark");
+}
+
+// Filters evaluated by reading every element with Get, by a query, and by a query answered by an index
+static void Benchmark_Query(JsonDb &json_db)
+{
+	size_t const users = 20000;
+	size_t const scans = 10;
+	size_t const lookups = 1000;
+
+	std::istringstream input(UsersDocument(users));
+	json_db.ImportJson("$.benchmark.query", input);
+
+	std::cout << "Query:" << std::endl;
+	{
+		BenchmarkTimer timer;
+		JsonDb::TransactionHandle transaction = json_db.StartReadTransaction();
+		for(size_t i = 0; i < scans; ++i)
+		{
+			size_t matches = 0;
+			for(size_t j = 0; j < users; ++j)
+			{
+				JsonDb::Path user = JsonDb::Path("$.benchmark.query.users")[j];
+				if(json_db.GetInt(transaction, user["id"]) >= (int)(users / 2) && json_db.GetInt(transaction, user["logins"]) == 10)
+					++matches;
+			}
+		}
+		Report("Filter by reading the array", timer.Elapsed(), scans);
+	}
+
+	{
+		BenchmarkTimer timer;
+		JsonDb::TransactionHandle transaction = json_db.StartReadTransaction();
+		JsonDb::Query query((boost::format("$.benchmark.query.users[?(@.id >= %d && @.logins == 10)]") % (users / 2)).str());
+		for(size_t i = 0; i < scans; ++i)
+			json_db.SelectPaths(transaction, query);
+		Report("Filter query", timer.Elapsed(), scans);
+	}
+
+	{
+		BenchmarkTimer timer;
+		JsonDb::TransactionHandle transaction = json_db.StartReadTransaction();
+		for(size_t i = 0; i < scans; ++i)
+			json_db.SelectPaths(transaction, (boost::format("$.benchmark.query.users[?(@.id == %d)]") % ((i * 7919) % users)).str());
+		Report("Equality query without index", timer.Elapsed(), scans);
+	}
+
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		json_db.CreateIndex(transaction, "id", "$.benchmark.query.users[*].id");
+	}
+
+	{
+		BenchmarkTimer timer;
+		JsonDb::TransactionHandle transaction = json_db.StartReadTransaction();
+		for(size_t i = 0; i < lookups; ++i)
+			json_db.SelectPaths(transaction, (boost::format("$.benchmark.query.users[?(@.id == %d)]") % ((i * 7919) % users)).str());
+		Report("Equality query with index", timer.Elapsed(), lookups);
+	}
+
+	JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+	json_db.DropIndex(transaction, "id");
+	json_db.Delete(transaction, "$.benchmark");
+}
+
+// Placement of subtrees which grow in turn over several sessions, and after the database is reclustered
+static void ReportLocality(JsonDb &json_db, std::string const &name, size_t subtrees)
+{
+	JsonDb::Locality total;
+	double elapsed = 0;
+	for(size_t i = 0; i < subtrees; ++i)
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartReadTransaction();
+		JsonDb::Path path = JsonDb::Path("$.benchmark")[i];
+		JsonDb::Locality locality = json_db.GetLocality(transaction, path);
+		total.records += locality.records;
+		total.fragments += locality.fragments;
+		total.leaf_pages += locality.leaf_pages;
+
+		transaction->ClearCache();
+		BenchmarkTimer timer;
+		std::ostringstream output;
+		json_db.Export(transaction, path, output);
+		elapsed += timer.Elapsed();
+	}
+
+	std::cout << name << ":" << std::endl;
+	std::cout << boost::format("  %-40s %10.1f") % "records per subtree" % ((double)total.records / subtrees) << std::endl;
+	std::cout << boost::format("  %-40s %10.1f") % "fragments per subtree" % ((double)total.fragments / subtrees) << std::endl;
+	std::cout << boost::format("  %-40s %10.1f") % "leaf pages per subtree" % ((double)total.leaf_pages / subtrees) << std::endl;
+	Report("Export subtree", elapsed, subtrees);
+}
+
+static void Benchmark_Locality(JsonDb &json_db)
+{
+	size_t const subtrees = 16;
+	size_t const sessions = 4;
+	size_t const documents = 200;
+	std::string const document = "{ \"id\": 1, \"name\": \"user\", \"email\": \"user@example.com\", "
+		"\"groups\": [1, 2, 3, 4], \"address\": { \"street\": \"a street name long enough to have a record of its own\" } }";
+
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		json_db.SetArray(transaction, "$.benchmark", subtrees);
+		for(size_t i = 0; i < subtrees; ++i)
+			json_db.SetArray(transaction, JsonDb::Path("$.benchmark")[i], 0);
+	}
+
+	// Every subtree grows a little in every transaction, the database is reopened after every session
+	for(size_t session = 0; session < sessions; ++session)
+	{
+		for(size_t i = 0; i < documents / sessions; i += 5)
+		{
+			JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+			for(size_t j = 0; j < 5; ++j)
+				for(size_t subtree = 0; subtree < subtrees; ++subtree)
+					json_db.AppendArrayJson(transaction, JsonDb::Path("$.benchmark")[subtree], document);
+		}
+
+		json_db.Close();
+	}
+
+	std::cout << "Locality:" << std::endl;
+	ReportLocality(json_db, "Before recluster", subtrees);
+
+	std::string const filename = "locality_benchmark.db";
+	json_db.Recluster(filename);
+	{
+		JsonDb reclustered(filename);
+		ReportLocality(reclustered, "After recluster", subtrees);
+		reclustered.Delete();
+	}
+
+	JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+	json_db.Delete(transaction, "$.benchmark");
+}
+
+// Latency of small transactions, reopening the database for every transaction as before and keeping it open
+static void Benchmark_SmallTransactions(JsonDb &json_db)
+{
+	size_t const iterations = 2000;
+
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		json_db.SetJson(transaction, "$.benchmark.small", "{ \"counter\": 0, \"name\": \"small\" }");
+	}
+
+	std::cout << "Small transactions:" << std::endl;
+	for(int reopen = 1; reopen >= 0; --reopen)
+	{
+		BenchmarkTimer timer;
+		for(size_t i = 0; i < iterations; ++i)
+		{
+			{
+				JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+				json_db.Set(transaction, "$.benchmark.small.counter", json_db.GetInt(transaction, "$.benchmark.small.counter") + 1);
+			}
+
+			if(reopen)
+				json_db.Close();
+		}
+		Report(reopen ? "increment, reopen database" : "increment, database kept open", timer.Elapsed(), iterations);
+	}
+
+	// Readers open the database themselves when it is closed, and use it when it is open
+	for(int reopen = 1; reopen >= 0; --reopen)
+	{
+		if(!reopen)
+			json_db.StartTransaction();
+
+		BenchmarkTimer timer;
+		for(size_t i = 0; i < iterations; ++i)
+		{
+			{
+				JsonDb::TransactionHandle transaction = json_db.StartReadTransaction();
+				json_db.GetString(transaction, "$.benchmark.small.name");
+			}
+
+			if(reopen)
+				json_db.Close();
+		}
+		Report(reopen ? "read, reopen database" : "read, database kept open", timer.Elapsed(), iterations);
+	}
+
+	JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+	json_db.Delete(transaction, "$.benchmark");
+}
+
+static void ReportThroughput(std::string const &name, double elapsed, size_t iterations)
+{
+	std::cout << boost::format("  %-40s %10.0f ops/s  (%d ops)") % name % (iterations * 1000000.0 / elapsed) % iterations << std::endl;
+}
+
+static void ScalingReader(JsonDb &json_db, size_t iterations)
+{
+	for(size_t i = 0; i < iterations; ++i)
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartReadTransaction();
+		json_db.GetInt(transaction, (boost::format("$.benchmark.threads.thread%d.value%d") % (i % 16) % (i % 100)).str());
+	}
+}
+
+static void ScalingWriter(JsonDb &json_db, int thread, size_t iterations)
+{
+	JsonDb::Path thread_path((boost::format("$.benchmark.threads.thread%d") % thread).str());
+	for(size_t i = 0; i < iterations; ++i)
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		json_db.Set(transaction, thread_path[(boost::format("value%d") % (i % 100)).str()], (int)i);
+	}
+}
+
+// Throughput of readers, and of writers on separate subtrees, with an increasing number of threads
+static void Benchmark_Threads(JsonDb &json_db)
+{
+	size_t const reads = 20000;
+	size_t const writes = 2000;
+
+	json_db.EnableThreadSafety();
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		for(int i = 0; i < 16; ++i)
+			for(int j = 0; j < 100; ++j)
+				json_db.Set(transaction, (boost::format("$.benchmark.threads.thread%d.value%d") % i % j).str(), j);
+	}
+
+	std::cout << "Threads:" << std::endl;
+	for(int threads = 1; threads <= 16; threads *= 2)
+	{
+		BenchmarkTimer timer;
+		boost::thread_group group;
+		for(int i = 0; i < threads; ++i)
+			group.create_thread(boost::bind(ScalingReader, boost::ref(json_db), reads / threads));
+		group.join_all();
+		ReportThroughput((boost::format("read, %d threads") % threads).str(), timer.Elapsed(), reads);
+	}
+
+	for(int threads = 1; threads <= 16; threads *= 2)
+	{
+		BenchmarkTimer timer;
+		boost::thread_group group;
+		for(int i = 0; i < threads; ++i)
+			group.create_thread(boost::bind(ScalingWriter, boost::ref(json_db), i, writes / threads));
+		group.join_all();
+		ReportThroughput((boost::format("write, %d threads") % threads).str(), timer.Elapsed(), writes);
+	}
+
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		json_db.Delete(transaction, "$.benchmark");
+	}
+
+	json_db.EnableThreadSafety(false);
+}
+
+// Write throughput with and without group commit, and the database commits it took
+static void Benchmark_GroupCommit(JsonDb &json_db)
+{
+	size_t const writes = 2000;
+
+	std::cout << "Group commit:" << std::endl;
+	for(int grouped = 0; grouped < 2; ++grouped)
+	{
+		if(grouped)
+			json_db.EnableGroupCommit();
+		else
+			json_db.EnableThreadSafety();
+
+		for(int threads = 1; threads <= 16; threads *= 4)
+		{
+			unsigned long commits = json_db.GetCommits();
+			BenchmarkTimer timer;
+			boost::thread_group group;
+			for(int i = 0; i < threads; ++i)
+				group.create_thread(boost::bind(ScalingWriter, boost::ref(json_db), i, writes / threads));
+			group.join_all();
+			ReportThroughput((boost::format("%s, %d threads, %d commits") % (grouped ? "grouped" : "single") % threads % (json_db.GetCommits() - commits)).str(), timer.Elapsed(), writes);
+		}
+	}
+
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		json_db.Delete(transaction, "$.benchmark");
+	}
+
+	json_db.EnableThreadSafety(false);
+}
+
+struct Benchmark
+{
+	char const *name;
+	void (*run)(JsonDb &json_db);
+};
+
+static Benchmark const benchmarks[] =
+{
+	{ "path", Benchmark_PathParse },
+	{ "codec", Benchmark_Codec },
+	{ "array", Benchmark_ArrayAppend },
+	{ "documents", Benchmark_Documents },
+	{ "parse", Benchmark_Parse },
+	{ "import", Benchmark_Import },
+	{ "export", Benchmark_Export },
+	{ "traversal", Benchmark_Traversal },
+	{ "compaction", Benchmark_Compaction },
+	{ "deferred", Benchmark_DeferredDelete },
+	{ "index", Benchmark_Index },
+	{ "query", Benchmark_Query },
+	{ "range", Benchmark_OrderedIndex },
+	{ "aggregate", Benchmark_Aggregate },
+	{ "locality", Benchmark_Locality },
+	{ "small", Benchmark_SmallTransactions },
+	{ "threads", Benchmark_Threads },
+	{ "group", Benchmark_GroupCommit }
+};
+
+int main(int argc, char **argv)
+{
+	std::cout << "JsonDbBenchmark" << std::endl;
+
+	if(argc < 2 || argc > 3)
+	{
+		std::cout << "Usage: jsondb_benchmark <dbname> [benchmark]" << std::endl;
+		return 0;
+	}
+
+	try
+	{
+		JsonDb json_db(argv[1]);
+
+		for(size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); ++i)
+		{
+			if(argc == 3 && std::string(argv[2]) != benchmarks[i].name)
+				continue;
+
+			benchmarks[i].run(json_db);
+		}
+	} catch(std::runtime_error &e)
+	{
+		std::cout << "Error occurred while running benchmark: " << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -20,10 +20,12 @@
 #include "JsonDb.h"
 
 #include <sstream>
+#include <fstream>
 #include <iostream>
 #include <readline/readline.h>
 #include <readline/history.h>
 #include <boost/tokenizer.hpp>
+#include <boost/lexical_cast.hpp>
 
 bool quit = false;
 
@@ -59,6 +61,12 @@ void Help()
 	std::cout << "put <path> <value>    - Set path to the specified json value" << std::endl;
 	std::cout << "delete <path>         - Delete specified value from database" << std::endl;
 	std::cout << "append <path> <value> - Append value to array" << std::endl;
+	std::cout << "import <path> <file>  - Set path to the json document in the file" << std::endl;
+	std::cout << "compact               - Remove unreachable records and rebuild the database file" << std::endl;
+	std::cout << "index <name> <path>   - Create an index on the values at the path" << std::endl;
+	std::cout << "lookup <name> <value> - Print the paths of the values in the index equal to the json value" << std::endl;
+	std::cout << "query <query>         - Print the paths of the elements matching the query" << std::endl;
+	std::cout << "stats [reset]         - Print the operation counts and latencies of the commands, or reset them" << std::endl;
 	std::cout << "quit                  - Exit" << std::endl;
 	std::cout << std::endl;
 	std::cout << "Examples: " << std::endl;
@@ -67,6 +75,11 @@ void Help()
 	std::cout << "delete $.a.b.c.d" << std::endl;
 	std::cout << "put $.a.b.c.array [10, 20, 30]" << std::endl;
 	std::cout << "append $.a.b.c.array 40" << std::endl;
+	std::cout << "import $.a.b.c.e document.json" << std::endl;
+	std::cout << "index email $.users[*].email" << std::endl;
+	std::cout << "lookup email 'user@example.com'" << std::endl;
+	std::cout << "query $.users[?(@.age > 30 && @.active)].email" << std::endl;
+	std::cout << "stats" << std::endl;
 	std::cout << "quit" << std::endl;
 }
 
@@ -82,6 +95,7 @@ int main(int argc, char **argv)
 
 	std::cout << "Opening database: " << argv[1] << std::endl;
 	JsonDb json_db(argv[1]);
+	json_db.EnableStatistics();
 
 	while(!quit)
 	{
@@ -104,7 +118,7 @@ int main(int argc, char **argv)
 				quit = true;
 			} else if(tokens_count == 2 && tokens[0] == "get")
 			{
-				JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+				JsonDb::TransactionHandle transaction = json_db.StartReadTransaction();
 				json_db.Print(transaction, tokens[1], std::cout);
 				std::cout << std::endl;
 			} else if(tokens_count == 2 && tokens[0] == "delete")
@@ -127,6 +141,59 @@ int main(int argc, char **argv)
 
 				JsonDb::TransactionHandle transaction = json_db.StartTransaction();
 				json_db.AppendArrayJson(transaction, tokens[1], value);
+			} else if(tokens_count == 3 && tokens[0] == "import")
+			{
+				std::ifstream input(tokens[2].c_str(), std::ios::in | std::ios::binary);
+				if(!input)
+					throw std::runtime_error("Failed to open file: " + tokens[2]);
+
+				size_t bytes = json_db.ImportJson(tokens[1], input);
+				std::cout << "Imported " << bytes << " bytes" << std::endl;
+			} else if(tokens_count == 1 && tokens[0] == "compact")
+			{
+				JsonDb::CompactionReport report = json_db.Compact();
+				std::cout << "Removed " << report.removed_records << " records and " << report.removed_entries << " entries, reclaimed "
+					<< report.GetReclaimed() << " bytes, rewrote " << report.pages_rewritten << " pages" << std::endl;
+			} else if(tokens_count == 3 && tokens[0] == "index")
+			{
+				JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+				json_db.CreateIndex(transaction, tokens[1], tokens[2]);
+			} else if(tokens_count >= 3 && tokens[0] == "lookup")
+			{
+				std::string value;
+				for(std::vector<std::string>::const_iterator i = tokens.begin() + 2; i != tokens.end(); ++i)
+					value += (i == tokens.begin() + 2 ? "" : " ") + *i;
+
+				// Quoted values are strings, other values are booleans or numbers
+				JsonDb::TransactionHandle transaction = json_db.StartReadTransaction();
+				std::vector<JsonDb::Path> paths;
+				if(value.size() >= 2 && (value[0] == '\'' || value[0] == '"') && value[value.size() - 1] == value[0])
+					paths = json_db.Lookup(transaction, tokens[1], value.substr(1, value.size() - 2));
+				else if(value == "true" || value == "false")
+					paths = json_db.Lookup(transaction, tokens[1], value == "true");
+				else if(value.find_first_of(".eE") == std::string::npos)
+					paths = json_db.Lookup(transaction, tokens[1], boost::lexical_cast<int>(value));
+				else
+					paths = json_db.Lookup(transaction, tokens[1], boost::lexical_cast<double>(value));
+
+				for(std::vector<JsonDb::Path>::const_iterator i = paths.begin(); i != paths.end(); ++i)
+					std::cout << i->ToString() << std::endl;
+			} else if(tokens_count >= 2 && tokens[0] == "query")
+			{
+				std::string query;
+				for(std::vector<std::string>::const_iterator i = tokens.begin() + 1; i != tokens.end(); ++i)
+					query += (i == tokens.begin() + 1 ? "" : " ") + *i;
+
+				JsonDb::TransactionHandle transaction = json_db.StartReadTransaction();
+				std::vector<JsonDb::Path> paths = json_db.SelectPaths(transaction, query);
+				for(std::vector<JsonDb::Path>::const_iterator i = paths.begin(); i != paths.end(); ++i)
+					std::cout << i->ToString() << std::endl;
+			} else if(tokens_count == 1 && tokens[0] == "stats")
+			{
+				json_db.GetStatistics().Print(std::cout);
+			} else if(tokens_count == 2 && tokens[0] == "stats" && tokens[1] == "reset")
+			{
+				json_db.ResetStatistics();
 			} else if(tokens_count == 1 && tokens[0] == "help")
 			{
 				Help();
@@ -138,6 +205,9 @@ int main(int argc, char **argv)
 		} catch(std::runtime_error &e)
 		{
 			std::cout << "Error occurred while handling request: " << e.what() << std::endl;
+		} catch(boost::bad_lexical_cast &e)
+		{
+			std::cout << "An invalid value was specified" << std::endl;
 		}
 	}
 
@@ -21,17 +21,29 @@
 #include "JsonDbValues.h"
 #include "JsonDbParser.h"
 #include "JsonDbPathParser.h"
+#include "JsonDbWriter.h"
+#include "JsonDbValidator.h"
+#include "JsonDbCompactor.h"
+#include "JsonDbReclaimer.h"
+#include "JsonDbIndex.h"
+#include "JsonDbQuery.h"
+#include "JsonDbAggregate.h"
 
 #include <boost/format.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/tokenizer.hpp>
 #include <boost/filesystem/operations.hpp>
+#include <boost/thread/thread_time.hpp>
+#include <boost/bind.hpp>
 
 #include <iostream>
 #include <sstream>
+#include <fstream>
 
 #include <map>
 #include <deque>
+#include <algorithm>
+#include <cstring>
 
 class CharPtr
 	: public boost::shared_ptr<char>
@@ -42,59 +54,669 @@ public:
 	{ }
 };
 
+// Order of the keys in the database. Records are ordered by key, as with VL_CMPINT, and
+// the entries below a record directly follow the record, ordered by name.
+static int CompareKeys(char const *a, int a_size, char const *b, int b_size)
+{
+	if(a_size < (int)sizeof(ValueKey) || b_size < (int)sizeof(ValueKey))
+		return a_size - b_size;
+
+	int a_key, b_key;
+	memcpy(&a_key, a, sizeof(ValueKey));
+	memcpy(&b_key, b, sizeof(ValueKey));
+	if(a_key != b_key)
+		return a_key < b_key ? -1 : 1;
+
+	int result = memcmp(a + sizeof(ValueKey), b + sizeof(ValueKey), std::min(a_size, b_size) - sizeof(ValueKey));
+	return result != 0 ? result : a_size - b_size;
+}
+
+// Name of the entry listing an element in the garbage list, the entries are ordered by key
+static std::string GarbageName(ValueKey key)
+{
+	std::string name(sizeof(ValueKey), '\0');
+	for(size_t i = 0; i < sizeof(ValueKey); ++i)
+		name[i] = (char)(key >> (8 * (sizeof(ValueKey) - 1 - i)));
+	return name;
+}
+
+static ValueKey GarbageKey(std::string const &name)
+{
+	ValueKey key = 0;
+	for(size_t i = 0; i < name.size() && i < sizeof(ValueKey); ++i)
+		key = (key << 8) | (unsigned char)name[i];
+	return key;
+}
+
+// The name of an entry follows the key of its record and a marker, so the key of an entry never equals the key of
+// a record, not even for an empty name
+static const char entry_marker = '\x01';
+static const size_t entry_prefix_size = sizeof(ValueKey) + 1;
+
+// Database key of an entry below a record
+static std::string EntryDbKey(ValueKey key, std::string const &name)
+{
+	std::string result((char const *)&key, sizeof(ValueKey));
+	result += entry_marker;
+	result += name;
+	return result;
+}
+
+// True if the database key is the key of an entry, below the record with the specified key
+static bool IsEntryDbKey(char const *db_key, int size)
+{
+	return size >= (int)entry_prefix_size && db_key[sizeof(ValueKey)] == entry_marker;
+}
+
+static bool IsEntryDbKey(char const *db_key, int size, ValueKey key)
+{
+	return IsEntryDbKey(db_key, size) && memcmp(db_key, &key, sizeof(ValueKey)) == 0;
+}
+
 static void CloseDatabase(VILLA *villa)
 {
 	if(villa != NULL)
 		vlclose(villa);
 }
 
-JsonDb::Transaction::Transaction(std::string const &filename, ValuePointer const &_null_element)
+// Holds the storage mutex in thread-safe mode
+class StorageLock
 {
-	/* The null element */
-	null_element = _null_element;
+public:
+	StorageLock(JsonDb::Storage &_storage)
+		: storage(_storage)
+	{
+		if(storage.mutex != NULL)
+			boost::unique_lock<boost::mutex>(*storage.mutex).swap(lock);
+	}
 
-  /* open the database */
-	db = StorageDbPointer(vlopen(filename.c_str(), VL_OWRITER | VL_OCREAT, VL_CMPINT), CloseDatabase);
+	// Release the mutex before the end of the scope
+	void Release()
+	{
+		if(lock.owns_lock())
+			lock.unlock();
+	}
 
-	/* Start the transaction */
-	vltranbegin(db.get());
+	// Wait until notified of a commit, or until the deadline has passed
+	void WaitForCommit(boost::system_time const &deadline)
+	{
+		storage.commit_condition.timed_wait(lock, deadline);
+	}
+
+	void WaitForCommit()
+	{
+		storage.commit_condition.wait(lock);
+	}
 
+private:
+	JsonDb::Storage &storage;
+	boost::unique_lock<boost::mutex> lock;
+};
+
+// Statistics of the transactions which ended, shared by the transactions of all threads
+class StatisticsTotals
+{
+public:
+	void Add(JsonDb::Statistics const &statistics)
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		totals.Merge(statistics);
+	}
+
+	JsonDb::Statistics Get()
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		return totals;
+	}
+
+	void Reset()
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		totals = JsonDb::Statistics();
+	}
+
+private:
+	boost::mutex mutex;
+	JsonDb::Statistics totals;
+};
+
+// Measures the latency of an operation until the end of the scope, when statistics are collected
+class OperationTimer
+{
+public:
+	OperationTimer(JsonDb::Statistics *_statistics, JsonDb::Statistics::Operation _operation)
+		: statistics(_statistics), operation(_operation)
+	{
+		if(statistics != NULL)
+			start = boost::get_system_time();
+	}
+
+	~OperationTimer()
+	{
+		if(statistics != NULL)
+			statistics->latencies[operation].Add((boost::get_system_time() - start).total_microseconds());
+	}
+
+	// Do not measure the operation, when it is measured by another timer
+	void Cancel()
+	{
+		statistics = NULL;
+	}
+
+private:
+	JsonDb::Statistics *statistics;
+	JsonDb::Statistics::Operation operation;
+	boost::system_time start;
+};
+
+JsonDb::Storage::Storage(std::string const &filename, int mode, bool thread_safe)
+	: db(vlopen(filename.c_str(), mode, CompareKeys), CloseDatabase)
+	, in_transaction(false)
+	, writers(0)
+	, next_id(initial_next_id)
+	, spill_extent(null_key)
+	, group_commit_size(0)
+	, group_commit_delay(0)
+	, waiting(0)
+	, commit_pending(false)
+	, commits(0)
+	, version(0)
+	, track_writes(false)
+	, defer_deletes(false)
+{
 	if(db.get() == NULL)
     throw std::runtime_error((boost::format("Failed to open database: %s") % dperrmsg(dpecode)).str().c_str());
-	
+
+	if(thread_safe)
+		mutex = boost::shared_ptr<boost::mutex>(new boost::mutex());
+
+	// Retrieve the next key from the database
+	int value_size;
+	char const *value = vlgetcache(db.get(), (char const *)&next_id_key, sizeof(ValueKey), &value_size);
+	if(value != NULL)
+		next_id = Value::Unserialize(next_id_key, value, value_size)->GetValueInt();
+
+	stored_next_id = next_id;
+}
+
+// Start the database transaction, if it is not started yet
+static void BeginStorage(JsonDb::Storage &storage)
+{
+	if(storage.in_transaction)
+		return;
+
+	if(!vltranbegin(storage.db.get()))
+		throw std::runtime_error((boost::format("Failed to start transaction: %s") % dperrmsg(dpecode)).str().c_str());
+
+	storage.in_transaction = true;
+}
+
+// Store the next key and commit the database transaction, called when no transaction has writes pending
+static void CommitStorage(JsonDb::Storage &storage)
+{
+	if(storage.next_id != storage.stored_next_id)
+	{
+		BeginStorage(storage);
+
+		std::string value;
+		ValueNumberInteger(next_id_key, storage.next_id).Serialize(value);
+		vlput(storage.db.get(), (char const *)&next_id_key, sizeof(ValueKey), value.data(), value.size(), VL_DOVER);
+		storage.stored_next_id = storage.next_id;
+	}
+
+	if(storage.in_transaction)
+	{
+		vltrancommit(storage.db.get());
+		storage.in_transaction = false;
+		++storage.commits;
+	}
+
+	// Release the transactions waiting for this commit
+	storage.waiting = 0;
+	storage.commit_pending = false;
+	storage.commit_condition.notify_all();
+}
+
+// Give an element or entry the version of the transaction committing or undoing a write to it
+template <typename Key>
+static void SetVersion(std::map<Key, unsigned long> &versions, std::deque<std::pair<unsigned long, Key> > &versioned, Key const &key, unsigned long version)
+{
+	versions[key] = version;
+	versioned.push_back(std::make_pair(version, key));
+}
+
+// Forget the versions up to the oldest version a running transaction started at, they can not fail a transaction
+template <typename Key>
+static void ForgetVersions(std::map<Key, unsigned long> &versions, std::deque<std::pair<unsigned long, Key> > &versioned, unsigned long oldest)
+{
+	for(; !versioned.empty() && versioned.front().first <= oldest; versioned.pop_front())
+	{
+		typename std::map<Key, unsigned long>::iterator i = versions.find(versioned.front().second);
+		if(i != versions.end() && i->second <= oldest)
+			versions.erase(i);
+	}
+}
+
+static void ForgetVersions(JsonDb::Storage &storage)
+{
+	unsigned long oldest = storage.snapshots.empty() ? storage.version : *storage.snapshots.begin();
+	ForgetVersions(storage.versions, storage.versioned_keys, oldest);
+	ForgetVersions(storage.entry_versions, storage.versioned_entries, oldest);
+}
+
+const ValueKey JsonDb::Transaction::cursor_key_spread;
+const size_t JsonDb::Transaction::cursor_skip_limit;
+const ValueKey JsonDb::Storage::extent_size;
+const unsigned int JsonDb::Storage::shared_extent_children;
+const unsigned int JsonDb::Storage::root_lease_extents;
+const size_t JsonDb::Storage::shared_children_limit;
+const unsigned int JsonDb::Transaction::unlimited_children;
+const size_t JsonDb::ValidationReport::listed_keys;
+const size_t JsonDb::reclaim_batch_size;
+const size_t JsonDb::Statistics::latency_buckets;
+
+// Start a new extent above all keys used so far
+static ValueKey AllocateExtent(JsonDb::Storage &storage)
+{
+	ValueKey const extent_size = JsonDb::Storage::extent_size;
+
+	ValueKey extent = (storage.next_id + extent_size - 1) / extent_size * extent_size;
+	storage.next_id = extent + extent_size;
+	storage.extent_next[extent] = extent;
+	return extent;
+}
+
+// Next free key of an extent. An extent which is not used since the database was opened counts as full, because
+// the keys of elements stored inline in their parent have no record of their own to find them by.
+static ValueKey &ExtentNext(JsonDb::Storage &storage, ValueKey extent)
+{
+	std::map<ValueKey, ValueKey>::iterator i = storage.extent_next.find(extent);
+	if(i != storage.extent_next.end())
+		return i->second;
+
+	return storage.extent_next[extent] = extent + JsonDb::Storage::extent_size;
+}
+
+// Lease the free keys of an extent to a transaction, when it has no free keys of the extent left. Returns NULL
+// when the extent is full.
+static JsonDb::Storage::KeyLease *LeaseExtent(JsonDb::Storage &storage, std::map<ValueKey, JsonDb::Storage::KeyLease> &leases, ValueKey extent)
+{
+	JsonDb::Storage::KeyLease &lease = leases[extent];
+	if(lease.next == lease.end)
+	{
+		ValueKey &next = ExtentNext(storage, extent);
+		lease.next = next;
+		lease.end = next = extent + JsonDb::Storage::extent_size;
+	}
+
+	return lease.next != lease.end ? &lease : NULL;
+}
+
+// Lease the first key of a run of new extents, the other keys of the extents are left for the elements below
+static JsonDb::Storage::KeyLease LeaseExtentRun(JsonDb::Storage &storage)
+{
+	JsonDb::Storage::KeyLease lease;
+	lease.step = JsonDb::Storage::extent_size;
+	for(unsigned int i = 0; i < JsonDb::Storage::root_lease_extents; ++i)
+	{
+		ValueKey extent = AllocateExtent(storage);
+		++storage.extent_next[extent];
+		if(i == 0)
+			lease.next = extent;
+	}
+
+	lease.end = storage.next_id;
+	return lease;
+}
+
+JsonDb::Transaction::Transaction(StoragePointer const &_storage, ValuePointer const &_null_element, bool _read_only)
+	: last_key(null_key)
+	, storage(_storage)
+	, db(_storage->db)
+	, joined(false)
+	, snapshot(0)
+	, read_only(_read_only)
+	, defer_deletes(_storage->defer_deletes)
+	, indexes_read(false)
+	, cache_hits(0)
+	, cache_misses(0)
+	, coalesced_writes(0)
+	, path_cache_hits(0)
+	, collect_statistics(_storage->statistics != NULL)
+	, statistics_totals(_storage->statistics)
+{
+	/* The null element */
+	null_element = _null_element;
+
+	// The elements this transaction modifies may not be modified by transactions committed from now on
+	if(!read_only)
+	{
+		StorageLock lock(*storage);
+		snapshot = storage->version;
+		storage->snapshots.insert(snapshot);
+	}
+
 	ValuePointer root = Retrieve(root_key);
 	if(root.get() == NULL)
 	{
 		root = ValuePointer(new ValueObject(root_key));
-		Store(root->GetKey(), root);
+
+		// A reader sees an empty database
+		if(read_only)
+			node_cache[root_key] = root;
+		else
+			Store(root->GetKey(), root);
+	}
+
+}
+
+JsonDb::Transaction::~Transaction()
+{
+	Commit();
+
+	if(!read_only)
+	{
+		StorageLock lock(*storage);
+		storage->snapshots.erase(storage->snapshots.find(snapshot));
+		ForgetVersions(*storage);
+	}
+
+	if(statistics_totals != NULL)
+		statistics_totals->Add(statistics);
+}
+
+ValueKey JsonDb::Transaction::GenerateKey(ValueKey parent)
+{
+	CheckWritable();
+
+	if(parent == null_key)
+		parent = last_key;
+
+	// The storage is only locked when the keys leased for the elements below the parent are used up
+	ChildLease &child = child_leases[parent];
+	if(child.lease == NULL || child.lease->next == child.lease->end || child.shared == 0)
+	{
+		StorageLock lock(*storage);
+		LeaseKeys(parent, child);
 	}
 
-	ValuePointer next_id_value = Retrieve(next_id_key);
-	if(next_id_value.get() == NULL)
+	last_key = child.lease->next;
+	child.lease->next += child.lease->step;
+	if(child.shared != unlimited_children)
+		--child.shared;
+
+	new_keys.insert(last_key);
+	return last_key;
+}
+
+void JsonDb::Transaction::LeaseKeys(ValueKey parent, ChildLease &child)
+{
+	ValueKey const extent_size = Storage::extent_size;
+
+	// The elements of the root each start in a new extent
+	if(parent < initial_next_id)
 	{
-		// Initialize values
-		next_id = initial_next_id;
-		start_next_id = next_id;
-	} else
+		if(root_lease.next == root_lease.end)
+			root_lease = LeaseExtentRun(*storage);
+
+		child.lease = &root_lease;
+		child.shared = unlimited_children;
+		return;
+	}
+
+	std::map<ValueKey, ValueKey>::iterator own_extent = storage->child_extent.find(parent);
+	if(own_extent != storage->child_extent.end())
+	{
+		child.lease = LeaseExtent(*storage, key_leases, own_extent->second);
+		if(child.lease == NULL)
+		{
+			own_extent->second = AllocateExtent(*storage);
+			child.lease = LeaseExtent(*storage, key_leases, own_extent->second);
+		}
+
+		child.shared = unlimited_children;
+		return;
+	}
+
+	// Counting restarts after many elements, this only delays moving an element to an extent of its own
+	if(storage->shared_children.size() >= Storage::shared_children_limit)
+		storage->shared_children.clear();
+
+	// The first elements share the extent of their parent, or the spill extent when that extent is full. The keys
+	// they may take are counted when they are leased, the unused ones are subtracted again when they are released.
+	unsigned int &shared = storage->shared_children[parent];
+	unsigned int left = child.lease != NULL ? child.shared : 0;
+	if(left == 0 && shared < Storage::shared_extent_children)
+	{
+		left = Storage::shared_extent_children - shared;
+		shared = Storage::shared_extent_children;
+	}
+
+	if(left > 0)
+	{
+		child.lease = LeaseExtent(*storage, key_leases, parent - parent % extent_size);
+		if(child.lease == NULL)
+			child.lease = LeaseExtent(*storage, key_leases, storage->spill_extent);
+
+		if(child.lease == NULL)
+		{
+			storage->spill_extent = AllocateExtent(*storage);
+			child.lease = LeaseExtent(*storage, key_leases, storage->spill_extent);
+		}
+
+		child.shared = left;
+		return;
+	}
+
+	// Further elements go to an extent of their own, so they are not mixed with the elements of siblings
+	storage->shared_children.erase(parent);
+	ValueKey extent = AllocateExtent(*storage);
+	storage->child_extent[parent] = extent;
+	child.lease = LeaseExtent(*storage, key_leases, extent);
+	child.shared = unlimited_children;
+}
+
+void JsonDb::Transaction::ReleaseKeys()
+{
+	// An extent gets its unused keys back when no keys of it were leased after them
+	for(KeyLeases::const_iterator i = key_leases.begin(); i != key_leases.end(); ++i)
+	{
+		std::map<ValueKey, ValueKey>::iterator next = storage->extent_next.find(i->first);
+		if(next != storage->extent_next.end() && next->second == i->second.end)
+			next->second = i->second.next;
+	}
+
+	if(root_lease.next != root_lease.end && storage->next_id == root_lease.end)
+	{
+		for(ValueKey extent = root_lease.next; extent != root_lease.end; extent += Storage::extent_size)
+			storage->extent_next.erase(extent);
+		storage->next_id = root_lease.next;
+	}
+
+	for(ChildLeases::const_iterator i = child_leases.begin(); i != child_leases.end(); ++i)
+	{
+		if(i->second.shared == 0 || i->second.shared == unlimited_children)
+			continue;
+
+		std::map<ValueKey, unsigned int>::iterator shared = storage->shared_children.find(i->first);
+		if(shared != storage->shared_children.end())
+			shared->second -= std::min(shared->second, i->second.shared);
+	}
+
+	key_leases.clear();
+	root_lease = Storage::KeyLease();
+	child_leases.clear();
+}
+
+bool JsonDb::Transaction::MarkDirty(ValueKey key)
+{
+	if(!dirty_keys.insert(key).second)
+		return false;
+
+	StorageLock lock(*storage);
+	std::pair<std::map<ValueKey, Transaction const *>::iterator, bool> owner = storage->owners.insert(std::make_pair(key, this));
+	if(owner.second)
+	{
+		owned_keys.push_back(key);
+
+		// The element read by this transaction may be outdated by a commit since it started
+		std::map<ValueKey, unsigned long>::const_iterator version = storage->versions.find(key);
+		if(version == storage->versions.end() || version->second <= snapshot)
+			return true;
+	} else if(owner.first->second == this)
 	{
-		// Retrieve values from database
-		next_id = next_id_value->GetValueInt();
-		start_next_id = next_id;
+		return true;
 	}
 
-	// std::cout << "Start transaction, next id: " << next_id << std::endl;
+	lock.Release();
+	Rollback();
+	throw std::runtime_error((boost::format("Failed to modify element %d, it is modified by another transaction") % key).str());
+}
+
+void JsonDb::Transaction::MarkEntryDirty(EntryKey const &entry_key)
+{
+	if(owned_entries.find(entry_key) != owned_entries.end())
+		return;
+
+	StorageLock lock(*storage);
+	if(storage->entry_owners.insert(std::make_pair(entry_key, this)).second)
+	{
+		owned_entries.insert(entry_key);
+
+		std::map<EntryKey, unsigned long>::const_iterator version = storage->entry_versions.find(entry_key);
+		if(version == storage->entry_versions.end() || version->second <= snapshot)
+			return;
+	}
+
+	lock.Release();
+	Rollback();
+	throw std::runtime_error((boost::format("Failed to modify an entry of element %d, it is modified by another transaction") % entry_key.first).str());
+}
+
+void JsonDb::Transaction::Rollback()
+{
+	StorageLock lock(*storage);
+
+	// Nobody else wrote the keys we own, so the values from before our writes are restored. Transactions which
+	// read our writes fail when they modify the element or entry.
+	if(!undo_log.empty())
+		++storage->version;
+
+	for(UndoLog::const_iterator i = undo_log.begin(); i != undo_log.end(); ++i)
+	{
+		std::string const &db_key = i->first;
+		if(i->second.first)
+		{
+			vlput(db.get(), db_key.data(), db_key.size(), i->second.second.data(), i->second.second.size(), VL_DOVER);
+			++statistics.writes;
+			statistics.bytes_written += i->second.second.size();
+		} else
+		{
+			vlout(db.get(), db_key.data(), db_key.size());
+			++statistics.removes;
+		}
+
+		ValueKey key;
+		memcpy(&key, db_key.data(), sizeof(ValueKey));
+		if(IsEntryDbKey(db_key.data(), db_key.size()))
+			SetVersion(storage->entry_versions, storage->versioned_entries, EntryKey(key, db_key.substr(entry_prefix_size)), storage->version);
+		else
+			SetVersion(storage->versions, storage->versioned_keys, key, storage->version);
+
+		if(storage->track_writes)
+			storage->written_keys.push_back(key);
+	}
+
+	for(std::vector<ValueKey>::const_iterator i = owned_keys.begin(); i != owned_keys.end(); ++i)
+		storage->owners.erase(*i);
+	owned_keys.clear();
+
+	for(std::set<EntryKey>::const_iterator i = owned_entries.begin(); i != owned_entries.end(); ++i)
+		storage->entry_owners.erase(*i);
+	owned_entries.clear();
+
+	ReleaseKeys();
+
+	// The restored values are committed with the other writers
+	if(joined)
+	{
+		--storage->writers;
+		joined = false;
+	}
+
+	if(storage->writers == 0 && storage->waiting == 0)
+		CommitStorage(*storage);
+
+	Renew();
+	DiscardWrites();
+}
+
+void JsonDb::Transaction::Renew()
+{
+	if(read_only)
+		return;
+
+	storage->snapshots.erase(storage->snapshots.find(snapshot));
+	snapshot = storage->version;
+	storage->snapshots.insert(snapshot);
+	ForgetVersions(*storage);
+}
+
+void JsonDb::Transaction::DiscardWrites()
+{
+	dirty_keys.clear();
+	dirty_entries.clear();
+	deleted_entries.clear();
+	new_keys.clear();
+	undo_log.clear();
+
+	// The values and the indexes changed by the discarded writes
+	DropCache();
+}
+
+void JsonDb::Transaction::DropCache()
+{
+	node_cache.clear();
+	inline_parents.clear();
+
+	// Elements stored inline can only be found through their parent
+	path_cache.clear();
+	path_cache_keys.clear();
+
+	// Other transactions may have changed the indexes since they were read
+	indexes.clear();
+	indexes_read = false;
 }
 
 void JsonDb::Transaction::Store(ValueKey key, ValuePointer value)
 {
+	CheckWritable();
+	OperationTimer timer(GetCollectedStatistics(), Statistics::operation_store);
+
 	if(key != null_key)
 	{
-		std::ostringstream output;
-		value->Serialize(output);
-
-		std::string output_string = output.str();
-		vlput(db.get(), (char const *)&key, sizeof(ValueKey), &output_string[0], output_string.size(), VL_DOVER);
-		// std::cout << "Store: key=" << key << std::endl;
+		// An element stored inline is written as part of its parent
+		InlineParents::iterator parent = inline_parents.find(key);
+		if(parent != inline_parents.end())
+		{
+			ValuePointer parent_value = node_cache[parent->second];
+			if(parent_value != NULL)
+			{
+				MarkDirty(parent->second);
+				if(parent_value->SetInline(key, value))
+				{
+					node_cache[key] = value;
+					return;
+				}
+			}
+
+			inline_parents.erase(parent);
+		}
+
+		if(!MarkDirty(key))
+			++coalesced_writes;
+
+		node_cache[key] = value;
 	}
 }
 
@@ -103,181 +725,1110 @@ ValuePointer JsonDb::Transaction::Retrieve(ValueKey key)
 	if(key == null_key)
 		return null_element;
 
-	// std::cout << "Retrieve: key=" << key << std::endl;
+	OperationTimer timer(GetCollectedStatistics(), Statistics::operation_retrieve);
+
+	// First look in the values already decoded by this transaction
+	NodeCache::const_iterator cached = node_cache.find(key);
+	if(cached != node_cache.end())
+	{
+		// A deleted entry is cached as an empty pointer
+		++cache_hits;
+		return cached->second;
+	}
+
+	++cache_misses;
+
+	// Then decode the actual data, directly from the database cache
+	StorageLock lock(*storage);
+
+	int value_size;
+	char const *value = vlgetcache(db.get(), (char const *)&key, sizeof(ValueKey), &value_size);
+
+	++statistics.reads;
+	if(value == NULL)
+		return ValuePointer();
+
+	statistics.bytes_read += value_size;
+
+	// Other threads may use the database cache while we decode a copy
+	if(storage->mutex != NULL)
+	{
+		decode_buffer.assign(value, value_size);
+		value = decode_buffer.data();
+	}
+
+	lock.Release();
+	return Decode(key, value, value_size);
+}
+
+ValuePointer JsonDb::Transaction::Decode(ValueKey key, char const *data, int size)
+{
+	if(size <= 0)
+		throw std::runtime_error((boost::format("Element has an invalid size: %d") % key).str().c_str());
+
+	ValuePointer result = Value::Unserialize(key, data, size);
+	node_cache[key] = result;
+
+	// Elements stored inline in the record are decoded with it
+	Value::InlineValues const *inline_values = result->GetInlineValues();
+	if(inline_values != NULL)
+	{
+		for(Value::InlineValues::const_iterator i = inline_values->begin(); i != inline_values->end(); ++i)
+		{
+			node_cache.insert(*i);
+			inline_parents[i->first] = key;
+		}
+	}
+
+	return result;
+}
+
+void JsonDb::Transaction::ReadBatch(std::vector<ValueKey> const &keys, RecordBatch &batch)
+{
+	batch.keys.clear();
+	batch.offsets.clear();
+	batch.data.clear();
+
+	std::vector<ValueKey> missing;
+	for(std::vector<ValueKey>::const_iterator i = keys.begin(); i != keys.end(); ++i)
+		if(*i != null_key && node_cache.find(*i) == node_cache.end())
+			missing.push_back(*i);
+
+	if(missing.empty())
+		return;
+
+	std::sort(missing.begin(), missing.end());
+	missing.erase(std::unique(missing.begin(), missing.end()), missing.end());
+
+	StorageLock lock(*storage);
+
+	// Keys spread over a small range are read with the cursor, stepping through the leaves of the tree instead
+	// of searching the tree for every key. The cursor jumps again after a gap in the keys.
+	bool clustered = missing.size() > 1 && missing.back() - missing.front() < missing.size() * cursor_key_spread;
+	bool positioned = false;
+	for(size_t i = 0; i < missing.size(); ++i)
+	{
+		ValueKey key = missing[i];
+		char const *value = NULL;
+		int value_size = 0;
+
+		if(clustered)
+		{
+			if(!positioned)
+				positioned = vlcurjump(db.get(), (char const *)&key, sizeof(ValueKey), VL_JFORWARD);
+
+			// Skip the entries stored with a record, and records not asked for
+			for(size_t skipped = 0; positioned; ++skipped)
+			{
+				int key_size;
+				char const *current = vlcurkeycache(db.get(), &key_size);
+				ValueKey current_key;
+				memcpy(&current_key, current, sizeof(ValueKey));
+				if(current_key > key || (current_key == key && key_size == sizeof(ValueKey)))
+					break;
+
+				positioned = skipped < cursor_skip_limit && vlcurnext(db.get());
+			}
+
+			if(!positioned)
+			{
+				// Jump to the key if the cursor did not reach it
+				positioned = vlcurjump(db.get(), (char const *)&key, sizeof(ValueKey), VL_JFORWARD);
+				if(!positioned)
+					break;
+			}
+
+			int key_size;
+			char const *current = vlcurkeycache(db.get(), &key_size);
+			if(key_size == sizeof(ValueKey) && memcmp(current, &key, sizeof(ValueKey)) == 0)
+				value = vlcurvalcache(db.get(), &value_size);
+		} else
+		{
+			value = vlgetcache(db.get(), (char const *)&key, sizeof(ValueKey), &value_size);
+		}
+
+		++statistics.reads;
+		if(value == NULL)
+			continue;
+
+		statistics.bytes_read += value_size;
+		batch.keys.push_back(key);
+		batch.offsets.push_back(batch.data.size());
+		batch.data.append(value, value_size);
+	}
+
+	batch.offsets.push_back(batch.data.size());
+}
+
+ValuePointer JsonDb::Transaction::Retrieve(ValueKey key, RecordBatch const &batch)
+{
+	if(key == null_key)
+		return null_element;
+
+	OperationTimer timer(GetCollectedStatistics(), Statistics::operation_retrieve);
+
+	NodeCache::const_iterator cached = node_cache.find(key);
+	if(cached != node_cache.end())
+	{
+		++cache_hits;
+		return cached->second;
+	}
+
+	std::vector<ValueKey>::const_iterator record = std::lower_bound(batch.keys.begin(), batch.keys.end(), key);
+	if(record == batch.keys.end() || *record != key)
+	{
+		timer.Cancel();
+		return Retrieve(key);
+	}
+
+	++cache_misses;
+
+	size_t index = record - batch.keys.begin();
+	return Decode(key, batch.data.data() + batch.offsets[index], batch.offsets[index + 1] - batch.offsets[index]);
+}
+
+bool JsonDb::Transaction::PeekRecord(ValueKey key, RecordBatch const &batch, char const *&data, size_t &size) const
+{
+	if(node_cache.find(key) != node_cache.end())
+		return false;
+
+	std::vector<ValueKey>::const_iterator record = std::lower_bound(batch.keys.begin(), batch.keys.end(), key);
+	if(record == batch.keys.end() || *record != key)
+		return false;
+
+	size_t index = record - batch.keys.begin();
+	data = batch.data.data() + batch.offsets[index];
+	size = batch.offsets[index + 1] - batch.offsets[index];
+	return true;
+}
+
+void JsonDb::Transaction::Delete(ValueKey key)
+{
+	CheckWritable();
+	OperationTimer timer(GetCollectedStatistics(), Statistics::operation_delete);
+
+	InvalidatePaths(key);
+
+	// An element stored inline is removed from its parent, it has no record of its own. The parent is
+	// remembered, so a value stored again with the same key is stored inline again.
+	InlineParents::iterator parent = inline_parents.find(key);
+	if(parent != inline_parents.end())
+	{
+		ValuePointer parent_value = node_cache[parent->second];
+		if(parent_value != NULL)
+		{
+			MarkDirty(parent->second);
+			parent_value->SetInline(key, ValuePointer());
+		} else
+		{
+			inline_parents.erase(parent);
+		}
+
+		node_cache[key] = ValuePointer();
+		return;
+	}
+
+	if(!MarkDirty(key))
+		++coalesced_writes;
+
+	node_cache[key] = ValuePointer();
+}
+
+void JsonDb::Transaction::StoreEntry(ValueKey key, std::string const &name, std::string const &value)
+{
+	CheckWritable();
+
+	EntryKey entry_key(key, name);
+	MarkEntryDirty(entry_key);
+	if(deleted_entries.erase(entry_key) > 0 || dirty_entries.find(entry_key) != dirty_entries.end())
+		++coalesced_writes;
+
+	dirty_entries[entry_key] = value;
+}
+
+bool JsonDb::Transaction::RetrieveEntry(ValueKey key, std::string const &name, std::string &value)
+{
+	EntryKey entry_key(key, name);
+	if(deleted_entries.find(entry_key) != deleted_entries.end())
+		return false;
+
+	std::map<EntryKey, std::string>::const_iterator i = dirty_entries.find(entry_key);
+	if(i != dirty_entries.end())
+	{
+		value = i->second;
+		return true;
+	}
+
+	std::string db_key = EntryDbKey(key, name);
+	StorageLock lock(*storage);
+
+	int value_size;
+	char const *db_value = vlgetcache(db.get(), db_key.data(), db_key.size(), &value_size);
+	++statistics.reads;
+	if(db_value == NULL)
+		return false;
+
+	statistics.bytes_read += value_size;
+	value.assign(db_value, value_size);
+	return true;
+}
+
+void JsonDb::Transaction::DeleteEntry(ValueKey key, std::string const &name)
+{
+	CheckWritable();
+
+	EntryKey entry_key(key, name);
+	MarkEntryDirty(entry_key);
+	if(dirty_entries.erase(entry_key) > 0 || deleted_entries.find(entry_key) != deleted_entries.end())
+		++coalesced_writes;
+
+	deleted_entries.insert(entry_key);
+}
+
+void JsonDb::Transaction::RetrieveEntries(ValueKey key, std::string const &from, size_t max_entries, Entries &entries)
+{
+	// Scan the database, it has to reflect all pending writes
+	Flush();
+	ReadEntries(key, from, max_entries, entries);
+}
+
+void JsonDb::Transaction::RetrieveEntriesBefore(ValueKey key, std::string const &before, size_t max_entries, Entries &entries)
+{
+	Flush();
+	entries.clear();
+
+	// Without a name the scan starts at the last entry, the entries are followed by the next record
+	ValueKey next = key + 1;
+	std::string db_key = before.empty() ? std::string((char const *)&next, sizeof(ValueKey)) : EntryDbKey(key, before);
+	StorageLock lock(*storage);
+
+	if(!vlcurjump(db.get(), db_key.data(), db_key.size(), VL_JBACKWARD))
+		return;
+
+	// The cursor is at the last key up to the name, the name itself is skipped
+	int key_size, value_size;
+	char const *entry_key = vlcurkeycache(db.get(), &key_size);
+	if(entry_key != NULL && key_size == (int)db_key.size() && memcmp(entry_key, db_key.data(), key_size) == 0 && !vlcurprev(db.get()))
+		return;
+
+	while(entries.size() < max_entries)
+	{
+		// The record itself precedes its entries
+		entry_key = vlcurkeycache(db.get(), &key_size);
+		if(entry_key == NULL || !IsEntryDbKey(entry_key, key_size, key))
+			break;
+
+		char const *entry_value = vlcurvalcache(db.get(), &value_size);
+		entries.push_back(std::make_pair(
+					std::string(entry_key + entry_prefix_size, key_size - entry_prefix_size),
+					std::string(entry_value, value_size)));
+
+		++statistics.reads;
+		statistics.bytes_read += value_size;
+
+		if(!vlcurprev(db.get()))
+			break;
+	}
+}
+
+void JsonDb::Transaction::ReadEntries(ValueKey key, std::string const &from, size_t max_entries, Entries &entries)
+{
+	entries.clear();
+
+	std::string db_key = EntryDbKey(key, from);
+	StorageLock lock(*storage);
+
+	if(!vlcurjump(db.get(), db_key.data(), db_key.size(), VL_JFORWARD))
+		return;
+
+	while(entries.size() < max_entries)
+	{
+		// The entries follow the record, the cursor starts past the record
+		int key_size, value_size;
+		char const *entry_key = vlcurkeycache(db.get(), &key_size);
+		if(entry_key == NULL || !IsEntryDbKey(entry_key, key_size, key))
+			break;
+
+		char const *entry_value = vlcurvalcache(db.get(), &value_size);
+		entries.push_back(std::make_pair(
+					std::string(entry_key + entry_prefix_size, key_size - entry_prefix_size),
+					std::string(entry_value, value_size)));
+
+		++statistics.reads;
+		statistics.bytes_read += value_size;
+
+		if(!vlcurnext(db.get()))
+			break;
+	}
+}
+
+ValuePointer JsonDb::Transaction::TakeInline(ValueKey parent, ValueKey key)
+{
+	if(dirty_keys.find(key) == dirty_keys.end())
+		return ValuePointer();
+
+	NodeCache::const_iterator cached = node_cache.find(key);
+	if(cached == node_cache.end() || cached->second == NULL || !cached->second->CanInline())
+		return ValuePointer();
+
+	dirty_keys.erase(key);
+	inline_parents[key] = parent;
+
+	// Remove a record written before
+	if(new_keys.find(key) == new_keys.end())
+	{
+		vlout(db.get(), (char const *)&key, sizeof(ValueKey));
+		++statistics.removes;
+	}
+
+	return cached->second;
+}
+
+void JsonDb::Transaction::Flush()
+{
+	Flush(true);
+}
+
+void JsonDb::Transaction::SaveUndo(std::string const &db_key, bool is_new)
+{
+	std::pair<UndoLog::iterator, bool> saved = undo_log.insert(std::make_pair(db_key, std::make_pair(false, std::string())));
+	if(!saved.second || is_new)
+		return;
+
+	int value_size;
+	char const *value = vlgetcache(db.get(), db_key.data(), db_key.size(), &value_size);
+	++statistics.reads;
+	if(value == NULL)
+		return;
+
+	statistics.bytes_read += value_size;
+	saved.first->second.first = true;
+	saved.first->second.second.assign(value, value_size);
+}
+
+void JsonDb::Transaction::Flush(bool undoable)
+{
+	if(dirty_keys.empty() && dirty_entries.empty() && deleted_entries.empty())
+		return;
+
+	StorageLock lock(*storage);
+
+	// Join the database transaction, it is committed when all writers in it are done
+	if(!joined)
+	{
+		// Wait for a group commit which only waits for the writers already in it
+		while(storage->commit_pending)
+			lock.WaitForCommit();
+
+		BeginStorage(*storage);
+		++storage->writers;
+		joined = true;
+	}
+
+	// Remember the records we replace, the records of children moved into their parent included
+	if(undoable)
+	{
+		for(std::set<ValueKey>::const_iterator i = dirty_keys.begin(); i != dirty_keys.end(); ++i)
+			SaveUndo(std::string((char const *)&*i, sizeof(ValueKey)), new_keys.find(*i) != new_keys.end());
+	}
+
+	// Move small new elements into their parents first
+	std::vector<ValuePointer> parents;
+	for(std::set<ValueKey>::const_iterator i = dirty_keys.begin(); i != dirty_keys.end(); ++i)
+	{
+		ValuePointer value = node_cache[*i];
+		if(value != NULL && value->GetInlineValues() != NULL)
+			parents.push_back(value);
+	}
+
+	for(std::vector<ValuePointer>::const_iterator i = parents.begin(); i != parents.end(); ++i)
+		(*i)->InlineChildren(*this);
+
+	for(std::set<ValueKey>::const_iterator i = dirty_keys.begin(); i != dirty_keys.end(); ++i)
+	{
+		ValueKey key = *i;
+		ValuePointer value = node_cache[key];
+
+		if(value != NULL)
+		{
+			encode_buffer.clear();
+			value->Serialize(encode_buffer);
+			vlput(db.get(), (char const *)&key, sizeof(ValueKey), encode_buffer.data(), encode_buffer.size(), VL_DOVER);
+			++statistics.writes;
+			statistics.bytes_written += encode_buffer.size();
+		} else
+		{
+			vlout(db.get(), (char const *)&key, sizeof(ValueKey));
+			++statistics.removes;
+		}
+
+		if(storage->track_writes)
+			storage->written_keys.push_back(key);
+	}
+
+	dirty_keys.clear();
+
+	for(std::map<EntryKey, std::string>::const_iterator i = dirty_entries.begin(); i != dirty_entries.end(); ++i)
+	{
+		std::string db_key = EntryDbKey(i->first.first, i->first.second);
+		if(undoable)
+			SaveUndo(db_key, new_keys.find(i->first.first) != new_keys.end());
+
+		vlput(db.get(), db_key.data(), db_key.size(), i->second.data(), i->second.size(), VL_DOVER);
+		++statistics.writes;
+		statistics.bytes_written += i->second.size();
+
+		if(storage->track_writes)
+			storage->written_keys.push_back(i->first.first);
+	}
+
+	for(std::set<EntryKey>::const_iterator i = deleted_entries.begin(); i != deleted_entries.end(); ++i)
+	{
+		std::string db_key = EntryDbKey(i->first, i->second);
+		if(undoable)
+			SaveUndo(db_key, new_keys.find(i->first) != new_keys.end());
+
+		vlout(db.get(), db_key.data(), db_key.size());
+		++statistics.removes;
+
+		if(storage->track_writes)
+			storage->written_keys.push_back(i->first);
+	}
+
+	dirty_entries.clear();
+	deleted_entries.clear();
+	new_keys.clear();
+}
+
+void JsonDb::Transaction::ClearCache()
+{
+	Flush();
+	DropCache();
+}
+
+void JsonDb::Transaction::Commit()
+{
+	// Only commits with writes are measured, a transaction commits again when it ends
+	bool writes = joined || !dirty_keys.empty() || !dirty_entries.empty() || !deleted_entries.empty();
+	OperationTimer timer(writes ? GetCollectedStatistics() : NULL, Statistics::operation_commit);
+
+	// Our writes are final, they are not undone
+	Flush(false);
+
+	StorageLock lock(*storage);
+
+	// Other transactions may modify our elements again, they fail when they started before this commit
+	unsigned long previous = snapshot;
+	bool wrote = !owned_keys.empty() || !owned_entries.empty();
+	if(wrote)
+		++storage->version;
+
+	for(std::vector<ValueKey>::const_iterator i = owned_keys.begin(); i != owned_keys.end(); ++i)
+	{
+		storage->owners.erase(*i);
+		SetVersion(storage->versions, storage->versioned_keys, *i, storage->version);
+	}
+	owned_keys.clear();
+
+	for(std::set<EntryKey>::const_iterator i = owned_entries.begin(); i != owned_entries.end(); ++i)
+	{
+		storage->entry_owners.erase(*i);
+		SetVersion(storage->entry_versions, storage->versioned_entries, *i, storage->version);
+	}
+	owned_entries.clear();
+	undo_log.clear();
+
+	// The values we decoded may be outdated by the commits of other transactions
+	if(!read_only && storage->version != previous + (wrote ? 1 : 0))
+		DropCache();
+	Renew();
+
+	// Other transactions may use the keys we did not take
+	ReleaseKeys();
+
+	if(joined)
+	{
+		--storage->writers;
+		joined = false;
+
+		if(storage->group_commit_size > 0)
+		{
+			GroupCommit(lock);
+			return;
+		}
+	}
+
+	// The last writer commits the database transaction, unless transactions wait for a group commit
+	if(!read_only && storage->writers == 0 && storage->waiting == 0)
+		CommitStorage(*storage);
+}
+
+void JsonDb::Transaction::GroupCommit(StorageLock &lock)
+{
+	// Our writes are in the next database commit
+	unsigned long commit = storage->commits + 1;
+	++storage->waiting;
+	storage->commit_condition.notify_all();
+
+	boost::system_time deadline = boost::get_system_time() + boost::posix_time::microseconds(storage->group_commit_delay);
+	while(storage->commits < commit)
+	{
+		// Commit when the batch is full or we waited long enough, as soon as no writer is halfway
+		if(storage->commit_pending || storage->waiting >= storage->group_commit_size || boost::get_system_time() >= deadline)
+		{
+			if(storage->writers == 0)
+			{
+				CommitStorage(*storage);
+				return;
+			}
+
+			storage->commit_pending = true;
+		}
+
+		if(storage->commit_pending)
+			lock.WaitForCommit();
+		else
+			lock.WaitForCommit(deadline);
+	}
+}
+
+std::set<ValueKey> JsonDb::Transaction::Walk()
+{
+	std::set<ValueKey> keys;
+
+	// The database has to reflect all pending writes
+	Flush();
+
+	StorageLock lock(*storage);
+
+ 	// initialize the iterator 
+  if(!vlcurfirst(db.get()))
+		throw std::runtime_error("Failed to initialize database iterator");
+
+	CharPtr key;
+	while((key = CharPtr(vlcurkey(db.get(), NULL))) != NULL)
+	{
+		keys.insert(*(ValueKey const *)key.get());
+		vlcurnext(db.get());
+	}
+
+	return keys;
+}
+
+std::vector<ValueKey> JsonDb::Transaction::WalkRecords()
+{
+	std::vector<ValueKey> keys;
+
+	// The database has to reflect all pending writes
+	Flush();
+
+	StorageLock lock(*storage);
+	if(!vlcurfirst(db.get()))
+		return keys;
+
+	int key_size;
+	char const *key;
+	while((key = vlcurkeycache(db.get(), &key_size)) != NULL)
+	{
+		keys.push_back(*(ValueKey const *)key);
+		vlcurnext(db.get());
+	}
+
+	return keys;
+}
+
+ValueKey JsonDb::Transaction::ScanKeys(boost::function<void (ValueKey key, bool entry)> const &receiver, ValueKey from, size_t max_records)
+{
+	// The database has to reflect all pending writes
+	Flush();
+
+	StorageLock lock(*storage);
+	if(!vlcurjump(db.get(), (char const *)&from, sizeof(ValueKey), VL_JFORWARD))
+		return null_key;
+
+	size_t records = 0;
+	int key_size;
+	char const *key;
+	while((key = vlcurkeycache(db.get(), &key_size)) != NULL)
+	{
+		ValueKey value_key;
+		memcpy(&value_key, key, sizeof(ValueKey));
+
+		// A key which is neither a record nor an entry is passed as an entry without a record
+		bool entry = key_size != sizeof(ValueKey);
+		if(entry && !IsEntryDbKey(key, key_size))
+			value_key = null_key;
+		else if(!entry && records++ == max_records)
+			return value_key;
+
+		receiver(value_key, entry);
+		vlcurnext(db.get());
+	}
+
+	return null_key;
+}
+
+size_t JsonDb::Transaction::GetRecordsPerLeaf()
+{
+	StorageLock lock(*storage);
+	int leaves = vllnum(db.get());
+	int records = vlrnum(db.get());
+	return leaves > 0 && records > leaves ? records / leaves : 1;
+}
+
+void JsonDb::Transaction::QueueGarbage(ValueKey key)
+{
+	InvalidatePaths(key);
+	StoreEntry(garbage_key, GarbageName(key), std::string());
+}
+
+bool JsonDb::Transaction::NextGarbage(std::string &from, std::vector<ValueKey> &keys)
+{
+	keys.clear();
+
+	Entries entries;
+	RetrieveEntries(garbage_key, from, ValueObject::member_batch_size, entries);
+	for(Entries::const_iterator i = entries.begin(); i != entries.end(); ++i)
+		keys.push_back(GarbageKey(i->first));
+
+	if(entries.empty())
+		return false;
+
+	// Continue directly after the last element
+	from = entries.back().first;
+	from += '\0';
+	return true;
+}
+
+void JsonDb::Transaction::RemoveGarbage(ValueKey key)
+{
+	DeleteEntry(garbage_key, GarbageName(key));
+}
+
+JsonDb::Transaction::Indexes const &JsonDb::Transaction::GetIndexes()
+{
+	if(indexes_read)
+		return indexes;
+
+	// Each index is listed by name, with the key of its record followed by its path. A path starts with $, the path
+	// of an ordered index follows an o. The indexes added or removed by this transaction are in the list already,
+	// so the pending writes are not flushed.
+	std::string from;
+	Entries entries;
+	do
+	{
+		ReadEntries(index_key, from, ValueObject::member_batch_size, entries);
+		for(Entries::const_iterator i = entries.begin(); i != entries.end(); ++i)
+		{
+			if(i->second.size() < sizeof(ValueKey))
+				throw std::runtime_error((boost::format("Index has an invalid definition: %s") % i->first).str());
+
+			ValueKey key;
+			memcpy(&key, i->second.data(), sizeof(ValueKey));
+			bool ordered = i->second.size() > sizeof(ValueKey) && i->second[sizeof(ValueKey)] == 'o';
+			indexes.push_back(Index(i->first, Path(i->second.substr(sizeof(ValueKey) + (ordered ? 1 : 0))), key, ordered));
+		}
+
+		if(!entries.empty())
+			from = entries.back().first + '\0';
+	} while(entries.size() == ValueObject::member_batch_size);
+
+	indexes_read = true;
+	return indexes;
+}
+
+void JsonDb::Transaction::AddIndex(Index const &index)
+{
+	GetIndexes();
+
+	std::string definition((char const *)&index.key, sizeof(ValueKey));
+	if(index.ordered)
+		definition += 'o';
+	definition += index.path.ToString();
+	StoreEntry(index_key, index.name, definition);
+	indexes.push_back(index);
+}
+
+void JsonDb::Transaction::RemoveIndex(std::string const &name)
+{
+	GetIndexes();
+
+	DeleteEntry(index_key, name);
+	for(Indexes::iterator i = indexes.begin(); i != indexes.end(); ++i)
+	{
+		if(i->name == name)
+		{
+			indexes.erase(i);
+			break;
+		}
+	}
+}
+
+size_t JsonDb::Transaction::GetDatabaseSize()
+{
+	StorageLock lock(*storage);
+	int size = vlfsiz(db.get());
+	return size > 0 ? size : 0;
+}
 
-	// Then retrieve the actual data
-	int value_size;
-	CharPtr val = CharPtr(vlget(db.get(), (char const *)&key, sizeof(ValueKey), &value_size));
+bool JsonDb::Transaction::Optimize(size_t &pages_rewritten)
+{
+	CheckWritable();
 
-	if(val.get() == NULL)
-		return ValuePointer();
+	StorageLock lock(*storage);
+	if(storage->in_transaction)
+		return false;
 
-	if(value_size <= 0)
-		throw std::runtime_error((boost::format("Element has an invalid size: %d") % key).str().c_str());
+	pages_rewritten = vllnum(db.get()) + vlnnum(db.get());
+	if(!vloptimize(db.get()))
+		throw std::runtime_error((boost::format("Failed to optimize database: %s") % dperrmsg(dpecode)).str());
 
-	std::string val_str(val.get(), value_size);
-	std::istringstream input(val_str);
-	ValuePointer result = Value::Unserialize(key, input);	
+	return true;
+}
 
-	return result;
+void JsonDb::Transaction::TrackWrites(bool enable)
+{
+	StorageLock lock(*storage);
+	storage->track_writes = enable;
+	storage->written_keys.clear();
 }
 
-void JsonDb::Transaction::Delete(ValueKey key)
+bool JsonDb::Transaction::TakeWrittenKeys(std::vector<ValueKey> &keys)
 {
-	vlout(db.get(), (char const *)&key, sizeof(ValueKey));
+	StorageLock lock(*storage);
+	keys.clear();
+	keys.swap(storage->written_keys);
+	if(keys.empty())
+		storage->track_writes = false;
 
-	// std::cout << "Delete: key=" << key << std::endl;
+	return storage->track_writes;
 }
 
-void JsonDb::Transaction::Commit()
+ValueKey JsonDb::Transaction::LookupPath(std::string const &path_key)
 {
-	if(next_id != start_next_id)
-	{
-		Store(next_id_key, ValuePointer(new ValueNumberInteger(next_id_key, next_id)));
-
-		// std::cout << "Commit transaction, next id: " << next_id << std::endl;
-	} 
+	PathCache::const_iterator i = path_cache.find(path_key);
+	if(i == path_cache.end())
+		return null_key;
 
-	vltrancommit(db.get());
+	++path_cache_hits;
+	return i->second;
+}
 
-	start_next_id = next_id;
+void JsonDb::Transaction::CachePath(std::string const &path_key, ValueKey key)
+{
+	std::pair<PathCache::iterator, bool> result = path_cache.insert(std::make_pair(path_key, key));
+	if(result.second)
+		path_cache_keys.insert(std::make_pair(key, path_key));
 }
 
-std::set<ValueKey> JsonDb::Transaction::Walk()
+void JsonDb::Transaction::InvalidatePaths(ValueKey key)
 {
-	std::set<ValueKey> keys;
+	std::pair<PathCacheKeys::iterator, PathCacheKeys::iterator> paths = path_cache_keys.equal_range(key);
+	if(paths.first == paths.second)
+		return;
 
- 	// initialize the iterator 
-  if(!vlcurfirst(db.get()))
-		throw std::runtime_error("Failed to initialize database iterator");
+	std::vector<std::string> prefixes;
+	for(PathCacheKeys::const_iterator i = paths.first; i != paths.second; ++i)
+		prefixes.push_back(i->second);
 
-	CharPtr key;
-	while((key = CharPtr(vlcurkey(db.get(), NULL))) != NULL)
+	for(std::vector<std::string>::const_iterator prefix = prefixes.begin(); prefix != prefixes.end(); ++prefix)
 	{
-		keys.insert(*(ValueKey const *)key.get());
-		vlcurnext(db.get());
+		// All paths through the element directly follow the path to the element
+		PathCache::iterator i = path_cache.lower_bound(*prefix);
+		while(i != path_cache.end() && i->first.compare(0, prefix->size(), *prefix) == 0)
+		{
+			std::pair<PathCacheKeys::iterator, PathCacheKeys::iterator> keys = path_cache_keys.equal_range(i->second);
+			for(PathCacheKeys::iterator j = keys.first; j != keys.second; ++j)
+			{
+				if(j->second == i->first)
+				{
+					path_cache_keys.erase(j);
+					break;
+				}
+			}
+
+			path_cache.erase(i++);
+		}
 	}
-
-	return keys;
 }
 
 JsonDb::JsonDb(std::string const &_filename)
 	: filename(_filename)
+	, thread_safe(false)
+	, group_commit_size(0)
+	, group_commit_delay(0)
+	, defer_deletes(false)
 { 
 	null_element = ValuePointer(new ValueNull(null_key));
 }
 
-void JsonDb::Set(TransactionHandle &transaction, std::string const &path, ValuePointer new_value, bool create_if_not_exists)
+JsonDb::~JsonDb()
+{
+	StopReclaimer();
+}
+
+// Replace the element at the path by a new value with a key of its own, when the transaction defers deletes and the
+// replaced element has subelements. The replaced element is queued in the garbage list. Returns false if the
+// replaced element has to be deleted.
+static bool ReplaceDeferred(JsonDb::TransactionHandle &transaction, JsonDb::Path const &path, ValuePointer const &parent, ValuePointer const &old_value, ValuePointer const &new_value)
+{
+	JsonDb::Path::Steps const &steps = path.GetSteps();
+	if(parent == NULL || steps.empty() || !old_value->DeferDelete(transaction))
+		return false;
+
+	new_value->SetKey(transaction->GenerateKey(parent->GetKey()));
+	transaction->Store(new_value->GetKey(), new_value);
+
+	if(steps.back().is_index)
+		parent->Relink(transaction, steps.back().index, new_value->GetKey());
+	else
+		parent->Relink(transaction, steps.back().name, new_value->GetKey());
+	return true;
+}
+
+void JsonDb::Set(TransactionHandle &transaction, Path const &path, ValuePointer new_value, bool create_if_not_exists)
 {
+	transaction->CheckWritable();
+
 	std::pair<ValuePointer, ValuePointer> old_value = Get(transaction, path, create_if_not_exists ? create : throw_exception);
+	ValuePointer const &parent = old_value.first;
+
+	Index_update index_update(transaction, path);
+	index_update.remove(old_value.second);
+
+	// A deferred element keeps its key in the garbage list, the parent refers to the new value by a new key
+	if(ReplaceDeferred(transaction, path, parent, old_value.second, new_value))
+	{
+		index_update.add(new_value);
+		return;
+	}
+
 	new_value->SetKey(old_value.second->GetKey());
 	old_value.second->Delete(transaction);
 	transaction->Store(new_value->GetKey(), new_value);
+
+	// Rewrite the parent, so a small value is moved inline
+	if(parent != NULL && new_value->CanInline() && parent->GetInlineValues() != NULL)
+		transaction->Store(parent->GetKey(), parent);
+
+	index_update.add(new_value);
 }
 
-void JsonDb::Set(TransactionHandle &transaction, std::string const &path, int value, bool create_if_not_exists)
+void JsonDb::Set(TransactionHandle &transaction, Path const &path, int value, bool create_if_not_exists)
 {
 	Set(transaction, path, ValuePointer(new ValueNumberInteger(null_key, value)), create_if_not_exists);
 }
 
-void JsonDb::Set(TransactionHandle &transaction, std::string const &path, std::string const &value, bool create_if_not_exists)
+void JsonDb::Set(TransactionHandle &transaction, Path const &path, std::string const &value, bool create_if_not_exists)
 {
 	Set(transaction, path, ValuePointer(new ValueString(null_key, value)), create_if_not_exists);
 }
 
-void JsonDb::Set(TransactionHandle &transaction, std::string const &path, double value, bool create_if_not_exists)
+void JsonDb::Set(TransactionHandle &transaction, Path const &path, double value, bool create_if_not_exists)
 {
 	Set(transaction, path, ValuePointer(new ValueNumberReal(null_key, value)), create_if_not_exists);
 }
 
-void JsonDb::Set(TransactionHandle &transaction, std::string const &path, bool value, bool create_if_not_exists)
+void JsonDb::Set(TransactionHandle &transaction, Path const &path, bool value, bool create_if_not_exists)
 {
 	Set(transaction, path, ValuePointer(new ValueNumberBoolean(null_key, value)), create_if_not_exists);
 }
 
-void JsonDb::SetArray(TransactionHandle &transaction, std::string const &path, size_t total_elements, bool create_if_not_exists)
+void JsonDb::SetArray(TransactionHandle &transaction, Path const &path, size_t total_elements, bool create_if_not_exists)
 {
-	ValueArray::Type elements(total_elements);
-	for(ValueArray::Type::iterator i = elements.begin(); i != elements.end(); ++i)
+	transaction->CheckWritable();
+
+	ValuePointer array(new ValueArray(null_key));
+	Set(transaction, path, array, create_if_not_exists);
+
+	// Append the elements, so large arrays are stored in segments
+	for(size_t i = 0; i < total_elements; ++i)
 	{
-		ValuePointer new_element(new ValueNull(transaction->GenerateKey()));
-		*i = new_element->GetKey();
+		ValuePointer new_element(new ValueNull(transaction->GenerateKey(array->GetKey())));
 		transaction->Store(new_element->GetKey(), new_element);
+		array->Append(transaction, new_element->GetKey());
 	}
-
-	Set(transaction, path, ValuePointer(new ValueArray(null_key, elements)), create_if_not_exists);
 }
 
-void JsonDb::AppendArray(TransactionHandle &transaction, std::string const &path, ValuePointer const &value)
+void JsonDb::AppendArray(TransactionHandle &transaction, Path const &path, ValuePointer const &value)
 {
+	transaction->CheckWritable();
+
+	// The element is allocated close to the array
 	std::pair<ValuePointer, ValuePointer> old_value = Get(transaction, path, throw_exception);
+	Index_update index_update(transaction, path, old_value.second->GetSize(transaction));
+
+	value->SetKey(transaction->GenerateKey(old_value.second->GetKey()));
 	old_value.second->Append(transaction, value->GetKey());
 	transaction->Store(value->GetKey(), value);
+
+	index_update.add(value);
 }
 
-void JsonDb::AppendArray(TransactionHandle &transaction, std::string const &path, int value)
+void JsonDb::AppendArray(TransactionHandle &transaction, Path const &path, int value)
 {
-	AppendArray(transaction, path, ValuePointer(new ValueNumberInteger(transaction->GenerateKey(), value)));
+	AppendArray(transaction, path, ValuePointer(new ValueNumberInteger(null_key, value)));
 }
 
-void JsonDb::AppendArray(TransactionHandle &transaction, std::string const &path, bool value)
+void JsonDb::AppendArray(TransactionHandle &transaction, Path const &path, bool value)
 {
-	AppendArray(transaction, path, ValuePointer(new ValueNumberBoolean(transaction->GenerateKey(), value)));
+	AppendArray(transaction, path, ValuePointer(new ValueNumberBoolean(null_key, value)));
 }
 
-void JsonDb::AppendArray(TransactionHandle &transaction, std::string const &path, std::string const &value)
+void JsonDb::AppendArray(TransactionHandle &transaction, Path const &path, std::string const &value)
 {
-	AppendArray(transaction, path, ValuePointer(new ValueString(transaction->GenerateKey(), value)));
+	AppendArray(transaction, path, ValuePointer(new ValueString(null_key, value)));
 }
 
-void JsonDb::AppendArray(TransactionHandle &transaction, std::string const &path, double value)
+void JsonDb::AppendArray(TransactionHandle &transaction, Path const &path, double value)
 {
-	AppendArray(transaction, path, ValuePointer(new ValueNumberReal(transaction->GenerateKey(), value)));
+	AppendArray(transaction, path, ValuePointer(new ValueNumberReal(null_key, value)));
 }
 
-void JsonDb::SetJson(TransactionHandle &transaction, std::string const &path, std::string const &value, bool create_if_not_exists)
+void JsonDb::SetJson(TransactionHandle &transaction, Path const &path, std::string const &value, bool create_if_not_exists)
 {
+	transaction->CheckWritable();
+
 	std::pair<ValuePointer, ValuePointer> old_value = Get(transaction, path, create_if_not_exists ? create : throw_exception);
-	JsonDb_ParseJsonExpression(transaction, value, old_value.second);
+	Index_update index_update(transaction, path);
+	index_update.remove(old_value.second);
+
+	// The parsed value replaces the element with the same key, or a new element linked in place of a deferred
+	// element
+	ValuePointer target = old_value.second;
+	ValuePointer placeholder(new ValueNull(null_key));
+	if(ReplaceDeferred(transaction, path, old_value.first, old_value.second, placeholder))
+		target = placeholder;
+
+	{
+		OperationTimer timer(transaction->GetCollectedStatistics(), Statistics::operation_parse);
+		JsonDb_ParseJsonExpression(transaction, value, target);
+	}
+
+	if(!index_update.empty())
+		index_update.add(transaction->Retrieve(target->GetKey()));
 	//Set(transaction, path, ValuePointer(new ValueNumberBoolean(null_key, value)), create_if_not_exists);
 }
 
-void JsonDb::AppendArrayJson(TransactionHandle &transaction, std::string const &path, std::string const &value_str)
+void JsonDb::AppendArrayJson(TransactionHandle &transaction, Path const &path, std::string const &value_str)
 {
-	ValuePointer value(new ValueNull(transaction->GenerateKey()));
+	transaction->CheckWritable();
 
 	std::pair<ValuePointer, ValuePointer> old_value = Get(transaction, path, throw_exception);
+	Index_update index_update(transaction, path, old_value.second->GetSize(transaction));
+
+	ValuePointer value(new ValueNull(transaction->GenerateKey(old_value.second->GetKey())));
 	old_value.second->Append(transaction, value->GetKey());
 
-	JsonDb_ParseJsonExpression(transaction, value_str, value);
+	{
+		OperationTimer timer(transaction->GetCollectedStatistics(), Statistics::operation_parse);
+		JsonDb_ParseJsonExpression(transaction, value_str, value);
+	}
+
+	if(!index_update.empty())
+		index_update.add(transaction->Retrieve(value->GetKey()));
+}
+
+// A value read by an import, added to the indexes with the batch it is read in
+struct ImportedValue
+{
+	ImportedValue(JsonDb::Path::Steps const &_steps, std::vector<ValueKey> const &_keys, ValuePointer const &_value)
+		: steps(_steps), keys(_keys), value(_value)
+	{ }
+
+	JsonDb::Path::Steps steps;
+	std::vector<ValueKey> keys;
+	ValuePointer value;
+};
+
+static void CollectImportedValue(std::vector<ImportedValue> &values, JsonDb::Path::Steps const &steps, std::vector<ValueKey> const &keys, ValuePointer const &value)
+{
+	values.push_back(ImportedValue(steps, keys, value));
+}
+
+// Add the values read since the last batch to the indexes
+static void IndexImportedValues(Index_update &index_update, ValuePointer const &element, std::vector<ImportedValue> &values)
+{
+	for(std::vector<ImportedValue>::const_iterator i = values.begin(); i != values.end(); ++i)
+		index_update.add(element, i->steps, i->keys, i->value);
+	values.clear();
+}
+
+// Commit the values imported so far with their index entries, and drop them from memory
+static void CommitImportBatch(JsonDb::TransactionHandle transaction, Index_update &index_update, ValuePointer const &element, std::vector<ImportedValue> &values)
+{
+	IndexImportedValues(index_update, element, values);
+	transaction->Commit();
+	transaction->ClearCache();
+}
+
+size_t JsonDb::ImportJson(Path const &path, std::istream &input, size_t batch_size)
+{
+	TransactionHandle transaction = StartTransaction();
+
+	std::pair<ValuePointer, ValuePointer> old_value = Get(transaction, path, create);
+
+	// The values are added to the indexes with the batch they are read in, the entries of the old element are
+	// removed in the first batch
+	Index_update index_update(transaction, path);
+	index_update.remove(old_value.second);
+
+	// A deferred element is replaced by a new element the document is read into
+	ValuePointer target = old_value.second;
+	ValuePointer placeholder(new ValueNull(null_key));
+	if(ReplaceDeferred(transaction, path, old_value.first, old_value.second, placeholder))
+		target = placeholder;
+
+	std::vector<ImportedValue> values;
+	Parsed_value_receiver receiver;
+	if(!index_update.empty())
+		receiver = boost::bind(&CollectImportedValue, boost::ref(values), _1, _2, _3);
+
+	size_t bytes = 0;
+	try
+	{
+		// The parse includes storing the values and committing the batches
+		OperationTimer timer(transaction->GetCollectedStatistics(), Statistics::operation_parse);
+		bytes = JsonDb_ParseJsonStream(transaction, input, target, batch_size,
+				boost::bind(&CommitImportBatch, transaction, boost::ref(index_update), target, boost::ref(values)), receiver);
+	} catch(std::exception const &)
+	{
+		// The values read before the error are kept
+		IndexImportedValues(index_update, target, values);
+		throw;
+	}
+
+	IndexImportedValues(index_update, target, values);
+	return bytes;
 }
 
-std::pair<ValuePointer, ValuePointer> JsonDb::Get(TransactionHandle &transaction, std::string const &path, NotExistsResolution not_exists_resolution)
+std::pair<ValuePointer, ValuePointer> JsonDb::Get(TransactionHandle &transaction, Path const &path, NotExistsResolution not_exists_resolution)
 {
-	return JsonDb_ParseJsonPathExpression(transaction, path, transaction->GetRoot(), not_exists_resolution);
+	OperationTimer timer(transaction->GetCollectedStatistics(), Statistics::operation_resolve);
+	return JsonDb_ResolveJsonPath(transaction, path, transaction->GetRoot(), not_exists_resolution);
 }
 
-int JsonDb::GetInt(TransactionHandle &transaction, std::string const &path)
+int JsonDb::GetInt(TransactionHandle &transaction, Path const &path)
 {
 	return Get(transaction, path, throw_exception).second->GetValueInt();
 }
 
-std::string JsonDb::GetString(TransactionHandle &transaction, std::string const &path)
+std::string JsonDb::GetString(TransactionHandle &transaction, Path const &path)
 {
 	return Get(transaction, path, throw_exception).second->GetValueString();
 }
 
-bool JsonDb::GetBool(TransactionHandle &transaction, std::string const &path)
+bool JsonDb::GetBool(TransactionHandle &transaction, Path const &path)
 {
 	return Get(transaction, path, throw_exception).second->GetValueBoolean();
 }
 
-double JsonDb::GetReal(TransactionHandle &transaction, std::string const &path)
+double JsonDb::GetReal(TransactionHandle &transaction, Path const &path)
 {
 	return Get(transaction, path, throw_exception).second->GetValueReal();
 }
 
-bool JsonDb::Exists(TransactionHandle &transaction, std::string const &path) 
+bool JsonDb::Exists(TransactionHandle &transaction, Path const &path) 
 {
 	return Get(transaction, path, return_null).second != NULL;
 }
@@ -288,88 +1839,497 @@ void JsonDb::Delete(TransactionHandle &transaction, ValuePointer value)
 		value->Delete(transaction);
 }
 
-void JsonDb::Delete(TransactionHandle &transaction, std::string const &path)
+void JsonDb::Delete(TransactionHandle &transaction, Path const &path)
 {
+	transaction->CheckWritable();
+
 	std::pair<ValuePointer, ValuePointer> element = Get(transaction, path, return_null);
-	element.first->Delete(transaction, element.second);
+	if(element.second == NULL)
+		return;
+
+	Index_update index_update(transaction, path);
+	index_update.remove(element.second);
+
+	// Elements are removed by index or name, so large arrays and objects do not have to be searched
+	Path::Steps const &steps = path.GetSteps();
+	if(steps.empty())
+		element.first->Delete(transaction, element.second);
+	else if(steps.back().is_index)
+		element.first->Delete(transaction, steps.back().index);
+	else
+		element.first->Delete(transaction, steps.back().name);
 }
 
-void JsonDb::Print(TransactionHandle &transaction, std::string const &path, std::ostream &output)
+void JsonDb::CreateIndex(TransactionHandle &transaction, std::string const &name, Path const &path)
 {
-	std::pair<ValuePointer, ValuePointer> element = Get(transaction, path, return_null);
-	element.second->Print(transaction, output, 1);
+	JsonDb_CreateIndex(transaction, name, path);
+}
+
+void JsonDb::CreateOrderedIndex(TransactionHandle &transaction, std::string const &name, Path const &path)
+{
+	JsonDb_CreateIndex(transaction, name, path, true);
+}
+
+void JsonDb::DropIndex(TransactionHandle &transaction, std::string const &name)
+{
+	JsonDb_DropIndex(transaction, name);
+}
+
+std::vector<JsonDb::Path> JsonDb::Lookup(TransactionHandle &transaction, std::string const &index, ValuePointer const &value)
+{
+	return JsonDb_LookupIndex(transaction, index, value);
+}
+
+std::vector<JsonDb::Path> JsonDb::Lookup(TransactionHandle &transaction, std::string const &index, int value)
+{
+	return Lookup(transaction, index, ValuePointer(new ValueNumberInteger(null_key, value)));
+}
+
+std::vector<JsonDb::Path> JsonDb::Lookup(TransactionHandle &transaction, std::string const &index, std::string const &value)
+{
+	return Lookup(transaction, index, ValuePointer(new ValueString(null_key, value)));
+}
+
+std::vector<JsonDb::Path> JsonDb::Lookup(TransactionHandle &transaction, std::string const &index, double value)
+{
+	return Lookup(transaction, index, ValuePointer(new ValueNumberReal(null_key, value)));
+}
+
+std::vector<JsonDb::Path> JsonDb::Lookup(TransactionHandle &transaction, std::string const &index, bool value)
+{
+	return Lookup(transaction, index, ValuePointer(new ValueNumberBoolean(null_key, value)));
+}
+
+std::vector<JsonDb::Path> JsonDb::Scan(TransactionHandle &transaction, std::string const &index, IndexRange const &range)
+{
+	return JsonDb_ScanIndex(transaction, index, range);
+}
+
+size_t JsonDb::Count(TransactionHandle &transaction, std::string const &index, IndexRange const &range)
+{
+	return JsonDb_CountIndex(transaction, index, range);
+}
+
+JsonDb::Aggregates JsonDb::Aggregate(TransactionHandle &transaction, Path const &path, unsigned int functions)
+{
+	return JsonDb_Aggregate(transaction, path, functions);
+}
+
+size_t JsonDb::Select(TransactionHandle &transaction, Query const &query, QueryReceiver const &receiver)
+{
+	return JsonDb_Select(transaction, query, receiver);
+}
+
+static bool CollectPath(std::vector<JsonDb::Path> &paths, JsonDb::Path const &path, ValuePointer const &value)
+{
+	paths.push_back(path);
+	return true;
+}
+
+std::vector<JsonDb::Path> JsonDb::SelectPaths(TransactionHandle &transaction, Query const &query)
+{
+	std::vector<Path> paths;
+	Select(transaction, query, boost::bind(&CollectPath, boost::ref(paths), _1, _2));
+	return paths;
+}
+
+void JsonDb::Export(TransactionHandle &transaction, Path const &path, std::ostream &sink, ExportOptions const &options)
+{
+	std::pair<ValuePointer, ValuePointer> element = Get(transaction, path, throw_exception);
+	JsonDb_WriteJson(transaction, element.second, sink, options);
+}
+
+void JsonDb::Print(TransactionHandle &transaction, Path const &path, std::ostream &output)
+{
+	Export(transaction, path, output, ExportOptions(true));
 }
 
 void JsonDb::Print(TransactionHandle &transaction, std::ostream &output)
 {
-	transaction->GetRoot()->Print(transaction, output, 1);
+	Export(transaction, Path(), output, ExportOptions(true));
 }
 
-std::set<ValueKey> JsonDb::WalkTree(TransactionHandle &transaction)
+JsonDb::Locality JsonDb::GetLocality(TransactionHandle &transaction, Path const &path)
 {
-	std::set<ValueKey> result;
-	result.insert(transaction->GetRoot()->GetKey());
-	transaction->GetRoot()->Walk(transaction, result);
-	return result;
+	std::set<ValueKey> keys;
+	Get(transaction, path, throw_exception).second->Walk(transaction, keys);
+
+	std::vector<ValueKey> records = transaction->WalkRecords();
+	size_t records_per_leaf = transaction->GetRecordsPerLeaf();
+
+	// Leaf pages are estimated from the position of each record in key order
+	Locality locality;
+	bool previous = false;
+	size_t previous_leaf = 0;
+	for(size_t i = 0; i < records.size(); ++i)
+	{
+		bool found = keys.find(records[i]) != keys.end();
+		if(found)
+		{
+			size_t leaf = i / records_per_leaf;
+			if(locality.records == 0 || leaf != previous_leaf)
+				++locality.leaf_pages;
+
+			if(!previous)
+				++locality.fragments;
+
+			++locality.records;
+			previous_leaf = leaf;
+		}
+
+		previous = found;
+	}
+
+	return locality;
+}
+
+void JsonDb::Recluster(std::string const &target_filename)
+{
+	JsonDb target(target_filename);
+	target.Delete();
+
+	// Each member is exported to a file and imported in a new extent, so its keys are allocated depth-first
+	std::string member_filename = target_filename + ".member";
+	TransactionHandle transaction = StartReadTransaction();
+	ValuePointer root = transaction->GetRoot();
+
+	std::string from;
+	ValueObject::Type members;
+	while(boost::static_pointer_cast<ValueObject>(root)->NextMembers(transaction, from, members))
+	{
+		for(ValueObject::Type::const_iterator i = members.begin(); i != members.end(); ++i)
+		{
+			Path path = Path()[i->first];
+			{
+				std::ofstream output(member_filename.c_str(), std::ios::binary);
+				Export(transaction, path, output);
+				if(!output)
+					throw std::runtime_error((boost::format("Failed to write %s") % member_filename).str());
+			}
+
+			std::ifstream input(member_filename.c_str(), std::ios::binary);
+			target.ImportJson(path, input);
+		}
+	}
+
+	boost::filesystem::remove(boost::filesystem::path(member_filename));
+
+	// The indexes are built again from the copied values
+	{
+		TransactionHandle target_transaction = target.StartTransaction();
+		Transaction::Indexes const &indexes = transaction->GetIndexes();
+		for(Transaction::Indexes::const_iterator i = indexes.begin(); i != indexes.end(); ++i)
+			JsonDb_CreateIndex(target_transaction, i->name, i->path, i->ordered);
+	}
+
+	target.Close();
+}
+
+JsonDb::CompactionReport JsonDb::Compact(unsigned int time_slice)
+{
+	boost::mutex::scoped_lock lock(compaction_mutex);
+
+	// A compaction of a database which has been closed since starts over, writes made by other processes in
+	// between are not tracked
+	StoragePointer opened = Open();
+	if(compaction == NULL || compaction->report.complete || !compaction->uses(opened))
+		compaction = boost::shared_ptr<Compaction_state>(new Compaction_state(opened, null_element));
+
+	++compaction->report.slices;
+	if(time_slice > 0)
+		compaction->run(boost::get_system_time() + boost::posix_time::microseconds(time_slice), (size_t)-1);
+	else
+	{
+		// Each transaction of the compaction does a limited number of batches, to bound the elements it decodes
+		boost::system_time const never(boost::posix_time::pos_infin);
+		while(!compaction->report.complete && compaction->run(never, Compaction_state::transaction_batches))
+			;
+	}
+
+	return compaction->report;
 }
 
 void JsonDb::Delete()
 {
+	Close();
+
 	// Remove the database directory and all it's subdirectories
 	boost::filesystem::remove_all(boost::filesystem::path(filename));	
 }
 
-bool JsonDb::Validate(TransactionHandle &transaction)
+JsonDb::StoragePointer JsonDb::Open()
+{
+	boost::mutex::scoped_lock lock(storage_mutex);
+	if(storage == NULL)
+	{
+		storage = StoragePointer(new Storage(filename, VL_OWRITER | VL_OCREAT, thread_safe));
+		storage->group_commit_size = group_commit_size;
+		storage->group_commit_delay = group_commit_delay;
+		storage->defer_deletes = defer_deletes;
+		storage->statistics = statistics;
+	}
+
+	return storage;
+}
+
+JsonDb::TransactionHandle JsonDb::StartReadTransaction()
+{
+	StoragePointer reader;
+	{
+		boost::mutex::scoped_lock lock(storage_mutex);
+		reader = storage;
+	}
+
+	// Threads share the database, otherwise a closed database is opened for this reader only
+	if(reader == NULL)
+	{
+		if(thread_safe)
+		{
+			reader = Open();
+		} else
+		{
+			reader = StoragePointer(new Storage(filename, VL_OREADER, false));
+			reader->statistics = statistics;
+		}
+	}
+
+	return Transaction::StartTransaction(reader, null_element, true);
+}
+
+void JsonDb::Close()
+{
+	boost::mutex::scoped_lock lock(storage_mutex);
+	storage.reset();
+}
+
+void JsonDb::EnableThreadSafety(bool enable)
+{
+	Close();
+	thread_safe = enable;
+	if(!enable)
+		group_commit_size = 0;
+}
+
+void JsonDb::EnableGroupCommit(size_t batch_size, unsigned int delay)
+{
+	Close();
+	thread_safe = thread_safe || batch_size > 0;
+	group_commit_size = batch_size;
+	group_commit_delay = delay;
+}
+
+unsigned long JsonDb::GetCommits()
+{
+	boost::mutex::scoped_lock lock(storage_mutex);
+	if(storage == NULL)
+		return 0;
+
+	StorageLock storage_lock(*storage);
+	return storage->commits;
+}
+
+void JsonDb::EnableStatistics(bool enable)
+{
+	Close();
+	statistics = enable ? boost::shared_ptr<StatisticsTotals>(new StatisticsTotals()) : boost::shared_ptr<StatisticsTotals>();
+}
+
+JsonDb::Statistics JsonDb::GetStatistics()
+{
+	return statistics != NULL ? statistics->Get() : Statistics();
+}
+
+void JsonDb::ResetStatistics()
+{
+	if(statistics != NULL)
+		statistics->Reset();
+}
+
+void JsonDb::EnableDeferredDelete(bool enable)
+{
+	Close();
+	defer_deletes = enable;
+}
+
+size_t JsonDb::Reclaim(size_t max_elements)
+{
+	TransactionHandle transaction = StartTransaction();
+	transaction->DeferDeletes(true);
+	return JsonDb_Reclaim(transaction, max_elements);
+}
+
+// Reclaim the garbage list until the thread is interrupted
+static void ReclaimThread(JsonDb &json_db, size_t max_elements, unsigned int interval)
+{
+	for(;;)
+	{
+		size_t reclaimed = 0;
+		try
+		{
+			// A transaction is not interrupted while it commits
+			boost::this_thread::disable_interruption disabled;
+			reclaimed = json_db.Reclaim(max_elements);
+		} catch(std::exception const &)
+		{
+			// The batch is tried again after the interval
+		}
+
+		if(reclaimed == 0)
+			boost::this_thread::sleep(boost::posix_time::milliseconds(interval));
+		else
+			boost::this_thread::interruption_point();
+	}
+}
+
+void JsonDb::StartReclaimer(size_t max_elements, unsigned int interval)
 {
-	std::set<ValueKey> tree_keys = WalkTree(transaction);
-	std::set<ValueKey> db_keys = transaction->Walk();
+	StopReclaimer();
 
-	// Item storing next id is a valid item
-	if(db_keys.find(next_id_key) != db_keys.end())
-		tree_keys.insert(next_id_key);
+	if(!thread_safe)
+		EnableThreadSafety();
 
-	std::set<ValueKey> db_missing_keys;
-	std::set_difference(
-			tree_keys.begin(), tree_keys.end(),
-			db_keys.begin(), db_keys.end(),
-			std::inserter(db_missing_keys, db_missing_keys.begin()));
+	reclaimer = boost::shared_ptr<boost::thread>(new boost::thread(boost::bind(&ReclaimThread, boost::ref(*this), max_elements, interval)));
+}
 
-	std::set<ValueKey> db_stale_keys;
-	std::set_difference(
-			db_keys.begin(), db_keys.end(),
-			tree_keys.begin(), tree_keys.end(),
-			std::inserter(db_stale_keys, db_stale_keys.begin()));
+void JsonDb::StopReclaimer()
+{
+	if(reclaimer == NULL)
+		return;
 
-	std::cout << "Keys found in tree: " << std::endl;
-	for(std::set<ValueKey>::const_iterator i = tree_keys.begin(); i != tree_keys.end(); ++i)
-		std::cout << (i != tree_keys.begin() ? ", " : "") << *i;
-	std::cout << std::endl;
+	reclaimer->interrupt();
+	reclaimer->join();
+	reclaimer.reset();
+}
 
-	std::cout << "Keys found in database: " << std::endl;
-	for(std::set<ValueKey>::const_iterator i = db_keys.begin(); i != db_keys.end(); ++i)
-		std::cout << (i != db_keys.begin() ? ", " : "") << *i;
-	std::cout << std::endl;
+bool JsonDb::Validate(TransactionHandle &transaction)
+{
+	return Validate(transaction, 1).IsValid();
+}
 
-	if(!db_missing_keys.empty())
+JsonDb::ValidationReport JsonDb::Validate(TransactionHandle &transaction, size_t threads)
+{
+	// Other transactions do not see the writes of this transaction, and share a database opened for writing
+	// safely only in thread-safe mode
+	bool shared;
 	{
-		std::cout << "Following keys are missing from the database: " << std::endl;
+		boost::mutex::scoped_lock lock(storage_mutex);
+		shared = storage != NULL && !thread_safe;
+	}
+
+	if(!transaction->IsReadOnly() || shared)
+		threads = 1;
 
-		for(std::set<ValueKey>::const_iterator i = db_missing_keys.begin(); i != db_missing_keys.end(); ++i)
-			std::cout << (i != db_missing_keys.begin() ? ", " : "") << *i;
+	return JsonDb_Validate(transaction, threads, boost::bind(&JsonDb::StartReadTransaction, this));
+}
+
+void JsonDb::ValidationReport::Print(std::ostream &output) const
+{
+	output << boost::format("Records: %d, entries: %d, reachable: %d, threads: %d") % records % entries % reachable % threads << std::endl;
 
-		std::cout << std::endl;
+	if(missing > 0)
+	{
+		output << "Keys missing from the database: " << missing << std::endl;
+		for(std::vector<ValueKey>::const_iterator i = missing_keys.begin(); i != missing_keys.end(); ++i)
+			output << (i != missing_keys.begin() ? ", " : "") << *i;
+		output << (missing > missing_keys.size() ? ", ..." : "") << std::endl;
 	}
 
-	if(!db_stale_keys.empty())
+	if(stale > 0)
 	{
-		std::cout << "Following stale keys where found in the database: " << std::endl;
+		output << "Stale keys found in the database: " << stale << std::endl;
+		for(std::vector<ValueKey>::const_iterator i = stale_keys.begin(); i != stale_keys.end(); ++i)
+			output << (i != stale_keys.begin() ? ", " : "") << *i;
+		output << (stale > stale_keys.size() ? ", ..." : "") << std::endl;
+	}
+
+	if(orphan_entries > 0)
+		output << "Entries without a record: " << orphan_entries << std::endl;
+
+	if(missing_index_entries > 0 || stale_index_entries > 0)
+		output << boost::format("Index entries: %d, values missing from the indexes: %d, entries without a value: %d") % index_entries % missing_index_entries % stale_index_entries << std::endl;
+
+	for(std::vector<std::string>::const_iterator i = errors.begin(); i != errors.end(); ++i)
+		output << *i << std::endl;
+}
+
+
+JsonDb::Statistics::Latency::Latency()
+	: count(0), total(0), max(0)
+{
+	std::fill(buckets, buckets + latency_buckets, 0);
+}
+
+void JsonDb::Statistics::Latency::Add(boost::uint64_t microseconds)
+{
+	size_t bucket = 0;
+	while(bucket + 1 < latency_buckets && (microseconds >> bucket) != 0)
+		++bucket;
+
+	++buckets[bucket];
+	++count;
+	total += microseconds;
+	max = std::max(max, microseconds);
+}
+
+void JsonDb::Statistics::Latency::Merge(Latency const &other)
+{
+	for(size_t i = 0; i < latency_buckets; ++i)
+		buckets[i] += other.buckets[i];
+
+	count += other.count;
+	total += other.total;
+	max = std::max(max, other.max);
+}
 
-		for(std::set<ValueKey>::const_iterator i = db_stale_keys.begin(); i != db_stale_keys.end(); ++i)
-			std::cout << (i != db_stale_keys.begin() ? ", " : "") << *i;
+double JsonDb::Statistics::Latency::GetAverage() const
+{
+	return count > 0 ? (double)total / count : 0.0;
+}
+
+boost::uint64_t JsonDb::Statistics::Latency::GetPercentile(double fraction) const
+{
+	if(count == 0)
+		return 0;
 
-		std::cout << std::endl;
+	// The operations up to and including the bucket reach the fraction
+	unsigned long counted = 0;
+	for(size_t i = 0; i + 1 < latency_buckets; ++i)
+	{
+		counted += buckets[i];
+		if(counted >= fraction * count)
+			return std::min(max, ((boost::uint64_t)1 << i) - 1);
 	}
 
-	return (db_missing_keys.empty() && db_stale_keys.empty());
+	return max;
+}
+
+char const *JsonDb::Statistics::GetName(Operation operation)
+{
+	static char const *names[operations] = { "retrieve", "store", "delete", "commit", "resolve", "parse" };
+	return names[operation];
+}
+
+void JsonDb::Statistics::Merge(Statistics const &other)
+{
+	for(size_t i = 0; i < operations; ++i)
+		latencies[i].Merge(other.latencies[i]);
+
+	reads += other.reads;
+	writes += other.writes;
+	removes += other.removes;
+	bytes_read += other.bytes_read;
+	bytes_written += other.bytes_written;
 }
 
+void JsonDb::Statistics::Print(std::ostream &output) const
+{
+	output << boost::format("%-10s %12s %12s %10s %10s %10s") % "Operation" % "Count" % "Average us" % "50% us" % "99% us" % "Max us" << std::endl;
+	for(size_t i = 0; i < operations; ++i)
+	{
+		Latency const &latency = latencies[i];
+		output << boost::format("%-10s %12d %12.1f %10d %10d %10d") % GetName((Operation)i) % latency.count % latency.GetAverage()
+			% latency.GetPercentile(0.5) % latency.GetPercentile(0.99) % latency.max << std::endl;
+	}
+
+	output << boost::format("Records read: %d (%d bytes), written: %d (%d bytes), removed: %d") % reads % bytes_read % writes % bytes_written % removes << std::endl;
+}
@@ -21,7 +21,13 @@
 */
 
 #include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/function.hpp>
+#include <boost/cstdint.hpp>
 #include <string>
+#include <iosfwd>
 #include <stdexcept>
 
 #include <depot.h>
@@ -29,9 +35,15 @@
 #include <vista.h>
 
 #include <map>
+#include <deque>
 #include <set>
+#include <vector>
 
 class Value;
+class StorageLock;
+class StatisticsTotals;
+class Compaction_state;
+struct Query_step;
 
 // Pointer to a value
 typedef boost::shared_ptr<Value> ValuePointer;
@@ -48,6 +60,12 @@ static const ValueKey root_key = 100;
 // Identifier of the next id element
 static const ValueKey next_id_key = 101;
 
+// Identifier below which the elements waiting to be deleted are listed
+static const ValueKey garbage_key = 102;
+
+// Identifier below which the indexes are listed
+static const ValueKey index_key = 103;
+
 // First identifier for a user created id
 static const ValueKey initial_next_id = 1000;
 
@@ -66,30 +84,564 @@ public:
 	// Pointer to a database transaction
 	typedef boost::shared_ptr<Transaction> TransactionHandle;
 
-	/* Our database transaction used to update the database */
-	class Transaction
+	/* A path expression compiled to a list of steps, so it can be used for many lookups */
+	class Path
+	{
+	public:
+		// Single step of the path, either an object member or an array index
+		struct Step
+		{
+			Step(std::string const &_name)
+				: name(_name), index(0), is_index(false), is_wildcard(false)
+			{ }
+
+			Step(size_t _index)
+				: index(_index), is_index(true), is_wildcard(false)
+			{ }
+
+			// Step matching every member of an object or element of an array, written as [*]. Only index paths
+			// may have wildcard steps.
+			static Step Wildcard()
+			{
+				Step step((size_t)0);
+				step.is_index = false;
+				step.is_wildcard = true;
+				return step;
+			}
+
+			std::string name;
+			size_t index;
+			bool is_index;
+			bool is_wildcard;
+		};
+
+		typedef std::vector<Step> Steps;
+
+		// Path to the root element
+		Path()
+		{ }
+
+		// Compile a path expression, for example: $.a.b[10]['c']
+		Path(std::string const &expression);
+		Path(char const *expression);
+
+		// Path to a member of the element at this path
+		Path operator[](std::string const &name) const;
+
+		// Path to an element of the array at this path
+		Path operator[](size_t index) const;
+
+		// Get the steps from the root element
+		Steps const &GetSteps() const { return steps; }
+
+		// Return the path as expression
+		std::string ToString() const;
+
+		// Append the key identifying the first steps of the path, used for caching resolved paths
+		void AppendKey(std::string &key, size_t step) const;
+
+	private:
+		Steps steps;
+	};
+
+	/* A JSONPath query compiled to a list of steps, a query may match many elements. Besides the steps of a path
+	   it supports [*], recursive descent with .., slices such as [1:10:2] and filters such as
+	   [?(@.age > 30 && @.active)]. */
+	class Query
 	{
+	public:
+		typedef std::vector<Query_step> Steps;
+
+		// Compile a query expression, for example: $.users[?(@.age > 30)].name
+		Query(std::string const &expression);
+		Query(char const *expression);
+
+		// Get the steps from the root element
+		Steps const &GetSteps() const { return *steps; }
+
+		// Return the query as expression
+		std::string const &ToString() const { return expression; }
+
+	private:
+		std::string expression;
+		boost::shared_ptr<Steps> steps;
+	};
+
+	// Receives the elements matching a query with their path, returns false to stop the query
+	typedef boost::function<bool (Path const &path, ValuePointer const &value)> QueryReceiver;
 
+	/* A value in an ordered index, encoded so the encoded values sort in the order of the values. Numbers are
+	   ordered by value whether integer or real, strings byte by byte. Booleans order before numbers, and numbers
+	   before strings. */
+	class IndexKey
+	{
 	public:
-		typedef boost::shared_ptr<VILLA> StorageDbPointer;
+		IndexKey(int value);
+		IndexKey(double value);
+		IndexKey(bool value);
+		IndexKey(std::string const &value);
+		IndexKey(char const *value);
+
+		std::string const &GetEncoded() const { return encoded; }
+
+	private:
+		std::string encoded;
+	};
+
+	/* Values of an ordered index to scan, for example IndexRange().From(100).To(200, true).Limit(50). A bound
+	   is included unless it is exclusive, a range without a bound is open at that end. */
+	class IndexRange
+	{
+	public:
+		IndexRange()
+			: has_lower(false), lower_exclusive(false), has_upper(false), upper_exclusive(false), descending(false), limit(0)
+		{ }
+
+		IndexRange &From(IndexKey const &value, bool exclusive = false)
+		{
+			lower = value.GetEncoded();
+			has_lower = true;
+			lower_exclusive = exclusive;
+			return *this;
+		}
+
+		IndexRange &To(IndexKey const &value, bool exclusive = false)
+		{
+			upper = value.GetEncoded();
+			has_upper = true;
+			upper_exclusive = exclusive;
+			return *this;
+		}
+
+		// Scan from the highest value down
+		IndexRange &Descending(bool enable = true)
+		{
+			descending = enable;
+			return *this;
+		}
+
+		// Stop after the specified number of values, 0 does not limit the scan
+		IndexRange &Limit(size_t max_values)
+		{
+			limit = max_values;
+			return *this;
+		}
+
+		std::string lower;
+		bool has_lower;
+		bool lower_exclusive;
+
+		std::string upper;
+		bool has_upper;
+		bool upper_exclusive;
+
+		bool descending;
+		size_t limit;
+	};
+
+	/* Output format of an export */
+	struct ExportOptions
+	{
+		ExportOptions(bool _pretty = false, unsigned int _indent = 2, size_t _buffer_size = 64 * 1024)
+			: pretty(_pretty), indent(_indent), buffer_size(_buffer_size)
+		{ }
+
+		// Write each member and element on its own line, indented by the specified number of spaces per level
+		bool pretty;
+		unsigned int indent;
+
+		// Output is collected in a buffer of this size before it is written to the sink
+		size_t buffer_size;
+	};
+
+	/* Placement of the records of an element and its subelements in the database */
+	struct Locality
+	{
+		Locality()
+			: records(0), fragments(0), leaf_pages(0)
+		{ }
+
+		// Records stored for the element, the entries of large objects included
+		size_t records;
+
+		// Runs of records of the element which are next to each other in key order
+		size_t fragments;
+
+		// Estimated number of B+tree leaf pages holding the records
+		size_t leaf_pages;
+	};
+
+	/* Aggregates of the values at a path, see JsonDb::Aggregate */
+	struct Aggregates
+	{
+		Aggregates()
+			: count(0), numbers(0), sum(0.0), min(0.0), max(0.0)
+		{ }
+
+		// Average of the numbers, 0 without numbers
+		double GetAverage() const
+		{
+			return numbers > 0 ? sum / numbers : 0.0;
+		}
 
-		Transaction(std::string const &filename, ValuePointer const &_null_element);
+		// Values at the path, of any type
+		size_t count;
 
-		~Transaction()
+		// Integers and reals among the values, with their sum, minimum and maximum, which are 0 without numbers
+		size_t numbers;
+		double sum;
+		double min;
+		double max;
+	};
+
+	// Aggregates to compute, combined with |
+	enum AggregateFunction
+	{
+		aggregate_count = 1,
+		aggregate_sum = 2,
+		aggregate_min = 4,
+		aggregate_max = 8,
+		aggregate_average = 16,
+		aggregate_all = 31
+	};
+
+	/* Operation counts and latencies of transactions, see JsonDb::EnableStatistics. The records read and written are
+	   counted by every transaction, the latencies are only measured by a transaction collecting statistics. */
+	struct Statistics
+	{
+		// Operations of which the latency is measured
+		enum Operation
+		{
+			operation_retrieve,
+			operation_store,
+			operation_delete,
+			operation_commit,
+			operation_resolve,
+			operation_parse,
+			operations
+		};
+
+		// Latencies are counted in buckets, bucket i holds the latencies below 2^i microseconds which are not
+		// counted in bucket i - 1, the last bucket holds all longer latencies
+		static const size_t latency_buckets = 24;
+
+		struct Latency
+		{
+			Latency();
+
+			// Count an operation which took the specified number of microseconds
+			void Add(boost::uint64_t microseconds);
+
+			void Merge(Latency const &other);
+
+			// Average latency in microseconds, 0 without operations
+			double GetAverage() const;
+
+			// Latency in microseconds below which the fraction of the operations completed, rounded up to the
+			// bound of its bucket
+			boost::uint64_t GetPercentile(double fraction) const;
+
+			unsigned long count;
+			boost::uint64_t total;
+			boost::uint64_t max;
+			unsigned long buckets[latency_buckets];
+		};
+
+		Statistics()
+			: reads(0), writes(0), removes(0), bytes_read(0), bytes_written(0)
+		{ }
+
+		// Name of an operation, as printed
+		static char const *GetName(Operation operation);
+
+		// Add the counts and latencies of other statistics
+		void Merge(Statistics const &other);
+
+		// Write a table of the latencies and the counts
+		void Print(std::ostream &output) const;
+
+		Latency latencies[operations];
+
+		// Records and entries read from the database with vlget or the cursor, written with vlput and removed
+		// with vlout
+		unsigned long reads;
+		unsigned long writes;
+		unsigned long removes;
+
+		// Bytes of the records and entries read, and serialized and written
+		boost::uint64_t bytes_read;
+		boost::uint64_t bytes_written;
+	};
+
+	/* Result of validating the database, keys are listed up to listed_keys, the counts are complete */
+	struct ValidationReport
+	{
+		static const size_t listed_keys = 100;
+
+		ValidationReport()
+			: records(0), entries(0), reachable(0), missing(0), stale(0), orphan_entries(0), index_entries(0), missing_index_entries(0), stale_index_entries(0), threads(0)
+		{ }
+
+		// True if the records in the database are exactly the records reachable from the root, and the indexes
+		// hold exactly the values in the database
+		bool IsValid() const
 		{
-			Commit();
+			return missing == 0 && stale == 0 && orphan_entries == 0 && missing_index_entries == 0 && stale_index_entries == 0 && errors.empty();
 		}
 
-		// Store a entry in the database
+		// Write a summary of the report
+		void Print(std::ostream &output) const;
+
+		// Records in the database and entries stored below them
+		size_t records;
+		size_t entries;
+
+		// Records reachable from the root
+		size_t reachable;
+
+		// Records referenced by the tree which are not in the database
+		size_t missing;
+		std::vector<ValueKey> missing_keys;
+
+		// Records in the database which are not reachable from the root
+		size_t stale;
+		std::vector<ValueKey> stale_keys;
+
+		// Entries stored below a key without a record
+		size_t orphan_entries;
+
+		// Entries of the indexes, values in the database without an entry and entries without a value
+		size_t index_entries;
+		size_t missing_index_entries;
+		size_t stale_index_entries;
+
+		// Elements which could not be walked, with the reason
+		std::vector<std::string> errors;
+
+		// Threads which walked the tree
+		size_t threads;
+	};
+
+	/* Progress of a compaction, the counts include the work done by the earlier calls of the compaction */
+	struct CompactionReport
+	{
+		CompactionReport()
+			: complete(false), slices(0), records(0), removed_records(0), removed_entries(0), size_before(0), size_after(0), pages_rewritten(0)
+		{ }
+
+		// Bytes by which the database file shrunk
+		size_t GetReclaimed() const
+		{
+			return size_before > size_after ? size_before - size_after : 0;
+		}
+
+		// True when the unreachable records are removed and the database file is rebuilt
+		bool complete;
+
+		// Calls which did part of the compaction
+		size_t slices;
+
+		// Records in the database when the compaction started
+		size_t records;
+
+		// Records not reachable from the root and entries stored below them or below a key without a record,
+		// which are removed
+		size_t removed_records;
+		size_t removed_entries;
+
+		// Size of the database file in bytes when the compaction started, and after it is rebuilt
+		size_t size_before;
+		size_t size_after;
+
+		// Leaf and non-leaf pages written when the database file is rebuilt
+		size_t pages_rewritten;
+	};
+
+	/* The opened database, shared by all transactions using it */
+	class Storage
+	{
+	public:
+		typedef boost::shared_ptr<VILLA> StorageDbPointer;
+
+		// Opens the database, a thread-safe storage serializes all access to the database
+		Storage(std::string const &filename, int mode, bool thread_safe);
+
+		// Pointer to the database
+		StorageDbPointer db;
+
+		// Held while accessing the database, only present in thread-safe mode
+		boost::shared_ptr<boost::mutex> mutex;
+
+		// True when a database transaction has been started and not yet committed
+		bool in_transaction;
+
+		// Number of transactions with writes in the database transaction, it is committed by the last one
+		unsigned int writers;
+
+		// Keys are allocated in extents of this size. The first elements below an element are allocated in the
+		// extent of the element, an element with more elements below it gets extents of its own. This keeps the
+		// records of a subtree close together in key order. The free keys of an extent are leased to a single
+		// transaction, which takes keys from them without the mutex until its next commit.
+		static const ValueKey extent_size = 256;
+		static const unsigned int shared_extent_children = 16;
+
+		// Keys leased to a transaction, taken from next up to end in steps of step. The elements of the root are
+		// leased the first key of a run of new extents.
+		struct KeyLease
+		{
+			KeyLease()
+				: next(null_key), end(null_key), step(1)
+			{ }
+
+			ValueKey next;
+			ValueKey end;
+			ValueKey step;
+		};
+		static const unsigned int root_lease_extents = 4;
+
+		// First key of the next extent, and the value stored in the database
+		ValueKey next_id;
+		ValueKey stored_next_id;
+
+		// Next free key of each extent used since the database was opened
+		std::map<ValueKey, ValueKey> extent_next;
+
+		// Extent of each element which has an extent of its own
+		std::map<ValueKey, ValueKey> child_extent;
+
+		// Elements allocated below each element in a shared extent, counting restarts after this many elements
+		std::map<ValueKey, unsigned int> shared_children;
+		static const size_t shared_children_limit = 4096;
+
+		// Extent shared by the elements whose parent extent is full or is not used since the database was opened
+		ValueKey spill_extent;
+
+		// Entry below an element, by the key of the element and the name of the entry
+		typedef std::pair<ValueKey, std::string> EntryKey;
+
+		// Transaction modifying each element and entry
+		std::map<ValueKey, Transaction const *> owners;
+		std::map<EntryKey, Transaction const *> entry_owners;
+
+		// Number of transactions which committed or undid writes. An element or entry has the version of the
+		// last of these transactions which wrote it, a transaction fails when it modifies an element or entry
+		// with a version above the version it started at.
+		unsigned long version;
+		std::map<ValueKey, unsigned long> versions;
+		std::map<EntryKey, unsigned long> entry_versions;
+
+		// The elements and entries in the order of their versions, a version is forgotten once every running
+		// transaction started after it
+		std::deque<std::pair<unsigned long, ValueKey> > versioned_keys;
+		std::deque<std::pair<unsigned long, EntryKey> > versioned_entries;
+
+		// Versions the running transactions which may write started at
+		std::multiset<unsigned long> snapshots;
+
+		// Transactions committed at once and the time in microseconds to wait for them, see JsonDb::EnableGroupCommit
+		size_t group_commit_size;
+		unsigned int group_commit_delay;
+
+		// Number of transactions waiting for the next database commit
+		size_t waiting;
+
+		// True when the next database commit waits for the writers in it, no writers may join
+		bool commit_pending;
+
+		// Number of database commits, signalled after each commit
+		unsigned long commits;
+		boost::condition_variable commit_condition;
+
+		// While a compaction marks the reachable records, the keys of the records and entries written or deleted
+		bool track_writes;
+		std::vector<ValueKey> written_keys;
+
+		// Default of the transactions for deferring deletes, see JsonDb::EnableDeferredDelete
+		bool defer_deletes;
+
+		// Statistics of the finished transactions, only present when the transactions collect statistics
+		boost::shared_ptr<StatisticsTotals> statistics;
+	};
+
+	// Pointer to the opened database
+	typedef boost::shared_ptr<Storage> StoragePointer;
+
+	/* Our database transaction used to update the database */
+	class Transaction
+	{
+
+	public:
+		typedef Storage::StorageDbPointer StorageDbPointer;
+
+		// A batch of records is read with the cursor when the keys are spread over at most this many keys per
+		// record, the cursor jumps when it has to skip more than cursor_skip_limit records
+		static const ValueKey cursor_key_spread = 4;
+		static const size_t cursor_skip_limit = 64;
+
+		// Entries below an element as pairs of name and value, ordered by name
+		typedef std::vector<std::pair<std::string, std::string> > Entries;
+
+		// A read-only transaction shares the database with other readers, and does not begin or commit
+		Transaction(StoragePointer const &_storage, ValuePointer const &_null_element, bool _read_only = false);
+
+		~Transaction();
+
+		// Store a entry in the database, the write is buffered until the next flush
 		void Store(ValueKey key, ValuePointer value);
 
 		// Retrieve a entry from the database
 		ValuePointer Retrieve(ValueKey key);
 
-		// Delete entry from database
+		// Records read at once, ordered by key. The data of record i is at offsets[i] up to offsets[i + 1].
+		struct RecordBatch
+		{
+			std::vector<ValueKey> keys;
+			std::vector<size_t> offsets;
+			std::string data;
+		};
+
+		// Read the records of the entries which are not decoded yet at once, in key order, with a cursor when
+		// the keys are close together. The records are only decoded when they are retrieved.
+		void ReadBatch(std::vector<ValueKey> const &keys, RecordBatch &batch);
+
+		// Retrieve a entry, decoding the record read in the batch if the entry is not decoded yet
+		ValuePointer Retrieve(ValueKey key, RecordBatch const &batch);
+
+		// Find the stored bytes of a record read in the batch, so they can be read without decoding the entry.
+		// Returns false if the entry is decoded already or the record is not in the batch.
+		bool PeekRecord(ValueKey key, RecordBatch const &batch, char const *&data, size_t &size) const;
+
+		// Delete entry from database, the delete is buffered until the next flush
 		void Delete(ValueKey key);
 
-		// Commit the transaction
+		// Store an entry below the element with the specified key, buffered until the next flush
+		void StoreEntry(ValueKey key, std::string const &name, std::string const &value);
+
+		// Retrieve an entry below an element, returns false if the entry does not exist
+		bool RetrieveEntry(ValueKey key, std::string const &name, std::string &value);
+
+		// Delete an entry below an element, buffered until the next flush
+		void DeleteEntry(ValueKey key, std::string const &name);
+
+		// Retrieve at most max_entries entries below an element, starting at the specified name
+		void RetrieveEntries(ValueKey key, std::string const &from, size_t max_entries, Entries &entries);
+
+		// Retrieve at most max_entries entries below an element in reverse order, starting at the last entry before
+		// the specified name, or at the last entry if the name is empty
+		void RetrieveEntriesBefore(ValueKey key, std::string const &before, size_t max_entries, Entries &entries);
+
+		// Write all buffered stores and deletes to the database
+		void Flush();
+
+		// Called while flushing a parent: returns the pending value of a child if it can be stored
+		// inline in the parent, the child is then no longer written as a separate record
+		ValuePointer TakeInline(ValueKey parent, ValueKey key);
+
+		// Flush and drop all decoded values, to bound the memory used by a large transaction
+		void ClearCache();
+
+		// Commit the transaction, the handle continues with a new transaction. The decoded values are dropped
+		// when other transactions committed in the meantime.
 		void Commit();
 
 		// Get the database root entry
@@ -98,119 +650,519 @@ public:
 			return Retrieve(root_key);
 		}
 
-		ValueKey GenerateKey()
+		// Generate a key for a new element, close to the key of its parent. Without a parent the key is close to
+		// the previous key generated by this transaction. The keys are taken from ranges leased to the transaction
+		// until its next commit, the storage is only locked to lease a new range.
+		ValueKey GenerateKey(ValueKey parent = null_key);
+
+		static TransactionHandle StartTransaction(StoragePointer const &storage, ValuePointer const &null_element, bool read_only = false)
 		{
-			return next_id++;
+			return TransactionHandle(new Transaction(storage, null_element, read_only));
 		}
 
-		static TransactionHandle StartTransaction(std::string const &filename, ValuePointer const &null_element)
+		// Returns true if the transaction can not modify the database
+		bool IsReadOnly() const { return read_only; }
+
+		// Throws when the transaction can not modify the database
+		void CheckWritable() const
 		{
-			return TransactionHandle(new Transaction(filename, null_element));
+			if(read_only)
+				throw std::runtime_error("Failed to modify database, transaction is read-only");
 		}
 
 		// Return a list of all keys stored in the database
 		std::set<ValueKey> Walk();
 
+		// Return the key of every record in key order, each entry is a record of its own
+		std::vector<ValueKey> WalkRecords();
+
+		// Step through all keys in the database in key order with the cursor, without building a set. Entries
+		// are passed with the key of the record they are stored below. The scan starts at the specified key and
+		// stops before the record following max_records records, the key of that record is returned to continue
+		// the scan. Returns null_key when all keys are scanned. A key which is neither the key of a record nor of an
+		// entry is passed as an entry with null_key.
+		ValueKey ScanKeys(boost::function<void (ValueKey key, bool entry)> const &receiver, ValueKey from = null_key, size_t max_records = (size_t)-1);
+
+		// Average number of records in a leaf page of the database
+		size_t GetRecordsPerLeaf();
+
+		// Size of the database file in bytes
+		size_t GetDatabaseSize();
+
+		// Rebuild the database file with its records in key order. Returns false without rebuilding while a
+		// database transaction is in progress.
+		bool Optimize(size_t &pages_rewritten);
+
+		// Queue an element in the garbage list, its records are deleted later by Reclaim. The element is no longer
+		// referred to by another element.
+		void QueueGarbage(ValueKey key);
+
+		// Retrieve the keys of the next batch of elements in the garbage list, starting at the specified name.
+		// Returns false if there are no more elements.
+		bool NextGarbage(std::string &from, std::vector<ValueKey> &keys);
+
+		// Remove an element from the garbage list
+		void RemoveGarbage(ValueKey key);
+
+		/* Index on the values found at a path with wildcard steps. The entries of the index are stored below the
+		   record of the index. The entries of an ordered index are ordered by value. */
+		struct Index
+		{
+			Index(std::string const &_name = std::string(), Path const &_path = Path(), ValueKey _key = null_key, bool _ordered = false)
+				: name(_name), path(_path), key(_key), ordered(_ordered)
+			{ }
+
+			std::string name;
+			Path path;
+			ValueKey key;
+			bool ordered;
+		};
+
+		typedef std::vector<Index> Indexes;
+
+		// The indexes of the database, listed below index_key. The list is read when first used by the transaction.
+		Indexes const &GetIndexes();
+
+		// Add an index to the list of indexes, or remove it
+		void AddIndex(Index const &index);
+		void RemoveIndex(std::string const &name);
+
+		// True if objects and arrays removed from their parent are queued in the garbage list
+		bool DefersDeletes() const { return defer_deletes; }
+		void DeferDeletes(bool enable) { defer_deletes = enable; }
+
+		// Remember the keys of the records and entries written or deleted from now on by all transactions, or stop
+		void TrackWrites(bool enable);
+
+		// Take the keys written or deleted since the tracking started or since the keys were taken before. When no
+		// keys were written, the tracking stops and false is returned.
+		bool TakeWrittenKeys(std::vector<ValueKey> &keys);
+
+		// Find the key of the element at an already resolved path, returns null_key if unknown
+		ValueKey LookupPath(std::string const &path_key);
+
+		// Remember the key of the element at a resolved path
+		void CachePath(std::string const &path_key, ValueKey key);
+
+		// Forget all resolved paths to and through the specified element
+		void InvalidatePaths(ValueKey key);
+
+		// Number of retrieves served from the decoded node cache
+		unsigned long GetCacheHits() const { return cache_hits; }
+
+		// Number of retrieves which had to read and decode the record
+		unsigned long GetCacheMisses() const { return cache_misses; }
+
+		// Number of stores and deletes which replaced a write still pending in the buffer
+		unsigned long GetCoalescedWrites() const { return coalesced_writes; }
+
+		// Number of path lookups which could start at a cached prefix
+		unsigned long GetPathCacheHits() const { return path_cache_hits; }
+
+		// Operation counts and latencies of the transaction
+		Statistics const &GetStatistics() const { return statistics; }
+
+		// Measure the latencies of the operations of the transaction, or stop. Enabled when the database collects
+		// statistics, the statistics of the transaction are then added to the statistics of the database when the
+		// transaction ends.
+		void CollectStatistics(bool enable) { collect_statistics = enable; }
+
+		// Statistics to measure the latencies in, NULL when the transaction does not collect statistics
+		Statistics *GetCollectedStatistics() { return collect_statistics ? &statistics : NULL; }
+
 	private:
+		// Decode a record and remember the value and the values stored inline in it
+		ValuePointer Decode(ValueKey key, char const *data, int size);
 
-		// Id of next item to store in the database
-		ValueKey next_id;
+		// Mark a key as modified, returns false if it was modified already. The element may not be modified by
+		// another running transaction, nor by a transaction which committed after this transaction started.
+		// Otherwise the transaction is undone and fails.
+		bool MarkDirty(ValueKey key);
+
+		// Mark an entry as modified, it may not be modified by another transaction either
+		void MarkEntryDirty(Storage::EntryKey const &entry_key);
+
+		// Undo the writes of the transaction which are flushed already, and drop the others. The transaction
+		// continues as if it started again.
+		void Rollback();
+
+		// Drop all writes which are not flushed yet
+		void DiscardWrites();
+
+		// Drop all decoded values and resolved paths
+		void DropCache();
+
+		// Write all buffered stores and deletes to the database. Unless the writes are committed next, the values
+		// they replace are remembered so the writes can be undone.
+		void Flush(bool undoable);
 
-		// Value of next_id when we started the transaction
-		ValueKey start_next_id;
+		// Remember the value stored at a database key before it is written for the first time
+		void SaveUndo(std::string const &db_key, bool is_new);
+
+		// Start the next transaction on this handle at the latest version, with the storage locked
+		void Renew();
+
+		// Read at most max_entries entries below an element from the database, without the pending writes
+		void ReadEntries(ValueKey key, std::string const &from, size_t max_entries, Entries &entries);
+
+		// Wait until the writes of this transaction are committed, together with other transactions
+		void GroupCommit(StorageLock &lock);
+
+		// Lease keys for the elements below an element from the storage, with the storage locked
+		struct ChildLease;
+		void LeaseKeys(ValueKey parent, ChildLease &child);
+
+		// Return the unused keys of the leases to the storage, with the storage locked
+		void ReleaseKeys();
+
+		typedef std::map<ValueKey, ValuePointer> NodeCache;
+		typedef std::map<std::string, ValueKey> PathCache;
+		typedef std::multimap<ValueKey, std::string> PathCacheKeys;
+		typedef Storage::EntryKey EntryKey;
+		typedef std::map<ValueKey, ValueKey> InlineParents;
+
+		// Values stored at the database keys written by the flushes before the commit, with false if a key held
+		// no value
+		typedef std::map<std::string, std::pair<bool, std::string> > UndoLog;
+
+		// Previous key generated by this transaction
+		ValueKey last_key;
+
+		// Keys generated since the last flush, these have never been written
+		std::set<ValueKey> new_keys;
+
+		// Keys leased by extent, or by the first extent of a run for the elements of the root
+		typedef std::map<ValueKey, Storage::KeyLease> KeyLeases;
+		KeyLeases key_leases;
+
+		// Run of new extents the elements of the root take their keys from
+		Storage::KeyLease root_lease;
+
+		// Lease each element takes the keys of the elements below it from, and the number of keys it may still take
+		// when the lease is on a shared extent
+		struct ChildLease
+		{
+			ChildLease()
+				: lease(NULL), shared(0)
+			{ }
+
+			Storage::KeyLease *lease;
+			unsigned int shared;
+		};
+		typedef std::map<ValueKey, ChildLease> ChildLeases;
+		ChildLeases child_leases;
+		static const unsigned int unlimited_children = ~0u;
+
+		// The opened database
+		StoragePointer storage;
 
 		// Pointer to the database
 		StorageDbPointer db;
 
 		// Our null element
 		ValuePointer null_element;
+
+		// Decoded values by key, so every key maps to a single value during the transaction.
+		// A deleted key is kept as an empty pointer until the delete is flushed.
+		NodeCache node_cache;
+
+		// Keys in the node cache which still have to be written to the database
+		std::set<ValueKey> dirty_keys;
+
+		// Parent of each decoded element which is stored inline in its parent record
+		InlineParents inline_parents;
+
+		// Entries which still have to be written to or deleted from the database
+		std::map<EntryKey, std::string> dirty_entries;
+		std::set<EntryKey> deleted_entries;
+
+		// Buffers reused for encoding records, and for decoding records in thread-safe mode
+		std::string encode_buffer;
+		std::string decode_buffer;
+
+		// Keys of the elements at resolved paths, and the paths resolved to each key
+		PathCache path_cache;
+		PathCacheKeys path_cache_keys;
+
+		// True when this transaction has writes in the database transaction
+		bool joined;
+
+		// Elements and entries this transaction owns
+		std::vector<ValueKey> owned_keys;
+		std::set<EntryKey> owned_entries;
+
+		// Version of the storage when the transaction started, or committed last
+		unsigned long snapshot;
+
+		// Values replaced by flushed writes, to undo them
+		UndoLog undo_log;
+
+		// True when the database is opened as reader
+		bool read_only;
+
+		// True when objects and arrays removed from their parent are queued in the garbage list
+		bool defer_deletes;
+
+		// Indexes of the database, when read
+		Indexes indexes;
+		bool indexes_read;
+
+		// Node cache statistics
+		unsigned long cache_hits;
+		unsigned long cache_misses;
+		unsigned long coalesced_writes;
+		unsigned long path_cache_hits;
+
+		// Operation statistics, the latencies are measured while collecting statistics
+		Statistics statistics;
+		bool collect_statistics;
+
+		// Statistics of the database the statistics of the transaction are added to when it ends
+		boost::shared_ptr<StatisticsTotals> statistics_totals;
 	};
 
 	JsonDb(std::string const &_filename);
+	~JsonDb();
 
 	// Set value in database
-	void Set(TransactionHandle &transaction, std::string const &path, int value, bool create_if_not_exists = true);
-	void Set(TransactionHandle &transaction, std::string const &path, std::string const &value, bool create_if_not_exists = true);
-	void Set(TransactionHandle &transaction, std::string const &path, char const *value, bool create_if_not_exists = true)
+	void Set(TransactionHandle &transaction, Path const &path, int value, bool create_if_not_exists = true);
+	void Set(TransactionHandle &transaction, Path const &path, std::string const &value, bool create_if_not_exists = true);
+	void Set(TransactionHandle &transaction, Path const &path, char const *value, bool create_if_not_exists = true)
 	{
 		std::string value_str(value);
 		Set(transaction, path, value_str, create_if_not_exists);
 	}
 
-	void Set(TransactionHandle &transaction, std::string const &path, double value, bool create_if_not_exists = true);
-	void Set(TransactionHandle &transaction, std::string const &path, bool value, bool create_if_not_exists = true);
+	void Set(TransactionHandle &transaction, Path const &path, double value, bool create_if_not_exists = true);
+	void Set(TransactionHandle &transaction, Path const &path, bool value, bool create_if_not_exists = true);
 
-	void SetJson(TransactionHandle &transaction, std::string const &path, std::string const &value, bool create_if_not_exists = true);
-	void SetJson(TransactionHandle &transaction, std::string const &path, char const *value, bool create_if_not_exists = true)
+	void SetJson(TransactionHandle &transaction, Path const &path, std::string const &value, bool create_if_not_exists = true);
+	void SetJson(TransactionHandle &transaction, Path const &path, char const *value, bool create_if_not_exists = true)
 	{
 		std::string value_str(value);
 		SetJson(transaction, path, value_str, create_if_not_exists);
 	}
 
+	// Import a json document read from the stream to the path, in its own transaction. The document is parsed in
+	// chunks and written as it is read, the transaction is committed after every batch_size values so the memory
+	// used does not depend on the size of the document. A failed import keeps the values read before the error.
+	// Returns the number of bytes read.
+	size_t ImportJson(Path const &path, std::istream &input, size_t batch_size = 10000);
+
 	// Create an array with the specified number of elements at the path
-	void SetArray(TransactionHandle &transaction, std::string const &path, size_t elements, bool create_if_not_exists = true);
+	void SetArray(TransactionHandle &transaction, Path const &path, size_t elements, bool create_if_not_exists = true);
 
 	// Append an element to an existing array
-	void AppendArray(TransactionHandle &transaction, std::string const &path, int value);
-	void AppendArray(TransactionHandle &transaction, std::string const &path, std::string const &value);
-	void AppendArray(TransactionHandle &transaction, std::string const &path, char const *value)
+	void AppendArray(TransactionHandle &transaction, Path const &path, int value);
+	void AppendArray(TransactionHandle &transaction, Path const &path, std::string const &value);
+	void AppendArray(TransactionHandle &transaction, Path const &path, char const *value)
 	{
 		std::string value_str(value);
 		AppendArray(transaction, path, value_str);
 	}
-	void AppendArray(TransactionHandle &transaction, std::string const &path, bool value);
-	void AppendArray(TransactionHandle &transaction, std::string const &path, double value);
-	void AppendArrayJson(TransactionHandle &transaction, std::string const &path, std::string const &value);
+	void AppendArray(TransactionHandle &transaction, Path const &path, bool value);
+	void AppendArray(TransactionHandle &transaction, Path const &path, double value);
+	void AppendArrayJson(TransactionHandle &transaction, Path const &path, std::string const &value);
 
 	// Read values from the database
-	std::string GetString(TransactionHandle &transaction, std::string const &path);
-	int GetInt(TransactionHandle &transaction, std::string const &path);
-	bool GetBool(TransactionHandle &transaction, std::string const &path);
-	double GetReal(TransactionHandle &transaction, std::string const &path);
+	std::string GetString(TransactionHandle &transaction, Path const &path);
+	int GetInt(TransactionHandle &transaction, Path const &path);
+	bool GetBool(TransactionHandle &transaction, Path const &path);
+	double GetReal(TransactionHandle &transaction, Path const &path);
 
 	// Returns true if the specified path exists
-	bool Exists(TransactionHandle &transaction, std::string const &path);
+	bool Exists(TransactionHandle &transaction, Path const &path);
 
 	// Delete a key from the database
-	void Delete(TransactionHandle &transaction, std::string const &key);
+	void Delete(TransactionHandle &transaction, Path const &path);
+
+	// Create an index on the values at the path, for example $.users[*].email, where [*] matches every element
+	// of an array or member of an object. Strings, numbers and booleans are indexed. The index is built from the
+	// values in the database, and is kept up to date by the changes made in the transactions.
+	void CreateIndex(TransactionHandle &transaction, std::string const &name, Path const &path);
+
+	// Create an index which keeps the values at the path in order, see IndexKey. Besides Lookup, where numbers
+	// are equal by value, it supports Scan and Count.
+	void CreateOrderedIndex(TransactionHandle &transaction, std::string const &name, Path const &path);
+
+	// Remove an index
+	void DropIndex(TransactionHandle &transaction, std::string const &name);
+
+	// Paths of the values in the index equal to the value, values of another type are not equal. The entries are
+	// found in a single search of the database.
+	std::vector<Path> Lookup(TransactionHandle &transaction, std::string const &index, int value);
+	std::vector<Path> Lookup(TransactionHandle &transaction, std::string const &index, std::string const &value);
+	std::vector<Path> Lookup(TransactionHandle &transaction, std::string const &index, char const *value)
+	{
+		std::string value_str(value);
+		return Lookup(transaction, index, value_str);
+	}
+	std::vector<Path> Lookup(TransactionHandle &transaction, std::string const &index, double value);
+	std::vector<Path> Lookup(TransactionHandle &transaction, std::string const &index, bool value);
+
+	// Paths of the values of an ordered index in the range, in the order of the values. The entries of the index
+	// are read in batches from the first value in the range on, the values themselves are not read.
+	std::vector<Path> Scan(TransactionHandle &transaction, std::string const &index, IndexRange const &range);
+
+	// Number of values of an ordered index in the range, only the entries of the index are read
+	size_t Count(TransactionHandle &transaction, std::string const &index, IndexRange const &range);
+
+	// Pass the elements matching the query to the receiver in document order, an element before the elements
+	// below it. The members or elements tested by a step are read in batches, and a filter is evaluated on the
+	// decoded elements as they are read. A filter comparing a member with a value is answered by an index on
+	// the members instead, when there is one. Returns the number of matches passed to the receiver.
+	size_t Select(TransactionHandle &transaction, Query const &query, QueryReceiver const &receiver);
+
+	// Paths of the elements matching the query, in document order
+	std::vector<Path> SelectPaths(TransactionHandle &transaction, Query const &query);
+
+	// Aggregate the values at a path with wildcard steps, for example $.metrics[*].value, in a single pass. The
+	// members or elements of a wildcard step are read in batches, and the numbers are read from the stored records
+	// without decoding them. When only counting the members or elements of the last step, they are counted from
+	// the size stored with their object or array, without reading them.
+	Aggregates Aggregate(TransactionHandle &transaction, Path const &path, unsigned int functions = aggregate_all);
+
+	// Write the element at the path as json to the sink
+	void Export(TransactionHandle &transaction, Path const &path, std::ostream &sink, ExportOptions const &options = ExportOptions());
 
 	// Pretty-print the database to the specified output stream
-	void Print(TransactionHandle &transaction, std::string const &path, std::ostream &output);
+	void Print(TransactionHandle &transaction, Path const &path, std::ostream &output);
 	void Print(TransactionHandle &transaction, std::ostream &output);
 
-	// Start a transaction
+	// Start a transaction. The first transaction opens the database for writing, and the database stays open
+	// for the next transactions, which locks out readers and writers in other processes until Close(). A
+	// transaction modifying an element modified by another running transaction, or by a transaction committed
+	// since it started, fails. Its writes are undone, the writes flushed to the database included, and the
+	// transaction continues as if it started again.
 	TransactionHandle StartTransaction()
 	{
-		return Transaction::StartTransaction(filename, null_element);
+		return Transaction::StartTransaction(Open(), null_element);
 	}
 
-	// Validate the integrity of the database
+	// Start a transaction which only reads. On a closed database it opens the database for reading only, so
+	// it runs concurrently with readers in other processes, otherwise it uses the open database.
+	TransactionHandle StartReadTransaction();
+
+	// Allow transactions in several threads. Readers run in parallel, writers run in parallel as long as
+	// they modify different elements. Takes effect when the database is opened next.
+	void EnableThreadSafety(bool enable = true);
+
+	// Commit the transactions of several threads in a single database commit, enables thread safety. A commit
+	// returns when its writes are committed, after batch_size transactions are waiting or after the delay in
+	// microseconds. A commit also waits for the transactions which have flushed writes, so a thread should
+	// not commit while another transaction of the same thread has flushed writes.
+	void EnableGroupCommit(size_t batch_size = 32, unsigned int delay = 1000);
+
+	// Number of database commits since the database was opened
+	unsigned long GetCommits();
+
+	// Measure the latencies of the operations of all transactions, and add the statistics of every transaction
+	// to the statistics of the database when it ends. Enabling resets the statistics. Takes effect when the
+	// database is opened next.
+	void EnableStatistics(bool enable = true);
+
+	// Statistics of the transactions ended since the statistics were enabled or reset
+	Statistics GetStatistics();
+	void ResetStatistics();
+
+	// Unlink objects and arrays which are deleted or replaced from their parent and queue them in a garbage list
+	// stored in the database, instead of deleting all elements below them. The elements are deleted later by
+	// Reclaim or the reclaimer thread. Takes effect when the database is opened next.
+	void EnableDeferredDelete(bool enable = true);
+
+	// Delete elements queued in the garbage list in a transaction of its own. An object or array is deleted
+	// one member at a time, members which are objects or arrays themselves are queued in turn, so at most
+	// max_elements members are removed. Returns the number of elements removed, 0 if the garbage list is empty.
+	size_t Reclaim(size_t max_elements = reclaim_batch_size);
+	static const size_t reclaim_batch_size = 256;
+
+	// Reclaim the garbage list in a thread of its own, in batches of max_elements elements. The thread waits
+	// the interval in milliseconds when the garbage list is empty, or when a batch failed. Enables thread safety.
+	void StartReclaimer(size_t max_elements = reclaim_batch_size, unsigned int interval = 100);
+	void StopReclaimer();
+
+	// Close the database, so other processes can read and write it. Transactions still running keep it open
+	// until they are done, the next transaction opens the database again.
+	void Close();
+
+	// Report how the records of the element at the path are spread over the database
+	Locality GetLocality(TransactionHandle &transaction, Path const &path);
+
+	// Copy the database to a new database, one member of the root at a time, so the records of every subtree
+	// are allocated next to each other. Replaces the target database.
+	void Recluster(std::string const &target_filename);
+
+	// Validate the integrity of the database, returns true if the report is valid
 	bool Validate(TransactionHandle &transaction);
 
+	// Validate the integrity of the database. Reachable records are tracked in a bitmap of one bit per key
+	// and the records are scanned in a single pass, so the memory used does not grow with the size of the
+	// tree. The tree is walked by the specified number of threads when the transaction only reads and the
+	// threads can read the database safely, that is when thread safety is enabled or the database is
+	// closed so every thread opens it as reader.
+	ValidationReport Validate(TransactionHandle &transaction, size_t threads);
+
+	// Remove the records which are not reachable from the root, and rebuild the database file in key order.
+	// With a time slice in microseconds, a call does about that much work and returns, and the next call
+	// continues the compaction until the report is complete. Other transactions may run between the calls and
+	// in other threads. Rebuilding the file is done at once, as soon as no transaction is writing to the
+	// database, and the elements written while the reachable records are marked are marked again at once at
+	// the end. Without a time slice the compaction runs to the end, unless a transaction is writing.
+	CompactionReport Compact(unsigned int time_slice = 0);
+
 	// Delete the complete database
 	void Delete();
 
 private:
-	// Get all id's stored in the database tree
-	std::set<ValueKey> WalkTree(TransactionHandle &transaction);
-
 	// Get raw element pointer from database
-	std::pair<ValuePointer, ValuePointer> Get(TransactionHandle &transaction, std::string const &path, NotExistsResolution not_exists_resolution);
+	std::pair<ValuePointer, ValuePointer> Get(TransactionHandle &transaction, Path const &path, NotExistsResolution not_exists_resolution);
 
 	// Set raw element 
-	void Set(TransactionHandle &transaction, std::string const &path, ValuePointer new_value, bool create_if_not_exists);
+	void Set(TransactionHandle &transaction, Path const &path, ValuePointer new_value, bool create_if_not_exists);
 
 	// Delete raw element
 	void Delete(TransactionHandle &transaction, ValuePointer value);
 
 	// Append raw element to array
-	void AppendArray(TransactionHandle &transaction, std::string const &path, ValuePointer const &value);
+	void AppendArray(TransactionHandle &transaction, Path const &path, ValuePointer const &value);
+
+	// Look up raw element in an index
+	std::vector<Path> Lookup(TransactionHandle &transaction, std::string const &index, ValuePointer const &value);
+
+	// Open the database for writing, the database stays open for the next transactions
+	StoragePointer Open();
 
 	// Our database filename
 	std::string filename;
 
+	// The database, kept open between transactions
+	StoragePointer storage;
+
+	// Held while opening or closing the database
+	boost::mutex storage_mutex;
+
+	// True when transactions may run in several threads
+	bool thread_safe;
+
+	// Group commit settings, a batch size of 0 disables group commit
+	size_t group_commit_size;
+	unsigned int group_commit_delay;
+
+	// True when deletes are deferred to the garbage list
+	bool defer_deletes;
+
+	// Statistics of the transactions, only present when statistics are enabled
+	boost::shared_ptr<StatisticsTotals> statistics;
+
+	// Thread reclaiming the garbage list
+	boost::shared_ptr<boost::thread> reclaimer;
+
 	// Our null element
 	ValuePointer null_element;
+
+	// The compaction which is running, held while it runs a slice
+	boost::shared_ptr<Compaction_state> compaction;
+	boost::mutex compaction_mutex;
 };
 
 #endif
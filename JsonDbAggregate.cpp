@@ -0,0 +1,205 @@
+/*
+ 		Copyright (C) 2010 Wouter van Kleunen
+
+		This file is part of JsonDb.
+
+    Foobar is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Foobar is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with JsonDb.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "JsonDb.h"
+#include "JsonDbValues.h"
+#include "JsonDbAggregate.h"
+
+#include <algorithm>
+
+// Walks the elements matching the steps of a path below an element, and adds the values at the end of the path
+// to the aggregates
+class Aggregate_walker
+{
+public:
+	Aggregate_walker(JsonDb::TransactionHandle &_transaction, JsonDb::Path::Steps const &_steps, unsigned int _functions, JsonDb::Aggregates &_result)
+		: transaction(_transaction)
+		, steps(_steps)
+		, functions(_functions)
+		, result(_result)
+	{ }
+
+	// Walk the value matching the steps before the specified step
+	void walk(ValuePointer const &value, size_t step);
+
+private:
+	// Walk a batch of the members or elements matching a step
+	void walk(ValuePointer const &value, size_t step, ValueArray::Type const &keys);
+
+	// Retrieve a member or element from a batch, a missing one fails the aggregate instead of giving a partial result
+	ValuePointer retrieve(ValueKey key, JsonDb::Transaction::RecordBatch const &records);
+
+	void add(ValuePointer const &value);
+	void add(Value::ValueTypeId type, double number);
+
+	JsonDb::TransactionHandle &transaction;
+	JsonDb::Path::Steps const &steps;
+	unsigned int functions;
+	JsonDb::Aggregates &result;
+};
+
+void Aggregate_walker::walk(ValuePointer const &value, size_t step)
+{
+	if(step == steps.size())
+	{
+		add(value);
+		return;
+	}
+
+	JsonDb::Path::Step const &current = steps[step];
+	Value::ValueTypeId type = value->GetType();
+	if(current.is_wildcard && (type == Value::VALUE_OBJECT || type == Value::VALUE_ARRAY))
+	{
+		// The members or elements of the last step are counted from the size of the object or array
+		if(step + 1 == steps.size() && functions == JsonDb::aggregate_count)
+		{
+			result.count += value->GetSize(transaction);
+			return;
+		}
+
+		ValueArray::Type keys;
+		if(type == Value::VALUE_OBJECT)
+		{
+			std::string from;
+			ValueObject::Type members;
+			while(static_cast<ValueObject const &>(*value).NextMembers(transaction, from, members))
+			{
+				keys.clear();
+				for(ValueObject::Type::const_iterator i = members.begin(); i != members.end(); ++i)
+					keys.push_back(i->second);
+				walk(value, step, keys);
+			}
+		} else
+		{
+			size_t index = 0;
+			while(static_cast<ValueArray const &>(*value).NextElements(transaction, index, keys))
+				walk(value, step, keys);
+		}
+	} else if(current.is_index && type == Value::VALUE_ARRAY)
+	{
+		// The element is walked as a batch of its own
+		size_t from = current.index;
+		ValueArray::Type keys;
+		if(current.index < value->GetSize(transaction) && static_cast<ValueArray const &>(*value).NextElements(transaction, from, keys))
+			walk(value, step, ValueArray::Type(1, keys.front()));
+	} else if(!current.is_wildcard && !current.is_index && type == Value::VALUE_OBJECT)
+	{
+		ValueKey member = static_cast<ValueObject const &>(*value).FindMember(transaction, current.name);
+		if(member != null_key)
+			walk(value, step, ValueArray::Type(1, member));
+	}
+}
+
+void Aggregate_walker::walk(ValuePointer const &value, size_t step, ValueArray::Type const &keys)
+{
+	JsonDb::Transaction::RecordBatch records;
+	transaction->ReadBatch(keys, records);
+
+	// The values of the last step, or of a member of the last step, are read from the records which are not
+	// decoded yet. Members with a record of their own are read in a second batch.
+	bool last = step + 1 == steps.size();
+	JsonDb::Path::Step const *member = step + 2 == steps.size() && !steps[step + 1].is_index && !steps[step + 1].is_wildcard ? &steps[step + 1] : NULL;
+	ValueArray::Type member_keys;
+	for(ValueArray::Type::const_iterator i = keys.begin(); i != keys.end(); ++i)
+	{
+		char const *data;
+		size_t size;
+		double number = 0.0;
+		if((last || member != NULL) && transaction->PeekRecord(*i, records, data, size))
+		{
+			if(last)
+			{
+				Value::ValueTypeId type = Value::PeekNumber(data, size, number);
+				add(type, number);
+				continue;
+			}
+
+			bool found;
+			ValueKey key;
+			unsigned char type;
+			if(Value::PeekMember(data, size, member->name, found, key, type, number))
+			{
+				if(found && type != 0)
+					add((Value::ValueTypeId)type, number);
+				else if(found)
+					member_keys.push_back(key);
+				continue;
+			}
+		}
+
+		walk(retrieve(*i, records), step + 1);
+	}
+
+	if(member_keys.empty())
+		return;
+
+	JsonDb::Transaction::RecordBatch member_records;
+	transaction->ReadBatch(member_keys, member_records);
+	for(ValueArray::Type::const_iterator i = member_keys.begin(); i != member_keys.end(); ++i)
+	{
+		char const *data;
+		size_t size;
+		double number = 0.0;
+		if(transaction->PeekRecord(*i, member_records, data, size))
+		{
+			Value::ValueTypeId type = Value::PeekNumber(data, size, number);
+			add(type, number);
+		} else
+			add(retrieve(*i, member_records));
+	}
+}
+
+ValuePointer Aggregate_walker::retrieve(ValueKey key, JsonDb::Transaction::RecordBatch const &records)
+{
+	ValuePointer element = transaction->Retrieve(key, records);
+	if(element == NULL)
+		throw std::runtime_error((boost::format("Element %d is missing from the database") % key).str());
+
+	return element;
+}
+
+void Aggregate_walker::add(ValuePointer const &value)
+{
+	Value::ValueTypeId type = value->GetType();
+	if(type == Value::VALUE_NUMBER_INTEGER)
+		add(type, value->GetValueInt());
+	else if(type == Value::VALUE_NUMBER_REAL)
+		add(type, value->GetValueReal());
+	else
+		add(type, 0.0);
+}
+
+void Aggregate_walker::add(Value::ValueTypeId type, double number)
+{
+	++result.count;
+	if(type != Value::VALUE_NUMBER_INTEGER && type != Value::VALUE_NUMBER_REAL)
+		return;
+
+	result.min = result.numbers == 0 ? number : std::min(result.min, number);
+	result.max = result.numbers == 0 ? number : std::max(result.max, number);
+	result.sum += number;
+	++result.numbers;
+}
+
+JsonDb::Aggregates JsonDb_Aggregate(JsonDb::TransactionHandle &transaction, JsonDb::Path const &path, unsigned int functions)
+{
+	JsonDb::Aggregates result;
+	Aggregate_walker(transaction, path.GetSteps(), functions, result).walk(transaction->GetRoot(), 0);
+	return result;
+}
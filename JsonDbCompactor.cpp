@@ -0,0 +1,283 @@
+/*
+ 		Copyright (C) 2010 Wouter van Kleunen
+
+		This file is part of JsonDb.
+
+    Foobar is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Foobar is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with JsonDb.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "JsonDb.h"
+#include "JsonDbValues.h"
+#include "JsonDbCompactor.h"
+
+#include <boost/bind.hpp>
+
+#include <algorithm>
+
+const size_t Compaction_state::scan_batch_size;
+const size_t Compaction_state::sweep_batch_size;
+const size_t Compaction_state::transaction_batches;
+
+Compaction_state::Compaction_state(JsonDb::StoragePointer const &_storage, ValuePointer const &_null_element)
+	: storage(_storage)
+	, null_element(_null_element)
+	, phase(scanning)
+	, next_record(null_key)
+	, remarking(false)
+	, sweep_word(0)
+{
+}
+
+bool Compaction_state::uses(JsonDb::StoragePointer const &opened) const
+{
+	return storage.lock() == opened;
+}
+
+bool Compaction_state::run(boost::system_time const &deadline, size_t max_batches)
+{
+	JsonDb::StoragePointer opened = storage.lock();
+
+	// Only the sweep and the rebuild write, each phase has a transaction of its own
+	JsonDb::TransactionHandle transaction;
+	Phase transaction_phase = finished;
+
+	for(size_t batch = 0; phase != finished && batch < max_batches; ++batch)
+	{
+		// Elements written during the compaction are marked again at once, so writes between the slices can not
+		// keep the marking from ending
+		if(batch > 0 && !remarking && boost::get_system_time() >= deadline)
+			break;
+
+		if(transaction == NULL || transaction_phase != phase)
+		{
+			transaction.reset();
+			transaction = JsonDb::Transaction::StartTransaction(opened, null_element, phase == scanning || phase == marking);
+			transaction_phase = phase;
+		}
+
+		switch(phase)
+		{
+		case scanning:
+			scan(transaction);
+			break;
+
+		case marking:
+			mark(transaction);
+			break;
+
+		case sweeping:
+			sweep(transaction);
+			break;
+
+		case rebuilding:
+			if(!transaction->Optimize(report.pages_rewritten))
+				return false;
+
+			report.size_after = transaction->GetDatabaseSize();
+			report.complete = true;
+			phase = finished;
+			break;
+
+		case finished:
+			break;
+		}
+	}
+
+	return true;
+}
+
+void Compaction_state::scan(JsonDb::TransactionHandle &transaction)
+{
+	// Writes are tracked before the first record is scanned
+	if(next_record == null_key)
+	{
+		transaction->TrackWrites(true);
+		report.size_before = transaction->GetDatabaseSize();
+	}
+
+	next_record = transaction->ScanKeys(boost::bind(&Compaction_state::scan_key, this, _1, _2), next_record, scan_batch_size);
+	if(next_record != null_key)
+		return;
+
+	// The record storing the next key, the garbage list and the indexes are always kept, the elements in the
+	// garbage list are removed by the reclaimer
+	reachable.reserve(stored.size());
+	reachable.set(root_key);
+	reachable.set(next_id_key);
+	reachable.set(garbage_key);
+	reachable.set(index_key);
+	items.push_back(Compaction_item(root_key));
+	items.push_back(Compaction_item(garbage_key));
+	items.push_back(Compaction_item(index_key));
+	phase = marking;
+}
+
+void Compaction_state::scan_key(ValueKey key, bool entry)
+{
+	if(entry)
+	{
+		entries.set(key);
+		return;
+	}
+
+	stored.set(key);
+	++report.records;
+}
+
+void Compaction_state::mark(JsonDb::TransactionHandle &transaction)
+{
+	if(items.empty())
+	{
+		// Elements written since the compaction started are kept, and the elements below them are marked again,
+		// until no more elements are written. Deleted elements are left alone, they are removed already.
+		std::vector<ValueKey> written;
+		if(!transaction->TakeWrittenKeys(written))
+		{
+			phase = sweeping;
+			return;
+		}
+
+		remarking = true;
+		std::sort(written.begin(), written.end());
+		written.erase(std::unique(written.begin(), written.end()), written.end());
+
+		for(std::vector<ValueKey>::const_iterator i = written.begin(); i != written.end(); ++i)
+		{
+			reachable.set(*i);
+			items.push_back(Compaction_item(*i));
+		}
+
+		// The transaction may have decoded the elements before they were written
+		transaction->ClearCache();
+		return;
+	}
+
+	// The next batch of members or elements of the last item, the garbage list is walked as an object and the
+	// records of the indexes as a single batch
+	Compaction_item &item = items.back();
+	bool listed = item.container == garbage_key || item.container == index_key;
+	ValuePointer container = !listed ? transaction->Retrieve(item.container) : ValuePointer();
+
+	bool is_object = container != NULL && container->GetType() == Value::VALUE_OBJECT;
+	bool is_array = container != NULL && container->GetType() == Value::VALUE_ARRAY;
+	if((is_object || is_array) && item.remaining == (size_t)-1)
+		item.remaining = container->GetSize(transaction);
+
+	ValueArray::Type keys;
+	bool found = false;
+	if(item.container == garbage_key)
+	{
+		found = transaction->NextGarbage(item.from, keys);
+	} else if(item.container == index_key)
+	{
+		JsonDb::Transaction::Indexes const &indexes = transaction->GetIndexes();
+		for(JsonDb::Transaction::Indexes::const_iterator i = indexes.begin(); i != indexes.end(); ++i)
+			keys.push_back(i->key);
+
+		found = item.index++ == 0 && !keys.empty();
+	} else if(is_object && item.remaining > 0)
+	{
+		ValueObject::Type members;
+		found = static_cast<ValueObject const &>(*container).NextMembers(transaction, item.from, members);
+		for(ValueObject::Type::const_iterator i = members.begin(); i != members.end(); ++i)
+			keys.push_back(i->second);
+	} else if(is_array && item.remaining > 0)
+	{
+		ValueArray const &array = static_cast<ValueArray const &>(*container);
+		if(item.index == 0)
+		{
+			ValueArray::Type segments;
+			array.CollectSegments(transaction, segments);
+			for(ValueArray::Type::const_iterator i = segments.begin(); i != segments.end(); ++i)
+				reachable.set(*i);
+		}
+
+		found = array.NextElements(transaction, item.index, keys);
+	}
+
+	if(!found)
+	{
+		items.pop_back();
+		return;
+	}
+
+	if(keys.size() > item.remaining)
+		keys.resize(item.remaining);
+	item.remaining -= keys.size();
+
+	// Elements marked before are not walked again
+	ValueArray::Type unmarked;
+	for(ValueArray::Type::const_iterator i = keys.begin(); i != keys.end(); ++i)
+	{
+		if(!reachable.test(*i))
+		{
+			reachable.set(*i);
+			unmarked.push_back(*i);
+		}
+	}
+
+	JsonDb::Transaction::RecordBatch records;
+	transaction->ReadBatch(unmarked, records);
+	for(ValueArray::Type::const_iterator i = unmarked.begin(); i != unmarked.end(); ++i)
+	{
+		ValuePointer value = transaction->Retrieve(*i, records);
+		if(value != NULL && (value->GetType() == Value::VALUE_OBJECT || value->GetType() == Value::VALUE_ARRAY))
+			items.push_back(Compaction_item(*i));
+	}
+}
+
+void Compaction_state::sweep(JsonDb::TransactionHandle &transaction)
+{
+	size_t words = std::max(stored.size(), entries.size());
+	size_t removed = 0;
+	while(sweep_word < words && removed < sweep_batch_size)
+	{
+		unsigned long garbage = (stored.word(sweep_word) | entries.word(sweep_word)) & ~reachable.word(sweep_word);
+		if(garbage == 0)
+		{
+			++sweep_word;
+			continue;
+		}
+
+		size_t bit = 0;
+		while((garbage & (1UL << bit)) == 0)
+			++bit;
+
+		ValueKey key = (ValueKey)(sweep_word * Key_bitmap::word_bits + bit);
+		if(stored.test(key))
+		{
+			transaction->Delete(key);
+			stored.reset(key);
+			++report.removed_records;
+			++removed;
+		}
+
+		// The entries are removed in batches, the key stays in the bitmap until all its entries are removed
+		if(entries.test(key))
+		{
+			JsonDb::Transaction::Entries batch;
+			transaction->RetrieveEntries(key, std::string(), sweep_batch_size, batch);
+			for(JsonDb::Transaction::Entries::const_iterator i = batch.begin(); i != batch.end(); ++i)
+				transaction->DeleteEntry(key, i->first);
+
+			report.removed_entries += batch.size();
+			removed += batch.size();
+			if(batch.size() < sweep_batch_size)
+				entries.reset(key);
+		}
+	}
+
+	if(sweep_word >= words)
+		phase = rebuilding;
+}
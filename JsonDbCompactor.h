@@ -0,0 +1,107 @@
+#ifndef __json_db_compactor_h__
+#define __json_db_compactor_h__
+
+/*
+ 		Copyright (C) 2010 Wouter van Kleunen
+
+		This file is part of JsonDb.
+
+    Foobar is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Foobar is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with JsonDb.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <boost/weak_ptr.hpp>
+#include <boost/thread/thread_time.hpp>
+#include <string>
+#include <vector>
+
+#include "JsonDbValidator.h"
+
+// A compaction of the database, run in batches of work which are small enough to interleave with other
+// transactions. The records are scanned, the records reachable from the root are marked and the records which
+// are not are removed, then the database file is rebuilt. Transactions writing while the records are scanned
+// and marked are tracked, the elements they write are kept and the elements below them are marked again.
+class Compaction_state
+{
+public:
+	// Records scanned in one batch, and records or entries removed in one batch
+	static const size_t scan_batch_size = 4096;
+	static const size_t sweep_batch_size = 256;
+
+	// Batches done in one transaction when the compaction runs to the end
+	static const size_t transaction_batches = 64;
+
+	Compaction_state(JsonDb::StoragePointer const &storage, ValuePointer const &null_element);
+
+	// True if the compaction runs on the opened database
+	bool uses(JsonDb::StoragePointer const &opened) const;
+
+	// Do batches of work until the deadline has passed or max_batches batches are done, at least one batch is
+	// done. Returns false when the compaction can not continue before the writing transactions are committed.
+	bool run(boost::system_time const &deadline, size_t max_batches);
+
+	JsonDb::CompactionReport report;
+
+private:
+	enum Phase
+	{
+		scanning,
+		marking,
+		sweeping,
+		rebuilding,
+		finished
+	};
+
+	// An object or array whose members or elements are marked, from the member name or element index. Only
+	// as many members or elements as the container had when its first batch was marked are marked, a container
+	// written since is marked again.
+	struct Compaction_item
+	{
+		Compaction_item(ValueKey _container)
+			: container(_container), index(0), remaining((size_t)-1)
+		{ }
+
+		ValueKey container;
+		size_t index;
+		std::string from;
+		size_t remaining;
+	};
+
+	void scan(JsonDb::TransactionHandle &transaction);
+	void scan_key(ValueKey key, bool entry);
+	void mark(JsonDb::TransactionHandle &transaction);
+	void sweep(JsonDb::TransactionHandle &transaction);
+
+	boost::weak_ptr<JsonDb::Storage> storage;
+	ValuePointer null_element;
+	Phase phase;
+
+	// Record to continue the scan at
+	ValueKey next_record;
+
+	// Keys with a record, keys with entries and keys reachable from the root
+	Key_bitmap stored;
+	Key_bitmap entries;
+	Key_bitmap reachable;
+
+	// Objects and arrays of which the members or elements are not marked yet, the last is marked first
+	std::vector<Compaction_item> items;
+
+	// True once the elements written during the compaction are marked again
+	bool remarking;
+
+	// Word of the bitmaps to continue the sweep at
+	size_t sweep_word;
+};
+
+#endif
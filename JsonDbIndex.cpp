@@ -0,0 +1,716 @@
+/*
+ 		Copyright (C) 2010 Wouter van Kleunen
+
+		This file is part of JsonDb.
+
+    Foobar is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Foobar is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with JsonDb.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "JsonDb.h"
+#include "JsonDbValues.h"
+#include "JsonDbPathParser.h"
+#include "JsonDbIndex.h"
+
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/format.hpp>
+#include <boost/cstdint.hpp>
+
+#include <algorithm>
+#include <cstring>
+
+// Entries of an index read at once
+static const size_t index_batch_size = 256;
+
+template<typename T>
+static void Append(std::string &output, T value)
+{
+	output.append((char const *)&value, sizeof(T));
+}
+
+template<typename T>
+static T Read(std::string const &input, size_t &offset)
+{
+	if(offset + sizeof(T) > input.size())
+		throw std::runtime_error("Index entry is truncated");
+
+	T value;
+	memcpy(&value, input.data() + offset, sizeof(T));
+	offset += sizeof(T);
+	return value;
+}
+
+// Append the value to the name of an index entry, returns false if the value is not indexed. The type is part
+// of the name, and the length of a string precedes it, so the entries of a value are next to each other.
+static bool EncodeValue(Value const &value, std::string &name)
+{
+	switch(value.GetType())
+	{
+	case Value::VALUE_NUMBER_INTEGER:
+		name += 'i';
+		Append<int>(name, value.GetValueInt());
+		return true;
+
+	case Value::VALUE_NUMBER_REAL:
+		name += 'r';
+		Append<double>(name, value.GetValueReal());
+		return true;
+
+	case Value::VALUE_NUMBER_BOOL:
+		name += 'b';
+		name += value.GetValueBoolean() ? '\1' : '\0';
+		return true;
+
+	case Value::VALUE_STRING:
+	{
+		std::string string = value.GetValueString();
+		name += 's';
+		Append<unsigned int>(name, string.size());
+		name += string;
+		return true;
+	}
+
+	default:
+		return false;
+	}
+}
+
+// Numbers are encoded as real, with the sign bit flipped and the other bits inverted for negative numbers, so
+// the bytes are ordered as the numbers
+static void EncodeOrderedNumber(double number, std::string &name)
+{
+	// Negative zero equals zero
+	if(number == 0.0)
+		number = 0.0;
+
+	boost::uint64_t bits;
+	memcpy(&bits, &number, sizeof(bits));
+	boost::uint64_t const sign = (boost::uint64_t)1 << 63;
+	bits = (bits & sign) ? ~bits : bits | sign;
+
+	name += 'n';
+	for(size_t i = 0; i < sizeof(bits); ++i)
+		name += (char)(bits >> (8 * (sizeof(bits) - 1 - i)));
+}
+
+// Strings end with two zero bytes, and a zero byte in the string is followed by a one, so a string orders before
+// the strings it is a prefix of
+static void EncodeOrderedString(std::string const &string, std::string &name)
+{
+	name += 's';
+	for(std::string::const_iterator i = string.begin(); i != string.end(); ++i)
+	{
+		name += *i;
+		if(*i == '\0')
+			name += '\1';
+	}
+	name.append(2, '\0');
+}
+
+// Append the value to the name of an entry of an ordered index, returns false if the value is not indexed
+static bool EncodeOrderedValue(Value const &value, std::string &name)
+{
+	switch(value.GetType())
+	{
+	case Value::VALUE_NUMBER_INTEGER:
+		EncodeOrderedNumber(value.GetValueInt(), name);
+		return true;
+
+	case Value::VALUE_NUMBER_REAL:
+		EncodeOrderedNumber(value.GetValueReal(), name);
+		return true;
+
+	case Value::VALUE_NUMBER_BOOL:
+		name += 'b';
+		name += value.GetValueBoolean() ? '\1' : '\0';
+		return true;
+
+	case Value::VALUE_STRING:
+		EncodeOrderedString(value.GetValueString(), name);
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+static bool EncodeValue(Value const &value, bool ordered, std::string &name)
+{
+	return ordered ? EncodeOrderedValue(value, name) : EncodeValue(value, name);
+}
+
+JsonDb::IndexKey::IndexKey(int value)
+{
+	EncodeOrderedNumber(value, encoded);
+}
+
+JsonDb::IndexKey::IndexKey(double value)
+{
+	EncodeOrderedNumber(value, encoded);
+}
+
+JsonDb::IndexKey::IndexKey(bool value)
+{
+	encoded += 'b';
+	encoded += value ? '\1' : '\0';
+}
+
+JsonDb::IndexKey::IndexKey(std::string const &value)
+{
+	EncodeOrderedString(value, encoded);
+}
+
+JsonDb::IndexKey::IndexKey(char const *value)
+{
+	EncodeOrderedString(value, encoded);
+}
+
+// The key of the element holding the value ends the name of an index entry, ordered by key
+static void EncodeKey(ValueKey key, std::string &name)
+{
+	for(size_t i = 0; i < sizeof(ValueKey); ++i)
+		name += (char)(key >> (8 * (sizeof(ValueKey) - 1 - i)));
+}
+
+// The positions of the wildcard steps leading to a value are stored in its index entry. A member is stored by
+// name, an element by its index and key, so the element can be found when elements before it were deleted.
+static void AppendMember(std::string &positions, std::string const &name)
+{
+	positions += 'n';
+	Append<unsigned int>(positions, name.size());
+	positions += name;
+}
+
+static void AppendElement(std::string &positions, size_t index, ValueKey key)
+{
+	positions += 'i';
+	Append<unsigned int>(positions, index);
+	Append<ValueKey>(positions, key);
+}
+
+// Walks the elements matching the steps of an index path below an element, and passes the name of the entry of
+// every indexed value with the positions of the wildcard steps leading to it
+class Index_walker
+{
+public:
+	typedef boost::function<void (std::string const &name, std::string const &positions)> Receiver;
+
+	Index_walker(JsonDb::TransactionHandle &_transaction, JsonDb::Transaction::Index const &index, Receiver const &_receiver)
+		: transaction(_transaction)
+		, steps(index.path.GetSteps())
+		, ordered(index.ordered)
+		, receiver(_receiver)
+	{ }
+
+	// Walk the value matching the steps before the specified step, positions holds the positions so far
+	void walk(ValuePointer const &value, size_t step, std::string &positions);
+
+private:
+	// Walk the batch of members or elements matching a wildcard step
+	void walk(ValueArray::Type const &keys, std::vector<std::string> const &names, size_t index, size_t step, std::string &positions);
+
+	JsonDb::TransactionHandle &transaction;
+	JsonDb::Path::Steps const &steps;
+	bool ordered;
+	Receiver receiver;
+};
+
+void Index_walker::walk(ValuePointer const &value, size_t step, std::string &positions)
+{
+	if(step == steps.size())
+	{
+		std::string name;
+		if(EncodeValue(*value, ordered, name))
+		{
+			EncodeKey(value->GetKey(), name);
+			receiver(name, positions);
+		}
+		return;
+	}
+
+	JsonDb::Path::Step const &current = steps[step];
+	Value::ValueTypeId type = value->GetType();
+	if(current.is_wildcard && type == Value::VALUE_OBJECT)
+	{
+		std::string from;
+		ValueObject::Type members;
+		while(static_cast<ValueObject const &>(*value).NextMembers(transaction, from, members))
+		{
+			ValueArray::Type keys;
+			std::vector<std::string> names;
+			for(ValueObject::Type::const_iterator i = members.begin(); i != members.end(); ++i)
+			{
+				keys.push_back(i->second);
+				names.push_back(i->first);
+			}
+
+			walk(keys, names, 0, step, positions);
+		}
+	} else if(current.is_wildcard && type == Value::VALUE_ARRAY)
+	{
+		size_t index = 0;
+		ValueArray::Type elements;
+		std::vector<std::string> names;
+		while(static_cast<ValueArray const &>(*value).NextElements(transaction, index, elements))
+			walk(elements, names, index - elements.size(), step, positions);
+	} else if(current.is_index && type == Value::VALUE_ARRAY)
+	{
+		if(current.index < value->GetSize(transaction))
+			walk(value->Get(transaction, current.index), step + 1, positions);
+	} else if(!current.is_wildcard && !current.is_index && type == Value::VALUE_OBJECT)
+	{
+		ValuePointer member = value->Get(transaction, current.name, return_null);
+		if(member != NULL)
+			walk(member, step + 1, positions);
+	}
+}
+
+void Index_walker::walk(ValueArray::Type const &keys, std::vector<std::string> const &names, size_t index, size_t step, std::string &positions)
+{
+	JsonDb::Transaction::RecordBatch records;
+	transaction->ReadBatch(keys, records);
+
+	size_t length = positions.size();
+	for(size_t i = 0; i < keys.size(); ++i)
+	{
+		ValuePointer element = transaction->Retrieve(keys[i], records);
+		if(element == NULL)
+			continue;
+
+		if(names.empty())
+			AppendElement(positions, index + i, keys[i]);
+		else
+			AppendMember(positions, names[i]);
+
+		walk(element, step + 1, positions);
+		positions.resize(length);
+	}
+}
+
+// Find an index by name, returns NULL if it does not exist
+static JsonDb::Transaction::Index const *FindIndex(JsonDb::TransactionHandle &transaction, std::string const &name)
+{
+	JsonDb::Transaction::Indexes const &indexes = transaction->GetIndexes();
+	for(JsonDb::Transaction::Indexes::const_iterator i = indexes.begin(); i != indexes.end(); ++i)
+		if(i->name == name)
+			return &*i;
+
+	return NULL;
+}
+
+// True if a step of an index path matches a step of a path, a wildcard step matches any member or element
+static bool Matches(JsonDb::Path::Step const &index_step, JsonDb::Path::Step const &step)
+{
+	if(index_step.is_wildcard)
+		return true;
+
+	return index_step.is_index == step.is_index && (step.is_index ? index_step.index == step.index : index_step.name == step.name);
+}
+
+// True if the index has values at or below the element at the path
+static bool Covers(JsonDb::Path const &index, JsonDb::Path const &path)
+{
+	JsonDb::Path::Steps const &index_steps = index.GetSteps();
+	JsonDb::Path::Steps const &path_steps = path.GetSteps();
+	if(path_steps.size() > index_steps.size())
+		return false;
+
+	for(size_t i = 0; i < path_steps.size(); ++i)
+		if(!Matches(index_steps[i], path_steps[i]))
+			return false;
+
+	return true;
+}
+
+static void StoreEntry(JsonDb::TransactionHandle &transaction, ValueKey index, std::string const &name, std::string const &positions)
+{
+	transaction->StoreEntry(index, name, positions);
+}
+
+static void DeleteEntry(JsonDb::TransactionHandle &transaction, ValueKey index, std::string const &name, std::string const &positions)
+{
+	transaction->DeleteEntry(index, name);
+}
+
+Index_update::Index_update(JsonDb::TransactionHandle &_transaction, JsonDb::Path const &_path)
+	: transaction(_transaction)
+{
+	if(!transaction->GetIndexes().empty())
+		find_indexes(_path);
+}
+
+Index_update::Index_update(JsonDb::TransactionHandle &_transaction, JsonDb::Path const &array, size_t element)
+	: transaction(_transaction)
+{
+	if(!transaction->GetIndexes().empty())
+		find_indexes(array[element]);
+}
+
+void Index_update::find_indexes(JsonDb::Path const &_path)
+{
+	JsonDb::Transaction::Indexes const &all = transaction->GetIndexes();
+	for(JsonDb::Transaction::Indexes::const_iterator i = all.begin(); i != all.end(); ++i)
+		if(Covers(i->path, _path))
+			indexes.push_back(*i);
+
+	if(!indexes.empty())
+		path = _path;
+}
+
+void Index_update::remove(ValuePointer const &element)
+{
+	update(element, false);
+}
+
+void Index_update::add(ValuePointer const &element)
+{
+	update(element, true);
+}
+
+void Index_update::add(ValuePointer const &element, JsonDb::Path::Steps const &below, std::vector<ValueKey> const &keys, ValuePointer const &value)
+{
+	JsonDb::Path::Steps const &steps = path.GetSteps();
+	for(JsonDb::Transaction::Indexes::const_iterator i = indexes.begin(); i != indexes.end(); ++i)
+	{
+		// The value has to be at the path of the index
+		JsonDb::Path::Steps const &index_steps = i->path.GetSteps();
+		if(index_steps.size() != steps.size() + below.size())
+			continue;
+
+		bool matches = true;
+		for(size_t step = 0; step < below.size() && matches; ++step)
+			matches = Matches(index_steps[steps.size() + step], below[step]);
+
+		std::string name;
+		if(!matches || !EncodeValue(*value, i->ordered, name))
+			continue;
+
+		std::string entry_positions = positions(*i, element);
+		for(size_t step = 0; step < below.size(); ++step)
+		{
+			if(!index_steps[steps.size() + step].is_wildcard)
+				continue;
+
+			if(below[step].is_index)
+				AppendElement(entry_positions, below[step].index, keys[step]);
+			else
+				AppendMember(entry_positions, below[step].name);
+		}
+
+		EncodeKey(value->GetKey(), name);
+		transaction->StoreEntry(i->key, name, entry_positions);
+	}
+}
+
+std::string Index_update::positions(JsonDb::Transaction::Index const &index, ValuePointer const &element)
+{
+	// The elements at the path are resolved already
+	JsonDb::Path::Steps const &steps = path.GetSteps();
+	std::string result;
+	JsonDb::Path prefix;
+	for(size_t step = 0; step < steps.size(); ++step)
+	{
+		prefix = steps[step].is_index ? prefix[steps[step].index] : prefix[steps[step].name];
+		if(!index.path.GetSteps()[step].is_wildcard)
+			continue;
+
+		if(!steps[step].is_index)
+		{
+			AppendMember(result, steps[step].name);
+			continue;
+		}
+
+		ValuePointer holder = element;
+		if(step + 1 < steps.size())
+			holder = JsonDb_ResolveJsonPath(transaction, prefix, transaction->GetRoot(), throw_exception).second;
+
+		AppendElement(result, steps[step].index, holder->GetKey());
+	}
+
+	return result;
+}
+
+void Index_update::update(ValuePointer const &element, bool add)
+{
+	if(element == NULL)
+		return;
+
+	for(JsonDb::Transaction::Indexes::const_iterator i = indexes.begin(); i != indexes.end(); ++i)
+	{
+		std::string element_positions = positions(*i, element);
+		Index_walker::Receiver receiver = boost::bind(add ? &StoreEntry : &DeleteEntry, boost::ref(transaction), i->key, _1, _2);
+		Index_walker(transaction, *i, receiver).walk(element, path.GetSteps().size(), element_positions);
+	}
+}
+
+void JsonDb_CreateIndex(JsonDb::TransactionHandle &transaction, std::string const &name, JsonDb::Path const &path, bool ordered)
+{
+	transaction->CheckWritable();
+
+	if(name.empty())
+		throw std::runtime_error("Failed to create index, the name is empty");
+
+	if(FindIndex(transaction, name) != NULL)
+		throw std::runtime_error((boost::format("Failed to create index, an index named '%s' exists already") % name).str());
+
+	// The record of the index holds its path, the entries are stored below it
+	ValueKey key = transaction->GenerateKey();
+	transaction->Store(key, ValuePointer(new ValueString(key, path.ToString())));
+	JsonDb::Transaction::Index index(name, path, key, ordered);
+	transaction->AddIndex(index);
+
+	std::string positions;
+	Index_walker::Receiver receiver = boost::bind(&StoreEntry, boost::ref(transaction), key, _1, _2);
+	Index_walker(transaction, index, receiver).walk(transaction->GetRoot(), 0, positions);
+}
+
+void JsonDb_DropIndex(JsonDb::TransactionHandle &transaction, std::string const &name)
+{
+	transaction->CheckWritable();
+
+	JsonDb::Transaction::Index const *index = FindIndex(transaction, name);
+	if(index == NULL)
+		throw std::runtime_error((boost::format("Failed to drop index, no index is named '%s'") % name).str());
+
+	// The deletes are flushed before the next batch is read
+	ValueKey key = index->key;
+	JsonDb::Transaction::Entries entries;
+	do
+	{
+		transaction->RetrieveEntries(key, std::string(), index_batch_size, entries);
+		for(JsonDb::Transaction::Entries::const_iterator i = entries.begin(); i != entries.end(); ++i)
+			transaction->DeleteEntry(key, i->first);
+	} while(entries.size() == index_batch_size);
+
+	transaction->Delete(key);
+	transaction->RemoveIndex(name);
+}
+
+// Find the index of an element in an array. Elements only move to a lower index, when elements before them are
+// deleted, so the array is searched down from the index the element had when it was indexed.
+static size_t FindElement(JsonDb::TransactionHandle &transaction, ValuePointer const &array, size_t index, ValueKey key)
+{
+	size_t size = array->GetType() == Value::VALUE_ARRAY ? array->GetSize(transaction) : 0;
+	for(size_t i = std::min(index + 1, size); i > 0; --i)
+	{
+		ValuePointer element = array->Get(transaction, i - 1);
+		if(element != NULL && element->GetKey() == key)
+			return i - 1;
+	}
+
+	throw std::runtime_error((boost::format("Index refers to element %d, which is not in its array") % key).str());
+}
+
+// Path of an indexed value from the positions of the wildcard steps of the index path
+static JsonDb::Path ResolvePositions(JsonDb::TransactionHandle &transaction, JsonDb::Path const &index, std::string const &positions)
+{
+	JsonDb::Path path;
+	size_t offset = 0;
+
+	JsonDb::Path::Steps const &steps = index.GetSteps();
+	for(JsonDb::Path::Steps::const_iterator i = steps.begin(); i != steps.end(); ++i)
+	{
+		if(!i->is_wildcard)
+		{
+			path = i->is_index ? path[i->index] : path[i->name];
+			continue;
+		}
+
+		char type = offset < positions.size() ? positions[offset++] : '\0';
+		if(type == 'n')
+		{
+			size_t length = Read<unsigned int>(positions, offset);
+			if(offset + length > positions.size())
+				throw std::runtime_error("Index entry is truncated");
+
+			path = path[positions.substr(offset, length)];
+			offset += length;
+		} else if(type == 'i')
+		{
+			size_t element = Read<unsigned int>(positions, offset);
+			ValueKey key = Read<ValueKey>(positions, offset);
+
+			ValuePointer array = JsonDb_ResolveJsonPath(transaction, path, transaction->GetRoot(), throw_exception).second;
+			path = path[FindElement(transaction, array, element, key)];
+		} else
+		{
+			throw std::runtime_error("Index entry has an invalid position");
+		}
+	}
+
+	return path;
+}
+
+std::vector<JsonDb::Path> JsonDb_LookupIndex(JsonDb::TransactionHandle &transaction, std::string const &name, ValuePointer const &value)
+{
+	JsonDb::Transaction::Index const *index = FindIndex(transaction, name);
+	if(index == NULL)
+		throw std::runtime_error((boost::format("Failed to look up value, no index is named '%s'") % name).str());
+
+	std::string prefix;
+	if(!EncodeValue(*value, index->ordered, prefix))
+		throw std::runtime_error((boost::format("Failed to look up value of type '%s', only strings, numbers and booleans are indexed") % value->GetTypeString()).str());
+
+	// The entries of the value directly follow the prefix, ordered by the key of the element holding the value
+	std::vector<JsonDb::Path> paths;
+	std::string from = prefix;
+	JsonDb::Transaction::Entries entries;
+	do
+	{
+		transaction->RetrieveEntries(index->key, from, index_batch_size, entries);
+		for(JsonDb::Transaction::Entries::const_iterator i = entries.begin(); i != entries.end(); ++i)
+		{
+			if(i->first.compare(0, prefix.size(), prefix) != 0)
+				return paths;
+
+			paths.push_back(ResolvePositions(transaction, index->path, i->second));
+		}
+
+		if(!entries.empty())
+			from = entries.back().first + '\0';
+	} while(entries.size() == index_batch_size);
+
+	return paths;
+}
+
+static JsonDb::Transaction::Index const &FindOrderedIndex(JsonDb::TransactionHandle &transaction, std::string const &name)
+{
+	JsonDb::Transaction::Index const *index = FindIndex(transaction, name);
+	if(index == NULL)
+		throw std::runtime_error((boost::format("Failed to scan index, no index is named '%s'") % name).str());
+
+	if(!index->ordered)
+		throw std::runtime_error((boost::format("Failed to scan index, index '%s' is not ordered") % name).str());
+
+	return *index;
+}
+
+// Pass the positions of the entries of an ordered index in the range to the receiver, in the order of the scan
+static void ScanRange(JsonDb::TransactionHandle &transaction, JsonDb::Transaction::Index const &index, JsonDb::IndexRange const &range, boost::function<void (std::string const &positions)> const &receiver)
+{
+	// The key of the element holding a value follows the value in the name of an entry, the names of the entries
+	// of a value are at most the value followed by this key
+	std::string const last_key = std::string(sizeof(ValueKey), '\xff') + '\0';
+
+	std::string position;
+	if(!range.descending && range.has_lower)
+		position = range.lower_exclusive ? range.lower + last_key : range.lower;
+	else if(range.descending && range.has_upper)
+		position = range.upper_exclusive ? range.upper : range.upper + last_key;
+
+	size_t count = 0;
+	JsonDb::Transaction::Entries entries;
+	do
+	{
+		if(range.descending)
+			transaction->RetrieveEntriesBefore(index.key, position, index_batch_size, entries);
+		else
+			transaction->RetrieveEntries(index.key, position, index_batch_size, entries);
+
+		for(JsonDb::Transaction::Entries::const_iterator i = entries.begin(); i != entries.end(); ++i)
+		{
+			if(i->first.size() < sizeof(ValueKey))
+				throw std::runtime_error("Index entry is truncated");
+
+			// The scan ends at the first value past the other end of the range
+			size_t length = i->first.size() - sizeof(ValueKey);
+			if(!range.descending && range.has_upper)
+			{
+				int result = i->first.compare(0, length, range.upper);
+				if(result > 0 || (result == 0 && range.upper_exclusive))
+					return;
+			} else if(range.descending && range.has_lower)
+			{
+				int result = i->first.compare(0, length, range.lower);
+				if(result < 0 || (result == 0 && range.lower_exclusive))
+					return;
+			}
+
+			receiver(i->second);
+			if(++count == range.limit)
+				return;
+		}
+
+		if(!entries.empty())
+			position = range.descending ? entries.back().first : entries.back().first + '\0';
+	} while(entries.size() == index_batch_size);
+}
+
+static void CollectPath(JsonDb::TransactionHandle &transaction, JsonDb::Path const &index, std::vector<JsonDb::Path> &paths, std::string const &positions)
+{
+	paths.push_back(ResolvePositions(transaction, index, positions));
+}
+
+static void CountEntry(size_t &count, std::string const &positions)
+{
+	++count;
+}
+
+std::vector<JsonDb::Path> JsonDb_ScanIndex(JsonDb::TransactionHandle &transaction, std::string const &name, JsonDb::IndexRange const &range)
+{
+	JsonDb::Transaction::Index const &index = FindOrderedIndex(transaction, name);
+
+	std::vector<JsonDb::Path> paths;
+	ScanRange(transaction, index, range, boost::bind(&CollectPath, boost::ref(transaction), boost::cref(index.path), boost::ref(paths), _1));
+	return paths;
+}
+
+size_t JsonDb_CountIndex(JsonDb::TransactionHandle &transaction, std::string const &name, JsonDb::IndexRange const &range)
+{
+	size_t count = 0;
+	ScanRange(transaction, FindOrderedIndex(transaction, name), range, boost::bind(&CountEntry, boost::ref(count), _1));
+	return count;
+}
+
+static void CollectEntry(std::vector<std::string> &names, std::string const &name, std::string const &positions)
+{
+	names.push_back(name);
+}
+
+void JsonDb_ValidateIndexes(JsonDb::TransactionHandle &transaction, JsonDb::ValidationReport &report)
+{
+	JsonDb::Transaction::Indexes indexes = transaction->GetIndexes();
+	for(JsonDb::Transaction::Indexes::const_iterator index = indexes.begin(); index != indexes.end(); ++index)
+	{
+		// The entries expected from the values in the database, ordered as the entries in the database
+		std::vector<std::string> expected;
+		std::string positions;
+		Index_walker::Receiver receiver = boost::bind(&CollectEntry, boost::ref(expected), _1, _2);
+		Index_walker(transaction, *index, receiver).walk(transaction->GetRoot(), 0, positions);
+		std::sort(expected.begin(), expected.end());
+
+		size_t next = 0;
+		std::string from;
+		JsonDb::Transaction::Entries entries;
+		do
+		{
+			transaction->RetrieveEntries(index->key, from, index_batch_size, entries);
+			for(JsonDb::Transaction::Entries::const_iterator i = entries.begin(); i != entries.end(); ++i)
+			{
+				++report.index_entries;
+				for(; next < expected.size() && expected[next] < i->first; ++next)
+					++report.missing_index_entries;
+
+				if(next < expected.size() && expected[next] == i->first)
+					++next;
+				else
+					++report.stale_index_entries;
+			}
+
+			if(!entries.empty())
+				from = entries.back().first + '\0';
+		} while(entries.size() == index_batch_size);
+
+		report.missing_index_entries += expected.size() - next;
+	}
+}
@@ -0,0 +1,82 @@
+#ifndef __json_db_index_h__
+#define __json_db_index_h__
+
+/*
+ 		Copyright (C) 2010 Wouter van Kleunen
+
+		This file is part of JsonDb.
+
+    Foobar is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Foobar is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with JsonDb.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <vector>
+
+// Keeps the indexes on the values at or below the element at a path up to date while the element changes. The
+// entries of the current element are removed before the change, and the entries of the new element are added
+// after it. Indexes on other paths are left alone.
+class Index_update
+{
+public:
+	// Update for the element at the path
+	Index_update(JsonDb::TransactionHandle &transaction, JsonDb::Path const &path);
+
+	// Update for the element appended at the specified index to the array at the path
+	Index_update(JsonDb::TransactionHandle &transaction, JsonDb::Path const &array, size_t element);
+
+	// True if no index has values at or below the path
+	bool empty() const { return indexes.empty(); }
+
+	// Remove the entries of the current element at the path, the element may be NULL
+	void remove(ValuePointer const &element);
+
+	// Add the entries of the new element at the path
+	void add(ValuePointer const &element);
+
+	// Add the entry of a single value below the new element at the path, at the specified steps below it. Keys holds
+	// the key of the element at each of these steps.
+	void add(ValuePointer const &element, JsonDb::Path::Steps const &steps, std::vector<ValueKey> const &keys, ValuePointer const &value);
+
+private:
+	// Find the indexes on values at or below the path
+	void find_indexes(JsonDb::Path const &path);
+
+	// Positions of the wildcard steps of the index up to the element at the path
+	std::string positions(JsonDb::Transaction::Index const &index, ValuePointer const &element);
+
+	void update(ValuePointer const &element, bool add);
+
+	JsonDb::TransactionHandle &transaction;
+	JsonDb::Path path;
+	JsonDb::Transaction::Indexes indexes;
+};
+
+// Create an index on the values at the path, the values in the database are added to it
+void JsonDb_CreateIndex(JsonDb::TransactionHandle &transaction, std::string const &name, JsonDb::Path const &path, bool ordered = false);
+
+// Remove an index and all its entries
+void JsonDb_DropIndex(JsonDb::TransactionHandle &transaction, std::string const &name);
+
+// Paths of the elements in the index equal to the value
+std::vector<JsonDb::Path> JsonDb_LookupIndex(JsonDb::TransactionHandle &transaction, std::string const &name, ValuePointer const &value);
+
+// Paths of the values of an ordered index in the range
+std::vector<JsonDb::Path> JsonDb_ScanIndex(JsonDb::TransactionHandle &transaction, std::string const &name, JsonDb::IndexRange const &range);
+
+// Number of values of an ordered index in the range
+size_t JsonDb_CountIndex(JsonDb::TransactionHandle &transaction, std::string const &name, JsonDb::IndexRange const &range);
+
+// Compare the entries of every index with the values in the database, and count the differences in the report
+void JsonDb_ValidateIndexes(JsonDb::TransactionHandle &transaction, JsonDb::ValidationReport &report);
+
+#endif
@@ -20,6 +20,7 @@
 #include "JsonDb.h"
 #include "JsonDbValues.h"
 #include "JsonDbParser.h"
+#include "JsonDbStructuralIndex.h"
 
 #include <boost/bind.hpp>
 #include <boost/function.hpp>
@@ -28,6 +29,14 @@
 #include <boost/spirit/include/classic_escape_char.hpp>
 #include <boost/spirit/include/classic_lists.hpp>
 
+#include <istream>
+#include <sstream>
+#include <cstring>
+#include <climits>
+#include <cerrno>
+#include <cstdlib>
+#include <cctype>
+
 using namespace boost;
 using namespace boost::spirit;
 using namespace boost::spirit::classic;
@@ -44,7 +53,7 @@ std::string remove_trailing_quote(std::string const &s)
 class Semantic_actions
 {
 public:
-	Semantic_actions(JsonDb::TransactionHandle &_transaction, ValuePointer root);
+	Semantic_actions(JsonDb::TransactionHandle &_transaction, ValuePointer root, Parsed_value_receiver const &_receiver = Parsed_value_receiver());
 
 	void begin_obj   ( char c );
 	void end_obj     ( char c );
@@ -59,11 +68,26 @@ public:
 	void new_int ( int i );
 	void new_real( double d );
 
+	// Events with the decoded value, used by the stream parser
+	void new_name ( std::string const &str );
+	void new_str  ( std::string const &str );
+	void new_bool ( bool b );
+	void new_null ();
+
+	// Number of values added so far
+	size_t get_values() const { return values; }
+
 private:
 
 	void add_to_current(ValuePointer value); 
 	std::string get_current_str();
 
+	// Track the steps to an added value, and pass a value which is not an object or array to the receiver
+	void track(ValuePointer const &value);
+
+	// Leave the object or array which is done
+	void untrack();
+
 	JsonDb::TransactionHandle transaction;
 
 	std::vector<ValuePointer> stack;    // previous child objects and arrays 
@@ -72,10 +96,20 @@ private:
 
 	std::string name;             		  // of current name/value pair
 	std::string current_str;        		// current name or string value 
+
+	size_t values;
+
+	// Steps from the root to the current object or array and the keys of the elements at these steps, only tracked
+	// for the receiver
+	Parsed_value_receiver receiver;
+	JsonDb::Path::Steps steps;
+	std::vector<ValueKey> keys;
 };
 
-Semantic_actions::Semantic_actions(JsonDb::TransactionHandle &_transaction, ValuePointer _root)
+Semantic_actions::Semantic_actions(JsonDb::TransactionHandle &_transaction, ValuePointer _root, Parsed_value_receiver const &_receiver)
 	: transaction(_transaction)
+	, values(0)
+	, receiver(_receiver)
 { 
 	root = _root;
 	current_value = _root;
@@ -98,6 +132,7 @@ void Semantic_actions::end_obj(char c)
 {
 	assert(c == '}');
 	transaction->Store(current_value->GetKey(), current_value);
+	untrack();
 	current_value = stack.back();
 	stack.pop_back(); 
 }
@@ -120,6 +155,7 @@ void Semantic_actions::end_array(char c)
 	assert(c == ']');
 
 	transaction->Store(current_value->GetKey(), current_value);
+	untrack();
 	current_value = stack.back();
 	stack.pop_back(); 
 }
@@ -133,33 +169,52 @@ void Semantic_actions::new_c_esc_ch(char c)  // work around for c_escape_ch_p pa
 
 void Semantic_actions::new_name(const char *str, const char *end)
 {
-	assert(current_value != NULL && current_value->GetType() == Value::VALUE_OBJECT);
-	name = get_current_str();
+	new_name(get_current_str());
 }
 
 void Semantic_actions::new_str(const char *str, const char *end)
 {
-	ValuePointer value(new ValueString(null_key, get_current_str()));
-	add_to_current(value);
+	new_str(get_current_str());
 }
 
 void Semantic_actions::new_true(const char *str, const char *end)
 {
 	assert(std::string(str, end) == "true");
-	ValuePointer value(new ValueNumberBoolean(null_key, true));
-	add_to_current(value);
+	new_bool(true);
 }
 
 void Semantic_actions::new_false(const char *str, const char *end)
 {
 	assert(std::string(str, end) == "false");
-	ValuePointer value(new ValueNumberBoolean(null_key, false));
-	add_to_current(value);
+	new_bool(false);
 }
 
 void Semantic_actions::new_null(const char *str, const char *end)
 {
 	assert(std::string(str, end) == "null");
+	new_null();
+}
+
+void Semantic_actions::new_name(std::string const &str)
+{
+	assert(current_value != NULL && current_value->GetType() == Value::VALUE_OBJECT);
+	name = str;
+}
+
+void Semantic_actions::new_str(std::string const &str)
+{
+	ValuePointer value(new ValueString(null_key, str));
+	add_to_current(value);
+}
+
+void Semantic_actions::new_bool(bool b)
+{
+	ValuePointer value(new ValueNumberBoolean(null_key, b));
+	add_to_current(value);
+}
+
+void Semantic_actions::new_null()
+{
 	ValuePointer value(new ValueNull(null_key));
 	add_to_current(value);
 }
@@ -178,6 +233,8 @@ void Semantic_actions::new_real(double d)
 
 void Semantic_actions::add_to_current(ValuePointer value)
 {
+	++values;
+
 	if(current_value == root)
 	{
 		// Replace the root with this value
@@ -187,20 +244,68 @@ void Semantic_actions::add_to_current(ValuePointer value)
 		transaction->Store(key, value);
 	} else if(current_value->GetType() == Value::VALUE_OBJECT)
 	{
-		// Set the field
+		// Set the field, a deferred member is queued in the garbage list and the value gets a key of its own
 		ValuePointer old_value = current_value->Get(transaction, name, create);
-		ValueKey key = old_value->GetKey();
-		old_value->Delete(transaction);
-		value->SetKey(key);
-		transaction->Store(key, value);
+		if(old_value->DeferDelete(transaction))
+		{
+			value->SetKey(transaction->GenerateKey(current_value->GetKey()));
+			transaction->Store(value->GetKey(), value);
+			current_value->Relink(transaction, name, value->GetKey());
+		} else
+		{
+			ValueKey key = old_value->GetKey();
+			old_value->Delete(transaction);
+			value->SetKey(key);
+			transaction->Store(key, value);
+		}
 	}	 else if(current_value->GetType() == Value::VALUE_ARRAY)
 	{
 		// Append to the list
-		ValueKey key = transaction->GenerateKey();
+		ValueKey key = transaction->GenerateKey(current_value->GetKey());
 		value->SetKey(key);
 		current_value->Append(transaction, key);
 		transaction->Store(key, value);
 	} 
+
+	track(value);
+}
+
+void Semantic_actions::track(ValuePointer const &value)
+{
+	if(receiver.empty())
+		return;
+
+	// The root has no step of its own
+	bool step = current_value != root;
+	if(step)
+	{
+		if(current_value->GetType() == Value::VALUE_OBJECT)
+			steps.push_back(JsonDb::Path::Step(name));
+		else
+			steps.push_back(JsonDb::Path::Step(current_value->GetSize(transaction) - 1));
+		keys.push_back(value->GetKey());
+	}
+
+	// An object or array keeps its step until it is done
+	Value::ValueTypeId type = value->GetType();
+	if(type == Value::VALUE_OBJECT || type == Value::VALUE_ARRAY)
+		return;
+
+	receiver(steps, keys, value);
+	if(step)
+	{
+		steps.pop_back();
+		keys.pop_back();
+	}
+}
+
+void Semantic_actions::untrack()
+{
+	if(!steps.empty())
+	{
+		steps.pop_back();
+		keys.pop_back();
+	}
 }
 
 std::string Semantic_actions::get_current_str()
@@ -321,7 +426,7 @@ public:
 	Semantic_actions& actions;
 };
 
-bool JsonDb_ParseJsonExpression(JsonDb::TransactionHandle &transaction, std::string const &expression, ValuePointer root)
+bool JsonDb_ParseJsonGrammar(JsonDb::TransactionHandle &transaction, std::string const &expression, ValuePointer root)
 {
 	Semantic_actions semantic_actions(transaction, root);
 	parse_info<> info = parse(expression.c_str(), Json_grammer(semantic_actions), space_p);
@@ -330,3 +435,686 @@ bool JsonDb_ParseJsonExpression(JsonDb::TransactionHandle &transaction, std::str
 	return true;
 }
 
+static bool is_number_char(int c)
+{
+	return isdigit(c) || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E';
+}
+
+// Add the number in the range to the current value, returns false if it is not a valid number. The range is
+// followed by a character which is not part of a number.
+static bool emit_number(Semantic_actions &actions, char const *begin, char const *end)
+{
+	bool real = false;
+	for(char const *i = begin; i != end; ++i)
+	{
+		if(!is_number_char(*i))
+			return false;
+		if(*i == '.' || *i == 'e' || *i == 'E')
+			real = true;
+	}
+
+	char *number_end;
+	errno = 0;
+	if(!real)
+	{
+		// Integers which do not fit are stored as real
+		long value = strtol(begin, &number_end, 10);
+		if(number_end == end && errno == 0 && value >= INT_MIN && value <= INT_MAX)
+		{
+			actions.new_int((int)value);
+			return true;
+		}
+	}
+
+	double value = strtod(begin, &number_end);
+	if(begin == end || number_end != end)
+		return false;
+
+	actions.new_real(value);
+	return true;
+}
+
+// Parses a json document read from a stream in chunks, without recursion. Only the chunk, the
+// current string and the open objects and arrays are kept in memory.
+class Json_stream_parser
+{
+public:
+	Json_stream_parser(std::istream &_input, Semantic_actions &_actions)
+		: input(_input)
+		, actions(_actions)
+		, buffer(chunk_size)
+		, position(0)
+		, end(0)
+		, offset(0)
+	{ }
+
+	// Parse the document, calls the batch function each time batch_size values were added
+	void parse(size_t batch_size, function<void ()> const &batch);
+
+	// Number of bytes read from the stream
+	size_t get_offset() const { return offset; }
+
+private:
+	enum State
+	{
+		VALUE,          // a value is expected
+		OBJECT_FIRST,   // after '{', a name or '}' is expected
+		OBJECT_NAME,    // a name is expected
+		ARRAY_FIRST,    // after '[', a value or ']' is expected
+		AFTER_VALUE,    // a ',' or the end of the object or array is expected
+		DONE
+	};
+
+	static const size_t chunk_size = 64 * 1024;
+	static const int end_of_input = -1;
+
+	// Next character without consuming it, reads the next chunk when needed
+	int peek()
+	{
+		if(position == end && !fill())
+			return end_of_input;
+
+		return (unsigned char)buffer[position];
+	}
+
+	int next()
+	{
+		int c = peek();
+		if(c != end_of_input)
+		{
+			++position;
+			++offset;
+		}
+
+		return c;
+	}
+
+	bool fill();
+	void skip_space();
+	void expect(char c);
+	void parse_string(std::string &result);
+	void parse_literal();
+	void parse_number();
+	void fail(char const *expected);
+
+	std::istream &input;
+	Semantic_actions &actions;
+
+	std::vector<char> buffer;
+	size_t position;
+	size_t end;
+	size_t offset;
+
+	// Scratch buffers for strings and numbers
+	std::string str;
+	std::string number;
+};
+
+bool Json_stream_parser::fill()
+{
+	if(!input)
+		return false;
+
+	input.read(&buffer[0], buffer.size());
+	position = 0;
+	end = input.gcount();
+	return end > 0;
+}
+
+void Json_stream_parser::skip_space()
+{
+	int c = peek();
+	while(c != end_of_input && isspace(c))
+	{
+		next();
+		c = peek();
+	}
+}
+
+void Json_stream_parser::fail(char const *expected)
+{
+	int c = peek();
+	if(c == end_of_input)
+		throw std::runtime_error((boost::format("Failed to parse json stream at offset %d: expected %s, found end of input") % offset % expected).str().c_str());
+	throw std::runtime_error((boost::format("Failed to parse json stream at offset %d: expected %s, found '%c'") % offset % expected % (char)c).str().c_str());
+}
+
+void Json_stream_parser::expect(char c)
+{
+	if(peek() != (unsigned char)c)
+		fail((boost::format("'%c'") % c).str().c_str());
+	next();
+}
+
+// Append a code point encoded as UTF-8
+static void append_utf8(std::string &result, unsigned long code)
+{
+	if(code < 0x80)
+	{
+		result += (char)code;
+	} else if(code < 0x800)
+	{
+		result += (char)(0xc0 | (code >> 6));
+		result += (char)(0x80 | (code & 0x3f));
+	} else if(code < 0x10000)
+	{
+		result += (char)(0xe0 | (code >> 12));
+		result += (char)(0x80 | ((code >> 6) & 0x3f));
+		result += (char)(0x80 | (code & 0x3f));
+	} else
+	{
+		result += (char)(0xf0 | (code >> 18));
+		result += (char)(0x80 | ((code >> 12) & 0x3f));
+		result += (char)(0x80 | ((code >> 6) & 0x3f));
+		result += (char)(0x80 | (code & 0x3f));
+	}
+}
+
+void Json_stream_parser::parse_string(std::string &result)
+{
+	result.clear();
+
+	// Strings are quoted with double or single quotes, like the expression grammar
+	int quote = next();
+	for(;;)
+	{
+		int c = next();
+		if(c == end_of_input)
+			fail("end of string");
+		if(c == quote)
+			return;
+		if(c != '\\')
+		{
+			result += (char)c;
+			continue;
+		}
+
+		c = next();
+		switch(c)
+		{
+			case 'b': result += '\b'; break;
+			case 'f': result += '\f'; break;
+			case 'n': result += '\n'; break;
+			case 'r': result += '\r'; break;
+			case 't': result += '\t'; break;
+			case 'u':
+			{
+				unsigned long code = 0;
+				for(int i = 0; i < 4; ++i)
+				{
+					int digit = next();
+					if(!isxdigit(digit))
+						fail("hexadecimal digit");
+					code = code * 16 + (isdigit(digit) ? digit - '0' : tolower(digit) - 'a' + 10);
+				}
+
+				// Combine a surrogate pair, a lone surrogate is kept as is
+				if(code >= 0xd800 && code < 0xdc00 && peek() == '\\')
+				{
+					next();
+					expect('u');
+					unsigned long low = 0;
+					for(int i = 0; i < 4; ++i)
+					{
+						int digit = next();
+						if(!isxdigit(digit))
+							fail("hexadecimal digit");
+						low = low * 16 + (isdigit(digit) ? digit - '0' : tolower(digit) - 'a' + 10);
+					}
+
+					if(low >= 0xdc00 && low < 0xe000)
+						code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+					else
+					{
+						append_utf8(result, code);
+						code = low;
+					}
+				}
+
+				append_utf8(result, code);
+				break;
+			}
+			case end_of_input:
+				fail("escape character");
+			default:
+				// Quotes, backslash and slash stand for themselves
+				result += (char)c;
+				break;
+		}
+	}
+}
+
+void Json_stream_parser::parse_literal()
+{
+	char const *literal = peek() == 't' ? "true" : peek() == 'f' ? "false" : "null";
+	for(char const *i = literal; *i != 0; ++i)
+	{
+		if(peek() != *i)
+			fail(literal);
+		next();
+	}
+
+	if(literal[0] == 'n')
+		actions.new_null();
+	else
+		actions.new_bool(literal[0] == 't');
+}
+
+void Json_stream_parser::parse_number()
+{
+	number.clear();
+
+	for(int c = peek(); c != end_of_input && is_number_char(c); c = peek())
+	{
+		number += (char)c;
+		next();
+	}
+
+	if(number.empty())
+		fail("value");
+
+	if(!emit_number(actions, number.c_str(), number.c_str() + number.size()))
+		throw std::runtime_error((boost::format("Failed to parse json stream at offset %d: invalid number '%s'") % offset % number).str().c_str());
+}
+
+void Json_stream_parser::parse(size_t batch_size, function<void ()> const &batch)
+{
+	// Open objects and arrays, by their opening character
+	std::vector<char> stack;
+	size_t batch_end = batch_size;
+
+	State state = VALUE;
+	while(state != DONE)
+	{
+		skip_space();
+
+		switch(state)
+		{
+			case VALUE:
+			{
+				int c = peek();
+				if(c == '{')
+				{
+					next();
+					actions.begin_obj('{');
+					stack.push_back('{');
+					state = OBJECT_FIRST;
+				} else if(c == '[')
+				{
+					next();
+					actions.begin_array('[');
+					stack.push_back('[');
+					state = ARRAY_FIRST;
+				} else
+				{
+					if(c == '"' || c == '\'')
+					{
+						parse_string(str);
+						actions.new_str(str);
+					} else if(c == 't' || c == 'f' || c == 'n')
+						parse_literal();
+					else
+						parse_number();
+
+					state = AFTER_VALUE;
+				}
+				break;
+			}
+
+			case OBJECT_FIRST:
+				if(peek() == '}')
+				{
+					next();
+					actions.end_obj('}');
+					stack.pop_back();
+					state = AFTER_VALUE;
+				} else
+					state = OBJECT_NAME;
+				break;
+
+			case OBJECT_NAME:
+				if(peek() != '"' && peek() != '\'')
+					fail("name");
+				parse_string(str);
+				actions.new_name(str);
+				skip_space();
+				expect(':');
+				state = VALUE;
+				break;
+
+			case ARRAY_FIRST:
+				if(peek() == ']')
+				{
+					next();
+					actions.end_array(']');
+					stack.pop_back();
+					state = AFTER_VALUE;
+				} else
+					state = VALUE;
+				break;
+
+			case AFTER_VALUE:
+				if(batch_size > 0 && actions.get_values() >= batch_end)
+				{
+					batch();
+					batch_end = actions.get_values() + batch_size;
+				}
+
+				if(stack.empty())
+				{
+					state = DONE;
+				} else if(peek() == ',')
+				{
+					next();
+					state = stack.back() == '{' ? OBJECT_NAME : VALUE;
+				} else if(stack.back() == '{')
+				{
+					expect('}');
+					actions.end_obj('}');
+					stack.pop_back();
+				} else
+				{
+					expect(']');
+					actions.end_array(']');
+					stack.pop_back();
+				}
+				break;
+
+			case DONE:
+				break;
+		}
+	}
+
+	skip_space();
+	if(peek() != end_of_input)
+		fail("end of input");
+}
+
+size_t JsonDb_ParseJsonStream(JsonDb::TransactionHandle &transaction, std::istream &input, ValuePointer root, size_t batch_size, function<void ()> const &batch,
+		Parsed_value_receiver const &receiver)
+{
+	Semantic_actions semantic_actions(transaction, root, receiver);
+	Json_stream_parser parser(input, semantic_actions);
+	parser.parse(batch_size, batch);
+	return parser.get_offset();
+}
+
+// Parses a json document in memory from its structural index, the structural characters are visited without
+// looking at the characters in between. Strings are copied at once, unless they contain escapes.
+class Json_structural_parser
+{
+public:
+	Json_structural_parser(std::string const &_expression, JsonDbStructuralIndex const &_index, Semantic_actions &_actions)
+		: expression(_expression)
+		, data(_expression.c_str())
+		, positions(_index.positions)
+		, actions(_actions)
+		, next(0)
+	{ }
+
+	void parse();
+
+private:
+	enum State
+	{
+		VALUE,
+		OBJECT_FIRST,
+		OBJECT_NAME,
+		ARRAY_FIRST,
+		AFTER_VALUE,
+		DONE
+	};
+
+	// Character at the next structural position, or 0 at the end
+	char peek() const
+	{
+		return next < positions.size() ? data[positions[next]] : 0;
+	}
+
+	void parse_string(std::string &result);
+	void parse_scalar();
+	void fail() const;
+
+	std::string const &expression;
+	char const *data;
+	std::vector<unsigned int> const &positions;
+	Semantic_actions &actions;
+
+	// Index of the next structural position
+	size_t next;
+
+	std::string str;
+};
+
+void Json_structural_parser::fail() const
+{
+	size_t offset = next < positions.size() ? positions[next] : expression.size();
+	throw std::runtime_error((boost::format("Failed to parse json expression at offset %d: '%s'") % offset % expression).str().c_str());
+}
+
+static int hex_value(char c)
+{
+	if(isdigit((unsigned char)c))
+		return c - '0';
+	if(isxdigit((unsigned char)c))
+		return tolower((unsigned char)c) - 'a' + 10;
+	return -1;
+}
+
+// Read four hexadecimal digits, returns false if they are not valid
+static bool read_hex4(char const *&i, char const *end, unsigned long &code)
+{
+	code = 0;
+	for(int digit = 0; digit < 4; ++digit, ++i)
+	{
+		if(i == end || hex_value(*i) < 0)
+			return false;
+		code = code * 16 + hex_value(*i);
+	}
+	return true;
+}
+
+void Json_structural_parser::parse_string(std::string &result)
+{
+	// The opening and closing quotes are consecutive positions
+	char const *begin = data + positions[next] + 1;
+	char const *end = data + positions[next + 1];
+	next += 2;
+
+	char const *escape = (char const *)memchr(begin, '\\', end - begin);
+	if(escape == NULL)
+	{
+		result.assign(begin, end);
+		return;
+	}
+
+	result.assign(begin, escape);
+	for(char const *i = escape; i != end; )
+	{
+		if(*i != '\\')
+		{
+			char const *next_escape = (char const *)memchr(i, '\\', end - i);
+			if(next_escape == NULL)
+				next_escape = end;
+			result.append(i, next_escape);
+			i = next_escape;
+			continue;
+		}
+
+		char c = *++i;
+		++i;
+		switch(c)
+		{
+			case 'b': result += '\b'; break;
+			case 'f': result += '\f'; break;
+			case 'n': result += '\n'; break;
+			case 'r': result += '\r'; break;
+			case 't': result += '\t'; break;
+			case 'u':
+			{
+				unsigned long code;
+				if(!read_hex4(i, end, code))
+					fail();
+
+				// Combine a surrogate pair, a lone surrogate is kept as is
+				unsigned long low;
+				char const *low_begin = i + 2;
+				if(code >= 0xd800 && code < 0xdc00 && end - i >= 6 && i[0] == '\\' && i[1] == 'u' && read_hex4(low_begin, end, low) && low >= 0xdc00 && low < 0xe000)
+				{
+					code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+					i = low_begin;
+				}
+
+				append_utf8(result, code);
+				break;
+			}
+			default:
+				// Quotes, backslash and slash stand for themselves
+				result += c;
+				break;
+		}
+	}
+}
+
+void Json_structural_parser::parse_scalar()
+{
+	// A number or literal runs up to the next space, structural character or quote
+	char const *begin = data + positions[next];
+	char const *end = begin;
+	while(*end != 0 && !isspace((unsigned char)*end) && strchr("{}[]:,\"'", *end) == NULL)
+		++end;
+
+	size_t length = end - begin;
+	if(length == 4 && memcmp(begin, "true", 4) == 0)
+		actions.new_bool(true);
+	else if(length == 5 && memcmp(begin, "false", 5) == 0)
+		actions.new_bool(false);
+	else if(length == 4 && memcmp(begin, "null", 4) == 0)
+		actions.new_null();
+	else if(!emit_number(actions, begin, end))
+		fail();
+
+	++next;
+}
+
+void Json_structural_parser::parse()
+{
+	// Open objects and arrays, by their opening character
+	std::vector<char> stack;
+
+	State state = VALUE;
+	while(state != DONE)
+	{
+		char c = peek();
+
+		switch(state)
+		{
+			case VALUE:
+				if(c == '{')
+				{
+					++next;
+					actions.begin_obj('{');
+					stack.push_back('{');
+					state = OBJECT_FIRST;
+				} else if(c == '[')
+				{
+					++next;
+					actions.begin_array('[');
+					stack.push_back('[');
+					state = ARRAY_FIRST;
+				} else if(c == '"')
+				{
+					parse_string(str);
+					actions.new_str(str);
+					state = AFTER_VALUE;
+				} else if(c != 0 && c != '}' && c != ']' && c != ':' && c != ',')
+				{
+					parse_scalar();
+					state = AFTER_VALUE;
+				} else
+					fail();
+				break;
+
+			case OBJECT_FIRST:
+				if(c == '}')
+				{
+					++next;
+					actions.end_obj('}');
+					stack.pop_back();
+					state = AFTER_VALUE;
+				} else
+					state = OBJECT_NAME;
+				break;
+
+			case OBJECT_NAME:
+				if(c != '"')
+					fail();
+				parse_string(str);
+				actions.new_name(str);
+				if(peek() != ':')
+					fail();
+				++next;
+				state = VALUE;
+				break;
+
+			case ARRAY_FIRST:
+				if(c == ']')
+				{
+					++next;
+					actions.end_array(']');
+					stack.pop_back();
+					state = AFTER_VALUE;
+				} else
+					state = VALUE;
+				break;
+
+			case AFTER_VALUE:
+				if(stack.empty())
+				{
+					state = DONE;
+				} else if(c == ',')
+				{
+					++next;
+					state = stack.back() == '{' ? OBJECT_NAME : VALUE;
+				} else if(c == (stack.back() == '{' ? '}' : ']'))
+				{
+					++next;
+					if(c == '}')
+						actions.end_obj('}');
+					else
+						actions.end_array(']');
+					stack.pop_back();
+				} else
+					fail();
+				break;
+
+			case DONE:
+				break;
+		}
+	}
+
+	if(next != positions.size())
+		fail();
+}
+
+bool JsonDb_ParseJsonExpression(JsonDb::TransactionHandle &transaction, std::string const &expression, ValuePointer root)
+{
+	JsonDbStructuralIndex index;
+	JsonDb_BuildStructuralIndex(expression.c_str(), expression.size(), index);
+
+	// Documents with single-quoted strings are parsed character by character
+	if(index.single_quotes)
+	{
+		std::istringstream input(expression);
+		JsonDb_ParseJsonStream(transaction, input, root, 0, function<void ()>());
+		return true;
+	}
+
+	if(index.unterminated)
+		throw std::runtime_error((boost::format("Failed to parse json expression, string is not terminated: '%s'") % expression).str().c_str());
+
+	Semantic_actions semantic_actions(transaction, root);
+	Json_structural_parser parser(expression, index, semantic_actions);
+	parser.parse();
+	return true;
+}
@@ -20,7 +20,24 @@
     along with JsonDb.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-// Parse the specified expression to the specified root pointer
+#include <boost/function.hpp>
+#include <iosfwd>
+#include <vector>
+
+// Receives every string, number, boolean and null added by the parser, with the steps from the root to the value and
+// the key of the element at each step
+typedef boost::function<void (JsonDb::Path::Steps const &steps, std::vector<ValueKey> const &keys, ValuePointer const &value)> Parsed_value_receiver;
+
+// Parse the specified expression to the specified root pointer, from the structural index of the expression
 bool JsonDb_ParseJsonExpression(JsonDb::TransactionHandle &transaction, std::string const &expression, ValuePointer root);
 
+// Parse the specified expression to the specified root pointer with the Spirit grammar, one character at a time
+bool JsonDb_ParseJsonGrammar(JsonDb::TransactionHandle &transaction, std::string const &expression, ValuePointer root);
+
+// Parse a json document read from the stream to the specified root pointer, the batch function is called each
+// time batch_size values were added. The values are passed to the receiver as they are added, when specified.
+// Returns the number of bytes read.
+size_t JsonDb_ParseJsonStream(JsonDb::TransactionHandle &transaction, std::istream &input, ValuePointer root, size_t batch_size, boost::function<void ()> const &batch,
+		Parsed_value_receiver const &receiver = Parsed_value_receiver());
+
 #endif
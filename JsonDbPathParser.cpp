@@ -25,6 +25,7 @@
 #include <boost/spirit/include/qi.hpp>
 #include <boost/bind.hpp>
 #include <boost/function.hpp>
+#include <boost/lexical_cast.hpp>
 
 #include <string>
 
@@ -54,29 +55,23 @@ struct JsonPathGrammar
 
 	void HandleName()
 	{
-		if(parent && child)
-		{
-			parent = child;
-			child = parent->Get(transaction, name, not_exists_resolution);
-		}
-
+		steps.push_back(JsonDb::Path::Step(name));
 		name = "";
 	}
 
 	void HandleNumber(int index)
 	{
-		if(parent && child)
-		{
-			parent = child;
-			child = parent->Get(transaction, index);
-		}
+		steps.push_back(JsonDb::Path::Step((size_t)index));
+	}
+
+	void HandleWildcard()
+	{
+		steps.push_back(JsonDb::Path::Step::Wildcard());
 	}
 
-	JsonPathGrammar(JsonDb::TransactionHandle &_transaction, ValuePointer root, NotExistsResolution _not_exists_resolution)
+	JsonPathGrammar(JsonDb::Path::Steps &_steps)
 		: JsonPathGrammar::base_type(start)
-		, parent(root), child(root)
-		, transaction(_transaction)
-		, not_exists_resolution(_not_exists_resolution)
+		, steps(_steps)
 	{
     namespace qi = boost::spirit::qi;
     namespace ascii = boost::spirit::ascii;
@@ -84,6 +79,8 @@ struct JsonPathGrammar
 
 		number = (int_) [ boost::bind(&JsonPathGrammar<Iterator>::HandleNumber, this, _1) ];
 
+		wildcard = qi::lit('*') [ boost::bind(&JsonPathGrammar<Iterator>::HandleWildcard, this) ];
+
 		name_char_no_singlequote  = 
 			((ascii::char_ - '\'' - '\\') [ boost::bind(&JsonPathGrammar<Iterator>::PushNameChar, this, _1) ] || 
 			 ('\\' >> ascii::char_[ boost::bind(&JsonPathGrammar<Iterator>::PushNameEscapeChar, this, _1) ]));
@@ -113,24 +110,18 @@ struct JsonPathGrammar
 		start = 
 			"$" >> 
 					*( 
-						('.' >> unquoted_name)|| 
+						('.' >> (wildcard || unquoted_name))|| 
 						('[' >> 
-						 ( number || single_quote_escaped_name || double_quote_escaped_name ) >> 
+						 ( wildcard || number || single_quote_escaped_name || double_quote_escaped_name ) >> 
 						 ']')
 					);
 		
 	}
 
-	JsonDb::TransactionHandle &transaction;
-	NotExistsResolution not_exists_resolution;
-
-	ValuePointer parent;
- 	ValuePointer child;
-
-	ValuePointer GetParent() { return parent; }
-	ValuePointer GetChild() { return child; }
+	JsonDb::Path::Steps &steps;
 
 	boost::spirit::qi::rule<Iterator> number;
+	boost::spirit::qi::rule<Iterator> wildcard;
 	boost::spirit::qi::rule<Iterator> unquoted_name;
 	boost::spirit::qi::rule<Iterator> alpha_char_name;
 	boost::spirit::qi::rule<Iterator> alnum_char_name;
@@ -142,28 +133,147 @@ struct JsonPathGrammar
 	boost::spirit::qi::rule<Iterator> start;
 
 	std::string name;
-	std::string current_path;
 };
 
-std::pair<ValuePointer, ValuePointer> JsonDb_ParseJsonPathExpression(JsonDb::TransactionHandle &transaction, std::string const &expression, ValuePointer root, NotExistsResolution not_exists_resolution)
+void JsonDb_CompileJsonPathExpression(std::string const &expression, JsonDb::Path::Steps &steps)
 {
-	JsonPathGrammar<std::string::const_iterator> grammar(transaction, root, not_exists_resolution);
+	JsonPathGrammar<std::string::const_iterator> grammar(steps);
 
 	std::string::const_iterator iter = expression.begin();
 	std::string::const_iterator end = expression.end();
 
-	bool result;
+	if(!parse(iter, end, grammar) || (iter != end))
+		throw std::runtime_error((boost::format("Invalid path specified: %s") % expression).str());
+}
+
+std::pair<ValuePointer, ValuePointer> JsonDb_ResolveJsonPath(JsonDb::TransactionHandle &transaction, JsonDb::Path const &path, ValuePointer root, NotExistsResolution not_exists_resolution)
+{
+	ValuePointer parent = root;
+	ValuePointer child = root;
+
+	JsonDb::Path::Steps const &steps = path.GetSteps();
+
+	// Key of every prefix of the path, the root is only cached by its key
+	std::vector<std::string> prefix_keys(steps.size());
+	std::string path_key;
+	for(size_t i = 0; i < steps.size(); ++i)
+	{
+		path.AppendKey(path_key, i);
+		prefix_keys[i] = path_key;
+	}
+
+	// Start at the longest prefix resolved before, the last step is always resolved to find the parent
+	size_t step = 0;
+	if(root->GetKey() == root_key)
+	{
+		for(size_t i = steps.size(); i > 1; --i)
+		{
+			ValueKey key = transaction->LookupPath(prefix_keys[i - 2]);
+			if(key == null_key)
+				continue;
+
+			ValuePointer element = transaction->Retrieve(key);
+			if(element)
+			{
+				child = element;
+				step = i - 1;
+				break;
+			}
+		}
+	}
+
 	try
 	{
-		result = parse(iter, end, grammar) && (iter == end);
+		for(; step < steps.size() && child; ++step)
+		{
+			JsonDb::Path::Step const &i = steps[step];
+
+			if(i.is_wildcard)
+				throw std::runtime_error("A wildcard can only be used in the path of an index");
+
+			parent = child;
+			if(i.is_index)
+				child = parent->Get(transaction, i.index);
+			else
+				child = parent->Get(transaction, i.name, not_exists_resolution);
+
+			if(child && child->GetKey() != null_key && root->GetKey() == root_key)
+				transaction->CachePath(prefix_keys[step], child->GetKey());
+		}
 	} catch(std::runtime_error &e)
 	{
-		throw std::runtime_error((boost::format("Parser error at for path: '%s', message: '%s'") % expression % e.what()).str());
+		throw std::runtime_error((boost::format("Parser error at for path: '%s', message: '%s'") % path.ToString() % e.what()).str());
 	}
 
-	if(result)
-		return std::make_pair<ValuePointer, ValuePointer>(grammar.GetParent(), grammar.GetChild());
-	else
-		throw std::runtime_error((boost::format("Invalid path specified: %s") % expression).str());
+	return std::make_pair(parent, child);
+}
+
+JsonDb::Path::Path(std::string const &expression)
+{
+	JsonDb_CompileJsonPathExpression(expression, steps);
+}
+
+JsonDb::Path::Path(char const *expression)
+{
+	JsonDb_CompileJsonPathExpression(std::string(expression), steps);
+}
+
+JsonDb::Path JsonDb::Path::operator[](std::string const &name) const
+{
+	Path result(*this);
+	result.steps.push_back(Step(name));
+	return result;
+}
+
+JsonDb::Path JsonDb::Path::operator[](size_t index) const
+{
+	Path result(*this);
+	result.steps.push_back(Step(index));
+	return result;
 }
 
+void JsonDb::Path::AppendKey(std::string &key, size_t step) const
+{
+	Step const &i = steps[step];
+	if(i.is_wildcard)
+	{
+		key += 'w';
+	} else if(i.is_index)
+	{
+		key += 'i';
+		key.append((char const *)&i.index, sizeof(i.index));
+	} else
+	{
+		size_t length = i.name.size();
+		key += 'n';
+		key.append((char const *)&length, sizeof(length));
+		key += i.name;
+	}
+}
+
+std::string JsonDb::Path::ToString() const
+{
+	std::string result = "$";
+	for(Steps::const_iterator i = steps.begin(); i != steps.end(); ++i)
+	{
+		if(i->is_wildcard)
+		{
+			result += "[*]";
+		} else if(i->is_index)
+		{
+			result += "[" + boost::lexical_cast<std::string>(i->index) + "]";
+		} else
+		{
+			// Quote the name, escaping quotes and backslashes
+			result += "['";
+			for(std::string::const_iterator c = i->name.begin(); c != i->name.end(); ++c)
+			{
+				if(*c == '\\' || *c == '\'')
+					result += '\\';
+				result += *c;
+			}
+			result += "']";
+		}
+	}
+	return result;
+}
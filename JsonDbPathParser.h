@@ -20,7 +20,10 @@
     along with JsonDb.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-// Parse the specified expression to the specified root pointer
-std::pair<ValuePointer, ValuePointer> JsonDb_ParseJsonPathExpression(JsonDb::TransactionHandle &transaction, std::string const &expression, ValuePointer root, NotExistsResolution not_exists_resolution);
+// Compile the specified expression to a list of path steps
+void JsonDb_CompileJsonPathExpression(std::string const &expression, JsonDb::Path::Steps &steps);
+
+// Resolve the compiled path starting at the specified root pointer, returns the parent and the element
+std::pair<ValuePointer, ValuePointer> JsonDb_ResolveJsonPath(JsonDb::TransactionHandle &transaction, JsonDb::Path const &path, ValuePointer root, NotExistsResolution not_exists_resolution);
 
 #endif
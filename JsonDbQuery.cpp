@@ -0,0 +1,1070 @@
+/*
+ 		Copyright (C) 2010 Wouter van Kleunen
+
+		This file is part of JsonDb.
+
+    Foobar is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Foobar is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with JsonDb.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "JsonDb.h"
+#include "JsonDbValues.h"
+#include "JsonDbTraversal.h"
+#include "JsonDbIndex.h"
+#include "JsonDbQuery.h"
+
+#include <boost/format.hpp>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+
+// Parses a query expression by recursive descent, the grammar is:
+//
+//   query       = '$' ( '.' name | '.*' | '..' name | '..*' | '..' bracket | bracket )*
+//   bracket     = '[' ( '*' | index | slice | quoted name | '?' disjunction ) ']'
+//   slice       = [ index ] ':' [ index ] [ ':' [ index ] ]
+//   disjunction = conjunction ( '||' conjunction )*
+//   conjunction = unary ( '&&' unary )*
+//   unary       = '!' unary | '(' disjunction ')' | operand [ operator operand ]
+//   operand     = '@' ( '.' name | '[' index ']' | '[' quoted name ']' )* | number | quoted string | true | false | null
+class Query_parser
+{
+public:
+	Query_parser(std::string const &_expression)
+		: expression(_expression)
+		, position(0)
+	{ }
+
+	void parse(JsonDb::Query::Steps &steps);
+
+private:
+	static const int end_of_input = -1;
+
+	int peek(size_t ahead = 0) const
+	{
+		return position + ahead < expression.size() ? (unsigned char)expression[position + ahead] : end_of_input;
+	}
+
+	// Consume the characters if they follow, returns false otherwise
+	bool accept(char const *token);
+
+	void expect(char c);
+	void skip_space();
+	void fail(char const *expected);
+
+	void parse_bracket(JsonDb::Query::Steps &steps, bool recursive);
+	bool parse_name(std::string &name);
+	void parse_string(std::string &result);
+	bool parse_integer(long &value);
+	void parse_number(ValuePointer &literal);
+
+	boost::shared_ptr<Query_filter> parse_disjunction();
+	boost::shared_ptr<Query_filter> parse_conjunction();
+	boost::shared_ptr<Query_filter> parse_unary();
+	void parse_operand(Query_operand &operand);
+	bool parse_operator(Query_filter::Operator &op);
+
+	std::string const &expression;
+	size_t position;
+};
+
+bool Query_parser::accept(char const *token)
+{
+	size_t length = strlen(token);
+	if(expression.compare(position, length, token) != 0)
+		return false;
+
+	position += length;
+	return true;
+}
+
+void Query_parser::expect(char c)
+{
+	if(peek() != (unsigned char)c)
+		fail((boost::format("'%c'") % c).str().c_str());
+	++position;
+}
+
+void Query_parser::skip_space()
+{
+	while(peek() != end_of_input && isspace(peek()))
+		++position;
+}
+
+void Query_parser::fail(char const *expected)
+{
+	throw std::runtime_error((boost::format("Invalid query '%s' at offset %d: expected %s") % expression % position % expected).str());
+}
+
+void Query_parser::parse(JsonDb::Query::Steps &steps)
+{
+	skip_space();
+	expect('$');
+
+	for(skip_space(); peek() != end_of_input; skip_space())
+	{
+		if(accept("["))
+		{
+			parse_bracket(steps, false);
+			continue;
+		}
+
+		if(!accept("."))
+			fail("'.' or '['");
+
+		bool recursive = accept(".");
+		if(recursive && accept("["))
+		{
+			parse_bracket(steps, true);
+			continue;
+		}
+
+		Query_step step(Query_step::member);
+		step.recursive = recursive;
+		if(accept("*"))
+			step.type = Query_step::wildcard;
+		else if(!parse_name(step.name))
+			fail("a member name or '*'");
+
+		steps.push_back(step);
+	}
+}
+
+void Query_parser::parse_bracket(JsonDb::Query::Steps &steps, bool recursive)
+{
+	Query_step step(Query_step::member);
+	step.recursive = recursive;
+
+	skip_space();
+	if(accept("*"))
+	{
+		step.type = Query_step::wildcard;
+	} else if(peek() == '\'' || peek() == '"')
+	{
+		parse_string(step.name);
+	} else if(accept("?"))
+	{
+		step.type = Query_step::filter;
+		step.predicate = parse_disjunction();
+	} else
+	{
+		step.has_start = parse_integer(step.start);
+		skip_space();
+		if(accept(":"))
+		{
+			step.type = Query_step::slice;
+			skip_space();
+			step.has_end = parse_integer(step.end);
+			skip_space();
+			if(accept(":"))
+			{
+				skip_space();
+				parse_integer(step.stride);
+			}
+		} else if(step.has_start)
+		{
+			step.type = Query_step::element;
+			step.index = step.start;
+		} else
+		{
+			fail("'*', an index, a slice, a quoted name or a filter");
+		}
+	}
+
+	skip_space();
+	expect(']');
+	steps.push_back(step);
+}
+
+bool Query_parser::parse_name(std::string &name)
+{
+	if(!isalpha(peek()) && peek() != '_')
+		return false;
+
+	size_t begin = position;
+	while(isalnum(peek()) || peek() == '_')
+		++position;
+
+	name.assign(expression, begin, position - begin);
+	return true;
+}
+
+void Query_parser::parse_string(std::string &result)
+{
+	char quote = (char)peek();
+	++position;
+
+	result.clear();
+	for(int c = peek(); c != quote; c = peek())
+	{
+		if(c == end_of_input)
+			fail("the end of the string");
+
+		++position;
+		if(c != '\\')
+		{
+			result += (char)c;
+			continue;
+		}
+
+		switch(peek())
+		{
+			case 'b': result += '\b'; break;
+			case 't': result += '\t'; break;
+			case 'n': result += '\n'; break;
+			case 'f': result += '\f'; break;
+			case 'r': result += '\r'; break;
+			case '"': result += '"'; break;
+			case '\'': result += '\''; break;
+			case '\\': result += '\\'; break;
+			case '/': result += '/'; break;
+			default: fail("an escape character");
+		}
+		++position;
+	}
+
+	++position;
+}
+
+bool Query_parser::parse_integer(long &value)
+{
+	size_t begin = position;
+	if(peek() == '-')
+		++position;
+
+	if(!isdigit(peek()))
+	{
+		if(position != begin)
+			fail("a digit");
+		return false;
+	}
+
+	while(isdigit(peek()))
+		++position;
+
+	errno = 0;
+	value = strtol(expression.c_str() + begin, NULL, 10);
+	if(errno != 0 || value < INT_MIN || value > INT_MAX)
+	{
+		position = begin;
+		fail("an index which fits an integer");
+	}
+
+	return true;
+}
+
+// Numbers which are integers and fit are compared as integer, other numbers as real
+void Query_parser::parse_number(ValuePointer &literal)
+{
+	size_t begin = position;
+	bool real = false;
+	if(peek() == '-')
+		++position;
+
+	for(int c = peek(); isdigit(c) || c == '.' || c == 'e' || c == 'E'; c = peek())
+	{
+		++position;
+		if(c == '.' || c == 'e' || c == 'E')
+			real = true;
+		if((c == 'e' || c == 'E') && (peek() == '+' || peek() == '-'))
+			++position;
+	}
+
+	std::string number(expression, begin, position - begin);
+	char *number_end;
+	errno = 0;
+	if(!real)
+	{
+		long value = strtol(number.c_str(), &number_end, 10);
+		if(*number_end == '\0' && errno == 0 && value >= INT_MIN && value <= INT_MAX && number_end != number.c_str())
+		{
+			literal.reset(new ValueNumberInteger(null_key, (int)value));
+			return;
+		}
+	}
+
+	double value = strtod(number.c_str(), &number_end);
+	if(number.empty() || *number_end != '\0')
+	{
+		position = begin;
+		fail("a number");
+	}
+
+	literal.reset(new ValueNumberReal(null_key, value));
+}
+
+boost::shared_ptr<Query_filter> Query_parser::parse_disjunction()
+{
+	boost::shared_ptr<Query_filter> filter = parse_conjunction();
+	for(skip_space(); accept("||"); skip_space())
+	{
+		boost::shared_ptr<Query_filter> node(new Query_filter(Query_filter::disjunction));
+		node->left = filter;
+		node->right = parse_conjunction();
+		filter = node;
+	}
+
+	return filter;
+}
+
+boost::shared_ptr<Query_filter> Query_parser::parse_conjunction()
+{
+	boost::shared_ptr<Query_filter> filter = parse_unary();
+	for(skip_space(); accept("&&"); skip_space())
+	{
+		boost::shared_ptr<Query_filter> node(new Query_filter(Query_filter::conjunction));
+		node->left = filter;
+		node->right = parse_unary();
+		filter = node;
+	}
+
+	return filter;
+}
+
+boost::shared_ptr<Query_filter> Query_parser::parse_unary()
+{
+	skip_space();
+	if(peek() == '!' && peek(1) != '=')
+	{
+		++position;
+		boost::shared_ptr<Query_filter> node(new Query_filter(Query_filter::negation));
+		node->left = parse_unary();
+		return node;
+	}
+
+	if(accept("("))
+	{
+		boost::shared_ptr<Query_filter> filter = parse_disjunction();
+		skip_space();
+		expect(')');
+		return filter;
+	}
+
+	boost::shared_ptr<Query_filter> node(new Query_filter(Query_filter::comparison));
+	parse_operand(node->first);
+
+	skip_space();
+	if(!parse_operator(node->op))
+	{
+		if(!node->first.relative)
+			fail("a comparison operator");
+
+		node->type = Query_filter::test;
+		return node;
+	}
+
+	skip_space();
+	parse_operand(node->second);
+	return node;
+}
+
+void Query_parser::parse_operand(Query_operand &operand)
+{
+	if(accept("@"))
+	{
+		operand.relative = true;
+		for(;;)
+		{
+			if(accept("."))
+			{
+				std::string name;
+				if(!parse_name(name))
+					fail("a member name");
+				operand.path = operand.path[name];
+			} else if(accept("["))
+			{
+				skip_space();
+				long index;
+				if(peek() == '\'' || peek() == '"')
+				{
+					std::string name;
+					parse_string(name);
+					operand.path = operand.path[name];
+				} else if(parse_integer(index) && index >= 0)
+				{
+					operand.path = operand.path[(size_t)index];
+				} else
+				{
+					fail("a quoted name or an index which is not negative");
+				}
+
+				skip_space();
+				expect(']');
+			} else
+			{
+				return;
+			}
+		}
+	}
+
+	if(peek() == '\'' || peek() == '"')
+	{
+		std::string value;
+		parse_string(value);
+		operand.literal.reset(new ValueString(null_key, value));
+		return;
+	}
+
+	if(peek() == '-' || isdigit(peek()))
+	{
+		parse_number(operand.literal);
+		return;
+	}
+
+	size_t begin = position;
+	std::string name;
+	parse_name(name);
+	if(name == "true" || name == "false")
+	{
+		operand.literal.reset(new ValueNumberBoolean(null_key, name == "true"));
+	} else if(name == "null")
+	{
+		operand.literal.reset(new ValueNull(null_key));
+	} else
+	{
+		position = begin;
+		fail("'@', a number, a string, true, false or null");
+	}
+}
+
+bool Query_parser::parse_operator(Query_filter::Operator &op)
+{
+	if(accept("=="))
+		op = Query_filter::equal;
+	else if(accept("!="))
+		op = Query_filter::not_equal;
+	else if(accept("<="))
+		op = Query_filter::less_equal;
+	else if(accept(">="))
+		op = Query_filter::greater_equal;
+	else if(accept("<"))
+		op = Query_filter::less;
+	else if(accept(">"))
+		op = Query_filter::greater;
+	else
+		return false;
+
+	return true;
+}
+
+void JsonDb_CompileQuery(std::string const &expression, JsonDb::Query::Steps &steps)
+{
+	Query_parser(expression).parse(steps);
+}
+
+JsonDb::Query::Query(std::string const &_expression)
+	: expression(_expression)
+	, steps(new Steps())
+{
+	JsonDb_CompileQuery(expression, *steps);
+}
+
+JsonDb::Query::Query(char const *_expression)
+	: expression(_expression)
+	, steps(new Steps())
+{
+	JsonDb_CompileQuery(expression, *steps);
+}
+
+static bool IsContainer(ValuePointer const &value)
+{
+	return value->GetType() == Value::VALUE_OBJECT || value->GetType() == Value::VALUE_ARRAY;
+}
+
+static bool IsNumber(Value const &value)
+{
+	return value.GetType() == Value::VALUE_NUMBER_INTEGER || value.GetType() == Value::VALUE_NUMBER_REAL;
+}
+
+static double GetNumber(Value const &value)
+{
+	return value.GetType() == Value::VALUE_NUMBER_INTEGER ? (double)value.GetValueInt() : value.GetValueReal();
+}
+
+// Path to the member or element of the element at the path
+static JsonDb::Path Child(JsonDb::Path const &path, JsonDb::Path::Step const &position)
+{
+	return position.is_index ? path[position.index] : path[position.name];
+}
+
+static bool SameStep(JsonDb::Path::Step const &a, JsonDb::Path::Step const &b)
+{
+	if(a.is_index != b.is_index || a.is_wildcard != b.is_wildcard)
+		return false;
+
+	return a.is_index ? a.index == b.index : a.name == b.name;
+}
+
+// Elements are ordered by index, members by name as they are stored
+static bool StepLess(JsonDb::Path::Step const &a, JsonDb::Path::Step const &b)
+{
+	if(a.is_index != b.is_index)
+		return a.is_index;
+
+	return a.is_index ? a.index < b.index : a.name < b.name;
+}
+
+// The elements of a slice are the indexes from upper down to lower with a negative stride, or from lower up to
+// upper otherwise, upper or lower itself excluded
+static void GetSliceBounds(Query_step const &step, long size, long &lower, long &upper)
+{
+	long start = step.start < 0 ? step.start + size : step.start;
+	long end = step.end < 0 ? step.end + size : step.end;
+	if(step.stride >= 0)
+	{
+		lower = step.has_start ? std::min(std::max(start, 0L), size) : 0;
+		upper = step.has_end ? std::min(std::max(end, 0L), size) : size;
+	} else
+	{
+		upper = step.has_start ? std::min(std::max(start, -1L), size - 1) : size - 1;
+		lower = step.has_end ? std::min(std::max(end, -1L), size - 1) : -1;
+	}
+}
+
+static bool InSlice(Query_step const &step, long size, long index)
+{
+	long lower, upper;
+	GetSliceBounds(step, size, lower, upper);
+	if(step.stride > 0)
+		return index >= lower && index < upper && (index - lower) % step.stride == 0;
+	if(step.stride < 0)
+		return index > lower && index <= upper && (upper - index) % -step.stride == 0;
+	return false;
+}
+
+// The value of an operand for the element, NULL if the path of the operand does not exist
+static ValuePointer Resolve(JsonDb::TransactionHandle &transaction, Query_operand const &operand, ValuePointer const &element)
+{
+	if(!operand.relative)
+		return operand.literal;
+
+	ValuePointer value = element;
+	JsonDb::Path::Steps const &steps = operand.path.GetSteps();
+	for(JsonDb::Path::Steps::const_iterator i = steps.begin(); i != steps.end() && value != NULL; ++i)
+	{
+		if(i->is_index)
+			value = value->GetType() == Value::VALUE_ARRAY && i->index < value->GetSize(transaction) ? value->Get(transaction, i->index) : ValuePointer();
+		else
+			value = value->GetType() == Value::VALUE_OBJECT ? value->Get(transaction, i->name, return_null) : ValuePointer();
+	}
+
+	return value;
+}
+
+// Numbers are equal by value whether integer or real, objects and arrays are never equal. Two values which do
+// not exist are equal.
+static bool Equal(ValuePointer const &a, ValuePointer const &b)
+{
+	if(a == NULL || b == NULL)
+		return a == b;
+
+	if(IsNumber(*a) && IsNumber(*b))
+	{
+		if(a->GetType() == Value::VALUE_NUMBER_INTEGER && b->GetType() == Value::VALUE_NUMBER_INTEGER)
+			return a->GetValueInt() == b->GetValueInt();
+		return GetNumber(*a) == GetNumber(*b);
+	}
+
+	if(a->GetType() != b->GetType())
+		return false;
+
+	switch(a->GetType())
+	{
+	case Value::VALUE_STRING:
+		return a->GetValueString() == b->GetValueString();
+	case Value::VALUE_NUMBER_BOOL:
+		return a->GetValueBoolean() == b->GetValueBoolean();
+	case Value::VALUE_NULL:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Only numbers and strings are ordered
+static bool Less(ValuePointer const &a, ValuePointer const &b)
+{
+	if(a == NULL || b == NULL)
+		return false;
+
+	if(IsNumber(*a) && IsNumber(*b))
+	{
+		if(a->GetType() == Value::VALUE_NUMBER_INTEGER && b->GetType() == Value::VALUE_NUMBER_INTEGER)
+			return a->GetValueInt() < b->GetValueInt();
+		return GetNumber(*a) < GetNumber(*b);
+	}
+
+	if(a->GetType() == Value::VALUE_STRING && b->GetType() == Value::VALUE_STRING)
+		return a->GetValueString() < b->GetValueString();
+
+	return false;
+}
+
+// Evaluate the predicate on a decoded member or element
+static bool Evaluate(JsonDb::TransactionHandle &transaction, Query_filter const &filter, ValuePointer const &element)
+{
+	switch(filter.type)
+	{
+	case Query_filter::disjunction:
+		return Evaluate(transaction, *filter.left, element) || Evaluate(transaction, *filter.right, element);
+
+	case Query_filter::conjunction:
+		return Evaluate(transaction, *filter.left, element) && Evaluate(transaction, *filter.right, element);
+
+	case Query_filter::negation:
+		return !Evaluate(transaction, *filter.left, element);
+
+	case Query_filter::test:
+	{
+		ValuePointer value = Resolve(transaction, filter.first, element);
+		if(value == NULL || value->GetType() == Value::VALUE_NULL)
+			return false;
+		return value->GetType() != Value::VALUE_NUMBER_BOOL || value->GetValueBoolean();
+	}
+
+	case Query_filter::comparison:
+	default:
+	{
+		ValuePointer first = Resolve(transaction, filter.first, element);
+		ValuePointer second = Resolve(transaction, filter.second, element);
+		switch(filter.op)
+		{
+		case Query_filter::equal: return Equal(first, second);
+		case Query_filter::not_equal: return !Equal(first, second);
+		case Query_filter::less: return Less(first, second);
+		case Query_filter::less_equal: return Less(first, second) || Equal(first, second);
+		case Query_filter::greater: return Less(second, first);
+		case Query_filter::greater_equal:
+		default: return Less(second, first) || Equal(first, second);
+		}
+	}
+	}
+}
+
+// Collect the comparisons for equality which must hold for the predicate to hold
+static void CollectEqualities(Query_filter const &filter, std::vector<Query_filter const *> &equalities)
+{
+	if(filter.type == Query_filter::conjunction)
+	{
+		CollectEqualities(*filter.left, equalities);
+		CollectEqualities(*filter.right, equalities);
+	} else if(filter.type == Query_filter::comparison && filter.op == Query_filter::equal)
+	{
+		equalities.push_back(&filter);
+	}
+}
+
+// True if the index path is the path of the filtered element, a wildcard, and the path of the compared member.
+// The wildcard steps of the index match any member or element of the filtered element path.
+static bool Covers(JsonDb::Path const &index, JsonDb::Path const &path, JsonDb::Path const &member)
+{
+	JsonDb::Path::Steps const &index_steps = index.GetSteps();
+	JsonDb::Path::Steps const &path_steps = path.GetSteps();
+	JsonDb::Path::Steps const &member_steps = member.GetSteps();
+	if(index_steps.size() != path_steps.size() + 1 + member_steps.size())
+		return false;
+
+	for(size_t i = 0; i < path_steps.size(); ++i)
+		if(!index_steps[i].is_wildcard && !SameStep(index_steps[i], path_steps[i]))
+			return false;
+
+	if(!index_steps[path_steps.size()].is_wildcard)
+		return false;
+
+	for(size_t i = 0; i < member_steps.size(); ++i)
+		if(!SameStep(index_steps[path_steps.size() + 1 + i], member_steps[i]))
+			return false;
+
+	return true;
+}
+
+// Evaluates the steps of a query, and passes the matches to the receiver
+class Query_runner
+{
+public:
+	Query_runner(JsonDb::TransactionHandle &_transaction, JsonDb::Query::Steps const &_steps, JsonDb::QueryReceiver const &_receiver)
+		: transaction(_transaction)
+		, steps(_steps)
+		, receiver(_receiver)
+		, matches(0)
+		, stopped(false)
+	{ }
+
+	// Apply the steps from the specified step on to the element at the path
+	void apply(ValuePointer const &value, JsonDb::Path const &path, size_t step);
+
+	// True if the member or element at the position of the parent is selected by the step
+	bool selects(size_t step, ValuePointer const &parent, JsonDb::Path::Step const &position, ValuePointer const &value);
+
+	size_t get_matches() const { return matches; }
+	bool is_stopped() const { return stopped; }
+
+private:
+	// Apply a step to the members or elements of the element
+	void select(ValuePointer const &value, JsonDb::Path const &path, size_t step);
+
+	// Apply a step to every stride element from lower up to upper, the elements are read in batches
+	void select_elements(ValuePointer const &value, JsonDb::Path const &path, size_t step, size_t lower, size_t upper, size_t stride);
+
+	// Apply a step to all members, the members are read in batches
+	void select_members(ValuePointer const &value, JsonDb::Path const &path, size_t step);
+
+	// Apply a step to a batch of members or elements
+	void select_batch(ValueArray::Type const &keys, std::vector<JsonDb::Path::Step> const &positions, JsonDb::Path const &path, size_t step);
+
+	// Apply a filter step to the members or elements found in an index, returns false if no index covers the filter
+	bool select_indexed(ValuePointer const &value, JsonDb::Path const &path, size_t step);
+
+	// Apply a recursive step to the element and all elements below it
+	void descend(ValuePointer const &value, JsonDb::Path const &path, size_t step);
+
+	JsonDb::TransactionHandle &transaction;
+	JsonDb::Query::Steps const &steps;
+	JsonDb::QueryReceiver const &receiver;
+
+	size_t matches;
+
+	// True when the receiver stopped the query
+	bool stopped;
+};
+
+// Visits the elements below the element matched before a recursive step, and applies the step to each of them.
+// The path of the visited element is kept for every object and array being visited.
+class Query_descendants
+	: public Json_visitor
+{
+public:
+	Query_descendants(Query_runner &_runner, JsonDb::Path const &_path, size_t _step)
+		: runner(_runner)
+		, path(_path)
+		, step(_step)
+	{ }
+
+	bool enter(ValuePointer const &parent, std::string const &name, ValuePointer const &value)
+	{
+		if(parent == NULL)
+		{
+			if(IsContainer(value))
+				frames.push_back(Frame(path));
+			return true;
+		}
+
+		Frame &frame = frames.back();
+		JsonDb::Path::Step position = parent->GetType() == Value::VALUE_ARRAY ? JsonDb::Path::Step(frame.next++) : JsonDb::Path::Step(name);
+		JsonDb::Path child = Child(frame.path, position);
+
+		if(runner.selects(step, parent, position, value))
+			runner.apply(value, child, step + 1);
+
+		if(IsContainer(value))
+			frames.push_back(Frame(child));
+		return true;
+	}
+
+	void leave(ValuePointer const &value)
+	{
+		frames.pop_back();
+	}
+
+	bool done() const
+	{
+		return runner.is_stopped();
+	}
+
+private:
+	struct Frame
+	{
+		Frame(JsonDb::Path const &_path)
+			: path(_path), next(0)
+		{ }
+
+		JsonDb::Path path;
+
+		// Index of the next element of an array
+		size_t next;
+	};
+
+	Query_runner &runner;
+	JsonDb::Path path;
+	size_t step;
+	std::vector<Frame> frames;
+};
+
+void Query_runner::apply(ValuePointer const &value, JsonDb::Path const &path, size_t step)
+{
+	if(stopped)
+		return;
+
+	if(step == steps.size())
+	{
+		++matches;
+		if(!receiver(path, value))
+			stopped = true;
+		return;
+	}
+
+	if(steps[step].recursive)
+		descend(value, path, step);
+	else
+		select(value, path, step);
+}
+
+bool Query_runner::selects(size_t step, ValuePointer const &parent, JsonDb::Path::Step const &position, ValuePointer const &value)
+{
+	Query_step const &current = steps[step];
+	switch(current.type)
+	{
+	case Query_step::member:
+		return !position.is_index && position.name == current.name;
+
+	case Query_step::wildcard:
+		return true;
+
+	case Query_step::element:
+	{
+		long size = position.is_index ? parent->GetSize(transaction) : 0;
+		return position.is_index && (current.index < 0 ? current.index + size : current.index) == (long)position.index;
+	}
+
+	case Query_step::slice:
+		return position.is_index && InSlice(current, parent->GetSize(transaction), position.index);
+
+	case Query_step::filter:
+	default:
+		return Evaluate(transaction, *current.predicate, value);
+	}
+}
+
+void Query_runner::select(ValuePointer const &value, JsonDb::Path const &path, size_t step)
+{
+	Query_step const &current = steps[step];
+	Value::ValueTypeId type = value->GetType();
+	if(type == Value::VALUE_OBJECT)
+	{
+		if(current.type == Query_step::member)
+		{
+			ValuePointer member = value->Get(transaction, current.name, return_null);
+			if(member != NULL)
+				apply(member, path[current.name], step + 1);
+		} else if(current.type == Query_step::wildcard || (current.type == Query_step::filter && !select_indexed(value, path, step)))
+		{
+			select_members(value, path, step);
+		}
+	} else if(type == Value::VALUE_ARRAY)
+	{
+		long size = value->GetSize(transaction);
+		switch(current.type)
+		{
+		case Query_step::element:
+		{
+			long index = current.index < 0 ? current.index + size : current.index;
+			if(index >= 0 && index < size)
+				apply(value->Get(transaction, index), path[(size_t)index], step + 1);
+			break;
+		}
+
+		case Query_step::slice:
+		{
+			long lower, upper;
+			GetSliceBounds(current, size, lower, upper);
+			if(current.stride > 0)
+			{
+				select_elements(value, path, step, lower, upper, current.stride);
+			} else if(current.stride < 0)
+			{
+				// Reverse slices are read one element at a time
+				for(long i = upper; i > lower && !stopped; i += current.stride)
+					apply(value->Get(transaction, i), path[(size_t)i], step + 1);
+			}
+			break;
+		}
+
+		case Query_step::wildcard:
+			select_elements(value, path, step, 0, size, 1);
+			break;
+
+		case Query_step::filter:
+			if(!select_indexed(value, path, step))
+				select_elements(value, path, step, 0, size, 1);
+			break;
+
+		default:
+			break;
+		}
+	}
+}
+
+void Query_runner::select_elements(ValuePointer const &value, JsonDb::Path const &path, size_t step, size_t lower, size_t upper, size_t stride)
+{
+	ValueArray::Type elements;
+	ValueArray::Type keys;
+	std::vector<JsonDb::Path::Step> positions;
+
+	size_t index = lower;
+	while(!stopped && index < upper)
+	{
+		size_t first = index;
+		if(!static_cast<ValueArray const &>(*value).NextElements(transaction, index, elements))
+			break;
+
+		keys.clear();
+		positions.clear();
+		for(size_t i = 0; i < elements.size() && first + i < upper; ++i)
+		{
+			if((first + i - lower) % stride != 0)
+				continue;
+
+			keys.push_back(elements[i]);
+			positions.push_back(JsonDb::Path::Step(first + i));
+		}
+
+		select_batch(keys, positions, path, step);
+	}
+}
+
+void Query_runner::select_members(ValuePointer const &value, JsonDb::Path const &path, size_t step)
+{
+	ValueObject::Type members;
+	ValueArray::Type keys;
+	std::vector<JsonDb::Path::Step> positions;
+
+	std::string from;
+	while(!stopped && static_cast<ValueObject const &>(*value).NextMembers(transaction, from, members))
+	{
+		keys.clear();
+		positions.clear();
+		for(ValueObject::Type::const_iterator i = members.begin(); i != members.end(); ++i)
+		{
+			keys.push_back(i->second);
+			positions.push_back(JsonDb::Path::Step(i->first));
+		}
+
+		select_batch(keys, positions, path, step);
+	}
+}
+
+void Query_runner::select_batch(ValueArray::Type const &keys, std::vector<JsonDb::Path::Step> const &positions, JsonDb::Path const &path, size_t step)
+{
+	// Records are decoded as the filter tests them, the batch is kept while the matches are processed
+	JsonDb::Transaction::RecordBatch batch;
+	transaction->ReadBatch(keys, batch);
+
+	Query_filter const *predicate = steps[step].type == Query_step::filter ? steps[step].predicate.get() : NULL;
+	for(size_t i = 0; i < keys.size() && !stopped; ++i)
+	{
+		ValuePointer element = transaction->Retrieve(keys[i], batch);
+		if(element == NULL)
+			throw std::runtime_error((boost::format("Element %d is missing from the database") % keys[i]).str());
+
+		if(predicate == NULL || Evaluate(transaction, *predicate, element))
+			apply(element, Child(path, positions[i]), step + 1);
+	}
+}
+
+bool Query_runner::select_indexed(ValuePointer const &value, JsonDb::Path const &path, size_t step)
+{
+	JsonDb::Transaction::Indexes const &indexes = transaction->GetIndexes();
+	if(indexes.empty())
+		return false;
+
+	Query_filter const &predicate = *steps[step].predicate;
+	std::vector<Query_filter const *> equalities;
+	CollectEqualities(predicate, equalities);
+
+	for(std::vector<Query_filter const *>::const_iterator i = equalities.begin(); i != equalities.end(); ++i)
+	{
+		Query_operand const &member = (*i)->first.relative ? (*i)->first : (*i)->second;
+		Query_operand const &literal = (*i)->first.relative ? (*i)->second : (*i)->first;
+		if(!member.relative || literal.relative)
+			continue;
+
+		// Numbers are equal to integers and reals with the same value, which are stored as different entries
+		std::vector<ValuePointer> values;
+		Value::ValueTypeId type = literal.literal->GetType();
+		if(type == Value::VALUE_NUMBER_INTEGER)
+		{
+			values.push_back(literal.literal);
+			values.push_back(ValuePointer(new ValueNumberReal(null_key, literal.literal->GetValueInt())));
+		} else if(type == Value::VALUE_NUMBER_REAL)
+		{
+			double number = literal.literal->GetValueReal();
+			values.push_back(literal.literal);
+			if(number >= INT_MIN && number <= INT_MAX && number == (double)(int)number)
+				values.push_back(ValuePointer(new ValueNumberInteger(null_key, (int)number)));
+		} else if(type == Value::VALUE_STRING || type == Value::VALUE_NUMBER_BOOL)
+		{
+			values.push_back(literal.literal);
+		} else
+		{
+			continue;
+		}
+
+		for(JsonDb::Transaction::Indexes::const_iterator index = indexes.begin(); index != indexes.end(); ++index)
+		{
+			if(!Covers(index->path, path, member.path))
+				continue;
+
+			// The members or elements of this element with the value, in the order they are stored
+			size_t depth = path.GetSteps().size();
+			// An ordered index has a single entry for a number, whether integer or real
+			size_t lookups = index->ordered ? 1 : values.size();
+			std::vector<JsonDb::Path::Step> positions;
+			for(std::vector<ValuePointer>::const_iterator v = values.begin(); v != values.begin() + lookups; ++v)
+			{
+				std::vector<JsonDb::Path> found = JsonDb_LookupIndex(transaction, index->name, *v);
+				for(std::vector<JsonDb::Path>::const_iterator p = found.begin(); p != found.end(); ++p)
+				{
+					JsonDb::Path::Steps const &found_steps = p->GetSteps();
+					if(std::equal(path.GetSteps().begin(), path.GetSteps().end(), found_steps.begin(), &SameStep))
+						positions.push_back(found_steps[depth]);
+				}
+			}
+
+			std::sort(positions.begin(), positions.end(), &StepLess);
+			positions.erase(std::unique(positions.begin(), positions.end(), &SameStep), positions.end());
+
+			// The other conditions of the filter are evaluated on the members or elements found
+			bool array = value->GetType() == Value::VALUE_ARRAY;
+			for(std::vector<JsonDb::Path::Step>::const_iterator p = positions.begin(); p != positions.end() && !stopped; ++p)
+			{
+				if(p->is_index != array)
+					continue;
+
+				ValuePointer element = array ? value->Get(transaction, p->index) : value->Get(transaction, p->name, return_null);
+				if(element != NULL && Evaluate(transaction, predicate, element))
+					apply(element, Child(path, *p), step + 1);
+			}
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void Query_runner::descend(ValuePointer const &value, JsonDb::Path const &path, size_t step)
+{
+	Query_descendants visitor(*this, path, step);
+	JsonDb_Traverse(transaction, value, visitor);
+}
+
+size_t JsonDb_Select(JsonDb::TransactionHandle &transaction, JsonDb::Query const &query, JsonDb::QueryReceiver const &receiver)
+{
+	Query_runner runner(transaction, query.GetSteps(), receiver);
+	runner.apply(transaction->GetRoot(), JsonDb::Path(), 0);
+	return runner.get_matches();
+}
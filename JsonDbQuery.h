@@ -0,0 +1,115 @@
+#ifndef __json_db_query_h__
+#define __json_db_query_h__
+
+/*
+ 		Copyright (C) 2010 Wouter van Kleunen
+
+		This file is part of JsonDb.
+
+    Foobar is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Foobar is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with JsonDb.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string>
+
+struct Query_filter;
+
+// Step of a query, selecting members or elements of the elements matched by the steps before it
+struct Query_step
+{
+	enum Type
+	{
+		member,     // the member with the name, .name or ['name']
+		element,    // the element at the index, [n]
+		wildcard,   // every member or element, .* or [*]
+		slice,      // the elements from start up to end, every stride elements, [start:end:stride]
+		filter      // the members or elements for which the predicate holds, [?(predicate)]
+	};
+
+	Query_step(Type _type)
+		: type(_type), recursive(false), index(0), start(0), end(0), stride(1), has_start(false), has_end(false)
+	{ }
+
+	Type type;
+
+	// True if the step also selects from every element below the matched element, written as ..
+	bool recursive;
+
+	std::string name;
+
+	// Index of an element, or the start and end of a slice. Negative indexes count from the end of the array.
+	long index;
+	long start;
+	long end;
+	long stride;
+	bool has_start;
+	bool has_end;
+
+	boost::shared_ptr<Query_filter> predicate;
+};
+
+// Operand of a comparison, either a path relative to the tested element or a literal value
+struct Query_operand
+{
+	Query_operand()
+		: relative(false)
+	{ }
+
+	bool relative;
+	JsonDb::Path path;
+	ValuePointer literal;
+};
+
+// Predicate of a filter step
+struct Query_filter
+{
+	enum Type
+	{
+		disjunction,    // left || right
+		conjunction,    // left && right
+		negation,       // !left
+		comparison,     // first op second
+		test            // first exists and is not false or null
+	};
+
+	enum Operator
+	{
+		equal,
+		not_equal,
+		less,
+		less_equal,
+		greater,
+		greater_equal
+	};
+
+	Query_filter(Type _type)
+		: type(_type), op(equal)
+	{ }
+
+	Type type;
+	Operator op;
+
+	boost::shared_ptr<Query_filter> left;
+	boost::shared_ptr<Query_filter> right;
+
+	Query_operand first;
+	Query_operand second;
+};
+
+// Compile the specified query expression to a list of query steps
+void JsonDb_CompileQuery(std::string const &expression, JsonDb::Query::Steps &steps);
+
+// Pass the elements matching the query to the receiver, returns the number of matches
+size_t JsonDb_Select(JsonDb::TransactionHandle &transaction, JsonDb::Query const &query, JsonDb::QueryReceiver const &receiver);
+
+#endif
@@ -0,0 +1,89 @@
+/*
+ 		Copyright (C) 2010 Wouter van Kleunen
+
+		This file is part of JsonDb.
+
+    Foobar is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Foobar is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with JsonDb.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "JsonDb.h"
+#include "JsonDbValues.h"
+#include "JsonDbReclaimer.h"
+
+#include <vector>
+
+// Remove at most max_elements members of an object or array, the last elements of an array are removed first so
+// the other elements do not move. Returns the number of members removed.
+static size_t RemoveMembers(JsonDb::TransactionHandle &transaction, ValuePointer const &value, size_t max_elements)
+{
+	size_t removed = 0;
+	if(value->GetType() == Value::VALUE_OBJECT)
+	{
+		ValueObject &object = static_cast<ValueObject &>(*value);
+
+		std::vector<std::string> names;
+		ValueObject::Type members;
+		while(removed < max_elements)
+		{
+			std::string from;
+			if(!object.NextMembers(transaction, from, members))
+				break;
+
+			names.clear();
+			for(ValueObject::Type::const_iterator i = members.begin(); i != members.end() && names.size() < max_elements - removed; ++i)
+				names.push_back(i->first);
+
+			for(std::vector<std::string>::const_iterator i = names.begin(); i != names.end(); ++i)
+				object.Delete(transaction, *i);
+
+			removed += names.size();
+		}
+	} else if(value->GetType() == Value::VALUE_ARRAY)
+	{
+		for(size_t size = value->GetSize(transaction); size > 0 && removed < max_elements; --size, ++removed)
+			value->Delete(transaction, size - 1);
+	}
+
+	return removed;
+}
+
+size_t JsonDb_Reclaim(JsonDb::TransactionHandle &transaction, size_t max_elements)
+{
+	size_t removed = 0;
+
+	std::string from;
+	std::vector<ValueKey> keys;
+	while(removed < max_elements && transaction->NextGarbage(from, keys))
+	{
+		for(std::vector<ValueKey>::const_iterator i = keys.begin(); i != keys.end() && removed < max_elements; ++i)
+		{
+			ValuePointer value = transaction->Retrieve(*i);
+			if(value != NULL)
+			{
+				removed += RemoveMembers(transaction, value, max_elements - removed);
+
+				// The element is deleted when all its members are removed, in a later batch if need be
+				if(removed == max_elements || ((value->GetType() == Value::VALUE_OBJECT || value->GetType() == Value::VALUE_ARRAY) && value->GetSize(transaction) > 0))
+					break;
+
+				value->Delete(transaction);
+				++removed;
+			}
+
+			transaction->RemoveGarbage(*i);
+		}
+	}
+
+	return removed;
+}
@@ -0,0 +1,28 @@
+#ifndef __json_db_reclaimer_h__
+#define __json_db_reclaimer_h__
+
+/*
+ 		Copyright (C) 2010 Wouter van Kleunen
+
+		This file is part of JsonDb.
+
+    Foobar is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Foobar is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with JsonDb.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Delete elements queued in the garbage list, at most max_elements members of the queued objects and arrays are
+// removed. Members which are objects or arrays with members themselves are queued when the transaction defers
+// deletes. Returns the number of elements removed.
+size_t JsonDb_Reclaim(JsonDb::TransactionHandle &transaction, size_t max_elements);
+
+#endif
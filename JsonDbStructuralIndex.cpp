@@ -0,0 +1,301 @@
+/*
+ 		Copyright (C) 2010 Wouter van Kleunen
+
+		This file is part of JsonDb.
+
+    Foobar is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Foobar is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with JsonDb.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "JsonDbStructuralIndex.h"
+
+#include <boost/cstdint.hpp>
+#include <boost/format.hpp>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+
+// The vectorized indexers are compiled for their instruction set and selected at runtime
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define JSON_DB_X86_INDEXERS
+#include <immintrin.h>
+#endif
+
+using boost::uint64_t;
+
+// The document is classified in blocks of 64 bytes, one bit per byte
+static const size_t block_size = 64;
+
+// Number of blocks classified at once
+static const size_t batch_blocks = 64;
+
+// Bit masks of the characters of a block
+struct BlockMasks
+{
+	uint64_t quote;
+	uint64_t backslash;
+	uint64_t single_quote;
+	uint64_t structural;
+	uint64_t space;
+};
+
+typedef void (*ClassifyFunction)(char const *data, size_t blocks, BlockMasks *masks);
+
+static void ClassifyScalar(char const *data, size_t blocks, BlockMasks *masks)
+{
+	for(size_t block = 0; block < blocks; ++block, data += block_size)
+	{
+		BlockMasks &mask = masks[block];
+		memset(&mask, 0, sizeof(mask));
+
+		for(size_t i = 0; i < block_size; ++i)
+		{
+			uint64_t bit = (uint64_t)1 << i;
+			switch(data[i])
+			{
+				case '"': mask.quote |= bit; break;
+				case '\\': mask.backslash |= bit; break;
+				case '\'': mask.single_quote |= bit; break;
+				case '{': case '}': case '[': case ']': case ':': case ',': mask.structural |= bit; break;
+				case ' ': case '\t': case '\n': case '\r': mask.space |= bit; break;
+			}
+		}
+	}
+}
+
+#ifdef JSON_DB_X86_INDEXERS
+
+__attribute__((target("sse2")))
+static uint64_t MatchSse2(__m128i const *chunks, char c)
+{
+	__m128i pattern = _mm_set1_epi8(c);
+	uint64_t result = 0;
+	for(int i = 0; i < 4; ++i)
+		result |= (uint64_t)(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(chunks[i], pattern)) << (i * 16);
+	return result;
+}
+
+__attribute__((target("sse2")))
+static void ClassifySse2(char const *data, size_t blocks, BlockMasks *masks)
+{
+	for(size_t block = 0; block < blocks; ++block, data += block_size)
+	{
+		__m128i chunks[4];
+		for(int i = 0; i < 4; ++i)
+			chunks[i] = _mm_loadu_si128((__m128i const *)(data + i * 16));
+
+		BlockMasks &mask = masks[block];
+		mask.quote = MatchSse2(chunks, '"');
+		mask.backslash = MatchSse2(chunks, '\\');
+		mask.single_quote = MatchSse2(chunks, '\'');
+		mask.structural = MatchSse2(chunks, '{') | MatchSse2(chunks, '}') | MatchSse2(chunks, '[') | MatchSse2(chunks, ']') | MatchSse2(chunks, ':') | MatchSse2(chunks, ',');
+		mask.space = MatchSse2(chunks, ' ') | MatchSse2(chunks, '\t') | MatchSse2(chunks, '\n') | MatchSse2(chunks, '\r');
+	}
+}
+
+__attribute__((target("avx2")))
+static uint64_t MatchAvx2(__m256i low, __m256i high, char c)
+{
+	__m256i pattern = _mm256_set1_epi8(c);
+	uint64_t result = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(low, pattern));
+	return result | (uint64_t)(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(high, pattern)) << 32;
+}
+
+__attribute__((target("avx2")))
+static void ClassifyAvx2(char const *data, size_t blocks, BlockMasks *masks)
+{
+	for(size_t block = 0; block < blocks; ++block, data += block_size)
+	{
+		__m256i low = _mm256_loadu_si256((__m256i const *)data);
+		__m256i high = _mm256_loadu_si256((__m256i const *)(data + 32));
+
+		BlockMasks &mask = masks[block];
+		mask.quote = MatchAvx2(low, high, '"');
+		mask.backslash = MatchAvx2(low, high, '\\');
+		mask.single_quote = MatchAvx2(low, high, '\'');
+		mask.structural = MatchAvx2(low, high, '{') | MatchAvx2(low, high, '}') | MatchAvx2(low, high, '[') | MatchAvx2(low, high, ']') | MatchAvx2(low, high, ':') | MatchAvx2(low, high, ',');
+		mask.space = MatchAvx2(low, high, ' ') | MatchAvx2(low, high, '\t') | MatchAvx2(low, high, '\n') | MatchAvx2(low, high, '\r');
+	}
+}
+
+#endif
+
+static int TrailingZeros(uint64_t value)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	return __builtin_ctzll(value);
+#else
+	int result = 0;
+	while((value & 1) == 0)
+	{
+		value >>= 1;
+		++result;
+	}
+	return result;
+#endif
+}
+
+// Each bit is the xor of all bits up to and including it, this marks the bytes from an opening quote up to the closing quote
+static uint64_t PrefixXor(uint64_t value)
+{
+	value ^= value << 1;
+	value ^= value << 2;
+	value ^= value << 4;
+	value ^= value << 8;
+	value ^= value << 16;
+	value ^= value << 32;
+	return value;
+}
+
+// Turns the character masks of consecutive blocks into structural positions, the state is carried between blocks
+class StructuralScanner
+{
+public:
+	StructuralScanner(JsonDbStructuralIndex &_index)
+		: index(_index)
+		, escaped_carry(0)
+		, string_carry(0)
+		, scalar_carry(0)
+		, single_quotes(0)
+	{ }
+
+	void Scan(BlockMasks const &mask, unsigned int offset)
+	{
+		// Backslashes are rare, resolve runs of them one by one. A backslash escapes the next character,
+		// unless it is escaped itself.
+		uint64_t escaped = escaped_carry;
+		uint64_t backslash = mask.backslash & ~escaped_carry;
+		escaped_carry = 0;
+		while(backslash != 0)
+		{
+			int bit = TrailingZeros(backslash);
+			backslash &= backslash - 1;
+			if(bit == 63)
+				escaped_carry = 1;
+			else
+			{
+				escaped |= (uint64_t)1 << (bit + 1);
+				backslash &= ~((uint64_t)1 << (bit + 1));
+			}
+		}
+
+		// Bytes inside strings, including the opening quote
+		uint64_t quote = mask.quote & ~escaped;
+		uint64_t in_string = PrefixXor(quote) ^ string_carry;
+		string_carry = (uint64_t)((boost::int64_t)in_string >> 63);
+
+		// Numbers and literals start at a character following a space, structural character or quote
+		uint64_t other = ~(mask.space | mask.structural | mask.quote | in_string);
+		uint64_t scalar_start = other & ~((other << 1) | scalar_carry);
+		scalar_carry = other >> 63;
+
+		single_quotes |= mask.single_quote & ~in_string;
+
+		uint64_t structural = (mask.structural & ~in_string) | quote | scalar_start;
+		while(structural != 0)
+		{
+			index.positions.push_back(offset + TrailingZeros(structural));
+			structural &= structural - 1;
+		}
+	}
+
+	void Finish()
+	{
+		index.single_quotes = single_quotes != 0;
+		index.unterminated = string_carry != 0;
+	}
+
+private:
+	JsonDbStructuralIndex &index;
+
+	uint64_t escaped_carry;
+	uint64_t string_carry;
+	uint64_t scalar_carry;
+	uint64_t single_quotes;
+};
+
+static bool ProcessorSupports(JsonDbIndexer indexer)
+{
+#ifdef JSON_DB_X86_INDEXERS
+	__builtin_cpu_init();
+	if(indexer == indexer_sse2)
+		return __builtin_cpu_supports("sse2");
+	if(indexer == indexer_avx2)
+		return __builtin_cpu_supports("avx2");
+#endif
+	return indexer == indexer_scalar;
+}
+
+static JsonDbIndexer ResolveIndexer(JsonDbIndexer indexer)
+{
+	static JsonDbIndexer const best = ProcessorSupports(indexer_avx2) ? indexer_avx2 : ProcessorSupports(indexer_sse2) ? indexer_sse2 : indexer_scalar;
+	return indexer == indexer_auto ? best : indexer;
+}
+
+bool JsonDb_IndexerSupported(JsonDbIndexer indexer)
+{
+	return ProcessorSupports(ResolveIndexer(indexer));
+}
+
+char const *JsonDb_IndexerName(JsonDbIndexer indexer)
+{
+	switch(ResolveIndexer(indexer))
+	{
+		case indexer_sse2: return "sse2";
+		case indexer_avx2: return "avx2";
+		default: return "scalar";
+	}
+}
+
+void JsonDb_BuildStructuralIndex(char const *data, size_t size, JsonDbStructuralIndex &index, JsonDbIndexer indexer)
+{
+	if(!JsonDb_IndexerSupported(indexer))
+		throw std::runtime_error((boost::format("Failed to build structural index, indexer '%s' is not supported") % JsonDb_IndexerName(indexer)).str());
+	if(size > 0xffffffffUL)
+		throw std::runtime_error("Failed to build structural index, document is larger than 4 GB");
+
+	ClassifyFunction classify = ClassifyScalar;
+#ifdef JSON_DB_X86_INDEXERS
+	switch(ResolveIndexer(indexer))
+	{
+		case indexer_sse2: classify = ClassifySse2; break;
+		case indexer_avx2: classify = ClassifyAvx2; break;
+		default: break;
+	}
+#endif
+
+	index.positions.clear();
+	StructuralScanner scanner(index);
+	BlockMasks masks[batch_blocks];
+
+	size_t offset = 0;
+	while(size - offset >= block_size)
+	{
+		size_t blocks = std::min((size - offset) / block_size, batch_blocks);
+		classify(data + offset, blocks, masks);
+		for(size_t i = 0; i < blocks; ++i, offset += block_size)
+			scanner.Scan(masks[i], offset);
+	}
+
+	// The last block is padded with spaces
+	if(offset < size)
+	{
+		char last[block_size];
+		memset(last, ' ', block_size);
+		memcpy(last, data + offset, size - offset);
+		classify(last, 1, masks);
+		scanner.Scan(masks[0], offset);
+	}
+
+	scanner.Finish();
+}
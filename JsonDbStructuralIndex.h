@@ -0,0 +1,57 @@
+#ifndef __json_db_structural_index_h__
+#define __json_db_structural_index_h__
+
+/*
+ 		Copyright (C) 2010 Wouter van Kleunen
+
+		This file is part of JsonDb.
+
+    Foobar is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Foobar is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with JsonDb.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstddef>
+#include <vector>
+
+// Instruction set used to build a structural index
+enum JsonDbIndexer
+{
+	indexer_auto,      // the best indexer supported by the processor
+	indexer_scalar,
+	indexer_sse2,
+	indexer_avx2
+};
+
+// Positions of the braces, brackets, colons and commas of a json document outside strings, of the double
+// quotes which open and close strings, and of the first character of every number and literal
+struct JsonDbStructuralIndex
+{
+	std::vector<unsigned int> positions;
+
+	// True when a single quote was found outside double-quoted strings, the index does not handle single-quoted strings
+	bool single_quotes;
+
+	// True when the document ends inside a string
+	bool unterminated;
+};
+
+// Returns true if the indexer can run on this processor
+bool JsonDb_IndexerSupported(JsonDbIndexer indexer);
+
+// Name of the indexer, the automatic indexer is named after the indexer it selects
+char const *JsonDb_IndexerName(JsonDbIndexer indexer);
+
+// Build the structural index of the document, the document may be at most 4 GB
+void JsonDb_BuildStructuralIndex(char const *data, size_t size, JsonDbStructuralIndex &index, JsonDbIndexer indexer = indexer_auto);
+
+#endif
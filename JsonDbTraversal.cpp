@@ -0,0 +1,128 @@
+/*
+ 		Copyright (C) 2010 Wouter van Kleunen
+
+		This file is part of JsonDb.
+
+    Foobar is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Foobar is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with JsonDb.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "JsonDb.h"
+#include "JsonDbValues.h"
+#include "JsonDbTraversal.h"
+
+#include <deque>
+
+void Json_visitor::missing(ValuePointer const &parent, ValueKey key)
+{
+	throw std::runtime_error((boost::format("Element %d is missing from the database") % key).str());
+}
+
+// An object or array being visited, with the batch of members or elements which is visited next. Frames
+// are reused for the objects and arrays at the same depth, so their buffers are allocated only once.
+struct Traversal_frame
+{
+	void Reset(ValuePointer const &_value)
+	{
+		value = _value;
+		object = _value->GetType() == Value::VALUE_OBJECT;
+		from.clear();
+		index = 0;
+		members.clear();
+		member = members.end();
+		keys.clear();
+		position = 0;
+	}
+
+	ValuePointer value;
+	bool object;
+
+	// Position of the next batch, the member name of an object or the element index of an array
+	std::string from;
+	size_t index;
+
+	// The current batch, members are only used for objects
+	ValueObject::Type members;
+	ValueObject::Type::const_iterator member;
+	ValueArray::Type keys;
+	JsonDb::Transaction::RecordBatch records;
+	size_t position;
+};
+
+static bool IsContainer(ValuePointer const &value)
+{
+	return value->GetType() == Value::VALUE_OBJECT || value->GetType() == Value::VALUE_ARRAY;
+}
+
+// Read the next batch of members or elements, returns false when all are visited
+static bool NextBatch(JsonDb::TransactionHandle &transaction, Traversal_frame &frame)
+{
+	frame.keys.clear();
+	frame.position = 0;
+
+	if(frame.object)
+	{
+		static_cast<ValueObject const &>(*frame.value).NextMembers(transaction, frame.from, frame.members);
+		for(ValueObject::Type::const_iterator i = frame.members.begin(); i != frame.members.end(); ++i)
+			frame.keys.push_back(i->second);
+		frame.member = frame.members.begin();
+	} else
+	{
+		static_cast<ValueArray const &>(*frame.value).NextElements(transaction, frame.index, frame.keys);
+	}
+
+	// Records are decoded when they are visited, while their memory is still in the processor cache
+	transaction->ReadBatch(frame.keys, frame.records);
+	return !frame.keys.empty();
+}
+
+void JsonDb_Traverse(JsonDb::TransactionHandle &transaction, ValuePointer const &root, Json_visitor &visitor)
+{
+	if(!visitor.enter(ValuePointer(), std::string(), root) || !IsContainer(root))
+		return;
+
+	// Frames above the current depth are kept for reuse, references to frames stay valid while frames are added
+	std::deque<Traversal_frame> stack(1);
+	stack.front().Reset(root);
+	size_t depth = 1;
+
+	std::string const no_name;
+	while(depth > 0 && !visitor.done())
+	{
+		Traversal_frame &frame = stack[depth - 1];
+		if(frame.position == frame.keys.size() && !NextBatch(transaction, frame))
+		{
+			ValuePointer value = frame.value;
+			frame.value.reset();
+			--depth;
+			visitor.leave(value);
+			continue;
+		}
+
+		size_t position = frame.position++;
+		ValuePointer value = transaction->Retrieve(frame.keys[position], frame.records);
+		std::string const &name = frame.object ? (frame.member++)->first : no_name;
+		if(value == NULL)
+		{
+			visitor.missing(frame.value, frame.keys[position]);
+			continue;
+		}
+
+		if(!visitor.enter(frame.value, name, value) || !IsContainer(value))
+			continue;
+
+		if(depth == stack.size())
+			stack.push_back(Traversal_frame());
+		stack[depth++].Reset(value);
+	}
+}
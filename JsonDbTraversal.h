@@ -0,0 +1,55 @@
+#ifndef __json_db_traversal_h__
+#define __json_db_traversal_h__
+
+/*
+ 		Copyright (C) 2010 Wouter van Kleunen
+
+		This file is part of JsonDb.
+
+    Foobar is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Foobar is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with JsonDb.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string>
+
+// Receives the elements visited by JsonDb_Traverse
+class Json_visitor
+{
+public:
+	virtual ~Json_visitor()
+	{ }
+
+	// Called for every element, with the object or array holding it and the member name, the parent of the first
+	// element is NULL. Return true to visit the members or elements of an object or array.
+	virtual bool enter(ValuePointer const &parent, std::string const &name, ValuePointer const &value) = 0;
+
+	// Called when all members or elements of an entered object or array are visited
+	virtual void leave(ValuePointer const &value)
+	{ }
+
+	// Called instead of enter for an element which is missing from the database, throws by default
+	virtual void missing(ValuePointer const &parent, ValueKey key);
+
+	// Return true to stop the traversal, checked before each element. Open objects and arrays are not left.
+	virtual bool done() const
+	{
+		return false;
+	}
+};
+
+// Visit the element and all elements below it depth-first, in document order. The members or elements of an
+// object or array are read in batches, each batch is fetched from the database in key order. Objects and arrays
+// being visited are kept on an explicit stack, so the depth of a document is not limited by the call stack.
+void JsonDb_Traverse(JsonDb::TransactionHandle &transaction, ValuePointer const &root, Json_visitor &visitor);
+
+#endif
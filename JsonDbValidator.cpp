@@ -0,0 +1,428 @@
+/*
+ 		Copyright (C) 2010 Wouter van Kleunen
+
+		This file is part of JsonDb.
+
+    Foobar is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Foobar is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with JsonDb.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "JsonDb.h"
+#include "JsonDbValues.h"
+#include "JsonDbTraversal.h"
+#include "JsonDbValidator.h"
+#include "JsonDbIndex.h"
+
+#include <boost/bind.hpp>
+#include <boost/format.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <deque>
+#include <algorithm>
+
+const size_t Key_bitmap::word_bits;
+
+// Members or elements of an object or array which are walked by one thread. Elements are given by index from
+// first up to last, members by name from up to to, an empty to means up to the last member.
+struct Validation_item
+{
+	Validation_item(ValueKey _container)
+		: container(_container)
+		, first(0)
+		, last((size_t)-1)
+	{ }
+
+	ValueKey container;
+	size_t first;
+	size_t last;
+	std::string from;
+	std::string to;
+};
+
+// The work shared by the threads, and the keys reachable from the root found so far
+class Validation_state
+{
+public:
+	Validation_state(size_t _threads, JsonDb::ValidationReport &_report)
+		: threads(_threads)
+		, busy(0)
+		, report(_report)
+	{ }
+
+	void push(Validation_item const &item)
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		items.push_back(item);
+		condition.notify_one();
+	}
+
+	// Take the next item, waits while other threads may still add items. Returns false when all items are done.
+	bool pop(Validation_item &item)
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		while(items.empty() && busy > 0)
+			condition.wait(lock);
+
+		if(items.empty())
+			return false;
+
+		item = items.front();
+		items.pop_front();
+		++busy;
+		return true;
+	}
+
+	// Called when an item taken by pop is walked
+	void done()
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		if(--busy == 0 && items.empty())
+			condition.notify_all();
+	}
+
+	// True if an idle thread could take part of the work
+	bool starving()
+	{
+		if(threads == 1)
+			return false;
+
+		boost::mutex::scoped_lock lock(mutex);
+		return items.size() < threads;
+	}
+
+	void mark(std::vector<ValueKey> const &keys)
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		for(std::vector<ValueKey>::const_iterator i = keys.begin(); i != keys.end(); ++i)
+			reachable.set(*i);
+	}
+
+	void error(std::string const &message)
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		if(report.errors.size() < JsonDb::ValidationReport::listed_keys)
+			report.errors.push_back(message);
+	}
+
+	Key_bitmap reachable;
+
+private:
+	size_t threads;
+	size_t busy;
+	JsonDb::ValidationReport &report;
+
+	boost::mutex mutex;
+	boost::condition_variable condition;
+	std::deque<Validation_item> items;
+};
+
+// Marks the records of the visited elements as reachable, objects and arrays which are large enough are split
+// into items for the other threads while threads are idle
+class Reachable_visitor
+	: public Json_visitor
+{
+public:
+	// Reachable keys are passed to the shared bitmap in batches of this size
+	static const size_t mark_batch_size = 4096;
+
+	// Objects and arrays are split into items of this many members or elements
+	static const size_t split_size = 4096;
+
+	Reachable_visitor(JsonDb::TransactionHandle &_transaction, Validation_state &_state)
+		: transaction(_transaction)
+		, state(_state)
+	{ }
+
+	// Walk the members or elements of the item and all elements below them
+	void walk(Validation_item const &item);
+
+	bool enter(ValuePointer const &parent, std::string const &name, ValuePointer const &value)
+	{
+		// Elements stored inline have no record of their own, the elements in the garbage list have no container
+		ValuePointer const &holder = parent != NULL ? parent : container;
+		Value::InlineValues const *inline_values = holder != NULL ? holder->GetInlineValues() : NULL;
+		if(inline_values == NULL || inline_values->find(value->GetKey()) == inline_values->end())
+			mark(value->GetKey());
+
+		if(value->GetType() == Value::VALUE_ARRAY)
+		{
+			segments.clear();
+			static_cast<ValueArray const &>(*value).CollectSegments(transaction, segments);
+			for(ValueArray::Type::const_iterator i = segments.begin(); i != segments.end(); ++i)
+				mark(*i);
+		}
+
+		if((value->GetType() == Value::VALUE_OBJECT || value->GetType() == Value::VALUE_ARRAY) && value->GetSize(transaction) > split_size && state.starving())
+		{
+			split(value);
+			return false;
+		}
+
+		return true;
+	}
+
+	// A missing record is reachable but not stored, it is reported as missing
+	void missing(ValuePointer const &parent, ValueKey key)
+	{
+		mark(key);
+	}
+
+	void flush()
+	{
+		state.mark(keys);
+		keys.clear();
+	}
+
+private:
+	void mark(ValueKey key)
+	{
+		keys.push_back(key);
+		if(keys.size() >= mark_batch_size)
+			flush();
+	}
+
+	void split(ValuePointer const &value);
+
+	// Walk the elements below the container
+	void walk(ValueArray::Type const &members);
+
+	JsonDb::TransactionHandle &transaction;
+	Validation_state &state;
+
+	// The object or array holding the members or elements of the current item
+	ValuePointer container;
+
+	std::vector<ValueKey> keys;
+	ValueArray::Type segments;
+	JsonDb::Transaction::RecordBatch records;
+};
+
+const size_t Reachable_visitor::mark_batch_size;
+const size_t Reachable_visitor::split_size;
+
+void Reachable_visitor::walk(Validation_item const &item)
+{
+	// Elements waiting to be deleted are listed in the garbage list, they are stored until they are reclaimed
+	if(item.container == garbage_key)
+	{
+		container.reset();
+
+		std::string from;
+		ValueArray::Type garbage;
+		while(transaction->NextGarbage(from, garbage))
+			walk(garbage);
+		return;
+	}
+
+	// The records of the indexes hold their path, the entries of an index are stored below its record
+	if(item.container == index_key)
+	{
+		JsonDb::Transaction::Indexes const &indexes = transaction->GetIndexes();
+		for(JsonDb::Transaction::Indexes::const_iterator i = indexes.begin(); i != indexes.end(); ++i)
+			mark(i->key);
+		return;
+	}
+
+	container = transaction->Retrieve(item.container);
+	if(container == NULL)
+	{
+		mark(item.container);
+		return;
+	}
+
+	ValueArray::Type members;
+	if(container->GetType() == Value::VALUE_OBJECT)
+	{
+		ValueObject const &object = static_cast<ValueObject const &>(*container);
+
+		std::string from = item.from;
+		ValueObject::Type batch;
+		while(object.NextMembers(transaction, from, batch))
+		{
+			members.clear();
+			for(ValueObject::Type::const_iterator i = batch.begin(); i != batch.end() && (item.to.empty() || i->first < item.to); ++i)
+				members.push_back(i->second);
+
+			walk(members);
+			if(members.size() < batch.size())
+				break;
+		}
+	} else if(container->GetType() == Value::VALUE_ARRAY)
+	{
+		ValueArray const &array = static_cast<ValueArray const &>(*container);
+
+		size_t index = item.first;
+		while(index < item.last && array.NextElements(transaction, index, members))
+		{
+			// The index is past the batch, drop the elements of the next item
+			if(index > item.last)
+				members.resize(members.size() - (index - item.last));
+
+			walk(members);
+		}
+	}
+}
+
+void Reachable_visitor::walk(ValueArray::Type const &members)
+{
+	transaction->ReadBatch(members, records);
+	for(ValueArray::Type::const_iterator i = members.begin(); i != members.end(); ++i)
+	{
+		ValuePointer value = transaction->Retrieve(*i, records);
+		if(value == NULL)
+			missing(container, *i);
+		else
+			JsonDb_Traverse(transaction, value, *this);
+	}
+}
+
+void Reachable_visitor::split(ValuePointer const &value)
+{
+	Validation_item item(value->GetKey());
+	if(value->GetType() == Value::VALUE_ARRAY)
+	{
+		size_t size = value->GetSize(transaction);
+		for(size_t first = 0; first < size; first += split_size)
+		{
+			item.first = first;
+			item.last = std::min(size, first + split_size);
+			state.push(item);
+		}
+		return;
+	}
+
+	// Objects are split at the name of every split_size-th member
+	ValueObject const &object = static_cast<ValueObject const &>(*value);
+	std::string from;
+	ValueObject::Type batch;
+	size_t count = 0;
+	while(object.NextMembers(transaction, from, batch))
+	{
+		for(ValueObject::Type::const_iterator i = batch.begin(); i != batch.end(); ++i, ++count)
+		{
+			if(count == 0 || count % split_size != 0)
+				continue;
+
+			item.to = i->first;
+			state.push(item);
+			item.from = i->first;
+		}
+	}
+
+	item.to.clear();
+	state.push(item);
+}
+
+// Take items until all items are walked
+static void ValidateThread(JsonDb::TransactionHandle transaction, Validation_state &state)
+{
+	Reachable_visitor visitor(transaction, state);
+
+	Validation_item item(null_key);
+	while(state.pop(item))
+	{
+		try
+		{
+			visitor.walk(item);
+		} catch(std::exception const &e)
+		{
+			state.error((boost::format("Failed to walk element %d: %s") % item.container % e.what()).str());
+		}
+
+		visitor.flush();
+		state.done();
+	}
+}
+
+// Remember the records in the database, entries directly follow the record they are stored below
+static void ScanKey(Key_bitmap &stored, ValueKey &record, JsonDb::ValidationReport &report, ValueKey key, bool entry)
+{
+	if(!entry)
+	{
+		stored.set(key);
+		record = key;
+		return;
+	}
+
+	++report.entries;
+	if(key == null_key || (key != record && key != garbage_key && key != index_key))
+		++report.orphan_entries;
+}
+
+// Number of keys set in a word of a bitmap
+static size_t CountKeys(unsigned long word)
+{
+	size_t count = 0;
+	for(; word != 0; word &= word - 1)
+		++count;
+	return count;
+}
+
+// Count the keys set in a word of a bitmap and list the first keys
+static void ListKeys(unsigned long word, size_t index, size_t &count, std::vector<ValueKey> &keys)
+{
+	for(size_t bit = 0; word != 0; ++bit, word >>= 1)
+	{
+		if((word & 1) == 0)
+			continue;
+
+		if(keys.size() < JsonDb::ValidationReport::listed_keys)
+			keys.push_back((ValueKey)(index * Key_bitmap::word_bits + bit));
+		++count;
+	}
+}
+
+JsonDb::ValidationReport JsonDb_Validate(JsonDb::TransactionHandle &transaction, size_t threads, boost::function<JsonDb::TransactionHandle ()> const &start_reader)
+{
+	JsonDb::ValidationReport report;
+	report.threads = std::max<size_t>(threads, 1);
+
+	// All records in the database, in a single pass with the cursor
+	Key_bitmap stored;
+	ValueKey record = null_key;
+	transaction->ScanKeys(boost::bind(&ScanKey, boost::ref(stored), boost::ref(record), boost::ref(report), _1, _2));
+
+	// All records reachable from the root, the record storing the next key is always valid
+	Validation_state state(report.threads, report);
+	state.reachable.reserve(stored.size());
+	state.reachable.set(root_key);
+	if(stored.test(next_id_key))
+		state.reachable.set(next_id_key);
+
+	state.push(Validation_item(root_key));
+	state.push(Validation_item(garbage_key));
+	state.push(Validation_item(index_key));
+
+	boost::thread_group group;
+	for(size_t i = 1; i < report.threads; ++i)
+		group.create_thread(boost::bind(&ValidateThread, start_reader(), boost::ref(state)));
+
+	ValidateThread(transaction, state);
+	group.join_all();
+
+	size_t words = std::max(stored.size(), state.reachable.size());
+	for(size_t i = 0; i < words; ++i)
+	{
+		unsigned long stored_word = stored.word(i);
+		unsigned long reachable_word = state.reachable.word(i);
+
+		report.records += CountKeys(stored_word);
+		report.reachable += CountKeys(reachable_word);
+		ListKeys(reachable_word & ~stored_word, i, report.missing, report.missing_keys);
+		ListKeys(stored_word & ~reachable_word, i, report.stale, report.stale_keys);
+	}
+
+	JsonDb_ValidateIndexes(transaction, report);
+
+	return report;
+}
@@ -0,0 +1,79 @@
+#ifndef __json_db_validator_h__
+#define __json_db_validator_h__
+
+/*
+ 		Copyright (C) 2010 Wouter van Kleunen
+
+		This file is part of JsonDb.
+
+    Foobar is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Foobar is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with JsonDb.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <boost/function.hpp>
+#include <vector>
+#include <algorithm>
+
+// One bit for every key, grows to hold the largest key set. Tracks the records found by a validation or compaction.
+class Key_bitmap
+{
+public:
+	static const size_t word_bits = sizeof(unsigned long) * 8;
+
+	void set(ValueKey key)
+	{
+		size_t index = key / word_bits;
+		if(index >= words.size())
+			words.resize(std::max(index + 1, words.size() + words.size() / 2));
+		words[index] |= 1UL << (key % word_bits);
+	}
+
+	void reset(ValueKey key)
+	{
+		size_t index = key / word_bits;
+		if(index < words.size())
+			words[index] &= ~(1UL << (key % word_bits));
+	}
+
+	bool test(ValueKey key) const
+	{
+		return (word(key / word_bits) & (1UL << (key % word_bits))) != 0;
+	}
+
+	// Make room for the keys below the specified number of words
+	void reserve(size_t size)
+	{
+		if(size > words.size())
+			words.resize(size);
+	}
+
+	size_t size() const
+	{
+		return words.size();
+	}
+
+	unsigned long word(size_t index) const
+	{
+		return index < words.size() ? words[index] : 0;
+	}
+
+private:
+	std::vector<unsigned long> words;
+};
+
+// Check that the records in the database are exactly the records reachable from the root. The tree is walked by
+// the specified number of threads, the first thread uses the transaction, the others read with a transaction
+// of their own started by start_reader.
+JsonDb::ValidationReport JsonDb_Validate(JsonDb::TransactionHandle &transaction, size_t threads, boost::function<JsonDb::TransactionHandle ()> const &start_reader);
+
+#endif
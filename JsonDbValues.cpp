@@ -19,189 +19,748 @@
 
 #include "JsonDb.h"
 #include "JsonDbValues.h"
+#include "JsonDbTraversal.h"
 
-void ValueNull::Print(JsonDb::TransactionHandle &transaction, std::ostream &output, unsigned int indent_level) const
+#include <cstring>
+#include <algorithm>
+
+// Append the bytes of a field to the output buffer
+template <typename T>
+static void Write(std::string &output, T const &value)
 {
-	output << "null";
+	output.append((char const *)&value, sizeof(T));
 }
 
-void ValueNull::Serialize(std::ostream &output) const
+// Reads the fields of a serialized value directly from the stored bytes
+class ValueReader
+{
+public:
+	ValueReader(char const *_data, size_t _size)
+		: data(_data)
+		, end(_data + _size)
+	{ }
+
+	template <typename T>
+	T Read()
+	{
+		T value;
+		memcpy(&value, Read(sizeof(T)), sizeof(T));
+		return value;
+	}
+
+	char const *Read(size_t length)
+	{
+		if((size_t)(end - data) < length)
+			throw std::runtime_error("Failed to unserialize database entry, entry is truncated");
+
+		char const *result = data;
+		data += length;
+		return result;
+	}
+
+	// Read the number of entries which follow, each at least entry_size bytes, before storage is reserved for them
+	unsigned int ReadCount(size_t entry_size)
+	{
+		unsigned int count = Read<unsigned int>();
+		if(count > (size_t)(end - data) / entry_size)
+			throw std::runtime_error("Failed to unserialize database entry");
+
+		return count;
+	}
+
+private:
+	char const *data;
+	char const *end;
+};
+
+// Collects the keys of all records below the visited element
+class Walk_visitor
+	: public Json_visitor
 {
-	unsigned char type = VALUE_NULL;	
-	output.write((char *)&type, sizeof(unsigned char));
+public:
+	Walk_visitor(JsonDb::TransactionHandle &_transaction, std::set<ValueKey> &_keys)
+		: transaction(_transaction)
+		, keys(_keys)
+	{ }
+
+	bool enter(ValuePointer const &parent, std::string const &name, ValuePointer const &value)
+	{
+		// Elements stored inline have no record of their own
+		Value::InlineValues const *inline_values = parent != NULL ? parent->GetInlineValues() : NULL;
+		if(inline_values == NULL || inline_values->find(value->GetKey()) == inline_values->end())
+			keys.insert(value->GetKey());
+
+		if(value->GetType() == Value::VALUE_ARRAY)
+		{
+			ValueArray::Type segments;
+			static_cast<ValueArray const &>(*value).CollectSegments(transaction, segments);
+			keys.insert(segments.begin(), segments.end());
+		}
+		return true;
+	}
+
+private:
+	JsonDb::TransactionHandle &transaction;
+	std::set<ValueKey> &keys;
+};
+
+// Deletes the records of all visited elements
+class Delete_visitor
+	: public Json_visitor
+{
+public:
+	Delete_visitor(JsonDb::TransactionHandle &_transaction)
+		: transaction(_transaction)
+	{ }
+
+	bool enter(ValuePointer const &parent, std::string const &name, ValuePointer const &value)
+	{
+		// Members of spilled objects have an entry of their own
+		if(parent != NULL && parent->GetType() == Value::VALUE_OBJECT && static_cast<ValueObject const &>(*parent).IsSpilled())
+			transaction->DeleteEntry(parent->GetKey(), name);
+
+		transaction->Delete(value->GetKey());
+		return true;
+	}
+
+	void leave(ValuePointer const &value)
+	{
+		// Segments are read until all elements are visited
+		if(value->GetType() != Value::VALUE_ARRAY)
+			return;
+
+		ValueArray::Type segments;
+		static_cast<ValueArray const &>(*value).CollectSegments(transaction, segments);
+		for(ValueArray::Type::const_iterator i = segments.begin(); i != segments.end(); ++i)
+			transaction->Delete(*i);
+	}
+
+private:
+	JsonDb::TransactionHandle &transaction;
+};
+
+void Value::Delete(JsonDb::TransactionHandle &transaction)
+{
+	if(GetType() != VALUE_OBJECT && GetType() != VALUE_ARRAY)
+	{
+		transaction->Delete(GetKey());
+		return;
+	}
+
+	Delete_visitor visitor(transaction);
+	JsonDb_Traverse(transaction, shared_from_this(), visitor);
 }
 
+bool Value::DeferDelete(JsonDb::TransactionHandle &transaction)
+{
+	if(!transaction->DefersDeletes() || (GetType() != VALUE_OBJECT && GetType() != VALUE_ARRAY) || GetSize(transaction) == 0)
+		return false;
+
+	transaction->QueueGarbage(GetKey());
+	return true;
+}
 
-void ValueNumberInteger::Serialize(std::ostream &output) const
+void Value::Walk(JsonDb::TransactionHandle &transaction, std::set<ValueKey> &keys)
 {
-	unsigned char type = VALUE_NUMBER_INTEGER;	
-	output.write((char *)&type, sizeof(unsigned char));
-	output.write((char *)&value, sizeof(Type));
+	Walk_visitor visitor(transaction, keys);
+	JsonDb_Traverse(transaction, shared_from_this(), visitor);
 }
 
-void ValueNumberInteger::Print(JsonDb::TransactionHandle &transaction, std::ostream &output, unsigned int indent_level) const
+void ValueNull::Serialize(std::string &output) const
 {
-	output << value;
+	Write<unsigned char>(output, VALUE_NULL);
 }
 
 
-void ValueNumberReal::Serialize(std::ostream &output) const
+void ValueNumberInteger::Serialize(std::string &output) const
 {
-	unsigned char type = VALUE_NUMBER_REAL;	
-	output.write((char *)&type, sizeof(unsigned char));
-	output.write((char *)&value, sizeof(Type));
+	Write<unsigned char>(output, VALUE_NUMBER_INTEGER);
+	Write(output, value);
 }
 
-void ValueNumberReal::Print(JsonDb::TransactionHandle &transaction, std::ostream &output, unsigned int indent_level) const
+void ValueNumberReal::Serialize(std::string &output) const
 {
-	output << (boost::format("%.1f") % value);
+	Write<unsigned char>(output, VALUE_NUMBER_REAL);
+	Write(output, value);
 }
 
+void ValueNumberBoolean::Serialize(std::string &output) const
+{
+	Write<unsigned char>(output, VALUE_NUMBER_BOOL);
+	Write(output, value);
+}
 
-void ValueNumberBoolean::Serialize(std::ostream &output) const
+void ValueString::Serialize(std::string &output) const
 {
-	unsigned char type = VALUE_NUMBER_BOOL;	
-	output.write((char *)&type, sizeof(unsigned char));
-	output.write((char *)&value, sizeof(Type));
+	Write<unsigned char>(output, VALUE_STRING);
+	Write<size_t>(output, value.size());
+	output.append(value);
 }
 
-void ValueNumberBoolean::Print(JsonDb::TransactionHandle &transaction, std::ostream &output, unsigned int indent_level) const
+const size_t ValueArraySegment::segment_size;
+const size_t ValueArray::segment_threshold;
+const size_t ValueArray::element_batch_size;
+
+void ValueArraySegment::Serialize(std::string &output) const
 {
-	output << (value ? "true" : "false");
+	Write<unsigned char>(output, VALUE_ARRAY_SEGMENT);
+	Write(output, level);
+	Write<unsigned int>(output, keys.size());
+
+	if(!keys.empty())
+		output.append((char const *)&keys[0], sizeof(ValueKey) * keys.size());
+
+	if(!counts.empty())
+		output.append((char const *)&counts[0], sizeof(unsigned int) * counts.size());
 }
 
+ValuePointer ValueArraySegment::Get(JsonDb::TransactionHandle &transaction, size_t index)
+{
+	if(level == 0)
+		return transaction->Retrieve(keys.at(index));
 
-void ValueString::Serialize(std::ostream &output) const
+	for(size_t i = 0; i < keys.size(); ++i)
+	{
+		if(index < counts[i])
+			return Retrieve(transaction, keys[i])->Get(transaction, index);
+		index -= counts[i];
+	}
+
+	throw std::runtime_error((boost::format("Index out of bound: %d") % index).str());
+}
+
+void ValueArraySegment::CollectElements(JsonDb::TransactionHandle &transaction, size_t index, size_t max_elements, Type &elements) const
 {
-	unsigned char type = VALUE_STRING;	
-	output.write((char *)&type, sizeof(unsigned char));
-	size_t len = value.size();
-	output.write((char *)&len, sizeof(size_t));
-	output.write(value.c_str(), len);
+	if(level == 0)
+	{
+		for(size_t i = index; i < keys.size() && elements.size() < max_elements; ++i)
+			elements.push_back(keys[i]);
+		return;
+	}
+
+	for(size_t i = 0; i < keys.size() && elements.size() < max_elements; ++i)
+	{
+		if(index < counts[i])
+		{
+			Retrieve(transaction, keys[i])->CollectElements(transaction, index, max_elements, elements);
+			index = 0;
+		} else
+			index -= counts[i];
+	}
 }
 
-void ValueString::Print(JsonDb::TransactionHandle &transaction, std::ostream &output, unsigned int indent_level) const
+void ValueArraySegment::CollectSegments(JsonDb::TransactionHandle &transaction, Type &segments) const
 {
-	output << "\"" << value << "\"";
+	segments.push_back(GetKey());
+	if(level > 0)
+	{
+		for(Type::const_iterator i = keys.begin(); i != keys.end(); ++i)
+			Retrieve(transaction, *i)->CollectSegments(transaction, segments);
+	}
 }
 
+size_t ValueArraySegment::GetSize(JsonDb::TransactionHandle &transaction) const
+{
+	if(level == 0)
+		return keys.size();
+
+	size_t result = 0;
+	for(Counts::const_iterator i = counts.begin(); i != counts.end(); ++i)
+		result += *i;
+	return result;
+}
 
-void ValueArray::Serialize(std::ostream &output) const
+ValueArraySegment::SegmentPointer ValueArraySegment::Retrieve(JsonDb::TransactionHandle &transaction, ValueKey key)
 {
-	unsigned char type = VALUE_ARRAY;	
-	output.write((char *)&type, sizeof(unsigned char));
-	unsigned int entries = values.size();
-	output.write((char *)&entries, sizeof(unsigned int));
+	ValuePointer segment = transaction->Retrieve(key);
+	if(segment == NULL || segment->GetType() != VALUE_ARRAY_SEGMENT)
+		throw std::runtime_error((boost::format("Array segment is missing from the database: %d") % key).str());
 
-	if(entries > 0)
-		output.write((char *)&values[0], sizeof(ValueKey) * entries);
+	return boost::static_pointer_cast<ValueArraySegment>(segment);
 }
 
-void ValueArray::Print(JsonDb::TransactionHandle &transaction, std::ostream &output, unsigned int indent_level) const
+ValueArraySegment::SegmentPointer ValueArraySegment::Create(JsonDb::TransactionHandle &transaction, unsigned char level, Type const &keys, Counts const &counts)
 {
-	output << "[";
-	for(Type::const_iterator i = values.begin(); i != values.end(); ++i)
+	// The segment is allocated close to the elements or segments below it
+	SegmentPointer segment(new ValueArraySegment(transaction->GenerateKey(keys.empty() ? null_key : keys.front()), level, keys, counts));
+	transaction->Store(segment->GetKey(), segment);
+	return segment;
+}
+
+ValueArraySegment::SegmentPointer ValueArraySegment::AppendElement(JsonDb::TransactionHandle &transaction, ValueKey element)
+{
+	if(level == 0)
 	{
-		if(i != values.begin())
-			output << ",";
-	 	transaction->Retrieve(*i)->Print(transaction, output, indent_level);
+		if(keys.size() >= segment_size)
+			return Create(transaction, 0, Type(1, element), Counts());
+
+		keys.push_back(element);
+		transaction->Store(GetKey(), shared_from_this());
+		return SegmentPointer();
 	}
-	output << "]";
+
+	// Append to the last child, the child is split off when it is full
+	SegmentPointer child_sibling = Retrieve(transaction, keys.back())->AppendElement(transaction, element);
+	if(child_sibling == NULL)
+	{
+		++counts.back();
+	} else
+	{
+		if(keys.size() >= segment_size)
+			return Create(transaction, level, Type(1, child_sibling->GetKey()), Counts(1, 1));
+
+		keys.push_back(child_sibling->GetKey());
+		counts.push_back(1);
+	}
+
+	transaction->Store(GetKey(), shared_from_this());
+	return SegmentPointer();
+}
+
+ValueKey ValueArraySegment::RemoveElement(JsonDb::TransactionHandle &transaction, size_t index)
+{
+	ValueKey element;
+
+	if(level == 0)
+	{
+		element = keys.at(index);
+		keys.erase(keys.begin() + index);
+	} else
+	{
+		size_t i = 0;
+		while(i < keys.size() && index >= counts[i])
+			index -= counts[i++];
+
+		if(i == keys.size())
+			throw std::runtime_error((boost::format("Index out of bound: %d") % index).str());
+
+		element = Retrieve(transaction, keys[i])->RemoveElement(transaction, index);
+
+		// Remove child segments which became empty
+		if(--counts[i] == 0)
+		{
+			transaction->Delete(keys[i]);
+			keys.erase(keys.begin() + i);
+			counts.erase(counts.begin() + i);
+		}
+	}
+
+	transaction->Store(GetKey(), shared_from_this());
+	return element;
+}
+
+void ValueArraySegment::ReplaceElement(JsonDb::TransactionHandle &transaction, size_t index, ValueKey element)
+{
+	if(level == 0)
+	{
+		keys.at(index) = element;
+		transaction->Store(GetKey(), shared_from_this());
+		return;
+	}
+
+	for(size_t i = 0; i < keys.size(); ++i)
+	{
+		if(index < counts[i])
+		{
+			Retrieve(transaction, keys[i])->ReplaceElement(transaction, index, element);
+			return;
+		}
+		index -= counts[i];
+	}
+
+	throw std::runtime_error((boost::format("Index out of bound: %d") % index).str());
+}
+
+bool ValueArraySegment::FindElement(JsonDb::TransactionHandle &transaction, ValueKey element, size_t &index)
+{
+	for(size_t i = 0; i < keys.size(); ++i)
+	{
+		if(level == 0)
+		{
+			if(keys[i] == element)
+				return true;
+			++index;
+		} else
+		{
+			if(Retrieve(transaction, keys[i])->FindElement(transaction, element, index))
+				return true;
+		}
+	}
+
+	return false;
+}
+
+
+// Write the key of a subelement, followed by its value when stored inline or a zero type otherwise
+static void WriteSlot(std::string &output, ValueKey key, Value::InlineValues const &inline_values)
+{
+	Write(output, key);
+
+	Value::InlineValues::const_iterator value = inline_values.find(key);
+	if(value != inline_values.end())
+		value->second->Serialize(output);
+	else
+		Write<unsigned char>(output, 0);
+}
+
+static bool SetInline(Value::InlineValues &inline_values, bool allowed, ValueKey key, ValuePointer const &value)
+{
+	if(allowed && value != NULL && value->CanInline())
+	{
+		inline_values[key] = value;
+		return true;
+	}
+
+	inline_values.erase(key);
+	return false;
+}
+
+static void TakeInline(JsonDb::Transaction &transaction, ValueKey parent, ValueKey key, Value::InlineValues &inline_values)
+{
+	if(inline_values.find(key) != inline_values.end())
+		return;
+
+	ValuePointer value = transaction.TakeInline(parent, key);
+	if(value != NULL)
+		inline_values[key] = value;
+}
+
+// Store the elements held inline as separate records again
+static void MaterializeInline(JsonDb::TransactionHandle &transaction, Value::InlineValues &inline_values)
+{
+	Value::InlineValues values;
+	values.swap(inline_values);
+
+	for(Value::InlineValues::const_iterator i = values.begin(); i != values.end(); ++i)
+		transaction->Store(i->first, i->second);
+}
+
+void ValueArray::Serialize(std::string &output) const
+{
+	if(root_segment != null_key)
+	{
+		Write<unsigned char>(output, VALUE_ARRAY_SEGMENTED);
+		Write(output, size);
+		Write(output, root_segment);
+		return;
+	}
+
+	if(!inline_values.empty())
+	{
+		Write<unsigned char>(output, VALUE_ARRAY_INLINE);
+		Write<unsigned int>(output, values.size());
+
+		for(Type::const_iterator i = values.begin(); i != values.end(); ++i)
+			WriteSlot(output, *i, inline_values);
+		return;
+	}
+
+	Write<unsigned char>(output, VALUE_ARRAY);
+	Write<unsigned int>(output, values.size());
+
+	if(!values.empty())
+		output.append((char const *)&values[0], sizeof(ValueKey) * values.size());
 }
 
 ValuePointer ValueArray::Get(JsonDb::TransactionHandle &transaction, size_t index)
 {
-	if(index >= values.size())
+	if(index >= GetSize(transaction))
 		throw std::runtime_error((boost::format("Index out of bound: %d") % index).str());
 
+	if(root_segment != null_key)
+		return transaction->Retrieve(root_segment)->Get(transaction, index);
+
 	return transaction->Retrieve(values[index]);
 }
 
+bool ValueArray::NextElements(JsonDb::TransactionHandle &transaction, size_t &from, Type &elements) const
+{
+	elements.clear();
+
+	if(root_segment != null_key)
+		ValueArraySegment::Retrieve(transaction, root_segment)->CollectElements(transaction, from, element_batch_size, elements);
+	else
+	{
+		for(size_t i = from; i < values.size() && elements.size() < element_batch_size; ++i)
+			elements.push_back(values[i]);
+	}
+
+	from += elements.size();
+	return !elements.empty();
+}
+
 void ValueArray::Append(JsonDb::TransactionHandle &transaction, ValueKey key)
 {
-	values.push_back(key);
+	if(root_segment == null_key)
+	{
+		values.push_back(key);
+		if(values.size() > segment_threshold)
+			CreateSegments(transaction);
+	} else
+	{
+		// A new root is added above the root when the root is full
+		ValueArraySegment::SegmentPointer root = ValueArraySegment::Retrieve(transaction, root_segment);
+		ValueArraySegment::SegmentPointer sibling = root->AppendElement(transaction, key);
+		if(sibling != NULL)
+		{
+			ValueArraySegment::Type keys;
+			keys.push_back(root->GetKey());
+			keys.push_back(sibling->GetKey());
+
+			ValueArraySegment::Counts counts;
+			counts.push_back(size);
+			counts.push_back(1);
+
+			root_segment = ValueArraySegment::Create(transaction, root->level + 1, keys, counts)->GetKey();
+		}
+
+		++size;
+	}
+
 	transaction->Store(GetKey(), shared_from_this());
 }
 
-void ValueArray::Delete(JsonDb::TransactionHandle &transaction)
+void ValueArray::CreateSegments(JsonDb::TransactionHandle &transaction)
 {
-	// Delete this element
-	transaction->Delete(GetKey());
+	std::vector<ValueArraySegment::SegmentPointer> segments;
 
-	// Delete all sub elements
-	for(Type::const_iterator i = values.begin(); i != values.end(); ++i)
-		transaction->Retrieve(*i)->Delete(transaction);
+	// Fill the segments holding the elements
+	for(Type::const_iterator i = values.begin(); i != values.end(); )
+	{
+		Type::const_iterator end = i + std::min<size_t>(ValueArraySegment::segment_size, values.end() - i);
+		segments.push_back(ValueArraySegment::Create(transaction, 0, Type(i, end), ValueArraySegment::Counts()));
+		i = end;
+	}
+
+	// Add levels of segments until a single root segment remains
+	for(unsigned char level = 1; segments.size() > 1; ++level)
+	{
+		std::vector<ValueArraySegment::SegmentPointer> parents;
+		for(size_t i = 0; i < segments.size(); i += ValueArraySegment::segment_size)
+		{
+			ValueArraySegment::Type keys;
+			ValueArraySegment::Counts counts;
+			for(size_t j = i; j < std::min(segments.size(), i + ValueArraySegment::segment_size); ++j)
+			{
+				keys.push_back(segments[j]->GetKey());
+				counts.push_back(segments[j]->GetSize(transaction));
+			}
+
+			parents.push_back(ValueArraySegment::Create(transaction, level, keys, counts));
+		}
+
+		segments.swap(parents);
+	}
+
+	root_segment = segments.front()->GetKey();
+	size = values.size();
+	values.clear();
+
+	// Segments refer to separate records only
+	MaterializeInline(transaction, inline_values);
+}
+
+void ValueArray::CollectSegments(JsonDb::TransactionHandle &transaction, Type &segments) const
+{
+	if(root_segment != null_key)
+		ValueArraySegment::Retrieve(transaction, root_segment)->CollectSegments(transaction, segments);
 }
 
 void ValueArray::Delete(JsonDb::TransactionHandle &transaction, ValuePointer const &element)
 {
+	if(root_segment != null_key)
+	{
+		size_t index = 0;
+		if(ValueArraySegment::Retrieve(transaction, root_segment)->FindElement(transaction, element->GetKey(), index))
+			Delete(transaction, index);
+		return;
+	}
+
 	// Delete all sub elements
 	for(Type::iterator i = values.begin(); i != values.end(); ++i)
 	{
 		if(*i == element->GetKey())
 		{
-			// Delete the element
-			transaction->Retrieve(*i)->Delete(transaction);
+			Delete(transaction, i - values.begin());
+			return;
+		}
+	}
+}
 
-			// Remove element from list
-			values.erase(i);
+void ValueArray::Delete(JsonDb::TransactionHandle &transaction, size_t index)
+{
+	if(index >= GetSize(transaction))
+		throw std::runtime_error((boost::format("Index out of bound: %d") % index).str());
 
-			// Store the current element
-			transaction->Store(GetKey(), shared_from_this());
+	ValueKey element;
+	if(root_segment != null_key)
+	{
+		ValueArraySegment::SegmentPointer root = ValueArraySegment::Retrieve(transaction, root_segment);
+		element = root->RemoveElement(transaction, index);
+		--size;
 
-			// Done
-			return;
+		// Remove root segments with a single child
+		while(root->level > 0 && root->keys.size() == 1)
+		{
+			transaction->Delete(root->GetKey());
+			root = ValueArraySegment::Retrieve(transaction, root->keys.front());
+			root_segment = root->GetKey();
 		}
+
+		// An empty array no longer needs segments
+		if(size == 0)
+		{
+			transaction->Delete(root_segment);
+			root_segment = null_key;
+		}
+	} else
+	{
+		element = values[index];
+
+		// Remove element from list
+		values.erase(values.begin() + index);
 	}
+
+	// Delete the element
+	ValuePointer value = transaction->Retrieve(element);
+	if(!value->DeferDelete(transaction))
+		value->Delete(transaction);
+
+	// Elements after the removed element have moved
+	transaction->InvalidatePaths(GetKey());
+
+	// Store the current element
+	transaction->Store(GetKey(), shared_from_this());
 }
 
-void ValueArray::Walk(JsonDb::TransactionHandle &transaction, std::set<ValueKey> &keys)
+void ValueArray::Relink(JsonDb::TransactionHandle &transaction, size_t index, ValueKey key)
+{
+	if(index >= GetSize(transaction))
+		throw std::runtime_error((boost::format("Index out of bound: %d") % index).str());
+
+	if(root_segment != null_key)
+		ValueArraySegment::Retrieve(transaction, root_segment)->ReplaceElement(transaction, index, key);
+	else
+		values[index] = key;
+
+	transaction->Store(GetKey(), shared_from_this());
+}
+
+Value::InlineValues const *ValueArray::GetInlineValues() const
+{
+	return root_segment == null_key ? &inline_values : NULL;
+}
+
+bool ValueArray::SetInline(ValueKey key, ValuePointer const &value)
+{
+	return ::SetInline(inline_values, root_segment == null_key, key, value);
+}
+
+void ValueArray::InlineChildren(JsonDb::Transaction &transaction)
 {
-	keys.insert(GetKey());
 	for(Type::const_iterator i = values.begin(); i != values.end(); ++i)
-	 	transaction->Retrieve(*i)->Walk(transaction, keys);
+		TakeInline(transaction, GetKey(), *i, inline_values);
+}
+
+
+const size_t ValueObject::spill_threshold;
+const size_t ValueObject::member_batch_size;
+
+// A member entry of a spilled object holds the key of the member
+static std::string EncodeMember(ValueKey key)
+{
+	return std::string((char const *)&key, sizeof(ValueKey));
 }
 
+static ValueKey DecodeMember(std::string const &entry)
+{
+	return ValueReader(entry.data(), entry.size()).Read<ValueKey>();
+}
 
-void ValueObject::Serialize(std::ostream &output) const
+void ValueObject::Serialize(std::string &output) const
 {
-	unsigned char type = VALUE_OBJECT;	
-	output.write((char *)&type, sizeof(unsigned char));
-	unsigned int entries = values.size();
-	output.write((char *)&entries, sizeof(unsigned int));
+	if(spilled)
+	{
+		Write<unsigned char>(output, VALUE_OBJECT_SPILLED);
+		Write<unsigned int>(output, size);
+		return;
+	}
+
+	Write<unsigned char>(output, inline_values.empty() ? VALUE_OBJECT : VALUE_OBJECT_INLINE);
+	Write<unsigned int>(output, values.size());
 
 	for(std::map<std::string, ValueKey>::const_iterator i = values.begin(); i != values.end(); ++i)
 	{
-		unsigned int name_length = i->first.size();
-		output.write((char *)&name_length, sizeof(name_length));
-		output.write(&i->first[0], i->first.size());
-		output.write((char *)&i->second, sizeof(ValueKey));
+		Write<unsigned int>(output, i->first.size());
+		output.append(i->first);
+
+		if(inline_values.empty())
+			Write(output, i->second);
+		else
+			WriteSlot(output, i->second, inline_values);
 	}
 }
 
-void ValueObject::Print(JsonDb::TransactionHandle &transaction, std::ostream &output, unsigned int indent_level) const
+bool ValueObject::NextMembers(JsonDb::TransactionHandle &transaction, std::string &from, Type &members) const
 {
-	output << std::endl << Indent(indent_level - 1) << "{";
-	for(std::map<std::string, ValueKey>::const_iterator i = values.begin(); i != values.end(); ++i)
+	members.clear();
+
+	if(spilled)
+	{
+		JsonDb::Transaction::Entries entries;
+		transaction->RetrieveEntries(GetKey(), from, member_batch_size, entries);
+		for(JsonDb::Transaction::Entries::const_iterator i = entries.begin(); i != entries.end(); ++i)
+			members.insert(members.end(), std::make_pair(i->first, DecodeMember(i->second)));
+	} else
+	{
+		for(Type::const_iterator i = values.lower_bound(from); i != values.end() && members.size() < member_batch_size; ++i)
+			members.insert(members.end(), *i);
+	}
+
+	if(members.empty())
+		return false;
+
+	// Continue directly after the last member
+	from = members.rbegin()->first;
+	from += '\0';
+	return true;
+}
+
+ValueKey ValueObject::FindMember(JsonDb::TransactionHandle &transaction, std::string const &name) const
+{
+	if(spilled)
 	{
-		if(i != values.begin())
-			output << "," << std::endl;
-		else 
-			output << std::endl;
+		std::string entry;
+		if(!transaction->RetrieveEntry(GetKey(), name, entry))
+			return null_key;
 
-		output << Indent(indent_level) << "\"" << i->first << "\" = ";
-	 	transaction->Retrieve(i->second)->Print(transaction, output, indent_level + 1);
+		return DecodeMember(entry);
 	}
-	output << std::endl << Indent(indent_level - 1) << "}";
+
+	Type::const_iterator i = values.find(name);
+	return i != values.end() ? i->second : null_key;
+}
+
+void ValueObject::Spill(JsonDb::TransactionHandle &transaction)
+{
+	for(Type::const_iterator i = values.begin(); i != values.end(); ++i)
+		transaction->StoreEntry(GetKey(), i->first, EncodeMember(i->second));
+
+	size = values.size();
+	spilled = true;
+	values.clear();
+
+	// Entries refer to separate records only
+	MaterializeInline(transaction, inline_values);
 }
 
 ValuePointer ValueObject::Get(JsonDb::TransactionHandle &transaction, std::string const &path, NotExistsResolution not_exists_resolution)
 {
 	ValuePointer element_pointer;
 
-	Type::const_iterator i = values.find(path);
-	if(i != values.end())
-		return transaction->Retrieve(i->second);
+	ValueKey member = FindMember(transaction, path);
+	if(member != null_key)
+		return transaction->Retrieve(member);
 
 	if(not_exists_resolution == throw_exception)
 	{
@@ -211,10 +770,21 @@ ValuePointer ValueObject::Get(JsonDb::TransactionHandle &transaction, std::strin
 		return ValuePointer();
 	}
 	
-	ValueKey key = transaction->GenerateKey();
+	ValueKey key = transaction->GenerateKey(GetKey());
 	element_pointer = ValuePointer(new ValueObject(key));
 
-	values[path] = element_pointer->GetKey();
+	if(spilled)
+	{
+		transaction->StoreEntry(GetKey(), path, EncodeMember(key));
+		++size;
+	} else
+	{
+		values[path] = element_pointer->GetKey();
+
+		// Wide objects are stored as separate entries, so adding a member does not rewrite all members
+		if(values.size() > spill_threshold)
+			Spill(transaction);
+	}
 
 	transaction->Store(element_pointer->GetKey(), element_pointer);
 	transaction->Store(GetKey(), shared_from_this());
@@ -222,82 +792,114 @@ ValuePointer ValueObject::Get(JsonDb::TransactionHandle &transaction, std::strin
 	return element_pointer;
 }
 
-void ValueObject::Delete(JsonDb::TransactionHandle &transaction)
+size_t ValueObject::GetSize(JsonDb::TransactionHandle &transaction) const
 {
-	// Delete this element
-	transaction->Delete(GetKey());
-
-	// Delete all sub elements
-	for(Type::const_iterator i = values.begin(); i != values.end(); ++i)
-		transaction->Retrieve(i->second)->Delete(transaction);
+	return spilled ? size : values.size();
 }
 
 void ValueObject::Delete(JsonDb::TransactionHandle &transaction, ValuePointer const &element)
 {
-	// Delete all sub elements
-	for(Type::iterator i = values.begin(); i != values.end(); ++i)
+	// Find the name of the element
+	std::string from;
+	Type members;
+	while(NextMembers(transaction, from, members))
 	{
-		if(i->second == element->GetKey())
+		for(Type::const_iterator i = members.begin(); i != members.end(); ++i)
 		{
-			// Delete the element
-			transaction->Retrieve(i->second)->Delete(transaction);
+			if(i->second == element->GetKey())
+			{
+				Delete(transaction, i->first);
+				return;
+			}
+		}
+	}
+}
 
-			// Remove element from list
-			values.erase(i);
+void ValueObject::Delete(JsonDb::TransactionHandle &transaction, std::string const &name)
+{
+	ValueKey member = FindMember(transaction, name);
+	if(member == null_key)
+		return;
 
-			// Store the current element
-			transaction->Store(GetKey(), shared_from_this());
+	// Delete the element
+	ValuePointer value = transaction->Retrieve(member);
+	if(!value->DeferDelete(transaction))
+		value->Delete(transaction);
 
-			// Done
-			return;
-		}
+	// Remove element from list
+	if(spilled)
+	{
+		transaction->DeleteEntry(GetKey(), name);
+		--size;
+	} else
+	{
+		values.erase(name);
 	}
+
+	// Store the current element
+	transaction->Store(GetKey(), shared_from_this());
+}
+
+void ValueObject::Relink(JsonDb::TransactionHandle &transaction, std::string const &name, ValueKey key)
+{
+	if(FindMember(transaction, name) == null_key)
+		throw std::runtime_error((boost::format("Element not found in object: %s") % name).str());
+
+	if(spilled)
+		transaction->StoreEntry(GetKey(), name, EncodeMember(key));
+	else
+		values[name] = key;
+
+	transaction->Store(GetKey(), shared_from_this());
+}
+
+Value::InlineValues const *ValueObject::GetInlineValues() const
+{
+	return spilled ? NULL : &inline_values;
+}
+
+bool ValueObject::SetInline(ValueKey key, ValuePointer const &value)
+{
+	return ::SetInline(inline_values, !spilled, key, value);
 }
 
-void ValueObject::Walk(JsonDb::TransactionHandle &transaction, std::set<ValueKey> &keys)
+void ValueObject::InlineChildren(JsonDb::Transaction &transaction)
 {
-	keys.insert(GetKey());
 	for(Type::const_iterator i = values.begin(); i != values.end(); ++i)
-	 	transaction->Retrieve(i->second)->Walk(transaction, keys);
+		TakeInline(transaction, GetKey(), i->second, inline_values);
 }
 
-ValuePointer Value::Unserialize(ValueKey key, std::istream &input) 
+static ValuePointer ReadValue(ValueKey key, unsigned char type, ValueReader &input);
+
+// Read a subelement written by WriteSlot
+static void ReadSlot(ValueReader &input, ValueKey &key, Value::InlineValues &inline_values)
+{
+	key = input.Read<ValueKey>();
+
+	unsigned char type = input.Read<unsigned char>();
+	if(type != 0)
+		inline_values[key] = ReadValue(key, type, input);
+}
+
+// Read a value of the specified type, the input is positioned directly after the value
+static ValuePointer ReadValue(ValueKey key, unsigned char type, ValueReader &input)
 {
-	unsigned char type;
-	input.read((char *)&type, sizeof(unsigned char));
-	
 	// std::cout << "Type: " << (unsigned int)type << ", object: " << Value::VALUE_OBJECT << std::endl;
 	switch(type)
 	{
 		case Value::VALUE_NUMBER_INTEGER:
-		{
-			ValueNumberInteger::Type value;
-			input.read((char *)&value, sizeof(value));
-			return ValuePointer(new ValueNumberInteger(key, value));
-		}
+			return ValuePointer(new ValueNumberInteger(key, input.Read<ValueNumberInteger::Type>()));
 
 		case Value::VALUE_NUMBER_REAL:
-		{
-			ValueNumberReal::Type value;
-			input.read((char *)&value, sizeof(value));
-			return ValuePointer(new ValueNumberReal(key, value));
-		}
+			return ValuePointer(new ValueNumberReal(key, input.Read<ValueNumberReal::Type>()));
 
 		case Value::VALUE_NUMBER_BOOL:
-		{
-			ValueNumberBoolean::Type value;
-			input.read((char *)&value, sizeof(value));
-			return ValuePointer(new ValueNumberBoolean(key, value));
-		}
+			return ValuePointer(new ValueNumberBoolean(key, input.Read<ValueNumberBoolean::Type>()));
 
 		case Value::VALUE_STRING:
 		{
-			size_t len;
-			input.read((char *)&len, sizeof(size_t));
-			ValueString::Type value(len, (char)0);
-			if(len > 0)
-				input.read((char *)&value[0], len);
-			return ValuePointer(new ValueString(key, value));
+			size_t len = input.Read<size_t>();
+			return ValuePointer(new ValueString(key, ValueString::Type(input.Read(len), len)));
 		}
 
 		case Value::VALUE_NULL:
@@ -307,40 +909,176 @@ ValuePointer Value::Unserialize(ValueKey key, std::istream &input)
 
 		case Value::VALUE_ARRAY:
 		{
-			unsigned int entries;
-			input.read((char *)&entries, sizeof(entries));
+			unsigned int entries = input.ReadCount(sizeof(ValueKey));
 			
 			ValueArray::Type values(entries);
 			if(entries > 0)
-				input.read((char *)&values[0], sizeof(ValueKey) * entries);
+				memcpy(&values[0], input.Read(sizeof(ValueKey) * entries), sizeof(ValueKey) * entries);
 			
 			return ValuePointer(new ValueArray(key, values));
 		}
 
+		case Value::VALUE_ARRAY_INLINE:
+		{
+			// A slot holds a key and a type
+			unsigned int entries = input.ReadCount(sizeof(ValueKey) + 1);
+
+			ValueArray::Type values(entries);
+			Value::InlineValues inline_values;
+			for(unsigned int i = 0; i < entries; ++i)
+				ReadSlot(input, values[i], inline_values);
+
+			return ValuePointer(new ValueArray(key, values, inline_values));
+		}
+
+		case Value::VALUE_ARRAY_SEGMENTED:
+		{
+			unsigned int size = input.Read<unsigned int>();
+			return ValuePointer(new ValueArray(key, input.Read<ValueKey>(), size));
+		}
+
+		case Value::VALUE_ARRAY_SEGMENT:
+		{
+			unsigned char level = input.Read<unsigned char>();
+			unsigned int entries = input.ReadCount(sizeof(ValueKey) + (level > 0 ? sizeof(unsigned int) : 0));
+
+			ValueArraySegment::Type keys(entries);
+			if(entries > 0)
+				memcpy(&keys[0], input.Read(sizeof(ValueKey) * entries), sizeof(ValueKey) * entries);
+
+			ValueArraySegment::Counts counts(level > 0 ? entries : 0);
+			if(!counts.empty())
+				memcpy(&counts[0], input.Read(sizeof(unsigned int) * entries), sizeof(unsigned int) * entries);
+
+			return ValuePointer(new ValueArraySegment(key, level, keys, counts));
+		}
+
 		case Value::VALUE_OBJECT:
 		{
-			unsigned int entries;
-			input.read((char *)&entries, sizeof(entries));
+			// A member holds the length of its name and a key
+			unsigned int entries = input.ReadCount(sizeof(unsigned int) + sizeof(ValueKey));
 			
 			ValueObject::Type values;
 			for(unsigned int i = 0; i < entries; ++i)
 			{
-				unsigned int name_length;
-				input.read((char *)&name_length, sizeof(name_length));
+				unsigned int name_length = input.Read<unsigned int>();
+				std::string name(input.Read(name_length), name_length);
 
-				std::string name((size_t)name_length, (char)0);
-				input.read(&name[0], name_length);
+				values.insert(values.end(), std::make_pair(name, input.Read<ValueKey>()));
+			}
 
-				ValueKey value;
-				input.read((char *)&value, sizeof(value));
+			return ValuePointer(new ValueObject(key, values));
+		}
 
-				values[name] = value;
+		case Value::VALUE_OBJECT_INLINE:
+		{
+			unsigned int entries = input.ReadCount(sizeof(unsigned int) + sizeof(ValueKey) + 1);
+			
+			ValueObject::Type values;
+			Value::InlineValues inline_values;
+			for(unsigned int i = 0; i < entries; ++i)
+			{
+				unsigned int name_length = input.Read<unsigned int>();
+				std::string name(input.Read(name_length), name_length);
+
+				ValueKey member;
+				ReadSlot(input, member, inline_values);
+				values.insert(values.end(), std::make_pair(name, member));
 			}
 
-			return ValuePointer(new ValueObject(key, values));
+			return ValuePointer(new ValueObject(key, values, inline_values));
+		}
+
+		case Value::VALUE_OBJECT_SPILLED:
+		{
+			return ValuePointer(new ValueObject(key, (size_t)input.Read<unsigned int>()));
 		}
 	}; 
 
 	throw std::runtime_error("Failed to unserialize database entry");
 }
 
+ValuePointer Value::Unserialize(ValueKey key, char const *data, size_t size) 
+{
+	ValueReader input(data, size);
+	unsigned char type = input.Read<unsigned char>();
+	return ReadValue(key, type, input);
+}
+
+// Skip a value which can be stored inline, the number of an integer or real is read
+static void PeekInline(unsigned char type, ValueReader &input, double &number)
+{
+	switch(type)
+	{
+		case Value::VALUE_NUMBER_INTEGER:
+			number = input.Read<ValueNumberInteger::Type>();
+			break;
+
+		case Value::VALUE_NUMBER_REAL:
+			number = input.Read<ValueNumberReal::Type>();
+			break;
+
+		case Value::VALUE_NUMBER_BOOL:
+			input.Read<ValueNumberBoolean::Type>();
+			break;
+
+		case Value::VALUE_STRING:
+			input.Read(input.Read<size_t>());
+			break;
+
+		case Value::VALUE_NULL:
+			break;
+
+		default:
+			throw std::runtime_error("Failed to unserialize database entry");
+	}
+}
+
+Value::ValueTypeId Value::PeekNumber(char const *data, size_t size, double &number)
+{
+	ValueReader input(data, size);
+	unsigned char type = input.Read<unsigned char>();
+	if(type == VALUE_NUMBER_INTEGER || type == VALUE_NUMBER_REAL)
+		PeekInline(type, input, number);
+
+	return (ValueTypeId)type;
+}
+
+bool Value::PeekMember(char const *data, size_t size, std::string const &name, bool &found, ValueKey &key, unsigned char &type, double &number)
+{
+	ValueReader input(data, size);
+	unsigned char object_type = input.Read<unsigned char>();
+	if(object_type != VALUE_OBJECT && object_type != VALUE_OBJECT_INLINE)
+		return false;
+
+	// Members are stored ordered by name
+	found = false;
+	unsigned int entries = input.Read<unsigned int>();
+	for(unsigned int i = 0; i < entries; ++i)
+	{
+		unsigned int name_length = input.Read<unsigned int>();
+		char const *member = input.Read(name_length);
+		int order = memcmp(member, name.data(), std::min<size_t>(name_length, name.size()));
+		if(order == 0)
+			order = name_length < name.size() ? -1 : (name_length > name.size() ? 1 : 0);
+		if(order > 0)
+			break;
+
+		ValueKey member_key = input.Read<ValueKey>();
+		unsigned char member_type = object_type == VALUE_OBJECT_INLINE ? input.Read<unsigned char>() : 0;
+		double member_number = 0.0;
+		if(member_type != 0)
+			PeekInline(member_type, input, member_number);
+
+		if(order == 0)
+		{
+			found = true;
+			key = member_key;
+			type = member_type;
+			number = member_number;
+			break;
+		}
+	}
+
+	return true;
+}
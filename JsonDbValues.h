@@ -32,11 +32,6 @@ class Value
 protected:
 	ValueKey key;
 
-	static std::string Indent(unsigned int level) 
-	{
-		return std::string(level * 2, ' ');
-	}
-
 public:
 	enum ValueTypeId
 	{
@@ -45,10 +40,18 @@ public:
 		VALUE_NUMBER_BOOL			= 0x30,
 		VALUE_STRING					= 0x40,
 		VALUE_ARRAY						=	0x50,
+		VALUE_ARRAY_SEGMENTED	=	0x51,
+		VALUE_ARRAY_SEGMENT		=	0x52,
+		VALUE_ARRAY_INLINE		=	0x53,
 		VALUE_OBJECT					= 0x60,
+		VALUE_OBJECT_SPILLED	= 0x61,
+		VALUE_OBJECT_INLINE		= 0x62,
 		VALUE_NULL						= 0x70
 	};
 
+	// Elements stored inline in the record of their parent, by key
+	typedef std::map<ValueKey, ValuePointer> InlineValues;
+
 	Value(ValueKey _key)
 		: key(_key)
 	{ }
@@ -110,35 +113,91 @@ public:
 		throw std::runtime_error((boost::format("Failed to append element, item is of type '%s'") % GetTypeString()).str().c_str());
 	}
 
-	// Print to a stream
-	virtual void Print(JsonDb::TransactionHandle &transaction, std::ostream &output, unsigned int indent_level = 0) const = 0;
-
-	// Serialize to a stream
-	virtual void Serialize(std::ostream &output) const 
+	// Number of elements in a list
+	virtual size_t GetSize(JsonDb::TransactionHandle &transaction) const
 	{
-		throw std::runtime_error((boost::format("Failed to serialize object of this type: '%s'") % GetTypeString()).str().c_str());
+		throw std::runtime_error((boost::format("Failed to get number of elements, item is of type '%s'") % GetTypeString()).str().c_str());
 	}
 
-	// Delete this element
-	virtual void Delete(JsonDb::TransactionHandle &transaction)
+	// Serialize by appending to the output buffer
+	virtual void Serialize(std::string &output) const 
 	{
-		transaction->Delete(GetKey());
+		throw std::runtime_error((boost::format("Failed to serialize object of this type: '%s'") % GetTypeString()).str().c_str());
 	}
 
+	// Delete this element and all subelements
+	void Delete(JsonDb::TransactionHandle &transaction);
+
+	// Queue this element in the garbage list instead of deleting it, when the transaction defers deletes and
+	// the element has subelements. Returns false if the element has to be deleted.
+	bool DeferDelete(JsonDb::TransactionHandle &transaction);
+
 	// Delete subelement element
 	virtual void Delete(JsonDb::TransactionHandle &transaction, ValuePointer const &element)
 	{
 		throw std::runtime_error((boost::format("Failed to delete subelement from object, item is of type '%s'") % GetTypeString()).str().c_str());
 	}
 
-	// Unserialize from a stream
-	static ValuePointer Unserialize(ValueKey key, std::istream &input);
+	// Delete subelement at the specified index
+	virtual void Delete(JsonDb::TransactionHandle &transaction, size_t index)
+	{
+		throw std::runtime_error((boost::format("Failed to delete element by index, item is of type '%s'") % GetTypeString()).str().c_str());
+	}
+
+	// Delete subelement with the specified name
+	virtual void Delete(JsonDb::TransactionHandle &transaction, std::string const &name)
+	{
+		throw std::runtime_error((boost::format("Failed to delete element by name, item is of type '%s'") % GetTypeString()).str().c_str());
+	}
+
+	// Refer to another element at the specified index, the element referred to before is left alone
+	virtual void Relink(JsonDb::TransactionHandle &transaction, size_t index, ValueKey key)
+	{
+		throw std::runtime_error((boost::format("Failed to replace element by index, item is of type '%s'") % GetTypeString()).str().c_str());
+	}
+
+	// Refer to another element by the specified name, the element referred to before is left alone
+	virtual void Relink(JsonDb::TransactionHandle &transaction, std::string const &name, ValueKey key)
+	{
+		throw std::runtime_error((boost::format("Failed to replace element by name, item is of type '%s'") % GetTypeString()).str().c_str());
+	}
+
+	// Unserialize directly from the stored bytes
+	static ValuePointer Unserialize(ValueKey key, char const *data, size_t size);
+
+	// Read the type of a serialized value from the stored bytes without creating the value, and its number if it
+	// is an integer or real
+	static ValueTypeId PeekNumber(char const *data, size_t size, double &number);
+
+	// Find a member of a serialized object in the stored bytes without creating the object. Returns false if the
+	// value is not an object with its members in the record. The type of a member stored inline is read with its
+	// number if it is an integer or real, the type is 0 if the member has a record of its own.
+	static bool PeekMember(char const *data, size_t size, std::string const &name, bool &found, ValueKey &key, unsigned char &type, double &number);
+
+	// Walk through the database and retrieve the keys of all records of this element and all subelements
+	void Walk(JsonDb::TransactionHandle &transaction, std::set<ValueKey> &keys);
+
+	// Returns true if this element is small enough to be stored inline in its parent
+	virtual bool CanInline() const
+	{
+		return false;
+	}
 
-	// Walk through the database and retrieve all keys
-	virtual void Walk(JsonDb::TransactionHandle &transaction, std::set<ValueKey> &keys)
+	// Elements stored inline in this element, or NULL if this element can not store elements inline
+	virtual InlineValues const *GetInlineValues() const
 	{
-		keys.insert(GetKey());
+		return NULL;
 	}
+
+	// Store a subelement inline or remove it when the value is empty, returns true if the value is stored inline
+	virtual bool SetInline(ValueKey key, ValuePointer const &value)
+	{
+		return false;
+	}
+
+	// Move small subelements which are still to be written inline, called while flushing
+	virtual void InlineChildren(JsonDb::Transaction &transaction)
+	{ }
 };
 
 // The null element
@@ -152,8 +211,12 @@ public:
 		: Value(key)
 	{ }
 
-	void Serialize(std::ostream &output) const;
-	void Print(JsonDb::TransactionHandle &transaction, std::ostream &output, unsigned int indent_level) const;
+	void Serialize(std::string &output) const;
+
+	bool CanInline() const
+	{
+		return true;
+	}
 
 	char const *GetTypeString() const
 	{
@@ -178,8 +241,7 @@ public:
 		, value(_value)
 	{ }
 
-	void Serialize(std::ostream &output) const;
-	void Print(JsonDb::TransactionHandle &transaction, std::ostream &output, unsigned int indent_level) const;
+	void Serialize(std::string &output) const;
 
 	// Allow reading as integer
 	int GetValueInt() const
@@ -187,6 +249,11 @@ public:
 		return value;
 	}
 
+	bool CanInline() const
+	{
+		return true;
+	}
+
 	char const *GetTypeString() const
 	{
 		return "Integer";
@@ -214,8 +281,7 @@ public:
 		, value(_value)
 	{ }
 
-	void Serialize(std::ostream &output) const;
-	void Print(JsonDb::TransactionHandle &transaction, std::ostream &output, unsigned int indent_level) const;
+	void Serialize(std::string &output) const;
 
 	// Allow reading as real
 	double GetValueReal() const
@@ -223,6 +289,11 @@ public:
 		return value;
 	}
 
+	bool CanInline() const
+	{
+		return true;
+	}
+
 	char const *GetTypeString() const
 	{
 		return "Real";
@@ -248,8 +319,7 @@ public:
 		, value(_value)
 	{ }
 
-	void Serialize(std::ostream &output) const;
-	void Print(JsonDb::TransactionHandle &transaction, std::ostream &output, unsigned int indent_level) const;
+	void Serialize(std::string &output) const;
 
 	// Allow reading as boolean
 	bool GetValueBoolean() const
@@ -257,6 +327,11 @@ public:
 		return value;
 	}
 
+	bool CanInline() const
+	{
+		return true;
+	}
+
 	char const *GetTypeString() const
 	{
 		return "Boolean";
@@ -278,14 +353,16 @@ class ValueString
 public:
 	typedef std::string Type;
 
+	// Strings up to this length are stored inline in their parent
+	static const size_t inline_size = 64;
+
 	ValueString(ValueKey key, Type _value = Type())
 		: Value(key)
 		, value(_value)
 	{ }
 
 	// Allow serialize and print
-	void Serialize(std::ostream &output) const;
-	void Print(JsonDb::TransactionHandle &transaction, std::ostream &output, unsigned int indent_level) const;
+	void Serialize(std::string &output) const;
 
 	// Allow reading as string
 	std::string GetValueString() const
@@ -293,6 +370,11 @@ public:
 		return value;
 	}
 
+	bool CanInline() const
+	{
+		return value.size() <= inline_size;
+	}
+
 	char const *GetTypeString() const
 	{
 		return "String";
@@ -307,21 +389,107 @@ private:
 	Type value;
 };
 
-// An array
+// Segment of a large array. The segments form a tree, the segments at level 0 hold the
+// element keys and the segments above hold the keys of their child segments with the
+// number of elements below each child.
+class ValueArraySegment
+	: public Value
+{
+public:
+	typedef std::vector<ValueKey> Type;
+	typedef std::vector<unsigned int> Counts;
+
+	// Maximum number of entries in a segment
+	static const size_t segment_size = 256;
+
+	ValueArraySegment(ValueKey key, unsigned char _level = 0, Type _keys = Type(), Counts _counts = Counts())
+		: Value(key)
+		, level(_level)
+		, keys(_keys)
+		, counts(_counts)
+	{ }
+
+	// Allow serialize
+	void Serialize(std::string &output) const;
+
+	// Get element at the index within this segment
+	ValuePointer Get(JsonDb::TransactionHandle &transaction, size_t index);
+
+	// Number of elements below this segment
+	size_t GetSize(JsonDb::TransactionHandle &transaction) const;
+
+	char const *GetTypeString() const
+	{
+		return "ArraySegment";
+	}
+
+	ValueTypeId GetType() const 
+	{
+	 	return VALUE_ARRAY_SEGMENT;
+	}
+
+private:
+	friend class ValueArray;
+	typedef boost::shared_ptr<ValueArraySegment> SegmentPointer;
+
+	// Retrieve a segment from the database
+	static SegmentPointer Retrieve(JsonDb::TransactionHandle &transaction, ValueKey key);
+
+	// Create and store a segment
+	static SegmentPointer Create(JsonDb::TransactionHandle &transaction, unsigned char level, Type const &keys, Counts const &counts);
+
+	// Append an element at the end, returns the new right sibling when this segment is full
+	SegmentPointer AppendElement(JsonDb::TransactionHandle &transaction, ValueKey element);
+
+	// Remove the element at the index, returns the key of the removed element
+	ValueKey RemoveElement(JsonDb::TransactionHandle &transaction, size_t index);
+
+	// Replace the key of the element at the index
+	void ReplaceElement(JsonDb::TransactionHandle &transaction, size_t index, ValueKey element);
+
+	// Find the index of the element with the specified key
+	bool FindElement(JsonDb::TransactionHandle &transaction, ValueKey element, size_t &index);
+
+	// Append the keys of at most max_elements elements, starting at the index within this segment
+	void CollectElements(JsonDb::TransactionHandle &transaction, size_t index, size_t max_elements, Type &elements) const;
+
+	// Append the keys of this segment and all segments below
+	void CollectSegments(JsonDb::TransactionHandle &transaction, Type &segments) const;
+
+	unsigned char level;
+	Type keys;
+	Counts counts;
+};
+
+// An array, arrays with more than segment_threshold elements store their elements in segments
 class ValueArray
 	: public Value
 {
 public:
 	typedef std::vector<ValueKey> Type;
 
-	ValueArray(ValueKey key, Type _values = Type())
+	// Number of elements above which the elements are moved to segments
+	static const size_t segment_threshold = 1024;
+
+	// Number of elements read at once
+	static const size_t element_batch_size = 256;
+
+	ValueArray(ValueKey key, Type _values = Type(), InlineValues _inline_values = InlineValues())
 		: Value(key)
 		, values(_values)
+		, inline_values(_inline_values)
+		, root_segment(null_key)
+		, size(0)
+	{ }
+
+	ValueArray(ValueKey key, ValueKey _root_segment, unsigned int _size)
+		: Value(key)
+		, root_segment(_root_segment)
+		, size(_size)
 	{ }
 
-	// Allow serialize and printing
-	void Serialize(std::ostream &output) const;
-	void Print(JsonDb::TransactionHandle &transaction, std::ostream &output, unsigned int indent_level) const;
+	// Allow serialize
+	void Serialize(std::string &output) const;
 
 	// Allow path functions
 	ValuePointer Get(JsonDb::TransactionHandle &transaction, size_t index);
@@ -329,12 +497,28 @@ public:
 	// Append an item to a list
 	void Append(JsonDb::TransactionHandle &transaction, ValueKey key);
 
-	// Delete this element and all subelements
-	void Delete(JsonDb::TransactionHandle &transaction);
+	// Retrieve the keys of the next batch of elements, starting at the specified index. Returns false if there
+	// are no more elements
+	bool NextElements(JsonDb::TransactionHandle &transaction, size_t &from, Type &elements) const;
+
+	// Number of elements in the array
+	size_t GetSize(JsonDb::TransactionHandle &transaction) const
+	{
+		return root_segment == null_key ? values.size() : size;
+	}
+
+	// Append the keys of the segments of a segmented array
+	void CollectSegments(JsonDb::TransactionHandle &transaction, Type &segments) const;
 
 	// Delete subelement
 	void Delete(JsonDb::TransactionHandle &transaction, ValuePointer const &element);
 
+	// Delete subelement at the specified index
+	void Delete(JsonDb::TransactionHandle &transaction, size_t index);
+
+	// Refer to another element at the index
+	void Relink(JsonDb::TransactionHandle &transaction, size_t index, ValueKey key);
+
 	char const *GetTypeString() const
 	{
 		return "Array";
@@ -345,11 +529,24 @@ public:
 	 	return VALUE_ARRAY;
 	}
 
-	// Walk through the database and retrieve all keys
-	void Walk(JsonDb::TransactionHandle &transaction, std::set<ValueKey> &keys);
+	// Small elements of an array which is not segmented are stored inline
+	InlineValues const *GetInlineValues() const;
+	bool SetInline(ValueKey key, ValuePointer const &value);
+	void InlineChildren(JsonDb::Transaction &transaction);
 
 private:
+	// Move the elements to segments
+	void CreateSegments(JsonDb::TransactionHandle &transaction);
+
+	// Elements of an array which is not segmented
 	Type values;
+
+	// Elements stored inline
+	InlineValues inline_values;
+
+	// Root of the segments and number of elements of a segmented array
+	ValueKey root_segment;
+	unsigned int size;
 };
 
 // An object
@@ -360,25 +557,55 @@ class ValueObject
 public:
 	typedef std::map<std::string, ValueKey> Type;
 
-	ValueObject(ValueKey key, Type _values = Type())
+	// Objects with more members store each member as a separate entry
+	static const size_t spill_threshold = 1024;
+
+	// Number of members read at once from a spilled object
+	static const size_t member_batch_size = 256;
+
+	ValueObject(ValueKey key, Type _values = Type(), InlineValues _inline_values = InlineValues())
 		: Value(key)
 		, values(_values)
+		, inline_values(_inline_values)
+		, spilled(false)
+		, size(0)
 	{ }
 
-	// Allow serialize and printing
-	void Serialize(std::ostream &output) const;
-	void Print(JsonDb::TransactionHandle &transaction, std::ostream &output, unsigned int indent_level) const;
+	// Spilled object with the specified number of members
+	ValueObject(ValueKey key, size_t _size)
+		: Value(key)
+		, spilled(true)
+		, size(_size)
+	{ }
+
+	// Allow serialize
+	void Serialize(std::string &output) const;
 
 	// Allow path functions
 	ValuePointer Get(JsonDb::TransactionHandle &transaction, std::string const &path, NotExistsResolution not_exists_resolution);
 
-	// Delete this element and all subelements
-	void Delete(JsonDb::TransactionHandle &transaction);
-
 	// Delete a element from this object
 	void Delete(JsonDb::TransactionHandle &transaction, ValuePointer const &element);
 
-	void Walk(JsonDb::TransactionHandle &transaction, std::set<ValueKey> &keys);
+	// Delete the member with the specified name
+	void Delete(JsonDb::TransactionHandle &transaction, std::string const &name);
+
+	// Refer to another element by the name of an existing member
+	void Relink(JsonDb::TransactionHandle &transaction, std::string const &name, ValueKey key);
+
+	// Number of members
+	size_t GetSize(JsonDb::TransactionHandle &transaction) const;
+
+	// Returns true if the members are stored as separate entries
+	bool IsSpilled() const { return spilled; }
+
+	// Retrieve the next batch of members, starting at the specified name. Returns false if there are no more members
+	bool NextMembers(JsonDb::TransactionHandle &transaction, std::string &from, Type &members) const;
+
+	// Small members of an object which is not spilled are stored inline
+	InlineValues const *GetInlineValues() const;
+	bool SetInline(ValueKey key, ValuePointer const &value);
+	void InlineChildren(JsonDb::Transaction &transaction);
 
 	ValueTypeId GetType() const 
 	{
@@ -390,8 +617,17 @@ public:
 		return "Object";
 	}
 
+	// Find the key of a member, returns null_key if it does not exist
+	ValueKey FindMember(JsonDb::TransactionHandle &transaction, std::string const &name) const;
+
 private:
+	// Move all members to separate entries
+	void Spill(JsonDb::TransactionHandle &transaction);
+
 	Type values;
+	InlineValues inline_values;
+	bool spilled;
+	size_t size;
 };
 
 #endif
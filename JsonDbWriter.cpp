@@ -0,0 +1,235 @@
+/*
+ 		Copyright (C) 2010 Wouter van Kleunen
+
+		This file is part of JsonDb.
+
+    Foobar is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Foobar is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with JsonDb.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "JsonDb.h"
+#include "JsonDbValues.h"
+#include "JsonDbWriter.h"
+#include "JsonDbTraversal.h"
+
+#include <ostream>
+#include <cstdio>
+#include <cstdlib>
+
+// Writes elements as json into a buffer, which is written to the sink when it is full. The elements are
+// visited by JsonDb_Traverse, so the depth of a document is not limited by the call stack.
+class Json_writer
+	: public Json_visitor
+{
+public:
+	Json_writer(JsonDb::TransactionHandle &_transaction, std::ostream &_sink, JsonDb::ExportOptions const &_options)
+		: transaction(_transaction)
+		, sink(_sink)
+		, options(_options)
+	{
+		buffer.reserve(options.buffer_size);
+	}
+
+	// Write the element and all subelements
+	void write(ValuePointer const &root);
+
+	bool enter(ValuePointer const &parent, std::string const &name, ValuePointer const &value);
+	void leave(ValuePointer const &value);
+
+private:
+	void write_string(std::string const &value);
+	void write_real(double value);
+	void new_line();
+
+	void append(char c)
+	{
+		buffer += c;
+		if(buffer.size() >= options.buffer_size)
+			flush();
+	}
+
+	void append(char const *data, size_t size)
+	{
+		buffer.append(data, size);
+		if(buffer.size() >= options.buffer_size)
+			flush();
+	}
+
+	void flush()
+	{
+		sink.write(buffer.data(), buffer.size());
+		buffer.clear();
+	}
+
+	JsonDb::TransactionHandle &transaction;
+	std::ostream &sink;
+	JsonDb::ExportOptions const &options;
+
+	std::string buffer;
+
+	// For every open object or array whether nothing is written into it yet
+	std::vector<bool> empty;
+};
+
+void Json_writer::write(ValuePointer const &root)
+{
+	JsonDb_Traverse(transaction, root, *this);
+	flush();
+}
+
+bool Json_writer::enter(ValuePointer const &parent, std::string const &name, ValuePointer const &value)
+{
+	if(parent != NULL)
+	{
+		if(!empty.back())
+			append(',');
+		empty.back() = false;
+		new_line();
+
+		if(parent->GetType() == Value::VALUE_OBJECT)
+		{
+			write_string(name);
+			append(options.pretty ? ": " : ":", options.pretty ? 2 : 1);
+		}
+	}
+
+	char number[32];
+
+	switch(value->GetType())
+	{
+		case Value::VALUE_NULL:
+			append("null", 4);
+			break;
+
+		case Value::VALUE_NUMBER_INTEGER:
+			append(number, snprintf(number, sizeof(number), "%d", value->GetValueInt()));
+			break;
+
+		case Value::VALUE_NUMBER_REAL:
+			write_real(value->GetValueReal());
+			break;
+
+		case Value::VALUE_NUMBER_BOOL:
+			if(value->GetValueBoolean())
+				append("true", 4);
+			else
+				append("false", 5);
+			break;
+
+		case Value::VALUE_STRING:
+			write_string(value->GetValueString());
+			break;
+
+		case Value::VALUE_OBJECT:
+		case Value::VALUE_ARRAY:
+			empty.push_back(true);
+			append(value->GetType() == Value::VALUE_OBJECT ? '{' : '[');
+			return true;
+
+		default:
+			throw std::runtime_error((boost::format("Failed to export element %d, item is of type '%s'") % value->GetKey() % value->GetTypeString()).str());
+	}
+
+	return false;
+}
+
+void Json_writer::leave(ValuePointer const &value)
+{
+	bool was_empty = empty.back();
+	empty.pop_back();
+
+	if(!was_empty)
+		new_line();
+	append(value->GetType() == Value::VALUE_OBJECT ? '}' : ']');
+}
+
+void Json_writer::write_string(std::string const &value)
+{
+	static char const hex[] = "0123456789abcdef";
+
+	append('"');
+
+	// Copy the characters which need no escaping at once
+	size_t start = 0;
+	for(size_t i = 0; i < value.size(); ++i)
+	{
+		unsigned char c = value[i];
+		if(c >= 0x20 && c != '"' && c != '\\')
+			continue;
+
+		append(value.data() + start, i - start);
+		start = i + 1;
+
+		switch(c)
+		{
+			case '"': append("\\\"", 2); break;
+			case '\\': append("\\\\", 2); break;
+			case '\b': append("\\b", 2); break;
+			case '\f': append("\\f", 2); break;
+			case '\n': append("\\n", 2); break;
+			case '\r': append("\\r", 2); break;
+			case '\t': append("\\t", 2); break;
+			default:
+			{
+				char escape[] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+				append(escape, sizeof(escape));
+				break;
+			}
+		}
+	}
+
+	append(value.data() + start, value.size() - start);
+	append('"');
+}
+
+void Json_writer::write_real(double value)
+{
+	// Json has no representation for infinity and not-a-number
+	if(value != value || value - value != 0)
+	{
+		append("null", 4);
+		return;
+	}
+
+	// Use the shortest representation which reads back as the same value
+	char number[32];
+	int length = snprintf(number, sizeof(number), "%.15g", value);
+	if(strtod(number, NULL) != value)
+		length = snprintf(number, sizeof(number), "%.17g", value);
+
+	append(number, length);
+
+	// Keep the value a real when it is read again
+	for(int i = 0; i < length; ++i)
+	{
+		if(number[i] == '.' || number[i] == 'e')
+			return;
+	}
+	append(".0", 2);
+}
+
+void Json_writer::new_line()
+{
+	if(!options.pretty)
+		return;
+
+	append('\n');
+	for(size_t i = 0; i < empty.size() * options.indent; ++i)
+		append(' ');
+}
+
+void JsonDb_WriteJson(JsonDb::TransactionHandle &transaction, ValuePointer const &root, std::ostream &sink, JsonDb::ExportOptions const &options)
+{
+	Json_writer writer(transaction, sink, options);
+	writer.write(root);
+}
@@ -0,0 +1,80 @@
+/*
+ 		Copyright (C) 2010 Wouter van Kleunen
+
+		This file is part of JsonDb.
+
+    Foobar is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Foobar is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with JsonDb.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "JsonDb.h"
+
+#include <iostream>
+#include <vector>
+#include <cstdio>
+#include <boost/format.hpp>
+
+// Print the placement of the records of every member of the root
+static void PrintLocality(JsonDb &json_db, std::vector<std::string> const &members)
+{
+	JsonDb::TransactionHandle transaction = json_db.StartReadTransaction();
+	for(std::vector<std::string>::const_iterator i = members.begin(); i != members.end(); ++i)
+	{
+		JsonDb::Locality locality = json_db.GetLocality(transaction, JsonDb::Path()[*i]);
+		std::cout << boost::format("  %-24s %8d records %8d fragments %8d leaf pages")
+			% *i % locality.records % locality.fragments % locality.leaf_pages << std::endl;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	if(argc < 2)
+	{
+		std::cout << "Usage: jsondb_recluster <dbname> [member ...]" << std::endl;
+		std::cout << "Rewrites the database so the records of every subtree are stored next to each other," << std::endl;
+		std::cout << "and reports the leaf pages holding the specified members of the root before and after." << std::endl;
+		return 0;
+	}
+
+	std::string filename(argv[1]);
+	std::string target_filename = filename + ".recluster";
+	std::vector<std::string> members(argv + 2, argv + argc);
+
+	try
+	{
+		{
+			JsonDb json_db(filename);
+			std::cout << "Before:" << std::endl;
+			PrintLocality(json_db, members);
+
+			json_db.Recluster(target_filename);
+		}
+
+		if(std::rename(target_filename.c_str(), filename.c_str()) != 0)
+		{
+			std::cout << "Failed to replace " << filename << " by " << target_filename << std::endl;
+			return 1;
+		}
+
+		JsonDb json_db(filename);
+		std::cout << "After:" << std::endl;
+		PrintLocality(json_db, members);
+	} catch(std::exception &e)
+	{
+		std::cout << "Failed to recluster database: " << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
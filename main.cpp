@@ -18,11 +18,19 @@
 */
 
 #include "JsonDb.h"
+#include "JsonDbValues.h"
+#include "JsonDbPathParser.h"
+#include "JsonDbStructuralIndex.h"
 
 #include <sstream>
+#include <set>
 #include <iostream>
+#include <algorithm>
 
 #include <boost/format.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
 
 #define BOOST_TEST_DYN_LINK
 #define BOOST_TEST_MAIN
@@ -81,15 +89,16 @@ void JsonDb_CreateDatabase(JsonDb &json_db)
 	for(int i = 6; i < 10; ++i)
 		BOOST_CHECK_THROW(json_db.GetInt(transaction, (boost::format(("$.this.is.a.deep.test.path.array_value[%d]")) % i).str()), std::runtime_error);
 
-	// Create some multilevel arrays
-	json_db.SetArray(transaction, "$.this.is.a.deep.test.path.multilevel_array_value", 5);
-	for(int i = 0; i < 5; ++i)
-		json_db.SetArray(transaction, (boost::format("$.this.is.a.deep.test.path.multilevel_array_value[%d]") % i).str(), i);
+	// Create some multilevel arrays, using a compiled path
+	JsonDb::Path multilevel_array("$.this.is.a.deep.test.path.multilevel_array_value");
+	json_db.SetArray(transaction, multilevel_array, 5);
+	for(size_t i = 0; i < 5; ++i)
+		json_db.SetArray(transaction, multilevel_array[i], i);
 
 	// Validate values in multilevel array
-	for(int i = 0; i < 5; ++i)
-		for(int j = 0; j < i; ++j)
-			json_db.Set(transaction, (boost::format("$.this.is.a.deep.test.path.multilevel_array_value[%d][%d]") % i % j).str(), i * j);
+	for(size_t i = 0; i < 5; ++i)
+		for(size_t j = 0; j < i; ++j)
+			json_db.Set(transaction, multilevel_array[i][j], (int)(i * j));
 	
 	// Check exists
 	BOOST_CHECK(json_db.Exists(transaction, "$.this.is.a.deep.test.path") == true);
@@ -224,6 +233,1756 @@ void JsonDb_ParserTest(JsonDb &json_db)
 	std::cout << std::endl;
 }
 
+void JsonDb_StructuralParserTest(JsonDb &json_db)
+{
+	// Escapes, strings and numbers across the 64 byte blocks of the index
+	std::ostringstream document;
+	document << "{ \"escaped\" : \"a\\\"b\\\\\\\\\\\"c\\n\\u00e9\\ud83d\\ude00\", \"list\" : [";
+	for(int i = 0; i < 200; ++i)
+		document << (i == 0 ? "" : ",") << std::string(i % 7, ' ') << "\"" << std::string(i % 67, 'x') << "\\\\\"," << i << ", " << i << ".25, true,false ,null";
+	document << "], \"runs\" : [";
+	for(int i = 0; i < 130; ++i)
+		document << (i == 0 ? "" : ",") << "\"" << std::string(i, 'x') << "\\\\\\\"q\"";
+	document << "], \"braces\" : \"{}[]:,\" }";
+
+	std::string const json = document.str();
+	JsonDbStructuralIndex expected;
+	JsonDb_BuildStructuralIndex(json.c_str(), json.size(), expected, indexer_scalar);
+	BOOST_CHECK(!expected.single_quotes && !expected.unterminated);
+
+	JsonDbIndexer const indexers[] = { indexer_sse2, indexer_avx2 };
+	for(size_t i = 0; i < sizeof(indexers) / sizeof(indexers[0]); ++i)
+	{
+		if(!JsonDb_IndexerSupported(indexers[i]))
+			continue;
+
+		JsonDbStructuralIndex index;
+		JsonDb_BuildStructuralIndex(json.c_str(), json.size(), index, indexers[i]);
+		BOOST_CHECK(index.positions == expected.positions);
+	}
+
+	JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+	json_db.SetJson(transaction, "$.structural_test", json);
+	BOOST_CHECK(json_db.GetString(transaction, "$.structural_test.escaped") == "a\"b\\\\\"c\n\xc3\xa9\xf0\x9f\x98\x80");
+	BOOST_CHECK(json_db.GetString(transaction, "$.structural_test.braces") == "{}[]:,");
+	BOOST_CHECK(json_db.GetString(transaction, "$.structural_test.runs[63]") == std::string(63, 'x') + "\\\"q");
+	BOOST_CHECK(json_db.GetString(transaction, "$.structural_test.list[60]") == std::string(60 / 6 % 67, 'x') + "\\");
+	BOOST_CHECK(json_db.GetInt(transaction, "$.structural_test.list[61]") == 10);
+	BOOST_CHECK(json_db.GetReal(transaction, "$.structural_test.list[62]") == 10.25);
+	BOOST_CHECK(json_db.GetBool(transaction, "$.structural_test.list[63]") == true);
+	BOOST_CHECK(json_db.GetBool(transaction, "$.structural_test.list[64]") == false);
+	BOOST_CHECK(json_db.Exists(transaction, "$.structural_test.list[65]"));
+
+	// Scalars at the top level, and invalid documents
+	json_db.SetJson(transaction, "$.structural_test", " 42 ");
+	BOOST_CHECK(json_db.GetInt(transaction, "$.structural_test") == 42);
+
+	char const *invalid[] = { "", "{\"a\" 1}", "[1,]", "{\"a\":1}}", "\"unterminated", "[tru]", "[1 2]", "{\"a\":0x10}", "[1]x" };
+	for(size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); ++i)
+		BOOST_CHECK_THROW(json_db.SetJson(transaction, "$.structural_invalid", invalid[i]), std::runtime_error);
+
+	json_db.Delete(transaction, "$.structural_test");
+	json_db.Delete(transaction, "$.structural_invalid");
+}
+
+void JsonDb_PathTest(JsonDb &json_db)
+{
+	JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+
+	json_db.SetJson(transaction, "$.path_test", "{ 'a' : { 'b c' : [ 10, 20, { 'd\\'e' : 30 } ] } }");
+
+	// Compiled and derived paths resolve the same elements as path expressions
+	JsonDb::Path array_path("$.path_test.a['b c']");
+	BOOST_CHECK(json_db.GetInt(transaction, array_path[0]) == 10);
+	BOOST_CHECK(json_db.GetInt(transaction, array_path[1]) == 20);
+	BOOST_CHECK(json_db.GetInt(transaction, array_path[2]["d'e"]) == 30);
+	BOOST_CHECK(json_db.GetInt(transaction, JsonDb::Path("$.path_test")["a"]["b c"][1]) == 20);
+	BOOST_CHECK(json_db.Exists(transaction, array_path[2]["f"]) == false);
+
+	// A path printed as expression compiles to the same path
+	BOOST_CHECK(json_db.GetInt(transaction, array_path[2]["d'e"].ToString()) == 30);
+
+	BOOST_CHECK_THROW(JsonDb::Path("$.path_test["), std::runtime_error);
+	BOOST_CHECK_THROW(JsonDb::Path("path_test"), std::runtime_error);
+
+	json_db.Delete(transaction, "$.path_test");
+	BOOST_CHECK(json_db.Validate(transaction) == true);
+}
+
+void JsonDb_SegmentedArrayTest(JsonDb &json_db)
+{
+	JsonDb::Path array_path("$.segmented_array_test.array");
+	int const elements = 3000;
+
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+
+		// Large arrays are moved to segments while appending
+		json_db.SetArray(transaction, array_path, 0);
+		for(int i = 0; i < elements; ++i)
+			json_db.AppendArray(transaction, array_path, i);
+
+		// Large arrays created at once are segmented as well
+		json_db.SetArray(transaction, "$.segmented_array_test.nulls", elements);
+		json_db.Set(transaction, "$.segmented_array_test.nulls[2999]", 10);
+	}
+
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		for(int i = 0; i < elements; i += 7)
+			BOOST_CHECK(json_db.GetInt(transaction, array_path[i]) == i);
+		BOOST_CHECK(json_db.GetInt(transaction, array_path[elements - 1]) == elements - 1);
+		BOOST_CHECK_THROW(json_db.GetInt(transaction, array_path[elements]), std::runtime_error);
+		BOOST_CHECK(json_db.GetInt(transaction, "$.segmented_array_test.nulls[2999]") == 10);
+
+		// Removing elements moves the elements after it
+		json_db.Delete(transaction, array_path[0]);
+		json_db.Delete(transaction, array_path[1000]);
+		BOOST_CHECK(json_db.GetInt(transaction, array_path[0]) == 1);
+		BOOST_CHECK(json_db.GetInt(transaction, array_path[999]) == 1000);
+		BOOST_CHECK(json_db.GetInt(transaction, array_path[1000]) == 1002);
+		BOOST_CHECK(json_db.GetInt(transaction, array_path[elements - 3]) == elements - 1);
+		BOOST_CHECK_THROW(json_db.GetInt(transaction, array_path[elements - 2]), std::runtime_error);
+
+		// Remove all elements, then append again
+		for(int i = 0; i < elements - 2; ++i)
+			json_db.Delete(transaction, array_path[0]);
+		BOOST_CHECK_THROW(json_db.GetInt(transaction, array_path[0]), std::runtime_error);
+		json_db.AppendArray(transaction, array_path, 10);
+		BOOST_CHECK(json_db.GetInt(transaction, array_path[0]) == 10);
+
+		BOOST_CHECK(json_db.Validate(transaction) == true);
+		json_db.Delete(transaction, "$.segmented_array_test");
+		BOOST_CHECK(json_db.Validate(transaction) == true);
+	}
+}
+
+void JsonDb_SpilledObjectTest(JsonDb &json_db)
+{
+	JsonDb::Path object_path("$.spilled_object_test.object");
+	int const members = 2000;
+
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+
+		// Wide objects are moved to separate entries while adding members
+		for(int i = 0; i < members; ++i)
+			json_db.Set(transaction, object_path[(boost::format("member%d") % i).str()], i);
+	}
+
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		for(int i = 0; i < members; i += 7)
+			BOOST_CHECK(json_db.GetInt(transaction, object_path[(boost::format("member%d") % i).str()]) == i);
+		BOOST_CHECK(!json_db.Exists(transaction, object_path["member"]));
+
+		// Overwrite, delete and re-create members
+		json_db.Set(transaction, object_path["member10"], std::string("ten"));
+		json_db.Delete(transaction, object_path["member11"]);
+		BOOST_CHECK(json_db.GetString(transaction, object_path["member10"]) == "ten");
+		BOOST_CHECK(!json_db.Exists(transaction, object_path["member11"]));
+		json_db.Set(transaction, object_path["member11"]["a"], 11);
+		BOOST_CHECK(json_db.GetInt(transaction, object_path["member11"]["a"]) == 11);
+
+		std::ostringstream output;
+		json_db.Print(transaction, object_path, output);
+		BOOST_CHECK(output.str().find("\"member1999\": 1999") != std::string::npos);
+
+		BOOST_CHECK(json_db.Validate(transaction) == true);
+		json_db.Delete(transaction, "$.spilled_object_test");
+		BOOST_CHECK(json_db.Validate(transaction) == true);
+	}
+
+	// A member with an empty name is stored in an entry of its own, it does not replace the record of the object
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		std::string document = "{ \"\": -1";
+		for(int i = 0; i < 1100; ++i)
+			document += (boost::format(", \"m%d\": %d") % i % i).str();
+		document += " }";
+		json_db.SetJson(transaction, "$.spilled_object_test", document);
+	}
+
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		BOOST_CHECK(json_db.GetInt(transaction, "$.spilled_object_test.m5") == 5);
+		BOOST_CHECK(json_db.GetInt(transaction, JsonDb::Path("$.spilled_object_test")[""]) == -1);
+		BOOST_CHECK(json_db.Validate(transaction) == true);
+
+		json_db.Delete(transaction, JsonDb::Path("$.spilled_object_test")[""]);
+		BOOST_CHECK(!json_db.Exists(transaction, JsonDb::Path("$.spilled_object_test")[""]));
+		BOOST_CHECK(json_db.GetInt(transaction, "$.spilled_object_test.m1099") == 1099);
+
+		json_db.Delete(transaction, "$.spilled_object_test");
+		BOOST_CHECK(json_db.Validate(transaction) == true);
+	}
+}
+
+void JsonDb_InlineTest(JsonDb &json_db)
+{
+	JsonDb::Path user_path("$.inline_test.user");
+	size_t records;
+
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		json_db.SetJson(transaction, "$.inline_test", "{}");
+		records = transaction->Walk().size();
+
+		// Small members are stored in the record of the object
+		json_db.SetJson(transaction, user_path, "{ \"id\": 1, \"name\": \"user\", \"admin\": false, \"score\": 1.5, \"manager\": null, \"groups\": [1, 2, 3] }");
+		BOOST_CHECK(transaction->Walk().size() == records + 2);
+	}
+
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+
+		// Reading the object decodes all small members at once, only the parents are read
+		unsigned long misses = transaction->GetCacheMisses();
+		std::ostringstream output;
+		json_db.Print(transaction, user_path, output);
+		BOOST_CHECK(output.str().find("\"name\": \"user\"") != std::string::npos);
+		BOOST_CHECK(transaction->GetCacheMisses() - misses == 3);
+		BOOST_CHECK(json_db.GetInt(transaction, user_path["groups"][2]) == 3);
+
+		// Members are stored separately when they are no longer small, and inline again afterwards
+		json_db.Set(transaction, user_path["name"], std::string(100, 'x'));
+		BOOST_CHECK(transaction->Walk().size() == records + 3);
+		BOOST_CHECK(json_db.GetString(transaction, user_path["name"]) == std::string(100, 'x'));
+		json_db.Set(transaction, user_path["name"], std::string("name"));
+		BOOST_CHECK(transaction->Walk().size() == records + 2);
+
+		json_db.Set(transaction, user_path["id"], 2);
+		json_db.Delete(transaction, user_path["admin"]);
+		json_db.Delete(transaction, user_path["groups"][0]);
+		BOOST_CHECK(json_db.Validate(transaction) == true);
+	}
+
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		BOOST_CHECK(json_db.GetInt(transaction, user_path["id"]) == 2);
+		BOOST_CHECK(json_db.GetString(transaction, user_path["name"]) == "name");
+		BOOST_CHECK(!json_db.Exists(transaction, user_path["admin"]));
+		BOOST_CHECK(json_db.GetInt(transaction, user_path["groups"][0]) == 2);
+
+		json_db.Delete(transaction, "$.inline_test");
+		BOOST_CHECK(json_db.Validate(transaction) == true);
+	}
+}
+
+void JsonDb_ReadTransactionTest(JsonDb &json_db)
+{
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		json_db.SetJson(transaction, "$.read_test", "{ \"a\": 10, \"array\": [1, 2] }");
+	}
+
+	{
+		// Readers run next to each other
+		JsonDb::TransactionHandle reader = json_db.StartReadTransaction();
+		JsonDb::TransactionHandle other_reader = json_db.StartReadTransaction();
+		BOOST_CHECK(reader->IsReadOnly());
+		BOOST_CHECK(json_db.GetInt(reader, "$.read_test.a") == 10);
+		BOOST_CHECK(json_db.GetInt(other_reader, "$.read_test.array[1]") == 2);
+		BOOST_CHECK(!json_db.Exists(reader, "$.read_test.b"));
+
+		// Mutations fail before touching the database
+		BOOST_CHECK_THROW(json_db.Set(reader, "$.read_test.a", 11), std::runtime_error);
+		BOOST_CHECK_THROW(json_db.Set(reader, "$.read_test.b", 11), std::runtime_error);
+		BOOST_CHECK_THROW(json_db.SetJson(reader, "$.read_test.b", "{}"), std::runtime_error);
+		BOOST_CHECK_THROW(json_db.AppendArray(reader, "$.read_test.array", 3), std::runtime_error);
+		BOOST_CHECK_THROW(json_db.Delete(reader, "$.read_test"), std::runtime_error);
+		BOOST_CHECK(json_db.GetInt(reader, "$.read_test.a") == 10);
+		BOOST_CHECK(json_db.Validate(reader) == true);
+	}
+
+	{
+		// A closed database is opened as reader only
+		json_db.Close();
+		JsonDb::TransactionHandle reader = json_db.StartReadTransaction();
+		BOOST_CHECK(json_db.GetInt(reader, "$.read_test.a") == 10);
+		BOOST_CHECK_THROW(json_db.Set(reader, "$.read_test.a", 11), std::runtime_error);
+	}
+
+	{
+		// Transactions keep the database open while it is closed
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		json_db.Close();
+		json_db.Set(transaction, "$.read_test.c", 12);
+	}
+
+	{
+		// Transactions of one thread interleave, a transaction fails to modify an element committed by another
+		// transaction since it read it, and continues from the committed elements
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		BOOST_CHECK(json_db.GetInt(transaction, "$.read_test.c") == 12);
+		{
+			JsonDb::TransactionHandle other_transaction = json_db.StartTransaction();
+			json_db.Set(other_transaction, "$.read_test.x", 1);
+		}
+
+		BOOST_CHECK_THROW(json_db.Set(transaction, "$.read_test.y", 1), std::runtime_error);
+		json_db.Set(transaction, "$.read_test.y", 2);
+	}
+
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		BOOST_CHECK(json_db.GetInt(transaction, "$.read_test.c") == 12);
+		BOOST_CHECK(json_db.GetInt(transaction, "$.read_test.x") == 1);
+		BOOST_CHECK(json_db.GetInt(transaction, "$.read_test.y") == 2);
+		BOOST_CHECK(!json_db.Exists(transaction, "$.read_test.b"));
+		BOOST_CHECK(json_db.GetInt(transaction, "$.read_test.array[1]") == 2);
+		json_db.Delete(transaction, "$.read_test");
+	}
+}
+
+// Each writer modifies its own subtree, in small transactions
+static void JsonDb_ThreadWriter(JsonDb &json_db, int thread, int elements, int &errors)
+{
+	try
+	{
+		JsonDb::Path thread_path((boost::format("$.thread_test.thread%d") % thread).str());
+		for(int i = 0; i < elements; i += 10)
+		{
+			JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+			for(int j = i; j < i + 10; ++j)
+				json_db.Set(transaction, thread_path[(boost::format("element%d") % j).str()], j);
+		}
+	} catch(std::runtime_error &e)
+	{
+		++errors;
+	}
+}
+
+static void JsonDb_ThreadReader(JsonDb &json_db, int iterations, int &errors)
+{
+	try
+	{
+		for(int i = 0; i < iterations; ++i)
+		{
+			JsonDb::TransactionHandle transaction = json_db.StartReadTransaction();
+			if(json_db.GetInt(transaction, "$.thread_test.thread0.element0") != 0)
+				++errors;
+
+			std::ostringstream output;
+			json_db.Print(transaction, "$.thread_test", output);
+		}
+	} catch(std::runtime_error &e)
+	{
+		++errors;
+	}
+}
+
+void JsonDb_ThreadTest(JsonDb &json_db)
+{
+	int const threads = 4;
+	int const elements = 200;
+
+	json_db.EnableThreadSafety();
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		for(int i = 0; i < threads; ++i)
+			json_db.SetJson(transaction, (boost::format("$.thread_test.thread%d") % i).str(), "{ \"element0\": 0 }");
+	}
+
+	// Writers on different subtrees run next to readers
+	std::vector<int> errors(threads * 2);
+	boost::thread_group group;
+	for(int i = 0; i < threads; ++i)
+	{
+		group.create_thread(boost::bind(JsonDb_ThreadWriter, boost::ref(json_db), i, elements, boost::ref(errors[i])));
+		group.create_thread(boost::bind(JsonDb_ThreadReader, boost::ref(json_db), 50, boost::ref(errors[threads + i])));
+	}
+	group.join_all();
+
+	for(int i = 0; i < threads * 2; ++i)
+		BOOST_CHECK(errors[i] == 0);
+
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		for(int i = 0; i < threads; ++i)
+			for(int j = 0; j < elements; j += 7)
+				BOOST_CHECK(json_db.GetInt(transaction, (boost::format("$.thread_test.thread%d.element%d") % i % j).str()) == j);
+
+		BOOST_CHECK(json_db.Validate(transaction) == true);
+	}
+
+	{
+		// Modifying an element modified by a running transaction fails
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		JsonDb::TransactionHandle other_transaction = json_db.StartTransaction();
+		json_db.Set(transaction, "$.thread_test.thread0.a", 1);
+		json_db.Set(other_transaction, "$.thread_test.thread1.a", 1);
+		BOOST_CHECK_THROW(json_db.Set(other_transaction, "$.thread_test.thread0.b", 1), std::runtime_error);
+	}
+
+	{
+		// Modifying an element committed by another transaction since the transaction started fails, the
+		// transaction then continues from the committed elements
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		BOOST_CHECK(json_db.Exists(transaction, "$.thread_test.thread0"));
+		{
+			JsonDb::TransactionHandle other_transaction = json_db.StartTransaction();
+			json_db.Set(other_transaction, "$.thread_test.x", 1);
+		}
+
+		BOOST_CHECK_THROW(json_db.Set(transaction, "$.thread_test.y", 1), std::runtime_error);
+		json_db.Set(transaction, "$.thread_test.y", 2);
+	}
+
+	{
+		// A failing transaction undoes the writes it flushed already
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		JsonDb::TransactionHandle other_transaction = json_db.StartTransaction();
+		json_db.Set(other_transaction, "$.thread_test.thread1.z", 1);
+		json_db.Set(transaction, "$.thread_test.p", 1);
+		json_db.Set(transaction, "$.thread_test.thread0.q", std::string(100, 'q'));
+		transaction->Flush();
+		BOOST_CHECK_THROW(json_db.Set(transaction, "$.thread_test.thread1.y", 1), std::runtime_error);
+
+		JsonDb::TransactionHandle reader = json_db.StartReadTransaction();
+		BOOST_CHECK(!json_db.Exists(reader, "$.thread_test.p"));
+		BOOST_CHECK(!json_db.Exists(reader, "$.thread_test.thread0.q"));
+	}
+
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		BOOST_CHECK(json_db.GetInt(transaction, "$.thread_test.thread0.a") == 1);
+		BOOST_CHECK(!json_db.Exists(transaction, "$.thread_test.thread1.a"));
+		BOOST_CHECK(!json_db.Exists(transaction, "$.thread_test.thread0.b"));
+		BOOST_CHECK(json_db.GetInt(transaction, "$.thread_test.x") == 1);
+		BOOST_CHECK(json_db.GetInt(transaction, "$.thread_test.y") == 2);
+		BOOST_CHECK(json_db.GetInt(transaction, "$.thread_test.thread1.z") == 1);
+		BOOST_CHECK(!json_db.Exists(transaction, "$.thread_test.p"));
+		BOOST_CHECK(!json_db.Exists(transaction, "$.thread_test.thread1.y"));
+		BOOST_CHECK(json_db.Validate(transaction) == true);
+		json_db.Delete(transaction, "$.thread_test");
+		BOOST_CHECK(json_db.Validate(transaction) == true);
+	}
+
+	json_db.EnableThreadSafety(false);
+}
+
+// A commit returns after the database commit which holds its writes
+static void JsonDb_GroupCommitWriter(JsonDb &json_db, int thread, int transactions, int &errors)
+{
+	try
+	{
+		for(int i = 0; i < transactions; ++i)
+		{
+			unsigned long commits;
+			{
+				JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+				json_db.Set(transaction, (boost::format("$.group_commit_test.thread%d.element%d") % thread % i).str(), i);
+				commits = json_db.GetCommits();
+			}
+
+			if(json_db.GetCommits() <= commits)
+				++errors;
+		}
+	} catch(std::runtime_error &e)
+	{
+		++errors;
+	}
+}
+
+void JsonDb_GroupCommitTest(JsonDb &json_db)
+{
+	int const threads = 8;
+	int const transactions = 20;
+
+	json_db.EnableGroupCommit(4, 20000);
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		for(int i = 0; i < threads; ++i)
+			json_db.SetJson(transaction, (boost::format("$.group_commit_test.thread%d") % i).str(), "{}");
+	}
+
+	std::vector<int> errors(threads);
+	boost::thread_group group;
+	for(int i = 0; i < threads; ++i)
+		group.create_thread(boost::bind(JsonDb_GroupCommitWriter, boost::ref(json_db), i, transactions, boost::ref(errors[i])));
+	group.join_all();
+
+	for(int i = 0; i < threads; ++i)
+		BOOST_CHECK(errors[i] == 0);
+
+	// Transactions share database commits
+	BOOST_CHECK(json_db.GetCommits() < (unsigned long)(threads * transactions));
+
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		BOOST_CHECK(json_db.GetInt(transaction, "$.group_commit_test.thread7.element19") == 19);
+		json_db.Delete(transaction, "$.group_commit_test");
+		BOOST_CHECK(json_db.Validate(transaction) == true);
+	}
+
+	json_db.EnableThreadSafety(false);
+}
+
+void JsonDb_ImportTest(JsonDb &json_db)
+{
+	// A document larger than a chunk, with a long string and wide objects and arrays
+	std::string long_string(100000, 'x');
+	std::ostringstream document;
+	document << "{ \"name\" : \"line\\none \\\"quoted\\\" \\u00e9\", \"long\" : \"" << long_string << "\", \"members\" : {";
+	for(int i = 0; i < 3000; ++i)
+		document << (i == 0 ? "" : ",") << "\"member" << i << "\":" << i;
+	document << "}, \"elements\" : [";
+	for(int i = 0; i < 5000; ++i)
+		document << (i == 0 ? "" : ",") << "{ \"value\" : " << i << ", \"real\" : " << i << ".5, \"flag\" : " << (i % 2 == 0 ? "true" : "false") << ", \"none\" : null }";
+	document << "], 'empty' : [ ], 'single' : 'quoted' }";
+
+	unsigned long commits = json_db.GetCommits();
+	std::istringstream input(document.str());
+	BOOST_CHECK(json_db.ImportJson("$.import_test", input, 1000) == document.str().size());
+
+	// The import is committed in batches
+	BOOST_CHECK(json_db.GetCommits() > commits + 10);
+
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartReadTransaction();
+		BOOST_CHECK(json_db.GetString(transaction, "$.import_test.name") == "line\none \"quoted\" \xc3\xa9");
+		BOOST_CHECK(json_db.GetString(transaction, "$.import_test.long") == long_string);
+		BOOST_CHECK(json_db.GetInt(transaction, "$.import_test.members.member0") == 0);
+		BOOST_CHECK(json_db.GetInt(transaction, "$.import_test.members.member2999") == 2999);
+		BOOST_CHECK(json_db.GetInt(transaction, "$.import_test.elements[4999].value") == 4999);
+		BOOST_CHECK(json_db.GetReal(transaction, "$.import_test.elements[10].real") == 10.5);
+		BOOST_CHECK(json_db.GetBool(transaction, "$.import_test.elements[10].flag") == true);
+		BOOST_CHECK(json_db.Exists(transaction, "$.import_test.elements[10].none"));
+		BOOST_CHECK(json_db.GetString(transaction, "$.import_test.single") == "quoted");
+	}
+
+	// Invalid documents are reported
+	std::istringstream invalid("{ \"a\" : [ 1, 2 }");
+	BOOST_CHECK_THROW(json_db.ImportJson("$.import_invalid", invalid), std::runtime_error);
+	std::istringstream truncated("{ \"a\" : \"unterminated");
+	BOOST_CHECK_THROW(json_db.ImportJson("$.import_invalid", truncated), std::runtime_error);
+
+	JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+	json_db.Delete(transaction, "$.import_test");
+	json_db.Delete(transaction, "$.import_invalid");
+	BOOST_CHECK(json_db.Validate(transaction) == true);
+}
+
+// Serves a document in small chunks, and calls the function before reading every chunk
+class Chunked_input
+	: public std::streambuf
+{
+public:
+	Chunked_input(std::string const &_document, size_t _chunk_size, boost::function<void ()> const &_before_chunk)
+		: document(_document), chunk_size(_chunk_size), before_chunk(_before_chunk), position(0)
+	{ }
+
+protected:
+	int_type underflow()
+	{
+		if(position == document.size())
+			return traits_type::eof();
+
+		before_chunk();
+
+		char *data = &document[position];
+		size_t size = std::min(chunk_size, document.size() - position);
+		setg(data, data, data + size);
+		position += size;
+		return traits_type::to_int_type(*data);
+	}
+
+private:
+	std::string document;
+	size_t chunk_size;
+	boost::function<void ()> before_chunk;
+	size_t position;
+};
+
+// Check that the users committed so far by the import are found in the index, and count the checks after the
+// first batch
+static void CheckImportedIndex(JsonDb &json_db, size_t &checks)
+{
+	JsonDb::TransactionHandle transaction = json_db.StartReadTransaction();
+	ValuePointer array = JsonDb_ResolveJsonPath(transaction, JsonDb::Path("$.import_index_test.users"), transaction->GetRoot(), throw_exception).second;
+	size_t users = array->GetSize(transaction);
+	int first = json_db.GetInt(transaction, "$.import_index_test.users[0].id");
+	int last = json_db.GetInt(transaction, (boost::format("$.import_index_test.users[%d].id") % (users - 1)).str());
+
+	BOOST_CHECK(json_db.Lookup(transaction, "import_id", first).size() == 1);
+	BOOST_CHECK(json_db.Lookup(transaction, "import_id", last).size() == 1);
+	BOOST_CHECK(json_db.Lookup(transaction, "import_id", last + 1).empty());
+	if(users > 1)
+		++checks;
+}
+
+void JsonDb_ImportIndexTest(JsonDb &json_db)
+{
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		json_db.SetJson(transaction, "$.import_index_test", "{ \"users\": [ { \"id\": -1 } ] }");
+		json_db.CreateIndex(transaction, "import_id", "$.import_index_test.users[*].id");
+	}
+
+	std::ostringstream document;
+	document << "{ \"users\": [";
+	for(int i = 0; i < 20000; ++i)
+		document << (i == 0 ? "" : ", ") << "{ \"id\": " << i << ", \"name\": \"user " << i << "\" }";
+	document << "] }";
+
+	// The index holds the values of every committed batch, and no longer the values replaced by the import
+	size_t checks = 0;
+	Chunked_input chunks(document.str(), 4096, boost::bind(&CheckImportedIndex, boost::ref(json_db), boost::ref(checks)));
+	std::istream input(&chunks);
+	json_db.ImportJson("$.import_index_test", input, 1000);
+	BOOST_CHECK(checks > 5);
+
+	JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+	BOOST_CHECK(json_db.Lookup(transaction, "import_id", -1).empty());
+	BOOST_CHECK(json_db.Lookup(transaction, "import_id", 19999).size() == 1);
+	BOOST_CHECK(json_db.GetInt(transaction, json_db.Lookup(transaction, "import_id", 12345)[0]) == 12345);
+	BOOST_CHECK(json_db.Validate(transaction) == true);
+
+	json_db.DropIndex(transaction, "import_id");
+	json_db.Delete(transaction, "$.import_index_test");
+}
+
+void JsonDb_ExportTest(JsonDb &json_db)
+{
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		json_db.SetJson(transaction, "$.export_test.small", "{ \"b\": [1, 2.5, true, null, \"x\"], \"a\": {}, \"c\": [] }");
+		json_db.Set(transaction, "$.export_test.escaped", std::string("quote \" backslash \\ newline \n tab \t control \x01"));
+		json_db.Set(transaction, "$.export_test.real", 3.0);
+
+		// Compact and pretty output
+		std::ostringstream compact;
+		json_db.Export(transaction, "$.export_test.small", compact);
+		BOOST_CHECK(compact.str() == "{\"a\":{},\"b\":[1,2.5,true,null,\"x\"],\"c\":[]}");
+
+		std::ostringstream pretty;
+		json_db.Export(transaction, "$.export_test.small", pretty, JsonDb::ExportOptions(true, 2));
+		BOOST_CHECK(pretty.str() == "{\n  \"a\": {},\n  \"b\": [\n    1,\n    2.5,\n    true,\n    null,\n    \"x\"\n  ],\n  \"c\": []\n}");
+
+		// Strings are escaped, reals stay reals
+		std::ostringstream escaped;
+		json_db.Export(transaction, "$.export_test.escaped", escaped);
+		BOOST_CHECK(escaped.str() == "\"quote \\\" backslash \\\\ newline \\n tab \\t control \\u0001\"");
+
+		std::ostringstream real;
+		json_db.Export(transaction, "$.export_test.real", real);
+		BOOST_CHECK(real.str() == "3.0");
+
+		// Wide objects, long arrays and deep documents, written through a small buffer
+		json_db.SetArray(transaction, "$.export_test.large.array", 0);
+		for(int i = 0; i < 2000; ++i)
+		{
+			json_db.Set(transaction, (boost::format("$.export_test.large.object.member%d") % i).str(), i);
+			json_db.AppendArray(transaction, "$.export_test.large.array", i);
+		}
+	}
+
+	std::string deep = std::string(1000, '[') + std::string(1000, ']');
+	std::istringstream deep_input(deep);
+	json_db.ImportJson("$.export_test.deep", deep_input);
+
+	// The exported json reads back as the same document
+	std::ostringstream exported;
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartReadTransaction();
+
+		std::ostringstream deep_output;
+		json_db.Export(transaction, "$.export_test.deep", deep_output, JsonDb::ExportOptions(false, 2, 16));
+		BOOST_CHECK(deep_output.str() == deep);
+
+		json_db.Export(transaction, "$.export_test", exported, JsonDb::ExportOptions(true, 2, 16));
+	}
+
+	std::istringstream input(exported.str());
+	json_db.ImportJson("$.export_copy", input);
+
+	JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+	std::ostringstream copy;
+	json_db.Export(transaction, "$.export_copy", copy, JsonDb::ExportOptions(true, 2, 16));
+	BOOST_CHECK(copy.str() == exported.str());
+	BOOST_CHECK(json_db.GetInt(transaction, "$.export_copy.large.object.member1999") == 1999);
+	BOOST_CHECK(json_db.GetInt(transaction, "$.export_copy.large.array[1999]") == 1999);
+
+	json_db.Delete(transaction, "$.export_test");
+	json_db.Delete(transaction, "$.export_copy");
+	BOOST_CHECK(json_db.Validate(transaction) == true);
+}
+
+void JsonDb_LocalityTest(JsonDb &json_db)
+{
+	std::string const element = "{ \"text\": \"a string which is too long to be stored inline in its parent object\" }";
+	{
+		// Transactions take keys from the extents leased to them, without taking the keys of each other
+		JsonDb::TransactionHandle first = json_db.StartTransaction();
+		JsonDb::TransactionHandle second = json_db.StartTransaction();
+		ValueKey parents[2] = { first->GenerateKey(), second->GenerateKey() };
+
+		std::set<ValueKey> keys;
+		for(int i = 0; i < 1000; ++i)
+		{
+			keys.insert(first->GenerateKey(parents[i % 2]));
+			keys.insert(second->GenerateKey(parents[i % 2]));
+		}
+		BOOST_CHECK(keys.size() == 2000);
+		BOOST_CHECK(keys.find(parents[0]) == keys.end() && keys.find(parents[1]) == keys.end());
+	}
+
+	{
+		// The keys a transaction did not take are leased to the next transaction
+		ValueKey parent = null_key;
+		ValueKey key = null_key;
+		{
+			JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+			parent = transaction->GenerateKey();
+			key = transaction->GenerateKey(parent);
+		}
+
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		BOOST_CHECK(transaction->GenerateKey(parent) == key + 1);
+	}
+
+	{
+		// Elements appended to two arrays in turn are allocated in the extents of their own array
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		json_db.SetJson(transaction, "$.locality_test", "{ \"a\": [], \"b\": [] }");
+		for(int i = 0; i < 500; ++i)
+		{
+			json_db.AppendArrayJson(transaction, "$.locality_test.a", element);
+			json_db.AppendArrayJson(transaction, "$.locality_test.b", element);
+		}
+
+		JsonDb::Locality locality = json_db.GetLocality(transaction, "$.locality_test.a");
+		BOOST_CHECK(locality.records > 1000);
+		BOOST_CHECK(locality.fragments <= locality.records / JsonDb::Storage::extent_size + JsonDb::Storage::shared_extent_children + 2);
+		BOOST_CHECK(locality.leaf_pages <= locality.records / transaction->GetRecordsPerLeaf() + 2 * locality.fragments);
+	}
+
+	// After the database is opened again the array continues in a new extent
+	json_db.Close();
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		for(int i = 0; i < 10; ++i)
+			json_db.AppendArrayJson(transaction, "$.locality_test.a", element);
+
+		JsonDb::Locality locality = json_db.GetLocality(transaction, "$.locality_test.a");
+		BOOST_CHECK(locality.fragments <= locality.records / JsonDb::Storage::extent_size + JsonDb::Storage::shared_extent_children + 3);
+	}
+
+	// A reclustered copy holds the same documents, every member of the root in a single run of records
+	std::ostringstream original;
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartReadTransaction();
+		json_db.Export(transaction, "$", original);
+	}
+
+	json_db.Recluster("locality_test.db");
+	{
+		JsonDb copy("locality_test.db");
+		JsonDb::TransactionHandle transaction = copy.StartTransaction();
+
+		std::ostringstream copied;
+		copy.Export(transaction, "$", copied);
+		BOOST_CHECK(copied.str() == original.str());
+		BOOST_CHECK(copy.GetLocality(transaction, "$.locality_test").fragments == 1);
+		BOOST_CHECK(copy.GetLocality(transaction, "$.locality_test.a").fragments <= 2);
+		BOOST_CHECK(copy.Validate(transaction) == true);
+	}
+
+	JsonDb("locality_test.db").Delete();
+
+	JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+	json_db.Delete(transaction, "$.locality_test");
+	BOOST_CHECK(json_db.Validate(transaction) == true);
+}
+
+void JsonDb_TraversalTest(JsonDb &json_db)
+{
+	// Documents deeper than the call stack can be exported, validated and deleted
+	std::string deep = std::string(100000, '[') + std::string(100000, ']');
+	std::istringstream deep_input(deep);
+	json_db.ImportJson("$.traversal_test.deep", deep_input);
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		json_db.SetJson(transaction, "$.traversal_test.wide", "{ \"array\": [], \"objects\": [] }");
+		for(int i = 0; i < 3000; ++i)
+		{
+			json_db.AppendArray(transaction, "$.traversal_test.wide.array", (boost::format("element %d which is too long to be stored inline") % i).str());
+			json_db.AppendArrayJson(transaction, "$.traversal_test.wide.objects", (boost::format("{ \"index\": %d, \"tags\": [\"a\", \"b\"] }") % i).str());
+		}
+		for(int i = 0; i < 1000; ++i)
+			json_db.Set(transaction, (boost::format("$.traversal_test.wide.object.member%d") % i).str(), i);
+	}
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+
+		std::ostringstream deep_output;
+		json_db.Export(transaction, "$.traversal_test.deep", deep_output);
+		BOOST_CHECK(deep_output.str() == deep);
+		BOOST_CHECK(json_db.Validate(transaction) == true);
+
+		// Elements decoded from a batch read are the same as elements read one at a time
+		std::vector<ValueKey> keys = transaction->WalkRecords();
+		std::reverse(keys.begin(), keys.end());
+		keys.push_back(keys.front());
+		keys.push_back(null_key);
+
+		transaction->ClearCache();
+		JsonDb::Transaction::RecordBatch batch;
+		transaction->ReadBatch(keys, batch);
+		BOOST_CHECK(!batch.keys.empty() && batch.offsets.size() == batch.keys.size() + 1);
+
+		std::vector<ValuePointer> values;
+		for(size_t i = 0; i < keys.size(); ++i)
+			values.push_back(transaction->Retrieve(keys[i], batch));
+
+		transaction->ClearCache();
+		size_t mismatches = 0;
+		for(size_t i = 0; i < keys.size(); ++i)
+		{
+			std::string batched, single;
+			ValuePointer value = transaction->Retrieve(keys[i]);
+			if(value == NULL || values[i] == NULL)
+			{
+				++mismatches;
+				continue;
+			}
+			value->Serialize(single);
+			values[i]->Serialize(batched);
+			if(batched != single || values[i]->GetKey() != value->GetKey())
+				++mismatches;
+		}
+		BOOST_CHECK(mismatches == 0);
+
+		// Keys without a record are not in the batch
+		std::vector<ValueKey> missing(1, -1);
+		transaction->ReadBatch(missing, batch);
+		BOOST_CHECK(batch.keys.empty());
+		BOOST_CHECK(transaction->Retrieve(-1, batch) == NULL);
+
+		json_db.Delete(transaction, "$.traversal_test.deep");
+		json_db.Delete(transaction, "$.traversal_test.wide.objects");
+		BOOST_CHECK(json_db.Validate(transaction) == true);
+		BOOST_CHECK(json_db.GetInt(transaction, "$.traversal_test.wide.object.member999") == 999);
+	}
+
+	JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+	json_db.Delete(transaction, "$.traversal_test");
+	BOOST_CHECK(json_db.Validate(transaction) == true);
+}
+
+void JsonDb_ValidatorTest(JsonDb &json_db)
+{
+	std::string const text = "a string which is too long to be stored inline in the array holding it";
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		json_db.SetArray(transaction, "$.validator_test.array", 0);
+		for(int i = 0; i < 10000; ++i)
+			json_db.AppendArray(transaction, "$.validator_test.array", text);
+		for(int i = 0; i < 5000; ++i)
+			json_db.Set(transaction, (boost::format("$.validator_test.object.member%d") % i).str(), i);
+
+		JsonDb::ValidationReport report = json_db.Validate(transaction, 4);
+		BOOST_CHECK(report.IsValid());
+		BOOST_CHECK(report.threads == 1);
+		BOOST_CHECK(report.records > 10000 && report.reachable == report.records);
+		BOOST_CHECK(report.entries >= 5000);
+	}
+
+	// A record missing from the tree, a record not in the tree and an entry without a record are reported
+	ValueKey stale_key;
+	ValueKey missing_key;
+	ValuePointer missing_value;
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		ValuePointer array = transaction->GetRoot()->Get(transaction, std::string("validator_test"), throw_exception)->Get(transaction, std::string("array"), throw_exception);
+		missing_value = array->Get(transaction, 5000);
+		missing_key = missing_value->GetKey();
+		transaction->Delete(missing_key);
+
+		stale_key = transaction->GenerateKey();
+		transaction->Store(stale_key, ValuePointer(new ValueNumberInteger(stale_key, 1)));
+		transaction->StoreEntry(transaction->GenerateKey(), "orphan", "entry");
+
+		JsonDb::ValidationReport report = json_db.Validate(transaction, 1);
+		BOOST_CHECK(!report.IsValid());
+		BOOST_CHECK(report.missing == 1 && report.missing_keys == std::vector<ValueKey>(1, missing_key));
+		BOOST_CHECK(report.stale == 1 && report.stale_keys == std::vector<ValueKey>(1, stale_key));
+		BOOST_CHECK(report.orphan_entries == 1);
+		BOOST_CHECK(json_db.Validate(transaction) == false);
+	}
+
+	// Threads walking a closed database through their own readers find the same
+	json_db.Close();
+	{
+		JsonDb::TransactionHandle reader = json_db.StartReadTransaction();
+		JsonDb::ValidationReport report = json_db.Validate(reader, 4);
+		BOOST_CHECK(report.threads == 4);
+		BOOST_CHECK(report.missing_keys == std::vector<ValueKey>(1, missing_key));
+		BOOST_CHECK(report.stale_keys == std::vector<ValueKey>(1, stale_key));
+		BOOST_CHECK(report.orphan_entries == 1);
+		BOOST_CHECK(report.errors.empty());
+
+		std::ostringstream summary;
+		report.Print(summary);
+		BOOST_CHECK(summary.str().find(boost::lexical_cast<std::string>(stale_key)) != std::string::npos);
+	}
+
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		transaction->Store(missing_key, missing_value);
+		transaction->Delete(stale_key);
+		transaction->DeleteEntry(stale_key + 1, "orphan");
+	}
+
+	json_db.Close();
+	{
+		JsonDb::TransactionHandle reader = json_db.StartReadTransaction();
+		JsonDb::ValidationReport single = json_db.Validate(reader, 1);
+		JsonDb::ValidationReport parallel = json_db.Validate(reader, 4);
+		BOOST_CHECK(single.IsValid() && parallel.IsValid());
+		BOOST_CHECK(parallel.records == single.records && parallel.reachable == single.reachable);
+	}
+
+	JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+	json_db.Delete(transaction, "$.validator_test");
+	BOOST_CHECK(json_db.Validate(transaction) == true);
+}
+
+void JsonDb_CompactionTest(JsonDb &json_db)
+{
+	std::string const text = "a string which is too long to be stored inline in the array holding it";
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		json_db.SetArray(transaction, "$.compaction_test.array", 0);
+		for(int i = 0; i < 5000; ++i)
+			json_db.AppendArray(transaction, "$.compaction_test.array", text);
+	}
+
+	JsonDb::CompactionReport clean = json_db.Compact();
+	BOOST_CHECK(clean.complete && clean.slices == 1);
+	BOOST_CHECK(clean.removed_records == 0 && clean.removed_entries == 0);
+	BOOST_CHECK(clean.records > 5000 && clean.pages_rewritten > 0);
+
+	// Records and entries which are not reachable from the root
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		for(int i = 0; i < 1000; ++i)
+		{
+			ValueKey key = transaction->GenerateKey();
+			transaction->Store(key, ValuePointer(new ValueString(key, text)));
+		}
+
+		ValueKey orphan = transaction->GenerateKey();
+		for(int i = 0; i < 600; ++i)
+			transaction->StoreEntry(orphan, (boost::format("entry%d") % i).str(), text);
+	}
+
+	// Elements written between the slices are kept, also the elements which move to a part of an array which
+	// is marked already
+	JsonDb::CompactionReport report;
+	size_t appended = 0;
+	while(!(report = json_db.Compact(1)).complete)
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		json_db.Delete(transaction, "$.compaction_test.array[0]");
+		json_db.AppendArray(transaction, "$.compaction_test.array", text);
+		json_db.Set(transaction, (boost::format("$.compaction_test.object.member%d") % appended).str(), text);
+		++appended;
+	}
+
+	BOOST_CHECK(report.slices > 1 && report.slices == appended + 1);
+	BOOST_CHECK(report.removed_records == 1000);
+	BOOST_CHECK(report.removed_entries == 600);
+	BOOST_CHECK(report.size_before > report.size_after && report.GetReclaimed() == report.size_before - report.size_after);
+
+	JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+	JsonDb::ValidationReport validation = json_db.Validate(transaction, 1);
+	BOOST_CHECK(validation.IsValid());
+	BOOST_CHECK(json_db.GetString(transaction, "$.compaction_test.array[4999]") == text);
+	BOOST_CHECK(json_db.GetString(transaction, (boost::format("$.compaction_test.object.member%d") % (appended - 1)).str()) == text);
+
+	json_db.Delete(transaction, "$.compaction_test");
+}
+
+// Number of elements in the garbage list
+static size_t GarbageSize(JsonDb::TransactionHandle &transaction)
+{
+	size_t size = 0;
+	std::string from;
+	std::vector<ValueKey> keys;
+	while(transaction->NextGarbage(from, keys))
+		size += keys.size();
+	return size;
+}
+
+void JsonDb_DeferredDeleteTest(JsonDb &json_db)
+{
+	size_t records;
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		records = json_db.Validate(transaction, 1).records;
+	}
+
+	json_db.EnableDeferredDelete();
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		json_db.SetArray(transaction, "$.deferred_test.array", 0);
+		for(int i = 0; i < 2000; ++i)
+			json_db.AppendArrayJson(transaction, "$.deferred_test.array", "{ 'name': 'a name which is too long to be stored inline in the object', 'tags': [1, 2, 3] }");
+		for(int i = 0; i < 1500; ++i)
+			json_db.Set(transaction, (boost::format("$.deferred_test.object.member%d") % i).str(), i);
+	}
+
+	// Elements are unlinked from their parent, and stay in the database until they are reclaimed
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		json_db.Set(transaction, "$.deferred_test.array[1500]", 10);
+		json_db.Set(transaction, "$.deferred_test.object", 20);
+		json_db.Delete(transaction, "$.deferred_test.array[0]");
+
+		BOOST_CHECK(json_db.GetInt(transaction, "$.deferred_test.array[1499]") == 10);
+		BOOST_CHECK(json_db.GetInt(transaction, "$.deferred_test.object") == 20);
+		BOOST_CHECK(json_db.GetString(transaction, "$.deferred_test.array[0].name") == "a name which is too long to be stored inline in the object");
+		BOOST_CHECK(GarbageSize(transaction) == 3);
+		BOOST_CHECK(json_db.Validate(transaction, 1).IsValid());
+	}
+
+	json_db.Close();
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		json_db.Delete(transaction, "$.deferred_test.array");
+		BOOST_CHECK(GarbageSize(transaction) == 4);
+		BOOST_CHECK(json_db.Exists(transaction, "$.deferred_test.array") == false);
+	}
+
+	// The garbage list is reclaimed in bounded batches, also after the database is opened again
+	json_db.Close();
+	size_t batches = 0;
+	size_t reclaimed;
+	while((reclaimed = json_db.Reclaim(100)) > 0)
+	{
+		BOOST_CHECK(reclaimed <= 100);
+		++batches;
+	}
+
+	BOOST_CHECK(batches > 20);
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		BOOST_CHECK(GarbageSize(transaction) == 0);
+
+		JsonDb::ValidationReport report = json_db.Validate(transaction, 1);
+		BOOST_CHECK(report.IsValid());
+
+		json_db.Delete(transaction, "$.deferred_test");
+	}
+
+	// Replacing a subtree with a parsed document unlinks it as well, the replaced elements stay in the database
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		json_db.SetJson(transaction, "$.deferred_test.replaced", "[]");
+		for(int i = 0; i < 2000; ++i)
+			json_db.AppendArrayJson(transaction, "$.deferred_test.replaced", "{ 'a': [1, 2, 3] }");
+	}
+
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		size_t garbage = GarbageSize(transaction);
+		size_t stored = transaction->WalkRecords().size();
+
+		json_db.SetJson(transaction, "$.deferred_test.replaced", "{ 'b': { 'c': 1 } }");
+		json_db.SetJson(transaction, "$.deferred_test.replaced.b", "[4, 5]");
+		BOOST_CHECK(json_db.GetInt(transaction, "$.deferred_test.replaced.b[1]") == 5);
+		BOOST_CHECK(GarbageSize(transaction) == garbage + 2);
+		BOOST_CHECK(transaction->WalkRecords().size() >= stored);
+
+		// The old array is queued with its elements
+		bool queued = false;
+		std::string from;
+		std::vector<ValueKey> keys;
+		while(transaction->NextGarbage(from, keys))
+		{
+			for(std::vector<ValueKey>::const_iterator i = keys.begin(); i != keys.end(); ++i)
+			{
+				ValuePointer value = transaction->Retrieve(*i);
+				queued = queued || (value != NULL && value->GetType() == Value::VALUE_ARRAY && value->GetSize(transaction) == 2000);
+			}
+		}
+
+		BOOST_CHECK(queued);
+		BOOST_CHECK(json_db.Validate(transaction, 1).IsValid());
+	}
+
+	// The reclaimer thread empties the garbage list in the background
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		for(int i = 0; i < 500; ++i)
+			json_db.SetJson(transaction, (boost::format("$.deferred_test.member%d") % i).str(), "{ 'a': [1, 2, { 'b': 3 }] }");
+		json_db.Delete(transaction, "$.deferred_test");
+	}
+
+	json_db.StartReclaimer(64, 1);
+	for(int i = 0; i < 1000; ++i)
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartReadTransaction();
+		if(GarbageSize(transaction) == 0)
+			break;
+		boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+	}
+	json_db.StopReclaimer();
+
+	json_db.EnableDeferredDelete(false);
+	json_db.EnableThreadSafety(false);
+
+	JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+	BOOST_CHECK(GarbageSize(transaction) == 0);
+
+	JsonDb::ValidationReport report = json_db.Validate(transaction, 1);
+	BOOST_CHECK(report.IsValid());
+	BOOST_CHECK(report.records == records);
+}
+
+// Paths of the values in an index equal to the value, as expressions
+template<typename T>
+static std::vector<std::string> Lookup(JsonDb &json_db, JsonDb::TransactionHandle &transaction, std::string const &index, T value)
+{
+	std::vector<JsonDb::Path> paths = json_db.Lookup(transaction, index, value);
+
+	std::vector<std::string> result;
+	for(std::vector<JsonDb::Path>::const_iterator i = paths.begin(); i != paths.end(); ++i)
+		result.push_back(i->ToString());
+	return result;
+}
+
+void JsonDb_IndexTest(JsonDb &json_db)
+{
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		json_db.SetArray(transaction, "$.index_test.users", 0);
+		for(int i = 0; i < 2000; ++i)
+			json_db.AppendArrayJson(transaction, "$.index_test.users", (boost::format("{ \"name\": \"user %d\", \"email\": \"user%d@example.com\", \"age\": %d }") % i % i % (i % 50)).str());
+
+		json_db.SetJson(transaction, "$.index_test.groups", "{ \"a\": { \"tag\": \"red\" }, \"b\": { \"tag\": \"blue\" }, \"c\": { \"tag\": \"red\" } }");
+	}
+
+	// Indexes are built from the values in the database
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		json_db.CreateIndex(transaction, "email", "$.index_test.users[*].email");
+		json_db.CreateIndex(transaction, "age", "$.index_test.users[*].age");
+		json_db.CreateIndex(transaction, "tag", "$.index_test.groups.*.tag");
+		BOOST_CHECK_THROW(json_db.CreateIndex(transaction, "email", "$.index_test.users[*].name"), std::runtime_error);
+		BOOST_CHECK_THROW(json_db.GetString(transaction, "$.index_test.users[*].email"), std::runtime_error);
+
+		std::vector<std::string> paths = Lookup(json_db, transaction, "email", "user7@example.com");
+		BOOST_CHECK(paths.size() == 1 && paths[0] == JsonDb::Path("$.index_test.users[7].email").ToString());
+		BOOST_CHECK(Lookup(json_db, transaction, "age", 10).size() == 40);
+		BOOST_CHECK(Lookup(json_db, transaction, "age", 10.0).empty());
+		BOOST_CHECK(Lookup(json_db, transaction, "email", "user7@example").empty());
+
+		paths = Lookup(json_db, transaction, "tag", "red");
+		BOOST_CHECK(paths.size() == 2);
+		BOOST_CHECK(std::find(paths.begin(), paths.end(), JsonDb::Path("$.index_test.groups.c.tag").ToString()) != paths.end());
+	}
+
+	// Changes are applied to the indexes in the same transaction
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		json_db.Set(transaction, "$.index_test.users[3].email", "changed@example.com");
+		json_db.AppendArrayJson(transaction, "$.index_test.users", "{ \"name\": \"user 2000\", \"email\": \"user2000@example.com\", \"age\": 10 }");
+		json_db.SetJson(transaction, "$.index_test.users[5]", "{ \"name\": \"user 5\", \"email\": \"json@example.com\", \"age\": 99 }");
+		json_db.Set(transaction, "$.index_test.groups.b.tag", "red");
+
+		BOOST_CHECK(Lookup(json_db, transaction, "email", "user3@example.com").empty());
+		BOOST_CHECK(Lookup(json_db, transaction, "email", "changed@example.com").size() == 1);
+		BOOST_CHECK(Lookup(json_db, transaction, "email", "user2000@example.com")[0] == JsonDb::Path("$.index_test.users[2000].email").ToString());
+		BOOST_CHECK(Lookup(json_db, transaction, "email", "user5@example.com").empty());
+		BOOST_CHECK(Lookup(json_db, transaction, "age", 99).size() == 1);
+		BOOST_CHECK(Lookup(json_db, transaction, "age", 10).size() == 41);
+		BOOST_CHECK(Lookup(json_db, transaction, "tag", "red").size() == 3);
+	}
+
+	// Elements after a deleted element are found at their new index
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		json_db.Delete(transaction, "$.index_test.users[0]");
+		json_db.Delete(transaction, "$.index_test.groups.a");
+
+		BOOST_CHECK(Lookup(json_db, transaction, "email", "user0@example.com").empty());
+		BOOST_CHECK(Lookup(json_db, transaction, "email", "user1@example.com")[0] == JsonDb::Path("$.index_test.users[0].email").ToString());
+		BOOST_CHECK(Lookup(json_db, transaction, "email", "user1999@example.com")[0] == JsonDb::Path("$.index_test.users[1998].email").ToString());
+		BOOST_CHECK(Lookup(json_db, transaction, "age", 0).size() == 39);
+		BOOST_CHECK(Lookup(json_db, transaction, "tag", "red").size() == 2);
+		BOOST_CHECK(json_db.Validate(transaction, 1).IsValid());
+	}
+
+	// A transaction failing to modify an element discards its changes of the indexes with its other changes
+	json_db.EnableThreadSafety();
+	{
+		JsonDb::TransactionHandle first = json_db.StartTransaction();
+		json_db.Set(first, "$.index_test.users[1].email", "first@example.com");
+
+		JsonDb::TransactionHandle second = json_db.StartTransaction();
+		BOOST_CHECK_THROW(json_db.Set(second, "$.index_test.users[1].email", "second@example.com"), std::runtime_error);
+	}
+
+	// The index changes flushed by a failing transaction are undone with the elements
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		std::string email = json_db.GetString(transaction, "$.index_test.users[4].email");
+
+		JsonDb::TransactionHandle other_transaction = json_db.StartTransaction();
+		json_db.Set(other_transaction, "$.index_test.users[6].email", "other@example.com");
+
+		json_db.Set(transaction, "$.index_test.users[4].email", "flushed@example.com");
+		transaction->Flush();
+		BOOST_CHECK_THROW(json_db.Set(transaction, "$.index_test.users[6].email", "failed@example.com"), std::runtime_error);
+
+		BOOST_CHECK(Lookup(json_db, transaction, "email", "flushed@example.com").empty());
+		BOOST_CHECK(Lookup(json_db, transaction, "email", email)[0] == JsonDb::Path("$.index_test.users[4].email").ToString());
+
+		JsonDb::ValidationReport report = json_db.Validate(transaction, 1);
+		BOOST_CHECK(report.IsValid());
+		BOOST_CHECK(report.missing_index_entries == 0 && report.stale_index_entries == 0);
+	}
+	json_db.EnableThreadSafety(false);
+
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		BOOST_CHECK(Lookup(json_db, transaction, "email", "first@example.com").size() == 1);
+		BOOST_CHECK(Lookup(json_db, transaction, "email", "second@example.com").empty());
+		BOOST_CHECK(Lookup(json_db, transaction, "email", "user2@example.com").empty());
+		BOOST_CHECK(Lookup(json_db, transaction, "email", "user1@example.com").size() == 1);
+
+		// A missing entry is reported by the validation
+		ValueKey key = null_key;
+		JsonDb::Transaction::Indexes const &indexes = transaction->GetIndexes();
+		for(JsonDb::Transaction::Indexes::const_iterator i = indexes.begin(); i != indexes.end(); ++i)
+			if(i->name == "email")
+				key = i->key;
+
+		JsonDb::Transaction::Entries entries;
+		transaction->RetrieveEntries(key, std::string(), 1, entries);
+		BOOST_REQUIRE(entries.size() == 1);
+		transaction->DeleteEntry(key, entries[0].first);
+
+		JsonDb::ValidationReport report = json_db.Validate(transaction, 1);
+		BOOST_CHECK(!report.IsValid());
+		BOOST_CHECK(report.missing_index_entries == 1 && report.stale_index_entries == 0);
+
+		transaction->StoreEntry(key, entries[0].first, entries[0].second);
+		report = json_db.Validate(transaction, 1);
+		BOOST_CHECK(report.IsValid());
+		BOOST_CHECK(report.index_entries == 2000 * 2 + 2);
+	}
+
+	// The indexes are stored in the database, and kept by a compaction
+	json_db.Close();
+	BOOST_CHECK(json_db.Compact().complete);
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		BOOST_CHECK(Lookup(json_db, transaction, "email", "user1000@example.com")[0] == JsonDb::Path("$.index_test.users[999].email").ToString());
+		BOOST_CHECK(json_db.Validate(transaction, 1).IsValid());
+
+		json_db.DropIndex(transaction, "email");
+		json_db.DropIndex(transaction, "age");
+		json_db.DropIndex(transaction, "tag");
+		BOOST_CHECK_THROW(json_db.Lookup(transaction, "email", "user1000@example.com"), std::runtime_error);
+		json_db.Delete(transaction, "$.index_test");
+
+		JsonDb::ValidationReport report = json_db.Validate(transaction, 1);
+		BOOST_CHECK(report.IsValid());
+		BOOST_CHECK(report.index_entries == 0);
+	}
+}
+
+// Paths of the elements matching a query, as expressions
+static std::vector<std::string> Select(JsonDb &json_db, JsonDb::TransactionHandle &transaction, JsonDb::Query const &query)
+{
+	std::vector<JsonDb::Path> paths = json_db.SelectPaths(transaction, query);
+
+	std::vector<std::string> result;
+	for(std::vector<JsonDb::Path>::const_iterator i = paths.begin(); i != paths.end(); ++i)
+		result.push_back(i->ToString());
+	return result;
+}
+
+static bool CollectTitle(std::vector<std::string> &titles, size_t limit, JsonDb::Path const &path, ValuePointer const &value)
+{
+	titles.push_back(value->GetValueString());
+	return titles.size() < limit;
+}
+
+void JsonDb_QueryTest(JsonDb &json_db)
+{
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		json_db.SetJson(transaction, "$.query_test.store", "{ \"book\": [ { \"title\": \"a\", \"price\": 8.95 }, { \"title\": \"b\", \"price\": 12.99 }, "
+			"{ \"title\": \"c\", \"price\": 8.99, \"isbn\": \"0-553-21311-3\" } ], \"bicycle\": { \"color\": \"red\", \"price\": 19.95 } }");
+
+		json_db.SetArray(transaction, "$.query_test.users", 0);
+		for(int i = 0; i < 600; ++i)
+			json_db.AppendArrayJson(transaction, "$.query_test.users", (boost::format("{ \"name\": \"user %d\", \"age\": %d, \"active\": %s }") % i % (i % 60) % (i % 3 == 0 ? "true" : "false")).str());
+	}
+
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+
+		// Wildcards and recursive descent, in document order
+		std::vector<std::string> paths = Select(json_db, transaction, "$.query_test.store.book[*].title");
+		BOOST_CHECK(paths.size() == 3 && paths[2] == JsonDb::Path("$.query_test.store.book[2].title").ToString());
+		paths = Select(json_db, transaction, "$.query_test.store..price");
+		BOOST_CHECK(paths.size() == 4 && paths[0] == JsonDb::Path("$.query_test.store.bicycle.price").ToString());
+		BOOST_CHECK(Select(json_db, transaction, "$.query_test.store.*").size() == 2);
+		BOOST_CHECK(Select(json_db, transaction, "$.query_test.store..*").size() == 14);
+		BOOST_CHECK(Select(json_db, transaction, "$.query_test..[0].title").size() == 1);
+		BOOST_CHECK(Select(json_db, transaction, "$").size() == 1);
+		BOOST_CHECK(Select(json_db, transaction, "$.query_test.missing[*]").empty());
+
+		// Indexes and slices
+		paths = Select(json_db, transaction, "$.query_test.store.book[-1]");
+		BOOST_CHECK(paths.size() == 1 && paths[0] == JsonDb::Path("$.query_test.store.book[2]").ToString());
+		paths = Select(json_db, transaction, "$.query_test.store.book[::-1]");
+		BOOST_CHECK(paths.size() == 3 && paths[0] == JsonDb::Path("$.query_test.store.book[2]").ToString());
+		paths = Select(json_db, transaction, "$.query_test.store.book[0:3:2]");
+		BOOST_CHECK(paths.size() == 2 && paths[1] == JsonDb::Path("$.query_test.store.book[2]").ToString());
+		BOOST_CHECK(Select(json_db, transaction, "$.query_test.users[10:20]").size() == 10);
+		BOOST_CHECK(Select(json_db, transaction, "$.query_test.users[-5:]").size() == 5);
+		BOOST_CHECK(Select(json_db, transaction, "$.query_test.users[590:1000:3]").size() == 4);
+		BOOST_CHECK(Select(json_db, transaction, "$.query_test.users[5:1]").empty());
+		BOOST_CHECK(Select(json_db, transaction, "$.query_test..book[1:]").size() == 2);
+
+		// Filters
+		paths = Select(json_db, transaction, "$.query_test.store.book[?(@.price < 9)].title");
+		BOOST_CHECK(paths.size() == 2 && paths[1] == JsonDb::Path("$.query_test.store.book[2].title").ToString());
+		paths = Select(json_db, transaction, "$.query_test.store.book[?(!@.isbn && @.price > 10)]");
+		BOOST_CHECK(paths.size() == 1 && paths[0] == JsonDb::Path("$.query_test.store.book[1]").ToString());
+		BOOST_CHECK(Select(json_db, transaction, "$.query_test.store.book[?@.isbn]").size() == 1);
+		BOOST_CHECK(Select(json_db, transaction, "$.query_test.store.book[?(@.title == 'b' || @.price == 8.95)]").size() == 2);
+		BOOST_CHECK(Select(json_db, transaction, "$.query_test.store.book[?(@.title >= \"b\")]").size() == 2);
+		BOOST_CHECK(Select(json_db, transaction, "$.query_test.store.book[?(@.title == 8)]").empty());
+		BOOST_CHECK(Select(json_db, transaction, "$.query_test.store.book[?(@.missing != 1)]").size() == 3);
+		BOOST_CHECK(Select(json_db, transaction, "$.query_test..[?(@.price > 15)].color").size() == 1);
+
+		size_t active = 0;
+		for(int i = 0; i < 600; ++i)
+			if(i % 60 > 30 && i % 3 == 0)
+				++active;
+		BOOST_CHECK(Select(json_db, transaction, "$.query_test.users[?(@.age > 30 && @.active)]").size() == active);
+		BOOST_CHECK(Select(json_db, transaction, "$.query_test.users[?(@.age == 45.0)]").size() == 10);
+
+		// The receiver gets the matching values, and stops the query
+		std::vector<std::string> titles;
+		BOOST_CHECK(json_db.Select(transaction, "$..book[*].title", boost::bind(&CollectTitle, boost::ref(titles), 2, _1, _2)) == 2);
+		BOOST_CHECK(titles.size() == 2 && titles[0] == "a" && titles[1] == "b");
+
+		BOOST_CHECK_THROW(JsonDb::Query("$.query_test["), std::runtime_error);
+		BOOST_CHECK_THROW(JsonDb::Query("$.query_test[?(@.age >)]"), std::runtime_error);
+		BOOST_CHECK_THROW(JsonDb::Query("$.query_test[?(10)]"), std::runtime_error);
+		BOOST_CHECK_THROW(JsonDb::Query("$.query_test..."), std::runtime_error);
+		BOOST_CHECK_THROW(JsonDb::Query("query_test"), std::runtime_error);
+	}
+
+	// A filter comparing a member with a value is answered by an index on the member, with the same result
+	std::vector<std::string> scanned;
+	unsigned long scan_misses;
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		scanned = Select(json_db, transaction, "$.query_test.users[?(@.age == 45 && @.active)].name");
+		scan_misses = transaction->GetCacheMisses();
+		BOOST_CHECK(scanned.size() == 10);
+
+		json_db.CreateIndex(transaction, "query_age", "$.query_test.users[*].age");
+	}
+
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		BOOST_CHECK(Select(json_db, transaction, "$.query_test.users[?(@.age == 45 && @.active)].name") == scanned);
+		BOOST_CHECK(transaction->GetCacheMisses() < scan_misses);
+		BOOST_CHECK(Select(json_db, transaction, "$.query_test.users[?(@.active && 45.0 == @.age)].name") == scanned);
+
+		json_db.Delete(transaction, "$.query_test.users[0]");
+		BOOST_CHECK(Select(json_db, transaction, "$.query_test.users[?(@.age == 0)]").size() == 9);
+
+		json_db.DropIndex(transaction, "query_age");
+		json_db.Delete(transaction, "$.query_test");
+		BOOST_CHECK(json_db.Validate(transaction));
+	}
+}
+
+static std::vector<std::string> Scan(JsonDb &json_db, JsonDb::TransactionHandle &transaction, std::string const &index, JsonDb::IndexRange const &range)
+{
+	std::vector<JsonDb::Path> paths = json_db.Scan(transaction, index, range);
+
+	std::vector<std::string> result;
+	for(std::vector<JsonDb::Path>::const_iterator i = paths.begin(); i != paths.end(); ++i)
+		result.push_back(i->ToString());
+	return result;
+}
+
+void JsonDb_OrderedIndexTest(JsonDb &json_db)
+{
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		json_db.SetArray(transaction, "$.ordered_test.events", 0);
+		for(int i = 0; i < 1000; ++i)
+		{
+			std::string total = i % 2 == 0 ? boost::lexical_cast<std::string>(i) : (boost::format("%d.5") % i).str();
+			json_db.AppendArrayJson(transaction, "$.ordered_test.events", (boost::format("{ \"name\": \"event %04d\", \"ts\": %d, \"total\": %s }") % i % (i * 10) % total).str());
+		}
+
+		json_db.CreateOrderedIndex(transaction, "ts", "$.ordered_test.events[*].ts");
+		json_db.CreateOrderedIndex(transaction, "total", "$.ordered_test.events[*].total");
+		json_db.CreateOrderedIndex(transaction, "name", "$.ordered_test.events[*].name");
+		json_db.CreateIndex(transaction, "unordered", "$.ordered_test.events[*].ts");
+	}
+
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+
+		// The latest values, scanned from the end
+		std::vector<std::string> paths = Scan(json_db, transaction, "ts", JsonDb::IndexRange().Descending().Limit(50));
+		BOOST_CHECK(paths.size() == 50);
+		BOOST_CHECK(paths[0] == JsonDb::Path("$.ordered_test.events[999]['ts']").ToString());
+		BOOST_CHECK(paths[49] == JsonDb::Path("$.ordered_test.events[950]['ts']").ToString());
+
+		paths = Scan(json_db, transaction, "ts", JsonDb::IndexRange().From(100).To(200).Descending().Limit(3));
+		BOOST_CHECK(paths.size() == 3 && paths[0] == JsonDb::Path("$.ordered_test.events[20].ts").ToString());
+
+		// Bounds are included unless they are exclusive
+		BOOST_CHECK(json_db.Count(transaction, "ts", JsonDb::IndexRange().From(100).To(200)) == 11);
+		BOOST_CHECK(json_db.Count(transaction, "ts", JsonDb::IndexRange().From(100).To(200, true)) == 10);
+		BOOST_CHECK(json_db.Count(transaction, "ts", JsonDb::IndexRange().From(100, true).To(200, true)) == 9);
+		BOOST_CHECK(json_db.Count(transaction, "ts", JsonDb::IndexRange().From(95).To(105).Descending()) == 1);
+		BOOST_CHECK(json_db.Count(transaction, "ts", JsonDb::IndexRange().From(200).To(100)) == 0);
+		BOOST_CHECK(json_db.Count(transaction, "ts", JsonDb::IndexRange()) == 1000);
+		BOOST_CHECK(json_db.Count(transaction, "ts", JsonDb::IndexRange().Descending()) == 1000);
+		BOOST_CHECK(json_db.Count(transaction, "ts", JsonDb::IndexRange().From("a")) == 0);
+
+		// Integers and reals are ordered by value
+		paths = Scan(json_db, transaction, "total", JsonDb::IndexRange().From(10).To(20.0));
+		BOOST_CHECK(paths.size() == 11);
+		BOOST_CHECK(paths[1] == JsonDb::Path("$.ordered_test.events[11].total").ToString());
+		BOOST_CHECK(json_db.Lookup(transaction, "total", 12).size() == 1 && json_db.Lookup(transaction, "total", 12.0).size() == 1);
+		BOOST_CHECK(json_db.SelectPaths(transaction, "$.ordered_test.events[?(@.total == 13.5)]").size() == 1);
+
+		BOOST_CHECK(json_db.Count(transaction, "name", JsonDb::IndexRange().From("event 0100").To("event 0199")) == 100);
+		BOOST_CHECK(json_db.Count(transaction, "name", JsonDb::IndexRange().From("event").To("event 0")) == 0);
+
+		BOOST_CHECK_THROW(json_db.Scan(transaction, "unordered", JsonDb::IndexRange()), std::runtime_error);
+		BOOST_CHECK_THROW(json_db.Count(transaction, "missing", JsonDb::IndexRange()), std::runtime_error);
+	}
+
+	// Changes are applied to the ordered indexes in the same transaction
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		json_db.Set(transaction, "$.ordered_test.events[500].total", -5.5);
+		json_db.AppendArrayJson(transaction, "$.ordered_test.events", "{ \"name\": \"event 1000\", \"ts\": 100000, \"total\": 0 }");
+		json_db.Delete(transaction, "$.ordered_test.events[0]");
+
+		std::vector<std::string> paths = Scan(json_db, transaction, "total", JsonDb::IndexRange().Limit(1));
+		BOOST_CHECK(paths.size() == 1 && paths[0] == JsonDb::Path("$.ordered_test.events[499].total").ToString());
+		paths = Scan(json_db, transaction, "ts", JsonDb::IndexRange().Descending().Limit(1));
+		BOOST_CHECK(paths.size() == 1 && paths[0] == JsonDb::Path("$.ordered_test.events[999].ts").ToString());
+		BOOST_CHECK(json_db.Count(transaction, "ts", JsonDb::IndexRange().To(0)) == 0);
+		BOOST_CHECK(json_db.Count(transaction, "total", JsonDb::IndexRange().To(0)) == 2);
+		BOOST_CHECK(json_db.Validate(transaction, 1).IsValid());
+	}
+
+	// The kind of index is kept in the database
+	json_db.Close();
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		BOOST_CHECK(json_db.Count(transaction, "ts", JsonDb::IndexRange().From(100000)) == 1);
+
+		json_db.DropIndex(transaction, "ts");
+		json_db.DropIndex(transaction, "total");
+		json_db.DropIndex(transaction, "name");
+		json_db.DropIndex(transaction, "unordered");
+		json_db.Delete(transaction, "$.ordered_test");
+
+		JsonDb::ValidationReport report = json_db.Validate(transaction, 1);
+		BOOST_CHECK(report.IsValid() && report.index_entries == 0);
+	}
+}
+
+void JsonDb_AggregateTest(JsonDb &json_db)
+{
+	double sum = 0.0;
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		json_db.SetArray(transaction, "$.aggregate_test.metrics", 0);
+		json_db.SetArray(transaction, "$.aggregate_test.numbers", 0);
+		for(int i = 0; i < 2000; ++i)
+		{
+			std::string value = i % 2 == 0 ? boost::lexical_cast<std::string>(i) : (boost::format("%d.5") % i).str();
+			json_db.AppendArrayJson(transaction, "$.aggregate_test.metrics", (boost::format("{ \"name\": \"metric %d\", \"value\": %s }") % i % value).str());
+			json_db.AppendArray(transaction, "$.aggregate_test.numbers", i);
+			sum += i % 2 == 0 ? i : i + 0.5;
+		}
+
+		json_db.SetJson(transaction, "$.aggregate_test.groups", "[ { \"values\": [1, 2, 3] }, { \"values\": [4.5, \"a\", null] }, { \"other\": 1 } ]");
+		json_db.AppendArrayJson(transaction, "$.aggregate_test.metrics", "{ \"name\": \"no value\" }");
+		json_db.AppendArrayJson(transaction, "$.aggregate_test.metrics", "{ \"name\": \"text\", \"value\": \"text\" }");
+	}
+
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+
+		// The numbers of records which are not decoded yet are read from the stored bytes
+		unsigned long misses = transaction->GetCacheMisses();
+		JsonDb::Aggregates aggregates = json_db.Aggregate(transaction, "$.aggregate_test.metrics[*].value");
+		BOOST_CHECK(aggregates.count == 2001 && aggregates.numbers == 2000);
+		BOOST_CHECK(aggregates.sum == sum && aggregates.min == 0.0 && aggregates.max == 1999.5);
+		BOOST_CHECK(aggregates.GetAverage() == sum / 2000);
+		BOOST_CHECK(transaction->GetCacheMisses() - misses < 100);
+
+		aggregates = json_db.Aggregate(transaction, "$.aggregate_test.numbers[*]", JsonDb::aggregate_sum);
+		BOOST_CHECK(aggregates.count == 2000 && aggregates.sum == 1999.0 * 2000 / 2 && aggregates.max == 1999.0);
+
+		// Counting the elements of the last step only reads the array
+		misses = transaction->GetCacheMisses();
+		aggregates = json_db.Aggregate(transaction, "$.aggregate_test.metrics[*]", JsonDb::aggregate_count);
+		BOOST_CHECK(aggregates.count == 2002 && aggregates.numbers == 0);
+		BOOST_CHECK(transaction->GetCacheMisses() - misses < 10);
+		BOOST_CHECK(json_db.Aggregate(transaction, "$.aggregate_test.*", JsonDb::aggregate_count).count == 3);
+
+		aggregates = json_db.Aggregate(transaction, "$.aggregate_test.groups[*].values[*]");
+		BOOST_CHECK(aggregates.count == 6 && aggregates.numbers == 4 && aggregates.sum == 10.5 && aggregates.min == 1.0);
+		BOOST_CHECK(json_db.Aggregate(transaction, "$.aggregate_test.groups[1].values[0]").sum == 4.5);
+		BOOST_CHECK(json_db.Aggregate(transaction, "$.aggregate_test.missing[*]").count == 0);
+		BOOST_CHECK(json_db.Aggregate(transaction, "$.aggregate_test.metrics[*].name.value").count == 0);
+
+		// Values changed by the transaction are aggregated as changed
+		json_db.Set(transaction, "$.aggregate_test.metrics[10].value", 1000000);
+		json_db.Delete(transaction, "$.aggregate_test.numbers[1999]");
+		aggregates = json_db.Aggregate(transaction, "$.aggregate_test.metrics[*].value");
+		BOOST_CHECK(aggregates.count == 2001 && aggregates.max == 1000000.0 && aggregates.sum == sum - 10 + 1000000);
+		BOOST_CHECK(json_db.Aggregate(transaction, "$.aggregate_test.numbers[*]").max == 1998.0);
+
+		json_db.Delete(transaction, "$.aggregate_test");
+	}
+
+	ValuePointer element;
+	ValuePointer member;
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		std::string const text = "a string which is too long to be stored inline in the object holding it";
+		json_db.SetArray(transaction, "$.aggregate_test.texts", 0);
+		for(int i = 0; i < 10; ++i)
+			json_db.AppendArrayJson(transaction, "$.aggregate_test.texts", (boost::format("{ \"text\": \"%s\" }") % text).str());
+
+		ValuePointer texts = transaction->GetRoot()->Get(transaction, std::string("aggregate_test"), throw_exception)->Get(transaction, std::string("texts"), throw_exception);
+		element = texts->Get(transaction, 5);
+		member = element->Get(transaction, std::string("text"), throw_exception);
+	}
+
+	// A missing element or member fails the aggregate instead of giving a partial result
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		transaction->Delete(member->GetKey());
+		BOOST_CHECK_THROW(json_db.Aggregate(transaction, "$.aggregate_test.texts[*].text"), std::runtime_error);
+		BOOST_CHECK_THROW(json_db.Aggregate(transaction, "$.aggregate_test.texts[5].text"), std::runtime_error);
+		transaction->Store(member->GetKey(), member);
+	}
+
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		transaction->Delete(element->GetKey());
+		BOOST_CHECK_THROW(json_db.Aggregate(transaction, "$.aggregate_test.texts[*]", JsonDb::aggregate_sum), std::runtime_error);
+		BOOST_CHECK_THROW(json_db.Aggregate(transaction, "$.aggregate_test.texts[5].text"), std::runtime_error);
+		transaction->Store(element->GetKey(), element);
+	}
+
+	JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+	BOOST_CHECK(json_db.Aggregate(transaction, "$.aggregate_test.texts[*].text").count == 10);
+	json_db.Delete(transaction, "$.aggregate_test");
+	BOOST_CHECK(json_db.Validate(transaction) == true);
+}
+
+void JsonDb_StatisticsTest(JsonDb &json_db)
+{
+	typedef JsonDb::Statistics Statistics;
+
+	// Without statistics the records are counted, the latencies are not measured
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		json_db.Set(transaction, "$.statistics_test.value", 10);
+		json_db.SetJson(transaction, "$.statistics_test.array", "[ [1, 2], [3, 4] ]");
+		transaction->Commit();
+
+		Statistics const &statistics = transaction->GetStatistics();
+		BOOST_CHECK(statistics.writes > 0 && statistics.bytes_written > 0);
+		BOOST_CHECK(statistics.latencies[Statistics::operation_resolve].count == 0);
+		BOOST_CHECK(statistics.latencies[Statistics::operation_commit].count == 0);
+	}
+
+	BOOST_CHECK(json_db.GetStatistics().writes == 0);
+
+	json_db.EnableStatistics();
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		json_db.SetJson(transaction, "$.statistics_test.object", "{ \"a\": [1, 2, 3], \"b\": \"test\" }");
+		BOOST_CHECK(json_db.GetInt(transaction, "$.statistics_test.object.a[1]") == 2);
+		json_db.Delete(transaction, "$.statistics_test.array");
+		transaction->Commit();
+
+		Statistics const &statistics = transaction->GetStatistics();
+		BOOST_CHECK(statistics.latencies[Statistics::operation_parse].count == 1);
+		BOOST_CHECK(statistics.latencies[Statistics::operation_resolve].count >= 3);
+		BOOST_CHECK(statistics.latencies[Statistics::operation_retrieve].count > 0);
+		BOOST_CHECK(statistics.latencies[Statistics::operation_store].count > 0);
+		BOOST_CHECK(statistics.latencies[Statistics::operation_delete].count > 0);
+		BOOST_CHECK(statistics.latencies[Statistics::operation_commit].count == 1);
+		BOOST_CHECK(statistics.writes > 0 && statistics.removes > 0);
+
+		// The statistics of the transaction are added when it ends
+		BOOST_CHECK(json_db.GetStatistics().latencies[Statistics::operation_parse].count == 0);
+	}
+
+	Statistics totals = json_db.GetStatistics();
+	BOOST_CHECK(totals.latencies[Statistics::operation_parse].count == 1);
+	BOOST_CHECK(totals.latencies[Statistics::operation_commit].count == 1);
+	BOOST_CHECK(totals.writes > 0 && totals.bytes_written > 0);
+
+	// Readers are counted as well, also when reading a closed database
+	json_db.Close();
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartReadTransaction();
+		BOOST_CHECK(json_db.GetString(transaction, "$.statistics_test.object.b") == "test");
+		BOOST_CHECK(transaction->GetStatistics().reads > 0 && transaction->GetStatistics().bytes_read > 0);
+	}
+
+	BOOST_CHECK(json_db.GetStatistics().reads > totals.reads);
+	BOOST_CHECK(json_db.GetStatistics().latencies[Statistics::operation_resolve].count > totals.latencies[Statistics::operation_resolve].count);
+
+	std::ostringstream output;
+	json_db.GetStatistics().Print(output);
+	BOOST_CHECK(output.str().find("commit") != std::string::npos && output.str().find("Records read") != std::string::npos);
+
+	json_db.ResetStatistics();
+	BOOST_CHECK(json_db.GetStatistics().reads == 0 && json_db.GetStatistics().latencies[Statistics::operation_commit].count == 0);
+
+	// Latencies are counted in buckets of powers of two microseconds
+	Statistics::Latency latency;
+	latency.Add(0);
+	latency.Add(1);
+	latency.Add(3);
+	latency.Add(1000);
+	BOOST_CHECK(latency.count == 4 && latency.max == 1000 && latency.GetAverage() == 251.0);
+	BOOST_CHECK(latency.GetPercentile(0.25) == 0 && latency.GetPercentile(0.5) == 1 && latency.GetPercentile(0.75) == 3);
+	BOOST_CHECK(latency.GetPercentile(1.0) == 1000);
+
+	json_db.EnableStatistics(false);
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		json_db.Delete(transaction, "$.statistics_test");
+	}
+
+	BOOST_CHECK(json_db.GetStatistics().writes == 0);
+}
+
+void JsonDb_CacheTest(JsonDb &json_db)
+{
+	JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+
+	json_db.Set(transaction, "$.cache_test.a.b.c", 10);
+	BOOST_CHECK(json_db.GetInt(transaction, "$.cache_test.a.b.c") == 10);
+
+	// Repeated lookups under the same prefix should not decode any records
+	unsigned long misses = transaction->GetCacheMisses();
+	unsigned long hits = transaction->GetCacheHits();
+	for(int i = 0; i < 10; ++i)
+		BOOST_CHECK(json_db.GetInt(transaction, "$.cache_test.a.b.c") == 10);
+	BOOST_CHECK(transaction->GetCacheMisses() == misses);
+	BOOST_CHECK(transaction->GetCacheHits() > hits);
+
+	// Cached values follow stores and deletes
+	json_db.Set(transaction, "$.cache_test.a.b.c", "replaced");
+	BOOST_CHECK(json_db.GetString(transaction, "$.cache_test.a.b.c") == "replaced");
+	json_db.Delete(transaction, "$.cache_test.a");
+	BOOST_CHECK(json_db.Exists(transaction, "$.cache_test.a.b.c") == false);
+	json_db.Delete(transaction, "$.cache_test");
+
+	BOOST_CHECK(json_db.Validate(transaction) == true);
+
+	// A corrupt number of entries fails the decode before storage is reserved for the entries
+	unsigned char const types[] = { Value::VALUE_ARRAY, Value::VALUE_ARRAY_INLINE, Value::VALUE_ARRAY_SEGMENT, Value::VALUE_OBJECT, Value::VALUE_OBJECT_INLINE };
+	for(size_t i = 0; i < sizeof(types); ++i)
+	{
+		unsigned int entries = 0x7fffffff;
+		std::string record(1, (char)types[i]);
+		if(types[i] == Value::VALUE_ARRAY_SEGMENT)
+			record += (char)1;
+		record.append((char const *)&entries, sizeof(entries));
+		record.append(16, '\0');
+		BOOST_CHECK_THROW(Value::Unserialize(1, record.data(), record.size()), std::runtime_error);
+	}
+}
+
+void JsonDb_PathCacheTest(JsonDb &json_db)
+{
+	JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+
+	json_db.SetJson(transaction, "$.path_cache_test.a.b", "{ 'c' : 1, 'd' : [ 10, 20, 30 ] }");
+	BOOST_CHECK(json_db.GetInt(transaction, "$.path_cache_test.a.b.c") == 1);
+
+	unsigned long hits = transaction->GetPathCacheHits();
+	BOOST_CHECK(json_db.GetInt(transaction, "$.path_cache_test.a.b.d[0]") == 10);
+	BOOST_CHECK(json_db.GetInt(transaction, "$.path_cache_test.a.b.d[1]") == 20);
+	BOOST_CHECK(json_db.GetInt(transaction, "$.path_cache_test.a.b.d[2]") == 30);
+	BOOST_CHECK(transaction->GetPathCacheHits() > hits);
+
+	// Removing an array element moves the elements after it
+	json_db.Delete(transaction, "$.path_cache_test.a.b.d[1]");
+	BOOST_CHECK(json_db.GetInt(transaction, "$.path_cache_test.a.b.d[1]") == 30);
+	BOOST_CHECK_THROW(json_db.GetInt(transaction, "$.path_cache_test.a.b.d[2]"), std::runtime_error);
+
+	// Replacing an intermediate element drops the paths through it
+	json_db.Set(transaction, "$.path_cache_test.a", 5);
+	BOOST_CHECK_THROW(json_db.GetInt(transaction, "$.path_cache_test.a.b.c"), std::runtime_error);
+	BOOST_CHECK(json_db.GetInt(transaction, "$.path_cache_test.a") == 5);
+
+	json_db.SetJson(transaction, "$.path_cache_test.a", "{ 'b' : { 'c' : 2 } }");
+	BOOST_CHECK(json_db.GetInt(transaction, "$.path_cache_test.a.b.c") == 2);
+	json_db.SetJson(transaction, "$.path_cache_test.a.b", "{ 'd' : 3 }");
+	BOOST_CHECK(json_db.Exists(transaction, "$.path_cache_test.a.b.c") == false);
+	BOOST_CHECK(json_db.GetInt(transaction, "$.path_cache_test.a.b.d") == 3);
+
+	json_db.Delete(transaction, "$.path_cache_test.a");
+	BOOST_CHECK(json_db.Exists(transaction, "$.path_cache_test.a.b.d") == false);
+	json_db.Delete(transaction, "$.path_cache_test");
+	BOOST_CHECK(json_db.Validate(transaction) == true);
+}
+
+void JsonDb_WriteBufferTest(JsonDb &json_db)
+{
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+
+		// Every append stores the array again, only the last store is written
+		json_db.SetArray(transaction, "$.write_buffer_test", 0);
+		for(int i = 0; i < 20; ++i)
+			json_db.AppendArray(transaction, "$.write_buffer_test", i);
+		BOOST_CHECK(transaction->GetCoalescedWrites() >= 19);
+
+		// Uncommitted writes are visible, also after an explicit flush
+		BOOST_CHECK(json_db.GetInt(transaction, "$.write_buffer_test[19]") == 19);
+		transaction->Flush();
+		BOOST_CHECK(json_db.GetInt(transaction, "$.write_buffer_test[19]") == 19);
+		json_db.AppendArray(transaction, "$.write_buffer_test", 20);
+	}
+
+	{
+		JsonDb::TransactionHandle transaction = json_db.StartTransaction();
+		for(int i = 0; i <= 20; ++i)
+			BOOST_CHECK(json_db.GetInt(transaction, (boost::format("$.write_buffer_test[%d]") % i).str()) == i);
+
+		json_db.Delete(transaction, "$.write_buffer_test");
+		BOOST_CHECK(json_db.Validate(transaction) == true);
+	}
+}
+
 BOOST_AUTO_TEST_CASE(JsonDbTest)
 {
 	try
@@ -234,6 +1993,30 @@ BOOST_AUTO_TEST_CASE(JsonDbTest)
 		JsonDb_ValidateDatabase(json_db);
 		JsonDb_EmptyDatabase(json_db);
 		JsonDb_ParserTest(json_db);
+		JsonDb_StructuralParserTest(json_db);
+		JsonDb_PathTest(json_db);
+		JsonDb_CacheTest(json_db);
+		JsonDb_WriteBufferTest(json_db);
+		JsonDb_PathCacheTest(json_db);
+		JsonDb_SegmentedArrayTest(json_db);
+		JsonDb_SpilledObjectTest(json_db);
+		JsonDb_InlineTest(json_db);
+		JsonDb_ReadTransactionTest(json_db);
+		JsonDb_ThreadTest(json_db);
+		JsonDb_GroupCommitTest(json_db);
+		JsonDb_ImportTest(json_db);
+		JsonDb_ImportIndexTest(json_db);
+		JsonDb_ExportTest(json_db);
+		JsonDb_LocalityTest(json_db);
+		JsonDb_TraversalTest(json_db);
+		JsonDb_ValidatorTest(json_db);
+		JsonDb_CompactionTest(json_db);
+		JsonDb_DeferredDeleteTest(json_db);
+		JsonDb_IndexTest(json_db);
+		JsonDb_QueryTest(json_db);
+		JsonDb_OrderedIndexTest(json_db);
+		JsonDb_AggregateTest(json_db);
+		JsonDb_StatisticsTest(json_db);
 
 		// Delete the complete database
 	//	json_db.Delete();